@@ -1,41 +1,57 @@
 #include <asio.hpp>
-#include <asio/ip/tcp.hpp>
-#include <asio/ts/buffer.hpp>
-#include <asio/ts/internet.hpp>
-#include <iostream>
+#include <chrono>
+#include <latch>
 #include <my_cpp_utils/logger.h>
-#include <vector>
-
-void GrabSomeDataAsync(asio::ip::tcp::socket& socket)
-{
-    static std::vector<char> vBuffer(1 * 1024);
-
-    // Request data from the server.
-    socket.async_read_some(
-        asio::buffer(vBuffer.data(), vBuffer.size()),
-        [&socket](std::error_code ec, std::size_t length)
-        {
-            if (!ec)
-            {
-                std::cout << "\n\nRead " << length << " bytes\n\n";
-                std::cout << std::string(vBuffer.data(), length) << std::endl;
-
-                // It is not a recursive call. It is a new call.
-                GrabSomeDataAsync(socket);
-            }
-        });
-}
-
-int main()
+#include <net_common/net_http.h>
+#include <net_common/net_http_client.h>
+#include <optional>
+#include <string>
+#include <thread>
+
+// Calls an HTTP service through net::http_client: the requests share a few keep-alive connections and are
+// pipelined on them, instead of one connection per request.
+//
+// "--host example.com --port 80 --path /index.html" calls a real service.
+// Without --host a local stand-in service is started and called.
+// "--requests 100" is how many requests are sent at once.
+int main(int argc, char** argv)
 {
     utils::Logger::Init("logs/net_asio_simple_example.log", spdlog::level::trace);
 
-    // Error code for asio operations. Exception can also be used.
-    asio::error_code ec;
+    std::string host;
+    uint16_t nPort = 80;
+    std::string path = "/";
+    size_t nRequests = 20;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "--host")
+            host = argv[i + 1];
+        else if (key == "--port")
+            nPort = static_cast<uint16_t>(std::stoul(argv[i + 1]));
+        else if (key == "--path")
+            path = argv[i + 1];
+        else if (key == "--requests")
+            nRequests = std::stoul(argv[i + 1]);
+    }
 
     // Hide all platform-specific requirements.
     asio::io_context context;
 
+    // The stand-in answers every GET with the path it was asked for. Started before the context runs.
+    std::optional<net::http_listener> standIn;
+    if (host.empty())
+    {
+        standIn.emplace(
+            context, 0,
+            [](const std::string& requestPath)
+            { return net::http_response{200, "text/plain", "Hello from " + requestPath}; });
+        standIn->Start();
+        host = "127.0.0.1";
+        nPort = standIn->Port();
+        MY_LOG(info, "Started the stand-in service on port {}", nPort);
+    }
+
     // Add fake work to the context to prevent it from returning.
     asio::io_context::work idleWork(context);
 
@@ -43,45 +59,39 @@ int main()
     // Run returns when there is no more work to do - no more instructions to execute.
     std::thread thrContext = std::thread([&]() { context.run(); });
 
-    // Get the address of somewhere we wish to connect to.
-    // 93.184.216.34 = example.com
-    // 51.38.81.49 = google.com
-    asio::ip::tcp::endpoint endpoint(asio::ip::make_address("51.38.81.49", ec), 80);
-
-    // Create a socket, the context will deliver the implementation.
-    asio::ip::tcp::socket socket(context);
-
-    // Tell socket to try and connect.
-    (void)socket.connect(endpoint, ec);
+    net::http_client client(context);
 
-    if (!ec)
+    // Two rounds: the first one opens the connections, the second one finds them open already.
+    for (int nRound = 1; nRound <= 2; ++nRound)
     {
-        MY_LOG(info, "Connected!");
-    }
-    else
-    {
-        MY_LOG(error, "Failed to connect to address: {}", ec.message());
-    }
-
-    if (socket.is_open())
-    {
-        // Start an asynchronous operation to read data.
-        // Is is started before sending the request to prevent getting empty data.
-        GrabSomeDataAsync(socket);
-
-        std::string request =
-            "GET /index.html HTTP/1.1\r\n"
-            "Host: example.com\r\n"
-            "Connection: close\r\n\r\n";
-
-        // Send request to the server.
-        // write_some means write as much as you can.
-        // asio::buffer is a container like array of bytes.
-        socket.write_some(asio::buffer(request.data(), request.size()), ec);
-        if (ec)
-            MY_LOG(error, "Failed to send request: {}", ec.message());
+        std::latch done(static_cast<std::ptrdiff_t>(nRequests));
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nRequests; ++i)
+        {
+            net::http_request request;
+            request.host = host;
+            request.nPort = nPort;
+            request.target = path;
+            client.Request(
+                std::move(request),
+                [&client, &done, i](std::error_code ec, net::http_client_response response)
+                {
+                    if (ec)
+                        MY_LOG(error, "Request {} HAS FAILED: {}", i, ec.message());
+                    else
+                        MY_LOG(debug, "Request {}: status {}, {} bytes", i, response.nStatus, response.body.size());
+
+                    client.Recycle(std::move(response));
+                    done.count_down();
+                });
+        }
+        done.wait();
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        MY_LOG(info, "Round {}: {} requests in {} us", nRound, nRequests, elapsed.count());
     }
 
-    // Delay the closing of the application.
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    client.Close();
+    context.stop();
+    thrContext.join();
 }
@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <fmt/format.h>
+#include <fstream>
+#include <future>
+#include <my_cpp_utils/logger.h>
+#include <net_common/net_connection.h>
+#include <net_common/net_crc32c.h>
+#include <net_common/net_latency.h>
+#include <net_common/net_memory.h>
+#include <net_common/net_server.h>
+#include <net_common/net_trace.h>
+#include <net_common/net_transport.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(NET_HAS_TLS)
+#include <net_common/net_tls.h>
+#endif
+
+#if defined(__linux__)
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Loopback echo benchmark.
+// One server_interface echoes every message back. Many client connections share one io_context thread,
+// each keeps "window" messages in flight. Build it twice (with and without NET_USE_IO_URING) and run both
+// binaries with the same arguments to compare the asio backends.
+//
+// With "--idle 1" nothing is echoed: the connections are opened, left idle, and the memory an idle connection
+// costs is reported. Compare "--idle-pool 0" and "--idle-pool 1".
+//
+// "--transport tls" and "--transport ktls" (built with NET_USE_TLS) compare TLS with "--transport tcp".
+// With "--handshakes N" the connections are opened one by one instead, and the handshake time is reported:
+// the first one is a full handshake, the others resume its session.
+
+enum class BenchMsgTypes : uint32_t
+{
+    Hello,
+    Echo,
+};
+
+struct bench_options
+{
+    std::string transport = "tcp"; // tcp, local, inproc, tls, ktls
+    size_t connections = 100;
+    size_t window = 8;
+    size_t payload = 64;
+    double seconds = 5.0;
+    uint16_t port = 60100;
+    // Busy polling latency mode. Pins server I/O, server Update and client I/O threads to cores 0, 1 and 2.
+    bool busyPoll = false;
+    // CRC32C trailer on every frame, both directions.
+    bool checksum = false;
+    // Report the memory of idle connections instead of echoing.
+    bool idle = false;
+    // Idle connections give their receive buffers back to a shared pool.
+    bool idlePool = false;
+    // Trace file of the transport events (see net_trace.h). Empty - tracing is off.
+    std::string trace;
+    // Open this many connections one after another and report the handshake time instead of echoing.
+    size_t handshakes = 0;
+};
+
+const char* BackendName()
+{
+#if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+    return "io_uring";
+#elif defined(__linux__)
+    return "epoll";
+#else
+    return "default";
+#endif
+}
+
+class EchoServer : public net::server_interface<BenchMsgTypes>
+{
+public:
+    EchoServer(uint16_t port) : net::server_interface<BenchMsgTypes>(port) {}
+protected:
+    bool OnClientConnect(std::shared_ptr<net::connection<BenchMsgTypes>> client) override
+    {
+        // The first message reaches the client only after its handshake answer is written.
+        // So the client knows it may start sending.
+        net::message<BenchMsgTypes> msg;
+        msg.header.id = BenchMsgTypes::Hello;
+        client->Send(msg);
+        return true;
+    }
+
+    void OnMessage(std::shared_ptr<net::connection<BenchMsgTypes>> client, net::message<BenchMsgTypes>& msg) override
+    {
+        client->Send(msg);
+    }
+};
+
+// Body layout of an echo message: [send time ns][connection index][payload].
+struct echo_stamp
+{
+    int64_t sentNs;
+    uint32_t index;
+};
+
+int64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Resident set size of the process, 0 if unknown.
+size_t ResidentBytes()
+{
+#if defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    size_t nPages = 0;
+    size_t nResident = 0;
+    statm >> nPages >> nResident;
+    return nResident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+double CpuSeconds()
+{
+#if defined(__linux__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+    return 0.0;
+#endif
+}
+
+bench_options ParseOptions(int argc, char** argv)
+{
+    bench_options options;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--transport")
+            options.transport = value;
+        else if (key == "--connections")
+            options.connections = std::stoul(value);
+        else if (key == "--window")
+            options.window = std::stoul(value);
+        else if (key == "--payload")
+            options.payload = std::stoul(value);
+        else if (key == "--seconds")
+            options.seconds = std::stod(value);
+        else if (key == "--port")
+            options.port = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--busy-poll")
+            options.busyPoll = value == "1";
+        else if (key == "--checksum")
+            options.checksum = value == "1";
+        else if (key == "--idle")
+            options.idle = value == "1";
+        else if (key == "--idle-pool")
+            options.idlePool = value == "1";
+        else if (key == "--trace")
+            options.trace = value;
+        else if (key == "--handshakes")
+            options.handshakes = std::stoul(value);
+        else
+            MY_LOG(warn, "[net_benchmark] Unknown option {}", key);
+    }
+    return options;
+}
+
+#if defined(NET_HAS_TLS)
+bool IsTls(const bench_options& options) { return options.transport == "tls" || options.transport == "ktls"; }
+
+// Server and client TLS contexts with a self signed certificate, kTLS on for "ktls".
+std::pair<std::shared_ptr<net::tls_context>, std::shared_ptr<net::tls_context>> MakeTlsContexts(
+    const bench_options& options)
+{
+    net::tls_identity identity = net::MakeSelfSignedIdentity("localhost");
+
+    net::tls_options serverOptions;
+    serverOptions.certificatePem = identity.certificatePem;
+    serverOptions.privateKeyPem = identity.privateKeyPem;
+    serverOptions.ktls = options.transport == "ktls";
+
+    net::tls_options clientOptions;
+    clientOptions.caPem = identity.certificatePem;
+    clientOptions.ktls = serverOptions.ktls;
+
+    return {
+        std::make_shared<net::tls_context>(net::tls_context::role::server, serverOptions),
+        std::make_shared<net::tls_context>(net::tls_context::role::client, clientOptions)};
+}
+
+// Client TLS context of the run, shared by all connections.
+std::shared_ptr<net::tls_context> g_pClientTls;
+#endif
+
+std::unique_ptr<net::transport> MakeTransport(
+    const bench_options& options, asio::io_context& context, EchoServer& server)
+{
+    if (options.transport == "inproc")
+        return server.ConnectInProcess(context);
+
+#if defined(NET_HAS_TLS)
+    if (IsTls(options))
+    {
+        std::vector endpoints{asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), options.port)};
+        return std::make_unique<net::tls_transport>(
+            g_pClientTls, asio::ip::tcp::socket(context), std::move(endpoints), "localhost");
+    }
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    if (options.transport == "local")
+    {
+        std::vector endpoints{asio::local::stream_protocol::endpoint("net_benchmark.sock")};
+        return std::make_unique<net::local_transport>(
+            asio::local::stream_protocol::socket(context), std::move(endpoints));
+    }
+#endif
+
+    std::vector endpoints{asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), options.port)};
+    return std::make_unique<net::tcp_transport>(asio::ip::tcp::socket(context), std::move(endpoints));
+}
+
+// Open the connections, let them go idle and report what an idle connection costs.
+int RunIdleReport(
+    const bench_options& options, EchoServer& server, const net::connection_options<BenchMsgTypes>& connectionOptions)
+{
+    size_t nResidentBefore = ResidentBytes();
+
+    asio::io_context clientContext;
+    net::thread_safe_queue<net::owned_message<BenchMsgTypes>> qIn;
+    std::vector<std::unique_ptr<net::connection<BenchMsgTypes>>> connections;
+    connections.reserve(options.connections);
+    for (size_t i = 0; i < options.connections; ++i)
+    {
+        connections.push_back(std::make_unique<net::connection<BenchMsgTypes>>(
+            net::connection<BenchMsgTypes>::owner::client, clientContext,
+            MakeTransport(options, clientContext, server), qIn, connectionOptions));
+        connections.back()->ConnectToServer();
+    }
+    auto workGuard = asio::make_work_guard(clientContext);
+    std::thread threadClients([&]() { clientContext.run(); });
+
+    // Every client gets Hello once the server has validated it. After that nothing happens.
+    for (size_t nReady = 0; nReady < connections.size(); ++nReady)
+    {
+        qIn.wait();
+        qIn.pop_front();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+#if defined(__GLIBC__)
+    // Buffers freed after the connect burst stay in the heap. Give them back, so RSS shows what is in use.
+    malloc_trim(0);
+#endif
+    size_t nResidentAfter = ResidentBytes();
+
+    // Buffers are touched by the asio thread only, so they are measured there.
+    std::promise<size_t> footprint;
+    asio::post(
+        clientContext,
+        [&]()
+        {
+            size_t nBytes = 0;
+            for (const auto& pConnection : connections)
+                nBytes += pConnection->MemoryFootprint();
+            footprint.set_value(nBytes);
+        });
+    size_t nFootprint = footprint.get_future().get();
+
+    fmt::print(
+        "backend={} transport={} connections={} idle-pool={}\n", BackendName(), options.transport,
+        options.connections, options.idlePool ? "on" : "off");
+    fmt::print(
+        "bytes per idle connection (connection object and buffers): {}\n", nFootprint / options.connections);
+    fmt::print(
+        "bytes per idle connection pair (client + server side, whole process RSS): {}\n",
+        (nResidentAfter - std::min(nResidentAfter, nResidentBefore)) / options.connections);
+
+    server.Stop();
+    workGuard.reset();
+    clientContext.stop();
+    threadClients.join();
+
+    return 0;
+}
+
+#if defined(NET_HAS_TLS)
+// Open the connections one after another and report how long the connect and the handshakes take.
+int RunHandshakeReport(
+    const bench_options& options, EchoServer& server, const net::connection_options<BenchMsgTypes>& connectionOptions)
+{
+    asio::io_context clientContext;
+    auto workGuard = asio::make_work_guard(clientContext);
+    std::thread threadClients([&]() { clientContext.run(); });
+
+    net::thread_safe_queue<net::owned_message<BenchMsgTypes>> qIn;
+    std::vector<int64_t> fullNs;
+    std::vector<int64_t> resumedNs;
+    bool bKtls = false;
+    for (size_t i = 0; i < options.handshakes; ++i)
+    {
+        auto pTransport = MakeTransport(options, clientContext, server);
+        auto* pTls = static_cast<net::tls_transport*>(pTransport.get());
+        auto pConnection = std::make_shared<net::connection<BenchMsgTypes>>(
+            net::connection<BenchMsgTypes>::owner::client, clientContext, std::move(pTransport), qIn,
+            connectionOptions);
+
+        // Hello arrives after the TLS handshake and the handshake of the connection.
+        int64_t nStartNs = NowNs();
+        pConnection->ConnectToServer();
+        qIn.wait();
+        qIn.pop_front();
+        int64_t nElapsedNs = NowNs() - nStartNs;
+
+        std::promise<bool> resumed;
+        asio::post(
+            clientContext,
+            [&]()
+            {
+                bKtls = pTls->IsKtlsSend();
+                resumed.set_value(pTls->IsResumed());
+            });
+        (resumed.get_future().get() ? resumedNs : fullNs).push_back(nElapsedNs);
+
+        pConnection->Disconnect();
+    }
+
+    auto meanUs = [](const std::vector<int64_t>& values)
+    {
+        int64_t nSum = 0;
+        for (int64_t nValue : values)
+            nSum += nValue;
+        return values.empty() ? 0.0 : double(nSum) / double(values.size()) / 1000.0;
+    };
+
+    fmt::print("transport={} handshakes={} ktls-send={}\n", options.transport, options.handshakes, bKtls);
+    fmt::print("full handshake us: {:.1f} ({} times)\n", meanUs(fullNs), fullNs.size());
+    fmt::print("resumed handshake us: {:.1f} ({} times)\n", meanUs(resumedNs), resumedNs.size());
+
+    server.Stop();
+    workGuard.reset();
+    clientContext.stop();
+    threadClients.join();
+
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    utils::Logger::Init("logs/net_benchmark.log", spdlog::level::warn);
+
+    bench_options options = ParseOptions(argc, argv);
+    if (!options.trace.empty() && !net::TraceSink().Start(options.trace))
+        MY_LOG(error, "[net_benchmark] Can't open trace file {}", options.trace);
+
+    net::latency_options serverLatency;
+    serverLatency.enabled = options.busyPoll;
+    serverLatency.ioCore = 0;
+    serverLatency.updateCore = 1;
+
+    net::latency_options clientLatency;
+    clientLatency.enabled = options.busyPoll;
+    clientLatency.ioCore = 2;
+
+    net::connection_options<BenchMsgTypes> connectionOptions;
+    connectionOptions.checksum = options.checksum;
+    if (options.idlePool)
+        connectionOptions.idleBufferPool = std::make_shared<net::buffer_pool>();
+
+    EchoServer server(options.port);
+    server.SetLatencyMode(serverLatency);
+    server.SetConnectionOptions(connectionOptions);
+#if defined(NET_HAS_TLS)
+    if (IsTls(options))
+    {
+        auto [pServerTls, pClientTls] = MakeTlsContexts(options);
+        server.SetTls(std::move(pServerTls));
+        g_pClientTls = std::move(pClientTls);
+    }
+#endif
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    if (options.transport == "local")
+        server.ListenLocal("net_benchmark.sock");
+#endif
+    server.Start();
+
+    if (options.idle)
+        return RunIdleReport(options, server, connectionOptions);
+#if defined(NET_HAS_TLS)
+    if (options.handshakes != 0 && IsTls(options))
+        return RunHandshakeReport(options, server, connectionOptions);
+#endif
+
+    std::atomic<bool> bRunning = true;
+    std::thread threadServer(
+        [&]()
+        {
+            while (bRunning)
+                server.Update(-1, true);
+        });
+
+    // All clients share one context and one thread.
+    asio::io_context clientContext;
+    net::thread_safe_queue<net::owned_message<BenchMsgTypes>> qIn;
+    std::vector<std::unique_ptr<net::connection<BenchMsgTypes>>> connections;
+    for (size_t i = 0; i < options.connections; ++i)
+    {
+        connections.push_back(std::make_unique<net::connection<BenchMsgTypes>>(
+            net::connection<BenchMsgTypes>::owner::client, clientContext,
+            MakeTransport(options, clientContext, server), qIn, connectionOptions));
+        connections.back()->ConnectToServer();
+    }
+    auto workGuard = asio::make_work_guard(clientContext);
+    std::thread threadClients([&]() { net::run_io_context(clientContext, clientLatency); });
+
+    auto sendEcho = [&](uint32_t index)
+    {
+        net::message<BenchMsgTypes> msg;
+        msg.header.id = BenchMsgTypes::Echo;
+        msg.body.resize(sizeof(echo_stamp) + options.payload);
+        echo_stamp stamp{NowNs(), index};
+        std::memcpy(msg.body.data(), &stamp, sizeof(stamp));
+        msg.header.size = msg.body.size();
+        connections[index]->Send(msg);
+    };
+
+    std::vector<int64_t> latenciesNs;
+    size_t nReady = 0;
+    size_t nMessages = 0;
+    double cpuStart = 0.0;
+    auto timeStart = std::chrono::steady_clock::now();
+    auto timeEnd = timeStart;
+    bool bMeasuring = false;
+
+    while (true)
+    {
+        if (qIn.empty())
+            qIn.wait();
+
+        auto msg = qIn.pop_front().msg;
+        if (msg.header.id == BenchMsgTypes::Hello)
+        {
+            // Start measuring once every connection is ready to talk.
+            if (++nReady == connections.size())
+            {
+                for (uint32_t i = 0; i < connections.size(); ++i)
+                    for (size_t w = 0; w < options.window; ++w)
+                        sendEcho(i);
+
+                cpuStart = CpuSeconds();
+                timeStart = std::chrono::steady_clock::now();
+                timeEnd = timeStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                          std::chrono::duration<double>(options.seconds));
+                bMeasuring = true;
+            }
+            continue;
+        }
+
+        echo_stamp stamp;
+        std::memcpy(&stamp, msg.body.data(), sizeof(stamp));
+        latenciesNs.push_back(NowNs() - stamp.sentNs);
+        nMessages++;
+
+        if (bMeasuring && std::chrono::steady_clock::now() >= timeEnd)
+            break;
+
+        sendEcho(stamp.index);
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+    double cpu = CpuSeconds() - cpuStart;
+
+    if (latenciesNs.empty())
+    {
+        MY_LOG(error, "[net_benchmark] No messages were echoed");
+        return -1;
+    }
+
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+    auto percentileUs = [&](double p)
+    { return double(latenciesNs[static_cast<size_t>(p * double(latenciesNs.size() - 1))]) / 1000.0; };
+
+    fmt::print(
+        "backend={} transport={} connections={} window={} payload={} checksum={}\n", BackendName(), options.transport,
+        options.connections, options.window, options.payload,
+        options.checksum ? (net::crc32c::IsHardwareAccelerated() ? "sse4.2" : "portable") : "off");
+    fmt::print("messages/s: {:.0f}\n", double(nMessages) / elapsed);
+    fmt::print(
+        "latency us: p50 {:.1f} p99 {:.1f} p99.9 {:.1f} max {:.1f}\n", percentileUs(0.5), percentileUs(0.99),
+        percentileUs(0.999), percentileUs(1.0));
+    fmt::print("cpu us/msg (both sides, user+sys): {:.2f}\n", cpu * 1e6 / double(nMessages));
+    if (net::TraceSink().IsRunning())
+    {
+        fmt::print(
+            "trace: level {}, {} events written, {} dropped\n", NET_TRACE_LEVEL, net::TraceSink().RecordCount(),
+            net::TraceSink().DroppedCount());
+    }
+
+    // Wake up the server thread with one more message, so it sees bRunning == false.
+    bRunning = false;
+    sendEcho(0);
+    threadServer.join();
+    server.Stop();
+
+    workGuard.reset();
+    clientContext.stop();
+    threadClients.join();
+
+    return 0;
+}
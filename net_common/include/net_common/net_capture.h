@@ -0,0 +1,239 @@
+#pragma once
+#include "net_timing.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace net
+{
+
+// Traffic capture: every message a server receives or sends, with its time and connection ID
+// (see server_interface::StartCapture). net_replay plays a capture back against a server.
+//
+// File layout:
+//   [capture_file_header] { [capture_record] [message header, nHeaderSize bytes] [body, nBodySize bytes] }*
+// Messages are captured as the application sees them: before delta/compression on the way out and after
+// decoding on the way in, so a capture does not depend on the connection options.
+// connect/disconnect records have no header and no body. All numbers are little endian, as the host.
+
+enum class capture_event : uint32_t
+{
+    connect = 0,
+    disconnect = 1,
+    // Client to server.
+    inbound = 2,
+    // Server to client.
+    outbound = 3,
+};
+
+struct capture_file_header
+{
+    static constexpr char c_magic[8] = {'N', 'E', 'T', 'C', 'A', 'P', 'T', '1'};
+
+    char magic[8] = {};
+    uint32_t nVersion = 1;
+    // sizeof(message_header<T>) of the server that wrote the capture.
+    uint32_t nHeaderSize = 0;
+    // Steady clock time the capture started at. Record times are relative to it.
+    int64_t nStartNs = 0;
+};
+
+struct capture_record
+{
+    int64_t nTimeNs = 0;
+    uint32_t nConnectionID = 0;
+    capture_event event = capture_event::connect;
+    uint32_t nBodySize = 0;
+    uint32_t nReserved = 0;
+};
+
+// Appends records to a capture file from a background thread, so the network threads never wait for the disk.
+// Records are copied into a pending buffer under a mutex and the thread writes the buffer out in big chunks.
+// If the disk falls behind by more than nMaxPendingBytes, records are dropped and counted instead of growing
+// the memory. Thread safe.
+class capture_writer
+{
+public:
+    explicit capture_writer(size_t nMaxPendingBytes = 64 * 1024 * 1024) : m_nMaxPendingBytes(nMaxPendingBytes) {}
+
+    ~capture_writer() { Close(); }
+
+    capture_writer(const capture_writer&) = delete;
+    capture_writer& operator=(const capture_writer&) = delete;
+
+    bool Open(const std::string& path, size_t nHeaderSize)
+    {
+        Close();
+
+        m_pFile = std::fopen(path.c_str(), "wb");
+        if (!m_pFile)
+            return false;
+
+        capture_file_header header;
+        std::memcpy(header.magic, capture_file_header::c_magic, sizeof(header.magic));
+        header.nHeaderSize = static_cast<uint32_t>(nHeaderSize);
+        header.nStartNs = SteadyNowNs();
+        m_nStartNs = header.nStartNs;
+        m_nHeaderSize = nHeaderSize;
+        if (std::fwrite(&header, sizeof(header), 1, m_pFile) != 1)
+        {
+            std::fclose(m_pFile);
+            m_pFile = nullptr;
+            return false;
+        }
+
+        m_bRunning = true;
+        m_thread = std::thread([this]() { WriterLoop(); });
+        return true;
+    }
+
+    // Write out what is pending and close the file. Records written after this are ignored.
+    // Returns false if the file was not open.
+    bool Close()
+    {
+        {
+            std::scoped_lock lock(m_mux);
+            if (!m_bRunning)
+                return false;
+            m_bRunning = false;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+
+        std::fclose(m_pFile);
+        m_pFile = nullptr;
+        return true;
+    }
+
+    // header must point to nHeaderSize bytes given to Open. connect/disconnect pass no header and no body.
+    void Write(
+        capture_event event, uint32_t nConnectionID, const void* header = nullptr, const uint8_t* body = nullptr,
+        size_t nBodySize = 0)
+    {
+        capture_record record;
+        record.nConnectionID = nConnectionID;
+        record.event = event;
+        record.nBodySize = static_cast<uint32_t>(nBodySize);
+        size_t nHeaderSize = header ? m_nHeaderSize : 0;
+
+        {
+            std::scoped_lock lock(m_mux);
+            if (!m_bRunning)
+                return;
+
+            // Taken under the lock, so the times in the file never go back.
+            record.nTimeNs = SteadyNowNs() - m_nStartNs;
+            size_t nRecordSize = sizeof(record) + nHeaderSize + nBodySize;
+            if (m_vecPending.size() + nRecordSize > m_nMaxPendingBytes)
+            {
+                m_nDropped++;
+                return;
+            }
+
+            auto append = [this](const void* data, size_t nSize)
+            {
+                auto* bytes = static_cast<const uint8_t*>(data);
+                m_vecPending.insert(m_vecPending.end(), bytes, bytes + nSize);
+            };
+            append(&record, sizeof(record));
+            append(header, nHeaderSize);
+            append(body, nBodySize);
+            m_nRecords++;
+        }
+        m_cv.notify_one();
+    }
+
+    uint64_t RecordCount() const { return m_nRecords.load(std::memory_order_relaxed); }
+    uint64_t DroppedCount() const { return m_nDropped.load(std::memory_order_relaxed); }
+private:
+    void WriterLoop()
+    {
+        std::vector<uint8_t> vecWriting;
+        while (true)
+        {
+            {
+                std::unique_lock lock(m_mux);
+                m_cv.wait(lock, [this]() { return !m_bRunning || !m_vecPending.empty(); });
+                if (m_vecPending.empty())
+                    break;
+                // The producers keep appending into the other buffer while this one is on its way to the disk.
+                std::swap(vecWriting, m_vecPending);
+            }
+
+            if (std::fwrite(vecWriting.data(), 1, vecWriting.size(), m_pFile) != vecWriting.size())
+                m_nDropped++;
+            vecWriting.clear();
+        }
+        std::fflush(m_pFile);
+    }
+
+    const size_t m_nMaxPendingBytes;
+    std::FILE* m_pFile = nullptr;
+    size_t m_nHeaderSize = 0;
+    int64_t m_nStartNs = 0;
+
+    std::mutex m_mux;
+    std::condition_variable m_cv;
+    std::vector<uint8_t> m_vecPending;
+    bool m_bRunning = false;
+    std::thread m_thread;
+
+    std::atomic<uint64_t> m_nRecords = 0;
+    std::atomic<uint64_t> m_nDropped = 0;
+};
+
+// Sequential reader of a capture file.
+class capture_reader
+{
+public:
+    ~capture_reader()
+    {
+        if (m_pFile)
+            std::fclose(m_pFile);
+    }
+
+    bool Open(const std::string& path)
+    {
+        m_pFile = std::fopen(path.c_str(), "rb");
+        if (!m_pFile)
+            return false;
+
+        if (std::fread(&m_header, sizeof(m_header), 1, m_pFile) != 1 ||
+            std::memcmp(m_header.magic, capture_file_header::c_magic, sizeof(m_header.magic)) != 0 ||
+            m_header.nVersion != 1)
+        {
+            std::fclose(m_pFile);
+            m_pFile = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    const capture_file_header& Header() const { return m_header; }
+
+    // Read the next record. header gets nHeaderSize bytes for inbound/outbound records.
+    // Returns false at the end of the file or on a truncated record (the tail of a capture that was killed).
+    bool Next(capture_record& record, std::vector<uint8_t>& header, std::vector<uint8_t>& body)
+    {
+        if (!m_pFile || std::fread(&record, sizeof(record), 1, m_pFile) != 1)
+            return false;
+
+        bool bHasMessage = record.event == capture_event::inbound || record.event == capture_event::outbound;
+        header.resize(bHasMessage ? m_header.nHeaderSize : 0);
+        body.resize(record.nBodySize);
+        return std::fread(header.data(), 1, header.size(), m_pFile) == header.size() &&
+               std::fread(body.data(), 1, body.size(), m_pFile) == body.size();
+    }
+private:
+    std::FILE* m_pFile = nullptr;
+    capture_file_header m_header;
+};
+
+} // namespace net
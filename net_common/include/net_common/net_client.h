@@ -1,13 +1,40 @@
 #pragma once
 #include "net_connection.h"
+#include "net_latency.h"
 #include "net_message.h"
+#include "net_server.h"
 #include "net_thread_safe_queue.h"
+#include "net_timing.h"
+#include "net_transport.h"
+#include <algorithm>
 #include <asio.hpp>
 #include <asio/ip/tcp.hpp>
+#include <chrono>
+#include <deque>
 #include <my_cpp_utils/logger.h>
+#include <unordered_map>
+#include <vector>
+
+#if defined(NET_HAS_TLS)
+#include "net_tls.h"
+#endif
 
 namespace net
 {
+// Result of client_interface::Update.
+struct client_update_stats
+{
+    // Messages passed to OnMessage.
+    size_t nHandled = 0;
+    // Messages dropped because a newer message of the same coalesced type was already received.
+    size_t nCoalesced = 0;
+    // Messages still waiting after this update. Growing backlog means the client does not keep up.
+    size_t nBacklog = 0;
+    // Receive to now time of the oldest message taken but not handled, or of the last handled one.
+    // 0 unless connection_options::timestamps is set, as the receive time is not recorded otherwise.
+    int64_t nBehindNs = 0;
+};
+
 // Responsible for setting up the ASIO and setting up the connection.
 // Also access point to talk to the server.
 template <typename T>
@@ -31,17 +58,67 @@ public:
         {
             // Resolve the IP address.
             asio::ip::tcp::resolver resolver(m_context);
-            auto endpoints = resolver.resolve(host, std::to_string(port));
+            auto results = resolver.resolve(host, std::to_string(port));
+            std::vector<asio::ip::tcp::endpoint> endpoints(results.begin(), results.end());
+
+            return Connect(std::make_unique<tcp_transport>(asio::ip::tcp::socket(m_context), std::move(endpoints)));
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "Client Exception: {}", e.what());
+            return false;
+        }
+    }
+
+#if defined(NET_HAS_TLS)
+    // Connect to the server over TLS (see server_interface::SetTls). Reuse one client tls_context for all
+    // connections, it keeps the sessions that make a reconnect skip the full handshake.
+    bool ConnectTls(const std::string& host, const uint16_t port, std::shared_ptr<tls_context> pTls)
+    {
+        try
+        {
+            asio::ip::tcp::resolver resolver(m_context);
+            auto results = resolver.resolve(host, std::to_string(port));
+            std::vector<asio::ip::tcp::endpoint> endpoints(results.begin(), results.end());
 
+            return Connect(std::make_unique<tls_transport>(
+                std::move(pTls), asio::ip::tcp::socket(m_context), std::move(endpoints), host));
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "Client Exception: {}", e.what());
+            return false;
+        }
+    }
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    // Connect to a server on the same host via the local socket (see server_interface::ListenLocal).
+    bool ConnectLocal(const std::string& path)
+    {
+        std::vector endpoints{asio::local::stream_protocol::endpoint(path)};
+        return Connect(
+            std::make_unique<local_transport>(asio::local::stream_protocol::socket(m_context), std::move(endpoints)));
+    }
+#endif
+
+    // Connect to a server living in the same process. No sockets are involved at all.
+    bool ConnectInProcess(server_interface<T>& server) { return Connect(server.ConnectInProcess(m_context)); }
+
+    // Connect over an already created transport. The transport must use m_context.
+    bool Connect(std::unique_ptr<transport> pTransport)
+    {
+        try
+        {
             // Create a connection.
             m_connection = std::make_unique<connection<T>>(
-                connection<T>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn);
+                connection<T>::owner::client, m_context, std::move(pTransport), m_qMessagesIn, m_connectionOptions);
 
             // Tell the connection object to connect to the server.
-            m_connection->ConnectToServer(endpoints);
+            m_connection->ConnectToServer();
 
             // Start the ASIO context thread.
-            thrContext = std::thread([this]() { m_context.run(); });
+            thrContext = std::thread([this]() { run_io_context(m_context, m_latency); });
         }
         catch (std::exception& e)
         {
@@ -49,7 +126,7 @@ public:
             return false;
         }
 
-        return false;
+        return true;
     }
 
     // Disconnect from the server.
@@ -69,8 +146,8 @@ public:
         if (thrContext.joinable())
             thrContext.join();
 
-        // Destroy the connection object.
-        m_connection.release();
+        // Destroy the connection object. The context is stopped, so no handler can touch it anymore.
+        m_connection.reset();
     }
 
     bool IsConnected() const
@@ -81,15 +158,105 @@ public:
             return false;
     }
 
-    // Retrieve queue of messages from the server.
+    // Enable the busy polling low latency mode for the I/O thread. Must be called before Connect.
+    void SetLatencyMode(const latency_options& options) { m_latency = options; }
+
+    // Settings of the connection (see connection_options). Must be called before Connect.
+    void SetConnectionOptions(const connection_options<T>& options) { m_connectionOptions = options; }
+
+    // Clock offset to the server and latency histograms of the connection. nullptr if not connected or if
+    // connection_options::timestamps and clockSyncInterval are not set.
+    const connection_timing* Timing() const { return m_connection ? m_connection->Timing() : nullptr; }
+
+    // Message types where only the newest message matters (e.g. state snapshots). When Update finds several of
+    // them in one batch, only the last one reaches OnMessage.
+    void SetCoalescedTypes(const std::vector<T>& types) { m_vecCoalescedTypes = types; }
+
+    // Retrieve queue of messages from the server. Use either it or Update, not both.
     thread_safe_queue<owned_message<T>>& Incoming() { return m_qMessagesIn; }
 
+    // Client counterpart of server_interface::Update. Call it once per frame.
+    // Takes up to nMaxMessages messages from the incoming queue under one lock, drops superseded messages of
+    // the coalesced types and passes the rest to OnMessage until the time budget runs out (0 - no budget).
+    // Messages left over wait for the next call, in order.
+    client_update_stats Update(size_t nMaxMessages = -1, std::chrono::microseconds timeBudget = {})
+    {
+        client_update_stats stats;
+        const auto timeStart = std::chrono::steady_clock::now();
+
+        if (m_deqPending.size() < nMaxMessages)
+        {
+            size_t nTaken = m_qMessagesIn.pop_front_n(m_deqPending, nMaxMessages - m_deqPending.size());
+            if (nTaken != 0 && !m_vecCoalescedTypes.empty())
+                stats.nCoalesced = Coalesce();
+        }
+
+        int64_t nLastReceivedNs = 0;
+        while (stats.nHandled < nMaxMessages && !m_deqPending.empty())
+        {
+            auto msg = std::move(m_deqPending.front());
+            m_deqPending.pop_front();
+
+            if (msg.nReceivedNs != 0)
+            {
+                m_updateDelay.Record(SteadyNowNs() - msg.nReceivedNs);
+                nLastReceivedNs = msg.nReceivedNs;
+            }
+
+            OnMessage(msg.msg);
+            stats.nHandled++;
+
+            if (timeBudget.count() != 0 && std::chrono::steady_clock::now() - timeStart >= timeBudget)
+                break;
+        }
+
+        stats.nBacklog = m_deqPending.size() + m_qMessagesIn.count();
+        int64_t nOldestNs = m_deqPending.empty() ? nLastReceivedNs : m_deqPending.front().nReceivedNs;
+        if (nOldestNs != 0)
+            stats.nBehindNs = SteadyNowNs() - nOldestNs;
+        return stats;
+    }
+
+    // Time messages wait in the incoming queue before Update handles them (see client_update_stats::nBehindNs).
+    const latency_histogram& UpdateDelay() const { return m_updateDelay; }
+
     // Send message to the server.
     void Send(const message<T>& msg)
     {
         if (IsConnected())
             m_connection->Send(msg);
     }
+protected:
+    // Called by Update for every message from the server.
+    virtual void OnMessage(message<T>& msg) {}
+private:
+    // Drop every coalesced type message of m_deqPending which has a newer one of the same type after it.
+    // Returns how many were dropped.
+    size_t Coalesce()
+    {
+        m_mapLastOfType.clear();
+        for (size_t i = 0; i < m_deqPending.size(); ++i)
+        {
+            T id = m_deqPending[i].msg.header.id;
+            if (std::find(m_vecCoalescedTypes.begin(), m_vecCoalescedTypes.end(), id) != m_vecCoalescedTypes.end())
+                m_mapLastOfType[id] = i;
+        }
+
+        size_t nKept = 0;
+        for (size_t i = 0; i < m_deqPending.size(); ++i)
+        {
+            auto itLast = m_mapLastOfType.find(m_deqPending[i].msg.header.id);
+            if (itLast != m_mapLastOfType.end() && itLast->second != i)
+                continue;
+            if (nKept != i)
+                m_deqPending[nKept] = std::move(m_deqPending[i]);
+            nKept++;
+        }
+
+        size_t nDropped = m_deqPending.size() - nKept;
+        m_deqPending.resize(nKept);
+        return nDropped;
+    }
 protected:
     // ASIO context handles the data transfer...
     asio::io_context m_context;
@@ -97,8 +264,20 @@ protected:
     std::thread thrContext;
     // Each client has a single instance of the "connection" class.
     std::unique_ptr<connection<T>> m_connection;
+    // Low latency mode settings.
+    latency_options m_latency;
+    // Settings of the connection.
+    connection_options<T> m_connectionOptions;
 private:
     // This is thread safe queue of incoming messages from the server.
     thread_safe_queue<owned_message<T>> m_qMessagesIn;
+    // Messages taken from m_qMessagesIn by Update, but not handled yet.
+    std::deque<owned_message<T>> m_deqPending;
+    // See SetCoalescedTypes. Few types, so a vector is faster than a set.
+    std::vector<T> m_vecCoalescedTypes;
+    // Index of the last message of each coalesced type in m_deqPending. Member to keep its buckets.
+    std::unordered_map<T, size_t> m_mapLastOfType;
+    // Receive to OnMessage delay (see UpdateDelay).
+    latency_histogram m_updateDelay;
 };
 } // namespace net
\ No newline at end of file
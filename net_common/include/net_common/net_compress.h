@@ -0,0 +1,211 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace net
+{
+
+// Fast payload compression in the LZ4 block format: greedy matching with a small hash table,
+// no entropy coding. Compresses hundreds of MB/s and decompresses faster than that, which is what a
+// bandwidth bound link needs. Ratio is lower than zlib/zstd, but the CPU cost is close to a memcpy.
+//
+// Block format (same as LZ4): a sequence of
+//   [token: literal length (4 bits) | match length - 4 (4 bits)] [extra literal length bytes]
+//   [literals...] [match offset, 2 bytes LE] [extra match length bytes]
+// A length nibble of 15 is continued by bytes, each 255 means "add 255 and continue".
+// The last sequence has literals only.
+namespace lz
+{
+
+constexpr size_t c_nMinMatch = 4;
+constexpr size_t c_nMaxOffset = 65535;
+// The format requires the last literals to be at least this long and matches to start before this.
+constexpr size_t c_nLastLiterals = 5;
+constexpr size_t c_nMatchStartLimit = 12;
+
+// Worst case size of a compressed block (incompressible input).
+inline size_t MaxCompressedSize(size_t nSize)
+{
+    return nSize + nSize / 255 + 16;
+}
+
+// Compression state. Keep one per connection: the hash table is reused for every message.
+class compressor
+{
+public:
+    // Append the compressed block of [src, src + nSize) to out.
+    void Compress(const uint8_t* src, size_t nSize, std::vector<uint8_t>& out)
+    {
+        // The table is allocated on first use, so connections that never compress do not pay for it.
+        if (m_table.empty())
+            m_table.resize(c_nTableSize);
+        else
+            std::fill(m_table.begin(), m_table.end(), 0);
+
+        size_t nAnchor = 0;
+        if (nSize > c_nMatchStartLimit)
+        {
+            size_t nMatchStartLimit = nSize - c_nMatchStartLimit;
+            size_t nMatchEndLimit = nSize - c_nLastLiterals;
+            size_t i = 0;
+            while (i < nMatchStartLimit)
+            {
+                uint32_t nSequence = Read32(src + i);
+                uint32_t nHash = Hash(nSequence);
+                size_t nCandidate = m_table[nHash];
+                m_table[nHash] = static_cast<uint32_t>(i);
+
+                if (nCandidate >= i || i - nCandidate > c_nMaxOffset || Read32(src + nCandidate) != nSequence)
+                {
+                    // Skip faster over data that does not compress.
+                    i += 1 + ((i - nAnchor) >> 6);
+                    continue;
+                }
+
+                // Extend the match forward and backward.
+                size_t nMatchEnd = i + c_nMinMatch;
+                while (nMatchEnd < nMatchEndLimit && src[nMatchEnd] == src[nCandidate + (nMatchEnd - i)])
+                    nMatchEnd++;
+                while (i > nAnchor && nCandidate > 0 && src[i - 1] == src[nCandidate - 1])
+                {
+                    i--;
+                    nCandidate--;
+                }
+
+                WriteSequence(out, src + nAnchor, i - nAnchor, i - nCandidate, nMatchEnd - i);
+                i = nMatchEnd;
+                nAnchor = i;
+            }
+        }
+
+        // Last literals.
+        size_t nLiterals = nSize - nAnchor;
+        out.push_back(uint8_t(std::min<size_t>(nLiterals, 15) << 4));
+        WriteLength(out, nLiterals);
+        out.insert(out.end(), src + nAnchor, src + nSize);
+    }
+
+    // Free the hash table of an idle connection. The next Compress allocates it again.
+    void Trim() { std::vector<uint32_t>().swap(m_table); }
+
+    size_t MemoryFootprint() const { return m_table.capacity() * sizeof(uint32_t); }
+private:
+    static constexpr size_t c_nHashBits = 12;
+    static constexpr size_t c_nTableSize = size_t(1) << c_nHashBits;
+
+    static uint32_t Read32(const uint8_t* p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t Hash(uint32_t nSequence) { return (nSequence * 2654435761u) >> (32 - c_nHashBits); }
+
+    // Extra bytes of a length whose nibble is 15.
+    static void WriteLength(std::vector<uint8_t>& out, size_t nLength)
+    {
+        if (nLength < 15)
+            return;
+
+        nLength -= 15;
+        while (nLength >= 255)
+        {
+            out.push_back(255);
+            nLength -= 255;
+        }
+        out.push_back(uint8_t(nLength));
+    }
+
+    static void WriteSequence(
+        std::vector<uint8_t>& out, const uint8_t* literals, size_t nLiterals, size_t nOffset, size_t nMatch)
+    {
+        size_t nMatchCode = nMatch - c_nMinMatch;
+        out.push_back(uint8_t((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatchCode, 15)));
+        WriteLength(out, nLiterals);
+        out.insert(out.end(), literals, literals + nLiterals);
+        out.push_back(uint8_t(nOffset & 0xFF));
+        out.push_back(uint8_t(nOffset >> 8));
+        WriteLength(out, nMatchCode);
+    }
+
+    // Position of the last occurrence of each hashed 4 byte sequence.
+    std::vector<uint32_t> m_table;
+};
+
+// Decompress a block into exactly nDstSize bytes. Returns false on malformed input.
+inline bool Decompress(const uint8_t* src, size_t nSrcSize, uint8_t* dst, size_t nDstSize)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    auto readLength = [&](size_t& nLength)
+    {
+        if (nLength != 15)
+            return true;
+
+        uint8_t byte = 255;
+        while (byte == 255)
+        {
+            if (ip == nSrcSize)
+                return false;
+            byte = src[ip++];
+            nLength += byte;
+        }
+        return true;
+    };
+
+    while (true)
+    {
+        if (ip == nSrcSize)
+            return false;
+
+        uint8_t token = src[ip++];
+        size_t nLiterals = token >> 4;
+        if (!readLength(nLiterals) || nLiterals > nSrcSize - ip || nLiterals > nDstSize - op)
+            return false;
+
+        // Not memcpy: dst may be null for an empty block.
+        std::copy_n(src + ip, nLiterals, dst + op);
+        ip += nLiterals;
+        op += nLiterals;
+
+        // The last sequence has no match.
+        if (ip == nSrcSize)
+            break;
+
+        if (nSrcSize - ip < 2)
+            return false;
+        size_t nOffset = size_t(src[ip]) | (size_t(src[ip + 1]) << 8);
+        ip += 2;
+        if (nOffset == 0 || nOffset > op)
+            return false;
+
+        size_t nMatch = token & 0x0F;
+        if (!readLength(nMatch))
+            return false;
+        nMatch += c_nMinMatch;
+        if (nMatch > nDstSize - op)
+            return false;
+
+        // Source and destination overlap when the offset is shorter than the match (repeated pattern).
+        if (nOffset >= nMatch)
+        {
+            std::memcpy(dst + op, dst + op - nOffset, nMatch);
+            op += nMatch;
+        }
+        else
+        {
+            for (size_t i = 0; i < nMatch; ++i, ++op)
+                dst[op] = dst[op - nOffset];
+        }
+    }
+
+    return op == nDstSize;
+}
+
+} // namespace lz
+} // namespace net
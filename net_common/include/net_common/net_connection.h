@@ -1,11 +1,30 @@
 #pragma once
 #include "my_cpp_utils/logger.h"
+#include "net_capture.h"
+#include "net_compress.h"
+#include "net_crc32c.h"
+#include "net_delta.h"
+#include "net_file.h"
+#include "net_memory.h"
 #include "net_message.h"
+#include "net_rate_limit.h"
 #include "net_thread_safe_queue.h"
+#include "net_timing.h"
+#include "net_trace.h"
+#include "net_transport.h"
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
 #include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
 #include <asio/write.hpp>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <span>
+#include <unordered_map>
+#include <vector>
 
 namespace net
 {
@@ -14,6 +33,90 @@ namespace net
 template <typename T>
 class server_interface;
 
+// Per connection settings. Server and client pass them to every connection they create.
+template <typename T>
+struct connection_options
+{
+    // Message types sent as deltas against the previous message of the same type (see net_delta.h).
+    // Good for state messages that are sent every tick and change a little. Both sides must list the same types:
+    // a delta frame of another type closes the connection. The last received body of every type is kept as its
+    // baseline and counts as incoming memory, so nMaxIncomingBytes must leave room for them.
+    std::vector<T> deltaTypes;
+
+    // Message types compressed with the built-in LZ4 style codec (see net_compress.h), with the minimal
+    // body size to compress for each of them. Small bodies rarely shrink enough to pay for the CPU time.
+    std::unordered_map<T, size_t> compressTypes;
+
+    // Append a CRC32C of the header and body to every sent frame (frame_flags::checksum), and require it on every
+    // received one: a mismatch or a frame without the checksum closes the connection. Enable it on both sides.
+    bool checksum = false;
+
+    // Hard limit of a frame body. A larger header.size closes the connection before anything is allocated.
+    // Also limits bodies restored by decompression and delta decoding.
+    size_t nMaxBodySize = 16 * 1024 * 1024;
+
+    // Memory budget of the connection. 0 means unlimited.
+    // Incoming: frames being received plus messages waiting for Update. Reads are paused while it is exceeded.
+    // A compressed message is charged the size it claims to decompress to before it is decompressed.
+    // Outgoing: messages waiting to be written. Send over the budget closes the connection, as the remote side
+    // does not keep up with what we send. Send over the shared budget only drops the message
+    // (connection_counters::nMessagesNotSent): the connection is not the one to blame.
+    size_t nMaxIncomingBytes = 0;
+    size_t nMaxOutgoingBytes = 0;
+
+    // Budget shared with other connections (e.g. the server wide cap, see server_interface::SetMemoryLimit).
+    // Everything the connection charges to itself is charged to it as well.
+    std::shared_ptr<memory_budget> sharedBudget;
+
+    // Receive buffers come from this pool and go back to it whenever nothing is buffered, so an idle connection
+    // holds no receive buffer. Costs one more wakeup per read. nullptr - the connection keeps its own buffer.
+    std::shared_ptr<buffer_pool> idleBufferPool;
+
+    // Flood protection: a token bucket per message type, checked before a message enters the incoming queue.
+    // Messages over the rate are dropped. After nMaxDroppedMessages drops the connection is closed (0 - never).
+    std::unordered_map<T, rate_limit> messageRateLimits;
+    size_t nMaxDroppedMessages = 0;
+
+    // Every frame carries the time it was written at. With the clock offset known, the receiver gets one way
+    // latency per direction (see connection::Timing). Costs 8 bytes per frame.
+    bool timestamps = false;
+    // Client side: period of the clock sync heartbeat, the first one goes right after the handshake. 0 - off.
+    // The server answers it whatever its own options are.
+    std::chrono::milliseconds clockSyncInterval{0};
+
+    // Traffic capture (see server_interface::StartCapture). Every message sent or received is appended to it.
+    std::shared_ptr<capture_writer> capture;
+
+    // Link to another server process (see net_federation.h). Received messages carry the connection even on the
+    // client side, so the server knows which link they came from.
+    bool serverLink = false;
+    // Client side: received messages carry the connection, so one incoming queue can be shared by several
+    // connections (see sharded_client). Nothing is charged, unlike serverLink.
+    bool tagIncoming = false;
+};
+
+// Transport counters of a connection. Written by the asio thread only, read from anywhere (e.g. the metrics
+// endpoint), so they are relaxed atomics updated without read-modify-write instructions.
+struct connection_counters
+{
+    std::atomic<uint64_t> nBytesIn = 0;
+    std::atomic<uint64_t> nBytesOut = 0;
+    std::atomic<uint64_t> nFramesIn = 0;
+    std::atomic<uint64_t> nFramesOut = 0;
+    // User messages put into the incoming queue (batches unpacked, control frames and dropped messages excluded).
+    std::atomic<uint64_t> nMessagesIn = 0;
+    // Messages dropped by the rate limits (see connection_options::messageRateLimits).
+    std::atomic<uint64_t> nMessagesDropped = 0;
+    // Messages not sent as the shared memory budget was full (see connection_options::sharedBudget).
+    // Counted by the threads calling Send, so it is the one counter with a real increment.
+    std::atomic<uint64_t> nMessagesNotSent = 0;
+
+    static void Add(std::atomic<uint64_t>& counter, uint64_t nValue)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + nValue, std::memory_order_relaxed);
+    }
+};
+
 // Client and server depends on the connection class.
 // Connection use net::thread_safe_queue and net::message.
 template <typename T>
@@ -27,12 +130,23 @@ public:
     };
 
     connection(
-        owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket,
-        thread_safe_queue<owned_message<T>>& qIn)
-      : m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn)
+        owner parent, asio::io_context& asioContext, std::unique_ptr<transport> pTransport,
+        thread_safe_queue<owned_message<T>>& qIn, connection_options<T> options = {})
+      : m_asioContext(asioContext), m_transport(std::move(pTransport)), m_qMessagesIn(qIn),
+        m_options(std::move(options))
     {
         m_nOwnerType = parent;
 
+        // Timing state is only allocated when it is used.
+        if (m_options.timestamps || m_options.clockSyncInterval.count() > 0)
+            m_pTiming = std::make_unique<timing_state>(asioContext);
+
+        // Without the pool the receive buffer is allocated right away.
+        if (!m_options.idleBufferPool)
+            m_rxBuffer.resize(c_nReceiveBufferSize);
+        if (m_options.sharedBudget)
+            m_options.sharedBudget->Charge(FixedMemoryCost(m_options));
+
         if (m_nOwnerType == owner::server)
         {
             // Server constuct random handshake number from the current time.
@@ -49,18 +163,74 @@ public:
         }
     }
 
-    virtual ~connection() {}
+    virtual ~connection()
+    {
+        // Give back everything this connection still holds.
+        if (m_options.idleBufferPool && !m_rxBuffer.empty())
+            ReleaseReceiveBuffer();
+        if (m_options.sharedBudget)
+        {
+            m_options.sharedBudget->RemoveWaiter(this);
+            m_options.sharedBudget->Release(FixedMemoryCost(m_options) + m_nIncomingBytes + m_nOutgoingBytes);
+        }
+    }
+
+    // Memory a connection holds even when it does nothing. Used for admission control.
+    static size_t FixedMemoryCost(const connection_options<T>& options)
+    {
+        return sizeof(connection<T>) + (options.idleBufferPool ? 0 : c_nReceiveBufferSize);
+    }
+
+    // Approximate bytes held by the connection object and its buffers (not counting the transport).
+    // Call it from the asio thread or while the connection is idle.
+    size_t MemoryFootprint() const
+    {
+        size_t nBytes = sizeof(*this) + m_rxBuffer.capacity() + m_msgTemporaryIn.body.capacity() +
+                        (m_qMessagesOut.capacity() + m_qBatch.capacity()) * sizeof(shared_message<T>) +
+                        m_qExternalOut.capacity() * sizeof(external_body) + m_compressor.MemoryFootprint();
+        for (const auto& [id, body] : m_mapDeltaOut)
+            nBytes += body.capacity();
+        for (const auto& [id, body] : m_mapDeltaIn)
+            nBytes += body.capacity();
+        return nBytes;
+    }
+
+    // Memory charged for a queued message.
+    static size_t MessageCost(const message<T>& msg) { return sizeof(message_header<T>) + msg.body.size(); }
+
+    // Called by the server when a message of this connection has been handled by Update.
+    // Thread safe. Paused reads resume on the next retry of the asio thread.
+    void ReleaseIncoming(size_t nBytes) { ReleaseMemory(m_nIncomingBytes, nBytes); }
+
+    size_t IncomingBytes() const { return m_nIncomingBytes; }
+    size_t OutgoingBytes() const { return m_nOutgoingBytes; }
+
+    // Clock offset and latency histograms. nullptr unless connection_options::timestamps or clockSyncInterval is set.
+    const connection_timing* Timing() const { return m_pTiming ? &m_pTiming->stats : nullptr; }
+
+    const connection_counters& Counters() const { return m_counters; }
+
+    // Frames waiting to be written. Call it from the asio thread.
+    size_t OutgoingQueueSize() const { return m_qMessagesOut.size(); }
+
+    // Remote address of the transport. Call it from the asio thread.
+    std::string RemoteName() const { return m_transport->RemoteName(); }
 
     // Get the unique ID for this connection.
     uint32_t GetID() const { return m_nID; }
+
+    // Link to another server, not a client (see connection_options::serverLink).
+    bool IsServerLink() const { return m_options.serverLink; }
 public:
     bool ConnectToClient(net::server_interface<T>* server, uint32_t uid = 0)
     {
         if (m_nOwnerType == owner::server)
         {
-            if (m_socket.is_open())
+            if (m_transport->IsOpen())
             {
                 m_nID = uid;
+                if (m_options.capture)
+                    m_options.capture->Write(capture_event::connect, m_nID);
 
                 // Send the handshake to the client.
                 WriteValidation();
@@ -72,27 +242,27 @@ public:
         return false;
     }
 
-    // Called by clients.
-    bool ConnectToServer(asio::ip::tcp::resolver::results_type endpoints)
+    // Called by clients. Where to connect is decided by the transport.
+    bool ConnectToServer()
     {
         if (m_nOwnerType == owner::client)
         {
-            MY_LOG(
-                debug, "[Connection] ConnectToServer STARTS at {}:{}", endpoints->endpoint().address().to_string(),
-                endpoints->endpoint().port());
+            NET_TRACE(debug, connect_start, m_nID);
 
-            asio::async_connect(
-                m_socket, endpoints,
-                [this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+            m_transport->AsyncConnect(
+                [this, self = KeepAlive()](std::error_code ec)
                 {
                     if (!ec)
                     {
-                        MY_LOG(
-                            debug, "[Connection] ConnectToServer HAS COMPLETED at {}:{}",
-                            endpoint.address().to_string(), endpoint.port());
+                        NET_TRACE(debug, connect_done, m_nID);
 
                         ReadValidation();
                     }
+                    else
+                    {
+                        MY_LOG(error, "[Connection] ConnectToServer HAS FAILED: {}", ec.message());
+                        m_transport->Close();
+                    }
                 });
             return true;
         }
@@ -104,104 +274,602 @@ public:
     {
         if (IsConnected())
         {
-            MY_LOG(debug, "[Connection] Disconnect STARTS from {}", m_socket.remote_endpoint().address().to_string());
+            NET_TRACE(debug, disconnect, m_nID);
 
-            asio::post(m_asioContext, [this]() { m_socket.close(); });
+            asio::post(m_asioContext, [this, self = KeepAlive()]() { m_transport->Close(); });
             return true;
         }
         return false;
     }
+    // Close the transport on the calling thread. Only for an owner whose context is stopped (see
+    // server_interface::Stop), where the close posted by Disconnect would never run.
+    void CloseNow() { m_transport->Close(); }
+    // Disconnect once every queued message is written, the collected batch included (see
+    // server_interface::HotRestartDone).
+    void DisconnectWhenFlushed()
+    {
+        asio::post(
+            m_asioContext,
+            [this, self = KeepAlive()]()
+            {
+                while (!m_qBatch.empty())
+                    WriteBatch();
+
+                m_bCloseWhenFlushed = true;
+                if (m_qMessagesOut.empty() || !m_bHandshakeWritten)
+                    m_transport->Close();
+            });
+    }
+
     // Is the connection still active?
-    bool IsConnected() const { return m_socket.is_open(); }
+    bool IsConnected() const { return m_transport->IsOpen(); }
 
     // Send a message to the remote endpoint.
-    void Send(const message<T>& msg)
+    void Send(const message<T>& msg) { Send(std::make_shared<const message<T>>(msg)); }
+
+    // Send a shared message. Used for fan-out: the frame is not copied per recipient.
+    void Send(shared_message<T> pMsg)
     {
-        MY_LOG(debug, "[Connection] Send STARTS: ID {}, BodySize {}", msg.header.id, msg.body.size());
+        NET_TRACE(debug, send, m_nID, pMsg->header.id, pMsg->body.size());
+
+        if (!ChargeOutgoing(MessageCost(*pMsg)))
+            return;
 
         // Add new task to the ASIO context.
         asio::post(
             m_asioContext,
-            [this, msg]()
+            [this, self = KeepAlive(), pMsg = std::move(pMsg)]() mutable
             {
-                // If the queue has a message in it, then we must
-                // assume that it is in the process of asynchronously being written.
-                bool bWritingMessage = !m_qMessagesOut.empty();
-                m_qMessagesOut.push_back(msg);
+                // Deltas are encoded here, in the order the messages go to the wire.
+                // The receiver decodes them in the same order, so both sides agree on the baseline.
+                size_t nCost = MessageCost(*pMsg);
+                if (m_options.capture)
+                    Capture(capture_event::outbound, *pMsg);
+                if (!m_options.deltaTypes.empty())
+                    pMsg = EncodeDelta(std::move(pMsg));
+                if (!m_options.compressTypes.empty())
+                    pMsg = CompressMessage(std::move(pMsg));
 
-                // log push_back message.
-                MY_LOG(
-                    debug, "[Connection] Send: ID {}, BodySize {}, QueueSize {}, WritingMessage {}", msg.header.id,
-                    msg.body.size(), m_qMessagesOut.count(), bWritingMessage);
+                // The encoded message replaces the original one in the budget.
+                ChargeMemory(m_nOutgoingBytes, MessageCost(*pMsg));
+                ReleaseMemory(m_nOutgoingBytes, nCost);
 
-                MY_LOG(debug, "[Connection] Send HAS COMPLETED: ID {}, BodySize {}", msg.header.id, msg.body.size());
+                // In batching mode the message waits for the next FlushBatch.
+                if (m_bBatching)
+                    m_qBatch.push_back(std::move(pMsg));
+                else
+                    QueueOutgoing(std::move(pMsg));
+            });
+    }
 
-                if (!bWritingMessage)
-                {
-                    // Restart writing messages process if it's not already running.
-                    // Suppose when the message queue is empty, the writing process is not running.
-                    WriteHeader();
-                }
+#if defined(NET_HAS_FILE_SEND)
+    // Send a frame of type id whose body is nLength bytes of the file from nOffset, without reading it into
+    // memory: socket transports pass the file to sendfile, so the kernel copies it from the page cache. The file
+    // must stay open until the frame is written. The frame is not captured, delta encoded, compressed or batched.
+    // With connection_options::checksum the range is mapped to compute the checksum, which costs a pass over it.
+    // Returns false if the frame is not sent: the memory budget is full, or nLength is over nMaxBodySize, as the
+    // remote side would close the connection on such a frame. Both sides are expected to use the same limit.
+    bool SendFile(T id, int nFile, uint64_t nOffset, size_t nLength)
+    {
+        external_body body;
+        body.nFile = nFile;
+        body.nOffset = nOffset;
+        return SendExternal(id, std::move(body), nLength);
+    }
+
+    // Send a frame of type id whose body is the mapped region. All connections write from the same shared pages,
+    // so an asset sent to many clients is never copied per client. Otherwise as SendFile.
+    bool SendMapped(T id, std::shared_ptr<const mapped_region> pRegion)
+    {
+        size_t nLength = pRegion->Size();
+        external_body body;
+        body.mapped = std::span<const uint8_t>(pRegion->Data(), nLength);
+        body.pOwner = std::move(pRegion);
+        return SendExternal(id, std::move(body), nLength);
+    }
+#endif
+
+    // Server tick mode: collect outgoing messages until FlushBatch instead of sending them one by one.
+    // Must be called before the connection starts (see server_interface::EnableTickMode).
+    void EnableBatching(size_t nMaxMessages, size_t nMaxBytes)
+    {
+        m_bBatching = true;
+        m_nBatchMaxMessages = nMaxMessages;
+        m_nBatchMaxBytes = nMaxBytes;
+    }
+
+    // Send the collected messages as one aggregate frame. Messages over the budget wait for the next flush.
+    void FlushBatch()
+    {
+        asio::post(m_asioContext, [this, self = KeepAlive()]() { WriteBatch(); });
+    }
+private:
+    // Body of a frame sent by SendFile or SendMapped. It waits in m_qExternalOut beside the header only message
+    // that stands for the frame in m_qMessagesOut.
+    struct external_body
+    {
+        const message<T>* pFrame = nullptr;
+        // SendMapped: the bytes and the owner keeping them alive.
+        std::span<const uint8_t> mapped;
+        std::shared_ptr<const void> pOwner;
+        // SendFile: the file, -1 for a mapped body. The length is the size in the frame header.
+        int nFile = -1;
+        uint64_t nOffset = 0;
+    };
+
+    bool SendExternal(T id, external_body body, size_t nLength)
+    {
+        NET_TRACE(debug, send, m_nID, id, nLength);
+
+        // The frame can't be split: the parts would arrive as separate messages.
+        if (nLength > m_options.nMaxBodySize)
+        {
+            MY_LOG(
+                error, "[Connection] SendExternal HAS FAILED: body of {} bytes is over nMaxBodySize {}, ID {}",
+                nLength, m_options.nMaxBodySize, m_nID);
+            return false;
+        }
+
+        auto pFrame = std::make_shared<message<T>>();
+        pFrame->header.id = id;
+        pFrame->header.size = nLength;
+        body.pFrame = pFrame.get();
+
+        // Only the header is charged: the body is not held by the connection.
+        if (!ChargeOutgoing(MessageCost(*pFrame)))
+            return false;
+
+        asio::post(
+            m_asioContext,
+            [this, self = KeepAlive(), pFrame = std::move(pFrame), body = std::move(body)]() mutable
+            {
+                // The frame can't join the aggregate frame, so the collected batch goes first to keep the order.
+                while (!m_qBatch.empty())
+                    WriteBatch();
+
+                m_qExternalOut.push_back(std::move(body));
+                QueueOutgoing(std::move(pFrame));
             });
+        return true;
+    }
+
+    // External body of the frame at the front of m_qMessagesOut, nullptr if the body is in the message.
+    external_body* FrontExternalBody()
+    {
+        if (m_qExternalOut.empty() || m_qExternalOut.front().pFrame != m_qMessagesOut.front().get())
+            return nullptr;
+        return &m_qExternalOut.front();
+    }
+
+    // Body of the frame at the front of m_qMessagesOut. Empty for SendFile.
+    std::span<const uint8_t> FrontBody()
+    {
+        const external_body* pExternal = FrontExternalBody();
+        return pExternal ? pExternal->mapped : std::span<const uint8_t>(m_qMessagesOut.front()->body);
+    }
+
+    // Add a message to the outgoing queue and start writing if nothing is being written.
+    void QueueOutgoing(shared_message<T> pMsg)
+    {
+        // If the queue has a message in it, then we must
+        // assume that it is in the process of asynchronously being written.
+        bool bWritingMessage = !m_qMessagesOut.empty();
+
+        // log push_back message.
+        NET_TRACE(debug, queue_outgoing, m_nID, pMsg->header.id, pMsg->body.size(), m_qMessagesOut.size());
+
+        m_qMessagesOut.push_back(std::move(pMsg));
+        if (m_options.timestamps)
+            m_pTiming->queuedAt.push_back(SteadyNowNs());
+
+        if (!bWritingMessage && m_bHandshakeWritten)
+        {
+            // Restart writing messages process if it's not already running.
+            // Suppose when the message queue is empty, the writing process is not running.
+            WriteHeader();
+        }
+    }
+
+    // Replace the message by its delta against the previous message of the same type.
+    // Falls back to the full body when there is no baseline yet or the delta is not smaller.
+    shared_message<T> EncodeDelta(shared_message<T> pMsg)
+    {
+        T id = pMsg->header.id;
+        if (std::find(m_options.deltaTypes.begin(), m_options.deltaTypes.end(), id) == m_options.deltaTypes.end())
+            return pMsg;
+
+        auto pOut = std::make_shared<message<T>>();
+        pOut->header = pMsg->header;
+
+        auto it = m_mapDeltaOut.find(id);
+        if (it != m_mapDeltaOut.end())
+            delta::Encode(it->second, pMsg->body, pOut->body);
+
+        if (it != m_mapDeltaOut.end() && pOut->body.size() < pMsg->body.size())
+        {
+            pOut->header.flags |= frame_flags::delta;
+        }
+        else
+        {
+            pOut->body = pMsg->body;
+            pOut->header.flags |= frame_flags::delta_baseline;
+        }
+        pOut->header.size = pOut->body.size();
+
+        // TCP and the other transports are reliable and ordered, so a sent body is the acknowledged baseline.
+        m_mapDeltaOut[id] = pMsg->body;
+
+        NET_TRACE(debug, encode_delta, m_nID, id, pMsg->body.size(), pOut->body.size());
+
+        return pOut;
+    }
+
+    // Replace the message by its compressed copy if it is an opted in type, big enough, and really shrinks.
+    shared_message<T> CompressMessage(shared_message<T> pMsg)
+    {
+        auto it = m_options.compressTypes.find(pMsg->header.id);
+        if (it == m_options.compressTypes.end() || pMsg->body.size() < it->second || pMsg->body.size() > UINT32_MAX)
+            return pMsg;
+
+        auto pOut = std::make_shared<message<T>>();
+        pOut->header = pMsg->header;
+        pOut->body.reserve(sizeof(uint32_t) + lz::MaxCompressedSize(pMsg->body.size()));
+        pOut->body.resize(sizeof(uint32_t));
+
+        auto nOriginalSize = static_cast<uint32_t>(pMsg->body.size());
+        std::memcpy(pOut->body.data(), &nOriginalSize, sizeof(nOriginalSize));
+        m_compressor.Compress(pMsg->body.data(), pMsg->body.size(), pOut->body);
+
+        if (pOut->body.size() >= pMsg->body.size())
+            return pMsg;
+
+        pOut->header.flags |= frame_flags::compressed;
+        pOut->header.size = pOut->body.size();
+
+        NET_TRACE(debug, compress, m_nID, pOut->header.id, pMsg->body.size(), pOut->body.size());
+
+        return pOut;
+    }
+
+    // Pack as many collected messages as the budget allows into one frame and send it.
+    void WriteBatch()
+    {
+        // Count what fits into the budget. At least one message is taken, whatever the budget, so a large message
+        // can't stall the client and the loops emptying m_qBatch always make progress.
+        size_t nMessages = 0;
+        size_t nBytes = 0;
+        for (const auto& pMsg : m_qBatch)
+        {
+            size_t nFrame = sizeof(message_header<T>) + pMsg->body.size();
+            if (nMessages > 0 && (nMessages == m_nBatchMaxMessages || nBytes + nFrame > m_nBatchMaxBytes))
+                break;
+            nBytes += nFrame;
+            nMessages++;
+        }
+
+        if (nMessages == 0)
+            return;
+
+        // A single message does not need the aggregate frame.
+        if (nMessages == 1)
+        {
+            QueueOutgoing(m_qBatch.front());
+            m_qBatch.pop_front();
+            return;
+        }
+
+        auto pBatch = std::make_shared<message<T>>();
+        pBatch->header.flags = frame_flags::batch;
+        pBatch->body.resize(nBytes);
+
+        size_t nOffset = 0;
+        for (size_t i = 0; i < nMessages; ++i)
+        {
+            const auto& msg = *m_qBatch.front();
+            std::memcpy(pBatch->body.data() + nOffset, &msg.header, sizeof(message_header<T>));
+            nOffset += sizeof(message_header<T>);
+            // Not memcpy: an empty body has no buffer.
+            std::copy_n(msg.body.data(), msg.body.size(), pBatch->body.data() + nOffset);
+            nOffset += msg.body.size();
+            ReleaseMemory(m_nOutgoingBytes, MessageCost(msg));
+            m_qBatch.pop_front();
+        }
+
+        pBatch->header.size = pBatch->body.size();
+        ChargeMemory(m_nOutgoingBytes, MessageCost(*pBatch));
+
+        NET_TRACE(debug, write_batch, m_nID, nMessages, nBytes, m_qBatch.size());
+
+        QueueOutgoing(std::move(pBatch));
     }
 private:
-    // ASYNC - Prime context ready to read a message header.
+    // Parse all complete frames from the receive buffer, then prime the context to read more.
+    // One read from the socket usually brings many small frames, so they cost one syscall instead of two each.
     void ReadHeader()
     {
-        MY_LOG(debug, "[Connection] ReadHeader STARTS");
+        while (true)
+        {
+            // A complete frame waited for the memory of its decompressed messages (see DeliverFrame).
+            if (m_bFramePending)
+            {
+                if (!DeliverFrame())
+                    return;
+                continue;
+            }
 
-        asio::async_read(
-            m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
-            [this](std::error_code ec, std::size_t length)
+            if (!m_bReadingBody)
             {
-                if (!ec)
+                if (!m_bHeaderParsed)
                 {
-                    MY_LOG(
-                        debug, "[Connection] ReadHeader HAS COMPLETED: ID {}, BodySize {}, AsioLenth {}",
-                        m_msgTemporaryIn.header.id, m_msgTemporaryIn.header.size, length);
+                    if (m_nRxEnd - m_nRxBegin < sizeof(message_header<T>))
+                        break;
+
+                    std::memcpy(
+                        &m_msgTemporaryIn.header, m_rxBuffer.data() + m_nRxBegin, sizeof(message_header<T>));
+                    m_nRxBegin += sizeof(message_header<T>);
+
+                    NET_TRACE(debug, read_header_done, m_nID, m_msgTemporaryIn.header.id, m_msgTemporaryIn.header.size);
 
-                    if (m_msgTemporaryIn.header.size > 0)
+                    // Never trust the size field: a corrupted one would make us allocate gigabytes.
+                    if (m_msgTemporaryIn.header.size > m_options.nMaxBodySize)
                     {
-                        // Body in not empty, so resize the message buffer to hold the message body.
-                        m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-                        ReadBody();
+                        MY_LOG(
+                            error, "[Connection] ReadHeader HAS FAILED: BodySize {} is over the limit {}",
+                            m_msgTemporaryIn.header.size, m_options.nMaxBodySize);
+                        m_transport->Close();
+                        return;
                     }
-                    else
+
+                    // The flag is a part of the protected header: a cleared one must not switch the check off.
+                    if (m_options.checksum && !(m_msgTemporaryIn.header.flags & frame_flags::checksum))
+                    {
+                        MY_LOG(
+                            error, "[Connection] ReadHeader HAS FAILED: frame without checksum, ID {}",
+                            m_msgTemporaryIn.header.id);
+                        m_transport->Close();
+                        return;
+                    }
+
+                    m_bHeaderParsed = true;
+                }
+
+                // Trailers are read as a part of the body and cut off in CompleteFrame.
+                size_t nFrameBody = static_cast<size_t>(m_msgTemporaryIn.header.size);
+                if (m_msgTemporaryIn.header.flags & frame_flags::timestamp)
+                    nFrameBody += sizeof(int64_t);
+                if (m_msgTemporaryIn.header.flags & frame_flags::checksum)
+                    nFrameBody += sizeof(uint32_t);
+
+                // The body is allocated only when the memory budget allows it. Otherwise stop reading:
+                // the remote side is throttled by the transport flow control until Update catches up.
+                if (nFrameBody > 0)
+                {
+                    auto result = TryChargeMemory(m_nIncomingBytes, m_options.nMaxIncomingBytes, nFrameBody);
+                    if (result != charge_result::ok)
                     {
-                        // Body is empty, so add this message to the incoming message queue.
-                        AddToIncomingMessageQueue();
+                        PauseRead(nFrameBody, result == charge_result::shared_limit);
+                        return;
                     }
                 }
+                m_nFrameCharge = nFrameBody;
+                m_bHeaderParsed = false;
+
+                if (nFrameBody == 0)
+                {
+                    // Body is empty, so add this message to the incoming message queue.
+                    m_msgTemporaryIn.body.clear();
+                    AddToIncomingMessageQueue();
+                    continue;
+                }
+
+                // Body in not empty, so resize the message buffer to hold the message body.
+                m_msgTemporaryIn.body.resize(nFrameBody);
+                m_nBodyRead = 0;
+                m_bReadingBody = true;
+            }
+
+            // Take as much of the body as the receive buffer has.
+            size_t nChunk = std::min(m_nRxEnd - m_nRxBegin, m_msgTemporaryIn.body.size() - m_nBodyRead);
+            std::memcpy(m_msgTemporaryIn.body.data() + m_nBodyRead, m_rxBuffer.data() + m_nRxBegin, nChunk);
+            m_nRxBegin += nChunk;
+            m_nBodyRead += nChunk;
+
+            if (m_nBodyRead < m_msgTemporaryIn.body.size())
+            {
+                // Large bodies are read straight into the message, there is no point to pass them through the buffer.
+                if (m_msgTemporaryIn.body.size() - m_nBodyRead >= m_rxBuffer.size())
+                {
+                    ReadBody();
+                    return;
+                }
+                break;
+            }
+
+            // Body has been read, so add this message to the incoming message queue.
+            m_bReadingBody = false;
+            if (!CompleteFrame())
+                return;
+        }
+
+        ReadSome();
+    }
+
+    // ASYNC - Retry ReadHeader when nBytes may fit: on the next release of the incoming budget of this connection
+    // (Update has handled some of its messages), or of the shared budget when that one is full.
+    // nHeld - charged bytes of the frame that waits, see TryChargeMemory.
+    void PauseRead(size_t nBytes, bool bShared, size_t nHeld = 0)
+    {
+        NET_TRACE(debug, pause_read, m_nID, m_nIncomingBytes.load());
+
+        m_bReadPaused = true;
+        bool bRoom;
+        if (bShared)
+        {
+            // A server connection may be dropped while it waits. Its destructor removes the waiter, and one that
+            // is being destroyed can't be locked anymore. A client connection is not owned by a shared_ptr.
+            m_options.sharedBudget->AddWaiter(
+                this,
+                [this, bShared = KeepAlive() != nullptr]()
+                {
+                    auto self = KeepAlive();
+                    if (self || !bShared)
+                        ResumeRead(std::move(self));
+                });
+            bRoom = m_options.sharedBudget->HasRoom(nBytes);
+        }
+        else
+        {
+            size_t nUsed = m_nIncomingBytes.load();
+            bRoom = nUsed == nHeld || nUsed + nBytes <= m_options.nMaxIncomingBytes;
+        }
+
+        // The memory may have been released between the failed charge and the flag.
+        if (bRoom)
+            ResumeRead(KeepAlive());
+    }
+
+    // Continue a paused read on the asio thread. Called from any thread.
+    void ResumeRead(std::shared_ptr<connection<T>> self)
+    {
+        if (!m_bReadPaused.exchange(false))
+            return;
+
+        asio::post(
+            m_asioContext,
+            [this, self = std::move(self)]()
+            {
+                if (m_transport->IsOpen())
+                    ReadHeader();
+            });
+    }
+
+    // ASYNC - Prime context ready to read whatever the remote side has sent.
+    void ReadSome()
+    {
+        // Move the incomplete frame to the beginning of the buffer.
+        if (m_nRxBegin > 0)
+        {
+            std::memmove(m_rxBuffer.data(), m_rxBuffer.data() + m_nRxBegin, m_nRxEnd - m_nRxBegin);
+            m_nRxEnd -= m_nRxBegin;
+            m_nRxBegin = 0;
+        }
+
+        // Nothing is buffered: an idle connection gives its receive buffer back and waits for data without it.
+        if (m_options.idleBufferPool && m_nRxEnd == 0)
+        {
+            WaitReadable();
+            return;
+        }
+
+        ReceiveSome();
+    }
+
+    // ASYNC - Read into the free part of the receive buffer.
+    void ReceiveSome()
+    {
+        NET_TRACE(debug, read_some_start, m_nID, m_nRxEnd);
+
+        m_transport->AsyncReadSome(
+            asio::buffer(m_rxBuffer.data() + m_nRxEnd, m_rxBuffer.size() - m_nRxEnd),
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
+            {
+                if (!ec)
+                {
+                    NET_TRACE(debug, read_some_done, m_nID, length);
+                    connection_counters::Add(m_counters.nBytesIn, length);
+
+                    m_nRxEnd += length;
+                    ReadHeader();
+                }
+                else
+                {
+                    MY_LOG(error, "[Connection] ReadSome HAS FAILED: {}", ec.message());
+                    m_transport->Close();
+                }
+            });
+    }
+
+    // ASYNC - Release the idle memory and wait for the remote side to send something.
+    void WaitReadable()
+    {
+        NET_TRACE(debug, wait_readable, m_nID);
+
+        if (!m_rxBuffer.empty())
+            ReleaseReceiveBuffer();
+        TrimIdleWriteState();
+
+        m_transport->AsyncWaitReadable(
+            [this, self = KeepAlive()](std::error_code ec, std::size_t)
+            {
+                if (!ec)
+                {
+                    m_rxBuffer = m_options.idleBufferPool->Acquire();
+                    if (m_options.sharedBudget)
+                        m_options.sharedBudget->Charge(m_rxBuffer.size());
+                    ReceiveSome();
+                }
                 else
                 {
-                    MY_LOG(error, "[Connection] ReadHeader HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    MY_LOG(error, "[Connection] WaitReadable HAS FAILED: {}", ec.message());
+                    m_transport->Close();
                 }
             });
     }
 
-    // ASYNC - Prime context ready to read a message body.
+    // Everything queued is written.
+    void OnWriteQueueEmpty()
+    {
+        if (m_bCloseWhenFlushed)
+            m_transport->Close();
+        else
+            TrimIdleWriteState();
+    }
+
+    // Free the outgoing state when nothing is being sent or received (only with the idle buffer pool).
+    void TrimIdleWriteState()
+    {
+        if (!m_options.idleBufferPool || !m_rxBuffer.empty() || !m_qMessagesOut.empty() || !m_qBatch.empty())
+            return;
+
+        m_qMessagesOut.Trim();
+        m_qBatch.Trim();
+        m_qExternalOut.Trim();
+        m_compressor.Trim();
+        if (m_pTiming)
+            m_pTiming->queuedAt.Trim();
+    }
+
+    void ReleaseReceiveBuffer()
+    {
+        if (m_options.sharedBudget)
+            m_options.sharedBudget->Release(m_rxBuffer.size());
+        m_options.idleBufferPool->Release(std::move(m_rxBuffer));
+        m_rxBuffer.clear();
+    }
+
+    // ASYNC - Prime context ready to read the rest of a large message body.
     void ReadBody()
     {
-        MY_LOG(debug, "[Connection] ReadBody STARTS: BodySize {}", m_msgTemporaryIn.body.size());
+        NET_TRACE(debug, read_body_start, m_nID, m_msgTemporaryIn.body.size(), m_nBodyRead);
 
-        asio::async_read(
-            m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-            [this](std::error_code ec, std::size_t length)
+        m_transport->AsyncRead(
+            asio::buffer(m_msgTemporaryIn.body.data() + m_nBodyRead, m_msgTemporaryIn.body.size() - m_nBodyRead),
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
             {
                 if (!ec)
                 {
-                    MY_LOG(
-                        debug, "[Connection] ReadBody HAS COMPLETED: Size {}, AsioLenth {}",
-                        m_msgTemporaryIn.body.size(), length);
+                    NET_TRACE(debug, read_body_done, m_nID, m_msgTemporaryIn.body.size(), length);
+                    connection_counters::Add(m_counters.nBytesIn, length);
 
                     // Body has been read, so add this message to the incoming message queue.
-                    AddToIncomingMessageQueue();
+                    m_bReadingBody = false;
+                    if (CompleteFrame())
+                        ReadHeader();
                 }
                 else
                 {
                     MY_LOG(error, "[Connection] ReadBody HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    m_transport->Close();
                 }
             });
     }
@@ -209,38 +877,69 @@ private:
     // ASYNC - Prime context ready to write a message header.
     void WriteHeader()
     {
-        MY_LOG(
-            debug, "[Connection] WriteHeader STARTS: ID {}, BodySize {}", m_qMessagesOut.front().header.id,
-            m_qMessagesOut.front().header.size);
+        NET_TRACE(
+            debug, write_header_start, m_nID, m_qMessagesOut.front()->header.id, m_qMessagesOut.front()->header.size);
 
-        asio::async_write(
-            m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
-            [this](std::error_code ec, std::size_t length)
+        // The queued message may be shared with other connections, so transport flags go into a copy of the header.
+        const auto& msg = *m_qMessagesOut.front();
+        const external_body* pExternal = FrontExternalBody();
+        m_headerOut = msg.header;
+        if (m_options.timestamps)
+        {
+            m_headerOut.flags |= frame_flags::timestamp;
+            m_pTiming->nTimestampOut = SteadyNowNs();
+            m_pTiming->stats.queueOut.Record(m_pTiming->nTimestampOut - m_pTiming->queuedAt.front());
+            m_pTiming->queuedAt.pop_front();
+        }
+        if (m_options.checksum)
+        {
+            auto body = FrontBody();
+#if defined(NET_HAS_FILE_SEND)
+            // A file body is not in memory: it is mapped for the time of the checksum.
+            mapped_region fileBody;
+            if (pExternal && pExternal->nFile >= 0 && msg.header.size > 0)
             {
-                if (!ec)
+                if (!fileBody.Open(pExternal->nFile, pExternal->nOffset, static_cast<size_t>(msg.header.size)))
                 {
                     MY_LOG(
-                        debug, "[Connection] WriteHeader HAS COMPLETED: ID {}, BodySize {}, AsioLenth {}",
-                        m_qMessagesOut.front().header.id, m_qMessagesOut.front().header.size, length);
+                        error, "[Connection] WriteHeader HAS FAILED: file body of ID {} can't be read", msg.header.id);
+                    m_transport->Close();
+                    return;
+                }
+                body = std::span<const uint8_t>(fileBody.Data(), fileBody.Size());
+            }
+#endif
+            m_headerOut.flags |= frame_flags::checksum;
+            m_nChecksumOut = crc32c::Extend(
+                crc32c::Compute(&m_headerOut, sizeof(message_header<T>)), body.data(), body.size());
+            if (m_options.timestamps)
+                m_nChecksumOut = crc32c::Extend(m_nChecksumOut, &m_pTiming->nTimestampOut, sizeof(int64_t));
+        }
 
-                    if (m_qMessagesOut.front().body.size() > 0)
-                    {
+        m_transport->AsyncWrite(
+            asio::buffer(&m_headerOut, sizeof(message_header<T>)),
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
+            {
+                if (!ec)
+                {
+                    NET_TRACE(
+                        debug, write_header_done, m_nID, m_qMessagesOut.front()->header.id,
+                        m_qMessagesOut.front()->header.size, length);
+                    connection_counters::Add(m_counters.nBytesOut, length);
+
+                    const external_body* pExternal = FrontExternalBody();
+                    if (pExternal && pExternal->nFile >= 0)
+                        WriteFileBody();
+                    else if (!FrontBody().empty() ||
+                             (m_headerOut.flags & (frame_flags::checksum | frame_flags::timestamp)))
                         WriteBody();
-                    }
                     else
-                    {
-                        m_qMessagesOut.pop_front();
-
-                        if (!m_qMessagesOut.empty())
-                        {
-                            WriteHeader();
-                        }
-                    }
+                        FrameWritten();
                 }
                 else
                 {
                     MY_LOG(error, "[Connection] WriteHeader HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    m_transport->Close();
                 }
             });
     }
@@ -248,57 +947,565 @@ private:
     // ASYNC - Prime context ready to write a message body.
     void WriteBody()
     {
-        MY_LOG(
-            debug, "[Connection] WriteBody STARTS: ID {}, BodySize {}", m_qMessagesOut.front().header.id,
-            m_qMessagesOut.front().body.size());
+        NET_TRACE(
+            debug, write_body_start, m_nID, m_qMessagesOut.front()->header.id, m_qMessagesOut.front()->header.size);
+
+        // The trailers go out in the same write as the body, so they cost no extra syscall.
+        auto body = FrontBody();
+        bool bChecksum = m_headerOut.flags & frame_flags::checksum;
+        m_writeBuffers[0] = asio::buffer(body.data(), body.size());
+        m_writeBuffers[1] = m_options.timestamps ? asio::buffer(&m_pTiming->nTimestampOut, sizeof(int64_t))
+                                                 : asio::const_buffer();
+        m_writeBuffers[2] = asio::buffer(&m_nChecksumOut, bChecksum ? sizeof(m_nChecksumOut) : 0);
 
-        asio::async_write(
-            m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-            [this](std::error_code ec, std::size_t length)
+        m_transport->AsyncWrite(
+            std::span<const asio::const_buffer>(m_writeBuffers),
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
             {
                 if (!ec)
                 {
-                    MY_LOG(
-                        debug, "[Connection] WriteBody HAS COMPLETED: ID {}, BodySize {}, AsioLenth {}",
-                        m_qMessagesOut.front().header.id, m_qMessagesOut.front().body.size(), length);
-
-                    m_qMessagesOut.pop_front();
-
-                    if (!m_qMessagesOut.empty())
-                    {
-                        WriteHeader();
-                    }
+                    NET_TRACE(
+                        debug, write_body_done, m_nID, m_qMessagesOut.front()->header.id,
+                        m_qMessagesOut.front()->header.size, length);
+                    connection_counters::Add(m_counters.nBytesOut, length);
+                    FrameWritten();
                 }
                 else
                 {
                     MY_LOG(error, "[Connection] WriteBody HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    m_transport->Close();
                 }
             });
     }
 
+    // ASYNC - Write the body of a SendFile frame straight from the file, then its trailers.
+    void WriteFileBody()
+    {
+#if defined(NET_HAS_FILE_SEND)
+        NET_TRACE(
+            debug, write_body_start, m_nID, m_qMessagesOut.front()->header.id, m_qMessagesOut.front()->header.size);
+
+        const external_body& body = *FrontExternalBody();
+        m_transport->AsyncSendFile(
+            body.nFile, body.nOffset, m_qMessagesOut.front()->header.size,
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
+            {
+                if (ec)
+                {
+                    MY_LOG(error, "[Connection] WriteFileBody HAS FAILED: {}", ec.message());
+                    m_transport->Close();
+                    return;
+                }
+
+                NET_TRACE(
+                    debug, write_body_done, m_nID, m_qMessagesOut.front()->header.id,
+                    m_qMessagesOut.front()->header.size, length);
+                connection_counters::Add(m_counters.nBytesOut, length);
+                if (!(m_headerOut.flags & (frame_flags::checksum | frame_flags::timestamp)))
+                {
+                    FrameWritten();
+                    return;
+                }
+
+                m_writeBuffers[0] = m_options.timestamps ? asio::buffer(&m_pTiming->nTimestampOut, sizeof(int64_t))
+                                                         : asio::const_buffer();
+                m_writeBuffers[1] = asio::buffer(
+                    &m_nChecksumOut, (m_headerOut.flags & frame_flags::checksum) ? sizeof(m_nChecksumOut) : 0);
+                m_writeBuffers[2] = asio::const_buffer();
+                m_transport->AsyncWrite(
+                    std::span<const asio::const_buffer>(m_writeBuffers),
+                    [this, self = KeepAlive()](std::error_code ec, std::size_t length)
+                    {
+                        if (!ec)
+                        {
+                            connection_counters::Add(m_counters.nBytesOut, length);
+                            FrameWritten();
+                        }
+                        else
+                        {
+                            MY_LOG(error, "[Connection] WriteFileBody HAS FAILED: {}", ec.message());
+                            m_transport->Close();
+                        }
+                    });
+            });
+#endif
+    }
+
+    // The frame at the front of the outgoing queue is on the wire: drop it and write the next one.
+    void FrameWritten()
+    {
+        connection_counters::Add(m_counters.nFramesOut, 1);
+        ReleaseMemory(m_nOutgoingBytes, MessageCost(*m_qMessagesOut.front()));
+        if (FrontExternalBody())
+            m_qExternalOut.pop_front();
+        m_qMessagesOut.pop_front();
+
+        if (!m_qMessagesOut.empty())
+            WriteHeader();
+        else
+            OnWriteQueueEmpty();
+    }
+
+    // Check and cut off the trailers of the frame, then pass the message on. Returns false if the connection is closed.
+    bool CompleteFrame()
+    {
+        connection_counters::Add(m_counters.nFramesIn, 1);
+        if (m_pTiming)
+            m_pTiming->nReceivedNs = SteadyNowNs();
+
+        if (m_msgTemporaryIn.header.flags & frame_flags::checksum)
+        {
+            auto& body = m_msgTemporaryIn.body;
+            size_t nBodySize = body.size() - sizeof(uint32_t);
+
+            uint32_t nChecksum = 0;
+            std::memcpy(&nChecksum, body.data() + nBodySize, sizeof(nChecksum));
+            body.resize(nBodySize);
+
+            uint32_t nExpected = crc32c::Extend(
+                crc32c::Compute(&m_msgTemporaryIn.header, sizeof(message_header<T>)), body.data(), body.size());
+            if (nChecksum != nExpected)
+            {
+                MY_LOG(
+                    error, "[Connection] CompleteFrame HAS FAILED: checksum mismatch, ID {}, BodySize {}",
+                    m_msgTemporaryIn.header.id, nBodySize);
+                m_transport->Close();
+                return false;
+            }
+
+            m_msgTemporaryIn.header.flags &= ~frame_flags::checksum;
+        }
+
+        if (m_msgTemporaryIn.header.flags & frame_flags::timestamp)
+        {
+            auto& body = m_msgTemporaryIn.body;
+            size_t nBodySize = body.size() - sizeof(int64_t);
+
+            int64_t nSentNs = 0;
+            std::memcpy(&nSentNs, body.data() + nBodySize, sizeof(nSentNs));
+            body.resize(nBodySize);
+            m_msgTemporaryIn.header.flags &= ~frame_flags::timestamp;
+
+            if (m_pTiming && m_pTiming->stats.clock.IsValid())
+                m_pTiming->stats.oneWayIn.Record(m_pTiming->nReceivedNs - m_pTiming->stats.clock.ToLocalNs(nSentNs));
+        }
+
+        return DeliverFrame();
+    }
+
+    // Pass the messages of a complete frame on. Returns false if the connection is closed or the frame waits for
+    // memory: a few compressed bytes may claim up to nMaxBodySize each, so their decompressed bodies are charged
+    // first, and over the budget the frame waits as a body would.
+    bool DeliverFrame()
+    {
+        m_bFramePending = false;
+        size_t nInflated = InflatedSize();
+        if (nInflated > 0)
+        {
+            // Past the budget only one message may go, as for a body (see TryChargeMemory). A batch of more may
+            // never fit.
+            if (m_options.nMaxIncomingBytes != 0 && nInflated > m_options.nMaxBodySize &&
+                m_nFrameCharge + nInflated > m_options.nMaxIncomingBytes)
+            {
+                MY_LOG(
+                    error, "[Connection] DeliverFrame HAS FAILED: {} decompressed bytes are over the budget {}",
+                    nInflated, m_options.nMaxIncomingBytes);
+                m_transport->Close();
+                return false;
+            }
+
+            auto result = TryChargeMemory(m_nIncomingBytes, m_options.nMaxIncomingBytes, nInflated, m_nFrameCharge);
+            if (result != charge_result::ok)
+            {
+                m_bFramePending = true;
+                PauseRead(nInflated, result == charge_result::shared_limit, m_nFrameCharge);
+                return false;
+            }
+        }
+
+        AddToIncomingMessageQueue();
+
+        // The body has been moved to the queue or unpacked. Drop what is left, so the connection does not keep
+        // the capacity of the largest frame it has ever received.
+        std::vector<uint8_t>().swap(m_msgTemporaryIn.body);
+
+        // The frame buffer is charged until its messages are in the queue, then the messages are charged instead.
+        ReleaseMemory(m_nIncomingBytes, m_nFrameCharge + nInflated);
+        m_nFrameCharge = 0;
+        return true;
+    }
+
+    // Sum of the sizes the compressed messages of the received frame claim to decompress to. Sizes over
+    // nMaxBodySize are left out, DecompressMessage refuses them before allocating anything.
+    size_t InflatedSize() const
+    {
+        const auto& body = m_msgTemporaryIn.body;
+        if (m_msgTemporaryIn.header.flags & frame_flags::control)
+            return 0;
+        if (!(m_msgTemporaryIn.header.flags & frame_flags::batch))
+            return OriginalSize(m_msgTemporaryIn.header, body.data(), body.size());
+
+        // Malformed batches are refused by UnpackBatch, here only the well formed part counts.
+        size_t nTotal = 0;
+        size_t nOffset = 0;
+        while (body.size() - nOffset >= sizeof(message_header<T>))
+        {
+            message_header<T> header;
+            std::memcpy(&header, body.data() + nOffset, sizeof(message_header<T>));
+            nOffset += sizeof(message_header<T>);
+            if (header.size > body.size() - nOffset)
+                break;
+
+            nTotal += OriginalSize(header, body.data() + nOffset, header.size);
+            nOffset += header.size;
+        }
+        return nTotal;
+    }
+
+    // Decompressed size of a message as its body claims it, 0 if it is not compressed.
+    size_t OriginalSize(const message_header<T>& header, const uint8_t* pBody, size_t nSize) const
+    {
+        uint32_t nOriginalSize = 0;
+        if (!(header.flags & frame_flags::compressed) || nSize < sizeof(nOriginalSize))
+            return 0;
+
+        std::memcpy(&nOriginalSize, pBody, sizeof(nOriginalSize));
+        return nOriginalSize <= m_options.nMaxBodySize ? nOriginalSize : 0;
+    }
+
     // Add a message to the incoming message queue.
     void AddToIncomingMessageQueue()
     {
-        if (m_nOwnerType == owner::server)
+        if (m_msgTemporaryIn.header.flags & frame_flags::control)
+            HandleControl();
+        else if (m_msgTemporaryIn.header.flags & frame_flags::batch)
+            UnpackBatch();
+        else
+            PushIncoming(m_msgTemporaryIn);
+    }
+
+    // Append a message as the application sees it (decoded) to the traffic capture.
+    void Capture(capture_event event, const message<T>& msg)
+    {
+        // Transport flags belong to the frame the message came in, not to the message.
+        message_header<T> header = msg.header;
+        header.flags = 0;
+        header.size = msg.body.size();
+        m_options.capture->Write(event, m_nID, &header, msg.body.data(), msg.body.size());
+    }
+
+    void PushIncoming(message<T>& msg)
+    {
+        // Undo the send stages in reverse order: compression, then delta.
+        if ((msg.header.flags & frame_flags::compressed) && !DecompressMessage(msg))
         {
-            MY_LOG(
-                debug, "[Connection] Server received message: ID {}, BodySize {}, From client {}",
-                m_msgTemporaryIn.header.id, m_msgTemporaryIn.body.size(), m_nID);
-            m_qMessagesIn.push_back({this->shared_from_this(), m_msgTemporaryIn});
+            MY_LOG(error, "[Connection] DecompressMessage HAS FAILED: ID {}", msg.header.id);
+            m_transport->Close();
+            return;
+        }
+
+        if ((msg.header.flags & (frame_flags::delta | frame_flags::delta_baseline)) && !DecodeDelta(msg))
+        {
+            MY_LOG(error, "[Connection] DecodeDelta HAS FAILED: ID {}", msg.header.id);
+            m_transport->Close();
+            return;
+        }
+
+        // Dropped messages are captured as well: a replay has to reproduce the flood, not what got through.
+        if (m_options.capture)
+            Capture(capture_event::inbound, msg);
+
+        if (!m_options.messageRateLimits.empty() && !CheckRateLimit(msg.header.id))
+            return;
+
+        NET_TRACE(debug, received, m_nID, msg.header.id, msg.body.size());
+        connection_counters::Add(m_counters.nMessagesIn, 1);
+
+        if (m_nOwnerType == owner::server || m_options.serverLink)
+        {
+            // Released by server_interface::Update when the message is handled.
+            ChargeMemory(m_nIncomingBytes, MessageCost(msg));
+            m_qMessagesIn.push_back({this->shared_from_this(), std::move(msg), ReceivedNs()});
         }
         else
         {
-            MY_LOG(
-                debug, "[Connection] Client received message: ID {}, BodySize {}", m_msgTemporaryIn.header.id,
-                m_msgTemporaryIn.body.size());
             // For client tagging the connection is not required.
-            // Because the client has only one connection.
-            m_qMessagesIn.push_back({nullptr, m_msgTemporaryIn});
+            // Because the client has only one connection, unless it shares the queue.
+            m_qMessagesIn.push_back(
+                {m_options.tagIncoming ? this->shared_from_this() : nullptr, std::move(msg), ReceivedNs()});
+        }
+    }
+
+    // Take a token from the bucket of the message type. Returns false if the message must be dropped.
+    // Checked after decoding, so a dropped delta message still updates the baseline.
+    bool CheckRateLimit(T id)
+    {
+        auto itLimit = m_options.messageRateLimits.find(id);
+        if (itLimit == m_options.messageRateLimits.end())
+            return true;
+
+        auto now = token_bucket::clock::now();
+        auto [itBucket, bInserted] = m_mapRateBuckets.try_emplace(id, itLimit->second, now);
+        if (itBucket->second.TryTake(now))
+            return true;
+
+        m_nDroppedMessages++;
+        connection_counters::Add(m_counters.nMessagesDropped, 1);
+        NET_TRACE(debug, rate_limit_drop, m_nID, id);
+
+        if (m_options.nMaxDroppedMessages != 0 && m_nDroppedMessages == m_options.nMaxDroppedMessages)
+        {
+            MY_LOG(
+                warn, "[Connection] Client {} is disconnected: {} messages over the rate limit", m_nID,
+                m_nDroppedMessages);
+            m_transport->Close();
+        }
+        return false;
+    }
+
+    bool DecompressMessage(message<T>& msg)
+    {
+        uint32_t nOriginalSize = 0;
+        if (msg.body.size() < sizeof(nOriginalSize))
+            return false;
+
+        std::memcpy(&nOriginalSize, msg.body.data(), sizeof(nOriginalSize));
+        if (nOriginalSize > m_options.nMaxBodySize)
+            return false;
+
+        // Charged by DeliverFrame. The body is moved to the incoming queue, so there is no buffer worth keeping
+        // between messages.
+        std::vector<uint8_t> body(nOriginalSize);
+        if (!lz::Decompress(
+                msg.body.data() + sizeof(nOriginalSize), msg.body.size() - sizeof(nOriginalSize), body.data(),
+                body.size()))
+            return false;
+
+        msg.body = std::move(body);
+        msg.header.flags &= ~frame_flags::compressed;
+        msg.header.size = msg.body.size();
+        return true;
+    }
+
+    // Restore the full body of a delta frame and remember it as the baseline of its message type.
+    bool DecodeDelta(message<T>& msg)
+    {
+        // Every type would keep a baseline of up to nMaxBodySize, so only the configured ones may use deltas.
+        if (std::find(m_options.deltaTypes.begin(), m_options.deltaTypes.end(), msg.header.id) ==
+            m_options.deltaTypes.end())
+            return false;
+
+        if (msg.header.flags & frame_flags::delta)
+        {
+            auto it = m_mapDeltaIn.find(msg.header.id);
+            if (it == m_mapDeltaIn.end())
+                return false;
+
+            std::vector<uint8_t> body;
+            if (!delta::Decode(it->second, msg.body.data(), msg.body.size(), m_options.nMaxBodySize, body))
+                return false;
+
+            msg.body = std::move(body);
+        }
+
+        // The baseline stays until the next message of the type, it is charged until then (the destructor
+        // releases the rest with m_nIncomingBytes).
+        auto& baseline = m_mapDeltaIn[msg.header.id];
+        if (msg.body.size() > baseline.size())
+            ChargeMemory(m_nIncomingBytes, msg.body.size() - baseline.size());
+        else if (msg.body.size() < baseline.size())
+            ReleaseMemory(m_nIncomingBytes, baseline.size() - msg.body.size());
+        baseline = msg.body;
+        msg.header.flags &= ~(frame_flags::delta | frame_flags::delta_baseline);
+        msg.header.size = msg.body.size();
+        return true;
+    }
+
+    // Split an aggregate frame (see WriteBatch) into the original messages.
+    void UnpackBatch()
+    {
+        const auto& body = m_msgTemporaryIn.body;
+        size_t nOffset = 0;
+        while (nOffset < body.size())
+        {
+            message<T> msg;
+            if (body.size() - nOffset < sizeof(message_header<T>))
+                break;
+
+            std::memcpy(&msg.header, body.data() + nOffset, sizeof(message_header<T>));
+            nOffset += sizeof(message_header<T>);
+
+            if (msg.header.size > body.size() - nOffset ||
+                (msg.header.flags & (frame_flags::batch | frame_flags::control)))
+                break;
+
+            msg.body.assign(body.begin() + nOffset, body.begin() + nOffset + msg.header.size);
+            nOffset += msg.header.size;
+            PushIncoming(msg);
+        }
+
+        if (nOffset != body.size())
+        {
+            MY_LOG(error, "[Connection] UnpackBatch HAS FAILED: malformed aggregate frame");
+            m_transport->Close();
+        }
+    }
+private: // Control frames and the clock sync heartbeat.
+    void SendControl(const control_frame& frame)
+    {
+        auto pMsg = std::make_shared<message<T>>();
+        pMsg->header.flags = frame_flags::control;
+        pMsg->body.resize(sizeof(control_frame));
+        std::memcpy(pMsg->body.data(), &frame, sizeof(control_frame));
+        pMsg->header.size = pMsg->body.size();
+
+        // Control frames skip delta, compression and batching, but are charged as any other outgoing frame.
+        ChargeMemory(m_nOutgoingBytes, MessageCost(*pMsg));
+        QueueOutgoing(std::move(pMsg));
+    }
+
+    void HandleControl()
+    {
+        control_frame frame;
+        if (m_msgTemporaryIn.body.size() != sizeof(control_frame))
+        {
+            MY_LOG(error, "[Connection] HandleControl HAS FAILED: malformed control frame");
+            m_transport->Close();
+            return;
+        }
+        std::memcpy(&frame, m_msgTemporaryIn.body.data(), sizeof(control_frame));
+
+        switch (frame.type)
+        {
+        case control_frame::clock_request:
+            {
+                if (m_pTiming && frame.bHasEstimate)
+                    m_pTiming->stats.clock.SetFromRemote(frame.offset, frame.roundTrip);
+
+                control_frame response;
+                response.type = control_frame::clock_response;
+                response.t0 = frame.t0;
+                response.t1 = m_pTiming ? m_pTiming->nReceivedNs : SteadyNowNs();
+                response.t2 = SteadyNowNs();
+                SendControl(response);
+                break;
+            }
+        case control_frame::clock_response:
+            {
+                if (!m_pTiming)
+                    break;
+
+                int64_t t3 = m_pTiming->nReceivedNs;
+                m_pTiming->stats.clock.AddSample(frame.t0, frame.t1, frame.t2, t3);
+                m_pTiming->stats.roundTrip.Record((t3 - frame.t0) - (frame.t2 - frame.t1));
+
+                NET_TRACE(
+                    debug, clock_sync, m_nID, m_pTiming->stats.clock.OffsetNs(), m_pTiming->stats.clock.RoundTripNs());
+                break;
+            }
+        default:
+            // Unknown control frames come from newer peers, they are ignored.
+            NET_TRACE(debug, control_unknown, m_nID, frame.type);
+            break;
         }
+    }
+
+    // Client side heartbeat: send a clock request now and schedule the next one.
+    void SendClockRequest()
+    {
+        if (!m_transport->IsOpen())
+            return;
+
+        control_frame request;
+        request.type = control_frame::clock_request;
+        request.t0 = SteadyNowNs();
+        if (m_pTiming->stats.clock.IsValid())
+        {
+            request.bHasEstimate = 1;
+            request.offset = m_pTiming->stats.clock.OffsetNs();
+            request.roundTrip = m_pTiming->stats.clock.RoundTripNs();
+        }
+        SendControl(request);
+
+        m_pTiming->syncTimer.expires_after(m_options.clockSyncInterval);
+        m_pTiming->syncTimer.async_wait(
+            [this, self = KeepAlive()](std::error_code ec)
+            {
+                if (!ec)
+                    SendClockRequest();
+            });
+    }
 
-        // We must now prime the asio context to receive the next message.
-        ReadHeader();
+    int64_t ReceivedNs() const { return m_pTiming ? m_pTiming->nReceivedNs : 0; }
+
+    // Pending handlers hold this, so a server connection (owned by a shared_ptr) lives until they have run,
+    // even when the server has already dropped it. A client owns its connection by unique_ptr and stops the
+    // context before destroying it, so there it is nullptr.
+    std::shared_ptr<connection<T>> KeepAlive() { return this->weak_from_this().lock(); }
+private: // Memory accounting.
+    enum class charge_result
+    {
+        ok,
+        // The budget of this connection is exceeded.
+        connection_limit,
+        // The shared budget is full, because of any connection.
+        shared_limit
+    };
+
+    // Charge a counter of this connection and the shared budget, if the limits allow it.
+    // A connection with nothing charged may always take one message, otherwise a message bigger than the budget
+    // would stall it forever. nHeld - what the same frame has charged already: a counter of just that is empty.
+    charge_result TryChargeMemory(std::atomic<size_t>& nCounter, size_t nLimit, size_t nBytes, size_t nHeld = 0)
+    {
+        size_t nOld = nCounter.fetch_add(nBytes);
+        charge_result result = charge_result::ok;
+        if (nLimit != 0 && nOld != nHeld && nOld + nBytes > nLimit)
+            result = charge_result::connection_limit;
+        else if (m_options.sharedBudget && !m_options.sharedBudget->TryCharge(nBytes))
+            result = charge_result::shared_limit;
+
+        if (result != charge_result::ok)
+            nCounter.fetch_sub(nBytes);
+        return result;
+    }
+
+    // Charge a message to be sent. Over the budget of this connection the remote side does not keep up, and the
+    // connection is closed. Over the shared budget the message is dropped, the connection stays.
+    bool ChargeOutgoing(size_t nBytes)
+    {
+        switch (TryChargeMemory(m_nOutgoingBytes, m_options.nMaxOutgoingBytes, nBytes))
+        {
+        case charge_result::ok:
+            return true;
+        case charge_result::connection_limit:
+            MY_LOG(
+                warn, "[Connection] Send HAS FAILED: outgoing memory budget is exceeded ({} bytes queued), closing",
+                m_nOutgoingBytes.load());
+            Disconnect();
+            return false;
+        case charge_result::shared_limit:
+            m_counters.nMessagesNotSent.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return false;
+    }
+
+    // Charge memory that is already allocated.
+    void ChargeMemory(std::atomic<size_t>& nCounter, size_t nBytes)
+    {
+        nCounter.fetch_add(nBytes);
+        if (m_options.sharedBudget)
+            m_options.sharedBudget->Charge(nBytes);
+    }
+
+    void ReleaseMemory(std::atomic<size_t>& nCounter, size_t nBytes)
+    {
+        nCounter.fetch_sub(nBytes);
+        if (m_options.sharedBudget)
+            m_options.sharedBudget->Release(nBytes);
+        // A read paused by the budget of this connection waits for its incoming messages to be handled.
+        if (&nCounter == &m_nIncomingBytes && m_bReadPaused.load())
+            ResumeRead(KeepAlive());
     }
 private: // Encryption/Decryption.
     // Naive encrypt data function.
@@ -312,43 +1519,50 @@ private: // Encryption/Decryption.
     // ASYNC - Used by both client and server to write the handshake pattern.
     void WriteValidation()
     {
-        MY_LOG(debug, "[Connection] WriteValidation STARTS: HandshakeOut {}", m_nHandshakeOut);
+        NET_TRACE(debug, write_validation_start, m_nID, m_nHandshakeOut);
 
-        asio::async_write(
-            m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-            [this](std::error_code ec, std::size_t length)
+        m_transport->AsyncWrite(
+            asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
+            [this, self = KeepAlive()](std::error_code ec, std::size_t length)
             {
                 if (!ec)
                 {
-                    MY_LOG(
-                        debug, "[Connection] WriteValidation HAS COMPLETED: HandshakeOut {}, AsioLenth {}",
-                        m_nHandshakeOut, length);
+                    NET_TRACE(debug, write_validation_done, m_nID, m_nHandshakeOut, length);
+
+                    // Messages sent during the handshake (e.g. from OnClientConnect) may go now.
+                    m_bHandshakeWritten = true;
+                    if (!m_qMessagesOut.empty())
+                        WriteHeader();
 
                     // Validation data sent. Client should sit and wait for a response.
                     if (m_nOwnerType == owner::client)
+                    {
                         ReadHeader();
+
+                        // The first clock sync goes right after the handshake, then it is a heartbeat.
+                        if (m_options.clockSyncInterval.count() > 0)
+                            SendClockRequest();
+                    }
                 }
                 else
                 {
                     MY_LOG(error, "[Connection] WriteValidation HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    m_transport->Close();
                 }
             });
     }
 
     void ReadValidation(net::server_interface<T>* server = nullptr)
     {
-        MY_LOG(debug, "[Connection] ReadValidation STARTS");
+        NET_TRACE(debug, read_validation_start, m_nID);
 
-        asio::async_read(
-            m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-            [this, server](std::error_code ec, std::size_t length)
+        m_transport->AsyncRead(
+            asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
+            [this, self = KeepAlive(), server](std::error_code ec, std::size_t length)
             {
                 if (!ec)
                 {
-                    MY_LOG(
-                        debug, "[Connection] ReadValidation HAS COMPLETED: HandshakeIn {}, AsioLenth {}",
-                        m_nHandshakeIn, length);
+                    NET_TRACE(debug, read_validation_done, m_nID, m_nHandshakeIn, length);
 
                     if (m_nOwnerType == owner::server)
                     {
@@ -368,13 +1582,15 @@ private: // Encryption/Decryption.
                         }
                         else
                         {
-                            // TODO3: There may be code to adding the client to a blacklist.
+                            // Repeated failures blacklist the address (see accept_limit_options).
+                            if (server)
+                                server->ReportHandshakeFailure(m_transport->RemoteAddress());
 
                             MY_LOG(
                                 error, "[Connection] ReadValidation: HandshakeIn {} != HandshakeCheck {}",
                                 m_nHandshakeIn, m_nHandshakeCheck);
                             MY_LOG(error, "[Connection] ReadValidation: Handshake is not validated");
-                            m_socket.close();
+                            m_transport->Close();
                         }
                     }
                     else
@@ -389,27 +1605,101 @@ private: // Encryption/Decryption.
                 else
                 {
                     MY_LOG(error, "[Connection] ReadValidation HAS FAILED: {}", ec.message());
-                    m_socket.close();
+                    m_transport->Close();
                 }
             });
     }
 protected:
+    // Size of the per connection receive buffer.
+    static constexpr size_t c_nReceiveBufferSize = 16 * 1024;
+
+    // Members are grouped by size, so there is no padding between them: a server may hold 100k+ connections.
+
     // This context is shared with the whole asio instance.
     // Provided by the client or server interface.
     asio::io_context& m_asioContext;
-    // Responsible for the ASIO stuff.
-    asio::ip::tcp::socket m_socket;
-    // This queue holds all messages to be sent to the remote side.
-    thread_safe_queue<message<T>> m_qMessagesOut;
+    // Byte stream to the remote side: TCP, local socket or in-process pipe.
+    std::unique_ptr<transport> m_transport;
     // This queue holds all messages that have been received from the remote side.
     // Note it is a reference as the "owner" of this connection is expected to provide a queue.
     // Provided by the client or server interface.
     thread_safe_queue<owned_message<T>>& m_qMessagesIn;
-    // The "temporary" incoming message (completed messages are transferred to incoming message queue).
+    // Settings given by the server or client interface.
+    connection_options<T> m_options;
+
+    // This queue holds all messages to be sent to the remote side. Only the asio thread touches it,
+    // so it needs no lock, and it takes no memory while empty.
+    compact_queue<shared_message<T>> m_qMessagesOut;
+    // Bodies of the SendFile and SendMapped frames of m_qMessagesOut, in the same order.
+    compact_queue<external_body> m_qExternalOut;
+    // Server tick mode: messages waiting for the next FlushBatch and the per flush budget.
+    compact_queue<shared_message<T>> m_qBatch;
+    size_t m_nBatchMaxMessages = -1;
+    size_t m_nBatchMaxBytes = -1;
+
+    // The "temporary" incoming message (completed messages are moved to the incoming message queue).
     message<T> m_msgTemporaryIn;
+    // Receive buffer. Bytes in [m_nRxBegin, m_nRxEnd) are received but not parsed yet.
+    // Empty while the connection waits for data with connection_options::idleBufferPool.
+    std::vector<uint8_t> m_rxBuffer;
+    size_t m_nRxBegin = 0;
+    size_t m_nRxEnd = 0;
+    size_t m_nBodyRead = 0;
+
+    // Memory accounting (see connection_options::nMaxIncomingBytes). Counters are touched from several threads.
+    std::atomic<size_t> m_nIncomingBytes = 0;
+    std::atomic<size_t> m_nOutgoingBytes = 0;
+    // Charge of the frame being received.
+    size_t m_nFrameCharge = 0;
+    // The received frame waits for the memory of its decompressed messages (see DeliverFrame).
+    bool m_bFramePending = false;
+    // Reading waits for memory (see PauseRead).
+    std::atomic<bool> m_bReadPaused = false;
+
+    // Delta baselines: last sent and last received body per message type.
+    std::unordered_map<T, std::vector<uint8_t>> m_mapDeltaOut;
+    std::unordered_map<T, std::vector<uint8_t>> m_mapDeltaIn;
+    // Compression state, reused for every message.
+    lz::compressor m_compressor;
+    // Flood protection: buckets of the rate limited message types, created on their first message.
+    std::unordered_map<T, token_bucket> m_mapRateBuckets;
+    size_t m_nDroppedMessages = 0;
+    // See Counters.
+    connection_counters m_counters;
+
+    // Timestamps and clock sync (see connection_options::timestamps). Allocated only when enabled.
+    struct timing_state
+    {
+        explicit timing_state(asio::io_context& context) : syncTimer(context) {}
+
+        connection_timing stats;
+        asio::steady_timer syncTimer;
+        // Time each frame of m_qMessagesOut was queued at, and the timestamp trailer of the frame being written.
+        compact_queue<int64_t> queuedAt;
+        int64_t nTimestampOut = 0;
+        // Receive time of the frame being completed.
+        int64_t nReceivedNs = 0;
+    };
+    std::unique_ptr<timing_state> m_pTiming;
+
+    // Body + trailer buffers of WriteBody, header of the frame being written (with transport flags)
+    // and its checksum trailer.
+    std::array<asio::const_buffer, 3> m_writeBuffers;
+    message_header<T> m_headerOut;
+    uint32_t m_nChecksumOut = 0;
+
     // The "owner" decides how some of the connection behaves.
-    owner m_nOwnerType = owner::server;
     uint32_t m_nID = 0;
+    owner m_nOwnerType = owner::server;
+    // The header of m_msgTemporaryIn is parsed and its body is being filled.
+    bool m_bReadingBody = false;
+    // The header of m_msgTemporaryIn is parsed, but its body is waiting for the memory budget.
+    bool m_bHeaderParsed = false;
+    bool m_bBatching = false;
+    // Our handshake value is written. Frames queued before wait for it, so they never get in front of it.
+    bool m_bHandshakeWritten = false;
+    // See DisconnectWhenFlushed.
+    bool m_bCloseWhenFlushed = false;
 protected: //  Handshake validation.
     // What the connections whould be send output.
     uint64_t m_nHandshakeOut = 0;
@@ -0,0 +1,125 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NET_CRC32C_X86 1
+#include <nmmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+#endif
+
+namespace net
+{
+
+// CRC32C (Castagnoli) - the checksum of iSCSI, ext4 and SCTP. Modern x86 CPUs compute it with the SSE4.2 crc32
+// instruction at several bytes per cycle, so a checksum per frame is cheap enough to keep on in production.
+// Other CPUs use the portable table version.
+namespace crc32c
+{
+
+namespace detail
+{
+constexpr uint32_t c_nPolynomial = 0x82F63B78; // Reversed Castagnoli polynomial.
+
+constexpr std::array<uint32_t, 256> MakeTable()
+{
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ c_nPolynomial : crc >> 1;
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 256> c_table = MakeTable();
+
+inline uint32_t ExtendPortable(uint32_t crc, const uint8_t* data, size_t nSize)
+{
+    for (size_t i = 0; i < nSize; ++i)
+        crc = c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(NET_CRC32C_X86)
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sse4.2")))
+#endif
+inline uint32_t ExtendHardware(uint32_t crc, const uint8_t* data, size_t nSize)
+{
+    uint64_t crc64 = crc;
+    while (nSize >= sizeof(uint64_t))
+    {
+        uint64_t v;
+        std::memcpy(&v, data, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        data += sizeof(v);
+        nSize -= sizeof(v);
+    }
+
+    auto crc32 = static_cast<uint32_t>(crc64);
+    while (nSize > 0)
+    {
+        crc32 = _mm_crc32_u8(crc32, *data++);
+        nSize--;
+    }
+    return crc32;
+}
+
+inline bool DetectHardware()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    unsigned int eax = 0;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_SSE4_2) != 0;
+#else
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#endif
+}
+#endif
+} // namespace detail
+
+// True if the hardware instruction is used.
+inline bool IsHardwareAccelerated()
+{
+#if defined(NET_CRC32C_X86)
+    static const bool bHardware = detail::DetectHardware();
+    return bHardware;
+#else
+    return false;
+#endif
+}
+
+// Continue a checksum over more data: Extend(Extend(0, a), b) == checksum of a followed by b.
+inline uint32_t Extend(uint32_t crc, const void* data, size_t nSize)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(NET_CRC32C_X86)
+    if (IsHardwareAccelerated())
+        return ~detail::ExtendHardware(crc, bytes, nSize);
+#endif
+    return ~detail::ExtendPortable(crc, bytes, nSize);
+}
+
+inline uint32_t Compute(const void* data, size_t nSize)
+{
+    return Extend(0, data, nSize);
+}
+
+} // namespace crc32c
+} // namespace net
@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace net
+{
+
+// Delta codec for state messages that change little between sends.
+// The new body is XORed with the previous body of the same message type (the baseline), so unchanged
+// bytes become zeros, then the zero runs are run-length encoded.
+//
+// Encoded layout (all numbers are LEB128 varints):
+//   [body size] { [zero run length] [literal length] [literal bytes...] }*
+// Literal bytes are XOR values. Bytes past the end of the baseline are XORed with zero.
+namespace delta
+{
+
+// Zero runs shorter than this are cheaper to keep inside a literal.
+constexpr size_t c_nMinZeroRun = 3;
+
+inline void WriteVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(uint8_t(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+inline bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for (int nShift = 0; nShift < 64 && data != end; nShift += 7)
+    {
+        uint8_t byte = *data++;
+        value |= uint64_t(byte & 0x7F) << nShift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline uint8_t XorAt(const std::vector<uint8_t>& baseline, const std::vector<uint8_t>& body, size_t i)
+{
+    return i < baseline.size() ? uint8_t(body[i] ^ baseline[i]) : body[i];
+}
+
+// Encode body against baseline. out is overwritten.
+inline void Encode(const std::vector<uint8_t>& baseline, const std::vector<uint8_t>& body, std::vector<uint8_t>& out)
+{
+    out.clear();
+    WriteVarint(out, body.size());
+
+    size_t i = 0;
+    while (i < body.size())
+    {
+        size_t nZeroStart = i;
+        while (i < body.size() && XorAt(baseline, body, i) == 0)
+            i++;
+        size_t nZeroRun = i - nZeroStart;
+
+        // The literal ends at the next zero run that is long enough, or at the end of the body.
+        size_t nLiteralStart = i;
+        size_t nZeros = 0;
+        while (i < body.size() && nZeros < c_nMinZeroRun)
+        {
+            nZeros = XorAt(baseline, body, i) == 0 ? nZeros + 1 : 0;
+            i++;
+        }
+        if (nZeros == c_nMinZeroRun)
+            i -= nZeros;
+
+        WriteVarint(out, nZeroRun);
+        WriteVarint(out, i - nLiteralStart);
+        for (size_t j = nLiteralStart; j < i; ++j)
+            out.push_back(XorAt(baseline, body, j));
+    }
+}
+
+// Reconstruct the body from baseline and encoded data. Returns false on malformed input
+// or if the body would be larger than nMaxBodySize.
+inline bool Decode(
+    const std::vector<uint8_t>& baseline, const uint8_t* data, size_t size, size_t nMaxBodySize,
+    std::vector<uint8_t>& body)
+{
+    const uint8_t* end = data + size;
+    uint64_t nBodySize = 0;
+    if (!ReadVarint(data, end, nBodySize) || nBodySize > nMaxBodySize)
+        return false;
+
+    // Start from the baseline: zero runs leave these bytes as they are.
+    body.assign(nBodySize, 0);
+    std::copy_n(baseline.begin(), std::min(baseline.size(), body.size()), body.begin());
+
+    size_t i = 0;
+    while (data != end)
+    {
+        uint64_t nZeroRun = 0;
+        uint64_t nLiteral = 0;
+        if (!ReadVarint(data, end, nZeroRun) || !ReadVarint(data, end, nLiteral))
+            return false;
+        if (nZeroRun > body.size() - i || nLiteral > body.size() - i - nZeroRun || nLiteral > size_t(end - data))
+            return false;
+
+        i += nZeroRun;
+        for (size_t j = 0; j < nLiteral; ++j, ++i)
+            body[i] ^= *data++;
+    }
+
+    return i == body.size();
+}
+
+} // namespace delta
+} // namespace net
@@ -0,0 +1,566 @@
+#pragma once
+#include "net_connection.h"
+#include "net_message.h"
+#include "net_thread_safe_queue.h"
+#include "net_transport.h"
+#include <algorithm>
+#include <asio.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <my_cpp_utils/logger.h>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace net
+{
+
+// Federation: several server processes linked by persistent connections, so a broadcast or a topic publish of one
+// server reaches the clients of all of them (see server_interface::StartFederation).
+//
+// A forwarded message is an item: origin server, sequence number, hop count, kind and topic, then the message.
+// Items for a peer are collected for batchInterval and go out as one frame_flags::federation frame per link.
+// An item goes to every peer once, whatever the number of clients there. Receivers drop the items they have seen
+// already (by origin and sequence number), so duplicate links and relays never deliver a message twice.
+
+struct federation_peer
+{
+    std::string host;
+    uint16_t nPort = 0;
+};
+
+struct federation_options
+{
+    // Id of this server, unique in the federation. Must not be 0.
+    uint32_t nServerId = 0;
+    // Port the other servers connect to. 0 - this server only dials.
+    uint16_t nListenPort = 0;
+    // Address the port is bound to. The local host only by default: servers on other hosts need a private
+    // network address, as anyone who can reach the port and knows the secret can send to every client.
+    std::string listenAddress = "127.0.0.1";
+    // Servers to dial. A link serves both directions, so only one server of a pair needs the other one here.
+    std::vector<federation_peer> peers;
+    // Both ends of a link must have the same secret, or the link is closed. It must not be empty: take it from
+    // the configuration of the deployment, never from the source. It is sent in the clear: links that
+    // leave the private network need an encrypted transport.
+    std::string secret;
+    // Items for a peer wait that long to go out in one frame. A batch over nMaxBatchBytes goes out right away.
+    std::chrono::microseconds batchInterval{1000};
+    size_t nMaxBatchBytes = 64 * 1024;
+    // Times an item is passed on. 1 - full mesh, every server is linked with every other one. More lets items
+    // reach servers through others, each server relays an item to its peers once.
+    uint16_t nMaxHops = 1;
+    // Period of the link checks. Broken links to the configured peers are dialed again.
+    std::chrono::milliseconds reconnectInterval{1000};
+};
+
+// Body of a frame_flags::federation frame starts with it.
+struct federation_frame
+{
+    enum kind : uint32_t
+    {
+        // federation_hello and the secret follow. The first frame on a link in both directions.
+        hello = 1,
+        // nCount federation_items follow, each one followed by its message_header and body.
+        items = 2,
+    };
+
+    uint32_t type = 0;
+    uint32_t nCount = 0;
+};
+
+struct federation_hello
+{
+    uint32_t nServerId = 0;
+    uint32_t nSecretSize = 0;
+};
+
+struct federation_item
+{
+    enum kind : uint16_t
+    {
+        // server_interface::MessageAllClients.
+        broadcast = 1,
+        // server_interface::Publish to the topic.
+        publish = 2,
+    };
+
+    uint32_t nOrigin = 0;
+    uint16_t type = 0;
+    uint16_t nHops = 0;
+    uint32_t topic = 0;
+    // Random per process start of the origin, a restarted origin numbers its items from 1 again.
+    uint32_t nIncarnation = 0;
+    uint64_t nSeq = 0;
+};
+
+struct federation_counters
+{
+    // Local broadcasts and publishes sent to the peers.
+    std::atomic<uint64_t> nItemsForwarded = 0;
+    // Items delivered to the local clients.
+    std::atomic<uint64_t> nItemsReceived = 0;
+    // Items of another link or relay that were delivered already.
+    std::atomic<uint64_t> nDuplicates = 0;
+    std::atomic<uint64_t> nFramesSent = 0;
+};
+
+// Sequence numbers seen from one origin: the highest one and a bitmap of the 64 before it. Items delayed by
+// more than 64 newer ones are taken for duplicates.
+struct seen_window
+{
+    uint32_t nIncarnation = 0;
+    uint64_t nHighest = 0;
+    uint64_t nMask = 0;
+
+    bool Insert(uint32_t nItemIncarnation, uint64_t nSeq)
+    {
+        if (nItemIncarnation != nIncarnation)
+        {
+            nIncarnation = nItemIncarnation;
+            nHighest = 0;
+            nMask = 0;
+        }
+
+        if (nSeq > nHighest)
+        {
+            uint64_t nShift = nSeq - nHighest;
+            uint64_t nNewMask = nShift >= 64 ? 0 : nMask << nShift;
+            if (nHighest != 0 && nShift <= 64)
+                nNewMask |= uint64_t(1) << (nShift - 1);
+            nMask = nNewMask;
+            nHighest = nSeq;
+            return true;
+        }
+
+        uint64_t nDistance = nHighest - nSeq;
+        if (nDistance == 0 || nDistance > 64)
+            return false;
+
+        uint64_t nBit = uint64_t(1) << (nDistance - 1);
+        if (nMask & nBit)
+            return false;
+        nMask |= nBit;
+        return true;
+    }
+};
+
+// Links of one server. Links are created, checked and flushed on the asio thread; Forward and Receive are called by
+// the thread calling server_interface::Update. The link list is shared by both under m_muxLinks, which is taken
+// once per forwarded item and once per received frame, never per client.
+template <typename T>
+class federation
+{
+public:
+    federation(asio::io_context& context, thread_safe_queue<owned_message<T>>& qIn, const federation_options& options)
+      : m_context(context), m_qIn(qIn), m_options(options), m_resolver(context), m_flushTimer(context),
+        m_checkTimer(context), m_vecDialing(options.peers.size(), false)
+    {
+        m_linkOptions.serverLink = true;
+        m_nIncarnation = static_cast<uint32_t>(std::chrono::system_clock::now().time_since_epoch().count()) | 1;
+        if (m_options.nMaxHops == 0)
+            m_options.nMaxHops = 1;
+    }
+
+    // Open the listener and dial the peers. Call it before the context runs or from its thread.
+    void Start()
+    {
+        if (m_options.nListenPort != 0)
+        {
+            m_acceptor.emplace(
+                m_context,
+                asio::ip::tcp::endpoint(asio::ip::make_address(m_options.listenAddress), m_options.nListenPort));
+            Accept();
+        }
+
+        for (size_t i = 0; i < m_options.peers.size(); ++i)
+            Dial(i);
+        CheckLinks();
+    }
+
+    // Send a local broadcast or publish to the peers. Update thread.
+    void Forward(uint16_t type, uint32_t topic, const message<T>& msg)
+    {
+        federation_item item;
+        item.nOrigin = m_options.nServerId;
+        item.type = type;
+        item.topic = topic;
+        item.nIncarnation = m_nIncarnation;
+        item.nSeq = ++m_nNextSeq;
+
+        message_header<T> header = msg.header;
+        header.flags = 0;
+        header.size = msg.body.size();
+
+        std::scoped_lock lock(m_muxLinks);
+        Append(item, header, msg.body.data(), 0);
+        m_counters.nItemsForwarded.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Handle a frame of a link. deliver(type, topic, message) sends a new item to the local clients. Update thread.
+    template <typename Deliver>
+    void Receive(const std::shared_ptr<connection<T>>& pLink, const message<T>& frame, Deliver&& deliver)
+    {
+        const auto& body = frame.body;
+        federation_frame header;
+        if (!(frame.header.flags & frame_flags::federation) || body.size() < sizeof(header))
+        {
+            CloseLink(pLink, "not a federation frame");
+            return;
+        }
+        std::memcpy(&header, body.data(), sizeof(header));
+        size_t nOffset = sizeof(header);
+
+        if (header.type == federation_frame::hello)
+        {
+            ReceiveHello(pLink, body, nOffset);
+            return;
+        }
+
+        uint32_t nFromPeer = PeerOf(pLink);
+        if (header.type != federation_frame::items || nFromPeer == 0)
+        {
+            CloseLink(pLink, "items before the hello");
+            return;
+        }
+
+        for (uint32_t i = 0; i < header.nCount; ++i)
+        {
+            federation_item item;
+            message<T> msg;
+            if (body.size() - nOffset < sizeof(item) + sizeof(msg.header))
+                break;
+            std::memcpy(&item, body.data() + nOffset, sizeof(item));
+            nOffset += sizeof(item);
+            std::memcpy(&msg.header, body.data() + nOffset, sizeof(msg.header));
+            nOffset += sizeof(msg.header);
+            if (msg.header.size > body.size() - nOffset)
+                break;
+
+            const uint8_t* pBody = body.data() + nOffset;
+            nOffset += msg.header.size;
+
+            // Our own items come back through relays and duplicate links.
+            if (item.nOrigin == m_options.nServerId || !m_mapSeen[item.nOrigin].Insert(item.nIncarnation, item.nSeq))
+            {
+                m_counters.nDuplicates.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            if (item.nHops + 1 < m_options.nMaxHops)
+            {
+                federation_item relayed = item;
+                relayed.nHops++;
+                std::scoped_lock lock(m_muxLinks);
+                Append(relayed, msg.header, pBody, nFromPeer);
+            }
+
+            msg.body.assign(pBody, pBody + msg.header.size);
+            m_counters.nItemsReceived.fetch_add(1, std::memory_order_relaxed);
+            deliver(item.type, item.topic, msg);
+        }
+
+        if (nOffset != body.size())
+            CloseLink(pLink, "malformed items frame");
+    }
+
+    // Ids of the linked servers, one per link that has completed its hello.
+    std::vector<uint32_t> Peers()
+    {
+        std::scoped_lock lock(m_muxLinks);
+        std::vector<uint32_t> vecPeers;
+        for (const auto& link : m_vecLinks)
+        {
+            if (link.nPeerId != 0 && link.pConnection->IsConnected())
+                vecPeers.push_back(link.nPeerId);
+        }
+        return vecPeers;
+    }
+
+    const federation_counters& Counters() const { return m_counters; }
+private:
+    struct link
+    {
+        std::shared_ptr<connection<T>> pConnection;
+        // Id from the hello of the peer, 0 until it arrives.
+        uint32_t nPeerId = 0;
+        // Index in federation_options::peers of a dialed link, -1 for an accepted one.
+        size_t nDialIndex = size_t(-1);
+        // federation_frame and the items waiting for the next flush.
+        std::vector<uint8_t> batch;
+        uint32_t nBatchItems = 0;
+    };
+
+    // Add the item to the batch of every link, except the peer it came from. One copy per peer: a second link
+    // to the same peer is skipped. m_muxLinks must be held.
+    void Append(const federation_item& item, const message_header<T>& header, const uint8_t* pBody, uint32_t nFromPeer)
+    {
+        m_vecSentTo.clear();
+        for (auto& link : m_vecLinks)
+        {
+            if (!link.pConnection->IsConnected())
+                continue;
+            if (link.nPeerId != 0)
+            {
+                if (link.nPeerId == nFromPeer || link.nPeerId == item.nOrigin ||
+                    std::find(m_vecSentTo.begin(), m_vecSentTo.end(), link.nPeerId) != m_vecSentTo.end())
+                    continue;
+                m_vecSentTo.push_back(link.nPeerId);
+            }
+
+            if (link.batch.empty())
+                link.batch.resize(sizeof(federation_frame));
+
+            size_t nOffset = link.batch.size();
+            link.batch.resize(nOffset + sizeof(item) + sizeof(header) + header.size);
+            std::memcpy(link.batch.data() + nOffset, &item, sizeof(item));
+            nOffset += sizeof(item);
+            std::memcpy(link.batch.data() + nOffset, &header, sizeof(header));
+            nOffset += sizeof(header);
+            std::memcpy(link.batch.data() + nOffset, pBody, header.size);
+            link.nBatchItems++;
+
+            if (link.batch.size() >= m_options.nMaxBatchBytes)
+                FlushLink(link);
+            else
+                ScheduleFlush();
+        }
+    }
+
+    // m_muxLinks must be held.
+    void FlushLink(link& link)
+    {
+        if (link.nBatchItems == 0)
+            return;
+
+        federation_frame header{federation_frame::items, link.nBatchItems};
+        std::memcpy(link.batch.data(), &header, sizeof(header));
+
+        auto pFrame = std::make_shared<message<T>>();
+        pFrame->header.flags = frame_flags::federation;
+        pFrame->body = std::move(link.batch);
+        pFrame->header.size = pFrame->body.size();
+        link.batch = {};
+        link.nBatchItems = 0;
+
+        link.pConnection->Send(std::move(pFrame));
+        m_counters.nFramesSent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // m_muxLinks must be held.
+    void ScheduleFlush()
+    {
+        if (m_bFlushScheduled)
+            return;
+        m_bFlushScheduled = true;
+
+        asio::post(
+            m_context,
+            [this]()
+            {
+                m_flushTimer.expires_after(m_options.batchInterval);
+                m_flushTimer.async_wait(
+                    [this](std::error_code ec)
+                    {
+                        if (ec)
+                            return;
+                        std::scoped_lock lock(m_muxLinks);
+                        m_bFlushScheduled = false;
+                        for (auto& link : m_vecLinks)
+                            FlushLink(link);
+                    });
+            });
+    }
+
+    void ReceiveHello(const std::shared_ptr<connection<T>>& pLink, const std::vector<uint8_t>& body, size_t nOffset)
+    {
+        federation_hello hello;
+        if (body.size() - nOffset < sizeof(hello))
+        {
+            CloseLink(pLink, "malformed hello");
+            return;
+        }
+        std::memcpy(&hello, body.data() + nOffset, sizeof(hello));
+        nOffset += sizeof(hello);
+
+        std::string secret(body.begin() + nOffset, body.end());
+        if (m_options.secret.empty() || hello.nSecretSize != secret.size() || secret != m_options.secret)
+        {
+            CloseLink(pLink, "wrong secret");
+            return;
+        }
+        if (hello.nServerId == 0 || hello.nServerId == m_options.nServerId)
+        {
+            CloseLink(pLink, "peer has the same server id");
+            return;
+        }
+
+        {
+            std::scoped_lock lock(m_muxLinks);
+            for (auto& link : m_vecLinks)
+            {
+                if (link.pConnection == pLink)
+                    link.nPeerId = hello.nServerId;
+            }
+        }
+        MY_LOG(info, "[federation] Linked with server {} ({})", hello.nServerId, pLink->GetID());
+    }
+
+    uint32_t PeerOf(const std::shared_ptr<connection<T>>& pLink)
+    {
+        std::scoped_lock lock(m_muxLinks);
+        for (const auto& link : m_vecLinks)
+        {
+            if (link.pConnection == pLink)
+                return link.nPeerId;
+        }
+        return 0;
+    }
+
+    void CloseLink(const std::shared_ptr<connection<T>>& pLink, const char* reason)
+    {
+        MY_LOG(error, "[federation] Link {} is closed: {}", pLink->GetID(), reason);
+        pLink->Disconnect();
+    }
+
+    // Asio thread from here on.
+
+    void Accept()
+    {
+        m_acceptor->async_accept(
+            [this](std::error_code ec, asio::ip::tcp::socket socket)
+            {
+                if (ec)
+                {
+                    MY_LOG(error, "[federation] Accept HAS FAILED: {}", ec.message());
+                }
+                else
+                {
+                    auto pConnection = std::make_shared<connection<T>>(
+                        connection<T>::owner::server, m_context, std::make_unique<tcp_transport>(std::move(socket)),
+                        m_qIn, m_linkOptions);
+                    AddLink(pConnection, size_t(-1));
+                    pConnection->ConnectToClient(nullptr, m_nNextLinkId++);
+                }
+                Accept();
+            });
+    }
+
+    void Dial(size_t nPeer)
+    {
+        const auto& peer = m_options.peers[nPeer];
+        m_vecDialing[nPeer] = true;
+        m_resolver.async_resolve(
+            peer.host, std::to_string(peer.nPort),
+            [this, nPeer](std::error_code ec, asio::ip::tcp::resolver::results_type results)
+            {
+                if (ec)
+                {
+                    MY_LOG(
+                        warn, "[federation] Resolve of {} HAS FAILED: {}", m_options.peers[nPeer].host,
+                        ec.message());
+                    m_vecDialing[nPeer] = false;
+                    return;
+                }
+
+                std::vector<asio::ip::tcp::endpoint> endpoints(results.begin(), results.end());
+                auto pConnection = std::make_shared<connection<T>>(
+                    connection<T>::owner::client, m_context,
+                    std::make_unique<tcp_transport>(asio::ip::tcp::socket(m_context), std::move(endpoints)), m_qIn,
+                    m_linkOptions);
+                AddLink(pConnection, nPeer);
+                pConnection->ConnectToServer();
+            });
+    }
+
+    // The hello is queued first, the connection writes it right after its handshake.
+    void AddLink(const std::shared_ptr<connection<T>>& pConnection, size_t nDialIndex)
+    {
+        auto pHello = std::make_shared<message<T>>();
+        pHello->header.flags = frame_flags::federation;
+        pHello->body.resize(sizeof(federation_frame) + sizeof(federation_hello) + m_options.secret.size());
+        federation_frame frame{federation_frame::hello, 0};
+        federation_hello hello{m_options.nServerId, static_cast<uint32_t>(m_options.secret.size())};
+        std::memcpy(pHello->body.data(), &frame, sizeof(frame));
+        std::memcpy(pHello->body.data() + sizeof(frame), &hello, sizeof(hello));
+        std::memcpy(
+            pHello->body.data() + sizeof(frame) + sizeof(hello), m_options.secret.data(), m_options.secret.size());
+        pHello->header.size = pHello->body.size();
+        pConnection->Send(std::move(pHello));
+
+        std::scoped_lock lock(m_muxLinks);
+        link newLink;
+        newLink.pConnection = pConnection;
+        newLink.nDialIndex = nDialIndex;
+        m_vecLinks.push_back(std::move(newLink));
+    }
+
+    // Forget the closed links and dial the configured peers that have none.
+    void CheckLinks()
+    {
+        {
+            std::scoped_lock lock(m_muxLinks);
+            std::erase_if(
+                m_vecLinks,
+                [this](const link& link)
+                {
+                    if (link.pConnection->IsConnected())
+                        return false;
+                    if (link.nPeerId != 0)
+                        MY_LOG(warn, "[federation] Link to server {} is lost", link.nPeerId);
+                    if (link.nDialIndex != size_t(-1))
+                        m_vecDialing[link.nDialIndex] = false;
+                    return true;
+                });
+        }
+
+        for (size_t i = 0; i < m_options.peers.size(); ++i)
+        {
+            if (!m_vecDialing[i])
+                Dial(i);
+        }
+
+        m_checkTimer.expires_after(m_options.reconnectInterval);
+        m_checkTimer.async_wait(
+            [this](std::error_code ec)
+            {
+                if (!ec)
+                    CheckLinks();
+            });
+    }
+
+    asio::io_context& m_context;
+    thread_safe_queue<owned_message<T>>& m_qIn;
+    federation_options m_options;
+    connection_options<T> m_linkOptions;
+
+    std::optional<asio::ip::tcp::acceptor> m_acceptor;
+    asio::ip::tcp::resolver m_resolver;
+    asio::steady_timer m_flushTimer;
+    asio::steady_timer m_checkTimer;
+    // Asio thread: a configured peer has a link or a dial in progress.
+    std::vector<bool> m_vecDialing;
+    uint32_t m_nNextLinkId = 1;
+
+    std::mutex m_muxLinks;
+    std::vector<link> m_vecLinks;
+    bool m_bFlushScheduled = false;
+    // Scratch list of Append.
+    std::vector<uint32_t> m_vecSentTo;
+
+    // Update thread.
+    uint32_t m_nIncarnation = 0;
+    uint64_t m_nNextSeq = 0;
+    std::unordered_map<uint32_t, seen_window> m_mapSeen;
+
+    federation_counters m_counters;
+};
+
+} // namespace net
@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <my_cpp_utils/logger.h>
+#include <string>
+
+#if defined(__linux__)
+#define NET_HAS_FILE_SEND 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace net
+{
+
+#if defined(NET_HAS_FILE_SEND)
+
+// Read-only shared mapping of a file, for connection::SendMapped. The pages belong to the page cache, so one
+// asset sent to any number of connections is in memory once and is never copied into a message body.
+// Share it with std::shared_ptr: connections keep it alive until their frames are written.
+class mapped_region
+{
+public:
+    mapped_region() = default;
+    mapped_region(const mapped_region&) = delete;
+    mapped_region& operator=(const mapped_region&) = delete;
+    ~mapped_region() { Close(); }
+
+    // Map nLength bytes of the file from nOffset, 0 - to the end of the file.
+    bool Open(const std::string& path, uint64_t nOffset = 0, size_t nLength = 0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            MY_LOG(error, "[mapped_region] Cannot open {}: {}", path, std::strerror(errno));
+            return false;
+        }
+
+        bool bOpened = Open(fd, nOffset, nLength);
+        ::close(fd);
+        return bOpened;
+    }
+
+    // Same for a file that is open already. The descriptor may be closed afterwards, the mapping stays.
+    bool Open(int nFile, uint64_t nOffset = 0, size_t nLength = 0)
+    {
+        Close();
+
+        struct stat st{};
+        if (::fstat(nFile, &st) != 0 || nOffset > static_cast<uint64_t>(st.st_size) ||
+            nLength > static_cast<uint64_t>(st.st_size) - nOffset)
+        {
+            MY_LOG(error, "[mapped_region] File {} has no {} bytes at {}", nFile, nLength, nOffset);
+            return false;
+        }
+        if (nLength == 0)
+            nLength = static_cast<size_t>(st.st_size - nOffset);
+
+        // mmap wants a page aligned offset: map from the page start and skip the head.
+        const uint64_t nPage = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        const uint64_t nHead = nOffset % nPage;
+        if (nLength > 0)
+        {
+            void* p =
+                ::mmap(nullptr, nHead + nLength, PROT_READ, MAP_SHARED, nFile, static_cast<off_t>(nOffset - nHead));
+            if (p == MAP_FAILED)
+            {
+                MY_LOG(error, "[mapped_region] Cannot map file {}: {}", nFile, std::strerror(errno));
+                return false;
+            }
+            m_pMapping = p;
+            m_nMappedSize = nHead + nLength;
+            m_pData = static_cast<const uint8_t*>(p) + nHead;
+        }
+
+        m_nSize = nLength;
+        return true;
+    }
+
+    void Close()
+    {
+        if (m_pMapping)
+            ::munmap(m_pMapping, m_nMappedSize);
+        m_pMapping = nullptr;
+        m_nMappedSize = 0;
+        m_pData = nullptr;
+        m_nSize = 0;
+    }
+
+    const uint8_t* Data() const { return m_pData; }
+    size_t Size() const { return m_nSize; }
+private:
+    void* m_pMapping = nullptr;
+    size_t m_nMappedSize = 0;
+    const uint8_t* m_pData = nullptr;
+    size_t m_nSize = 0;
+};
+
+#endif
+
+} // namespace net
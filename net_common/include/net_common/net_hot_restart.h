@@ -0,0 +1,142 @@
+#pragma once
+#include <asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS) && !defined(_WIN32)
+#define NET_HAS_HOT_RESTART 1
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace net
+{
+
+// Hot restart: a new server process takes the listening socket over from the running one, so no connection
+// is refused and no client is dropped by a deploy.
+//
+// 1. The running process serves a Unix socket (server_interface::EnableHotRestart).
+// 2. The new process connects to it (server_interface constructor with takeOverPath) and receives the
+//    listening socket as SCM_RIGHTS ancillary data. Both processes now share one kernel accept queue.
+// 3. The old process closes its copy and stops accepting. Its clients stay until they leave or drainTimeout
+//    passes, then their outgoing queues are written and they are disconnected (server_interface::HotRestartDone).
+struct hot_restart_options
+{
+    // Unix socket of the handoff. The new process binds it again for the next restart.
+    std::string path;
+    // How long the old process keeps serving its clients after the handoff.
+    std::chrono::milliseconds drainTimeout{30000};
+    // After drainTimeout: how long the outgoing queues of the remaining clients may take to be written.
+    std::chrono::milliseconds flushTimeout{2000};
+};
+
+#if defined(NET_HAS_HOT_RESTART)
+// Send a file descriptor over a connected Unix socket, with one byte of data as SCM_RIGHTS needs some.
+// Blocking. Returns false on failure, errno tells why.
+inline bool SendDescriptor(int nSocket, int nDescriptor)
+{
+    char cData = 'L';
+    iovec vec{&cData, 1};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* pHeader = CMSG_FIRSTHDR(&msg);
+    pHeader->cmsg_level = SOL_SOCKET;
+    pHeader->cmsg_type = SCM_RIGHTS;
+    pHeader->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(pHeader), &nDescriptor, sizeof(int));
+
+    ssize_t nSent;
+    do
+        nSent = sendmsg(nSocket, &msg, MSG_NOSIGNAL);
+    while (nSent < 0 && errno == EINTR);
+    return nSent == 1;
+}
+
+// Receive a file descriptor sent by SendDescriptor. Blocks for the timeout at most. Returns -1 on failure,
+// errno tells why: EPROTO if the message is not one descriptor. Descriptors of a rejected message are closed.
+inline int ReceiveDescriptor(int nSocket, std::chrono::milliseconds timeout)
+{
+    timeval tv{};
+    tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+    tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+    setsockopt(nSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char cData = 0;
+    iovec vec{&cData, 1};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t nReceived;
+    do
+        nReceived = recvmsg(nSocket, &msg, MSG_CMSG_CLOEXEC);
+    while (nReceived < 0 && errno == EINTR);
+    if (nReceived < 0)
+        return -1;
+
+    cmsghdr* pHeader = CMSG_FIRSTHDR(&msg);
+    if (nReceived != 1 || (msg.msg_flags & MSG_CTRUNC) || !pHeader || pHeader->cmsg_level != SOL_SOCKET ||
+        pHeader->cmsg_type != SCM_RIGHTS || pHeader->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        // Whatever did arrive must not leak.
+        for (; pHeader; pHeader = CMSG_NXTHDR(&msg, pHeader))
+        {
+            if (pHeader->cmsg_level != SOL_SOCKET || pHeader->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t nCount = (pHeader->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < nCount; ++i)
+            {
+                int nReceivedDescriptor = -1;
+                std::memcpy(&nReceivedDescriptor, CMSG_DATA(pHeader) + i * sizeof(int), sizeof(int));
+                ::close(nReceivedDescriptor);
+            }
+        }
+        errno = nReceived == 0 ? ECONNRESET : EPROTO;
+        return -1;
+    }
+
+    int nDescriptor = -1;
+    std::memcpy(&nDescriptor, CMSG_DATA(pHeader), sizeof(int));
+    return nDescriptor;
+}
+
+// The descriptor is a TCP socket in the listening state. Sets errno to ENOTSOCK or EINVAL if it is not.
+inline bool IsListeningTcpSocket(int nDescriptor)
+{
+    int nType = 0, nAccepting = 0;
+    socklen_t nSize = sizeof(int);
+    if (getsockopt(nDescriptor, SOL_SOCKET, SO_TYPE, &nType, &nSize) != 0)
+        return false;
+
+    sockaddr_storage address{};
+    socklen_t nLength = sizeof(address);
+    nSize = sizeof(int);
+    if (getsockname(nDescriptor, reinterpret_cast<sockaddr*>(&address), &nLength) != 0 ||
+        getsockopt(nDescriptor, SOL_SOCKET, SO_ACCEPTCONN, &nAccepting, &nSize) != 0)
+        return false;
+
+    if (nType != SOCK_STREAM || (address.ss_family != AF_INET && address.ss_family != AF_INET6) || !nAccepting)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+#endif
+
+} // namespace net
@@ -0,0 +1,245 @@
+#pragma once
+#include <asio.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <my_cpp_utils/logger.h>
+#include <string>
+
+namespace net
+{
+
+// Minimal HTTP/1.1 listener for introspection endpoints (see server_interface::StartMetrics).
+// Everything runs as asio handlers on the given context, nothing blocks and nothing takes a lock. GET only,
+// no request bodies. Keep-alive connections are served until the client closes or goes idle.
+
+struct http_response
+{
+    int nStatus = 200;
+    std::string contentType = "text/plain; charset=utf-8";
+    std::string body;
+};
+
+// Called on the asio thread with the path of a GET request (query string included).
+using http_handler = std::function<http_response(const std::string& path)>;
+
+class http_listener
+{
+public:
+    // There is no authentication, so the default address lets only the local host in. Listen on another one
+    // (e.g. "0.0.0.0") only where a firewall or a proxy decides who may scrape. Throws on a bad address or port.
+    http_listener(
+        asio::io_context& context, uint16_t port, http_handler handler, const std::string& address = "127.0.0.1")
+      : m_acceptor(context, asio::ip::tcp::endpoint(asio::ip::make_address(address), port)), m_retryTimer(context),
+        m_pHandler(std::make_shared<const http_handler>(std::move(handler)))
+    {}
+
+    // Start accepting. Call it before the context runs or from its thread.
+    void Start() { Accept(); }
+
+    // Stop accepting. Open sessions end with their next request. Call it from the asio thread or after
+    // the context has stopped.
+    void Stop()
+    {
+        asio::error_code ec;
+        m_acceptor.close(ec);
+        m_retryTimer.cancel();
+    }
+
+    uint16_t Port() const { return m_acceptor.local_endpoint().port(); }
+private:
+    class session : public std::enable_shared_from_this<session>
+    {
+    public:
+        session(asio::ip::tcp::socket socket, std::shared_ptr<const http_handler> pHandler)
+          : m_socket(std::move(socket)), m_timer(m_socket.get_executor()), m_request(c_nMaxRequestSize),
+            m_pHandler(std::move(pHandler))
+        {}
+
+        void ReadRequest()
+        {
+            // A client that sends nothing for a while gives its socket back.
+            m_timer.expires_after(c_idleTimeout);
+            m_timer.async_wait(
+                [self = this->shared_from_this()](std::error_code ec)
+                {
+                    if (!ec)
+                        self->Close();
+                });
+
+            asio::async_read_until(
+                m_socket, m_request, "\r\n\r\n",
+                [self = this->shared_from_this()](std::error_code ec, std::size_t nLength)
+                {
+                    self->m_timer.cancel();
+                    if (ec == asio::error::not_found)
+                    {
+                        // Over c_nMaxRequestSize.
+                        self->WriteResponse({431, "text/plain; charset=utf-8", "Request too large\n"}, false);
+                        return;
+                    }
+                    if (ec)
+                    {
+                        self->Close();
+                        return;
+                    }
+                    self->HandleRequest(nLength);
+                });
+        }
+    private:
+        void HandleRequest(size_t nLength)
+        {
+            std::string head(asio::buffers_begin(m_request.data()), asio::buffers_begin(m_request.data()) + nLength);
+            m_request.consume(nLength);
+
+            // Request line: METHOD SP PATH SP VERSION.
+            size_t nLineEnd = head.find("\r\n");
+            std::string line = head.substr(0, nLineEnd);
+            size_t nMethodEnd = line.find(' ');
+            size_t nPathEnd = line.find(' ', nMethodEnd + 1);
+            if (nMethodEnd == std::string::npos || nPathEnd == std::string::npos)
+            {
+                WriteResponse({400, "text/plain; charset=utf-8", "Bad request\n"}, false);
+                return;
+            }
+
+            std::string method = line.substr(0, nMethodEnd);
+            std::string path = line.substr(nMethodEnd + 1, nPathEnd - nMethodEnd - 1);
+            std::string version = line.substr(nPathEnd + 1);
+
+            // HTTP/1.1 keeps the connection by default, HTTP/1.0 closes it.
+            bool bKeepAlive = version == "HTTP/1.1";
+            if (HasHeaderValue(head, "connection", "close"))
+                bKeepAlive = false;
+            else if (HasHeaderValue(head, "connection", "keep-alive"))
+                bKeepAlive = true;
+
+            if (method != "GET")
+            {
+                WriteResponse({405, "text/plain; charset=utf-8", "Only GET is supported\n"}, false);
+                return;
+            }
+
+            WriteResponse((*m_pHandler)(path), bKeepAlive);
+        }
+
+        // Case insensitive check of a header line "name: value". Good enough for the Connection header.
+        static bool HasHeaderValue(const std::string& head, const std::string& name, const std::string& value)
+        {
+            auto lower = [](std::string text)
+            {
+                for (auto& c : text)
+                    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                return text;
+            };
+            return lower(head).find("\r\n" + name + ": " + value) != std::string::npos;
+        }
+
+        void WriteResponse(http_response response, bool bKeepAlive)
+        {
+            m_response = "HTTP/1.1 " + std::to_string(response.nStatus) + " " + StatusText(response.nStatus) +
+                         "\r\nContent-Type: " + response.contentType +
+                         "\r\nContent-Length: " + std::to_string(response.body.size()) +
+                         (bKeepAlive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+            m_response += response.body;
+
+            asio::async_write(
+                m_socket, asio::buffer(m_response),
+                [self = this->shared_from_this(), bKeepAlive](std::error_code ec, std::size_t)
+                {
+                    if (!ec && bKeepAlive)
+                        self->ReadRequest();
+                    else
+                        self->Close();
+                });
+        }
+
+        void Close()
+        {
+            asio::error_code ec;
+            m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+            m_socket.close(ec);
+        }
+
+        static const char* StatusText(int nStatus)
+        {
+            switch (nStatus)
+            {
+            case 200:
+                return "OK";
+            case 400:
+                return "Bad Request";
+            case 404:
+                return "Not Found";
+            case 405:
+                return "Method Not Allowed";
+            case 431:
+                return "Request Header Fields Too Large";
+            default:
+                return "Unknown";
+            }
+        }
+
+        static constexpr size_t c_nMaxRequestSize = 8 * 1024;
+        static constexpr std::chrono::seconds c_idleTimeout{30};
+
+        asio::ip::tcp::socket m_socket;
+        asio::steady_timer m_timer;
+        asio::streambuf m_request;
+        std::string m_response;
+        // Shared, so a session still waiting in the context never outlives it.
+        std::shared_ptr<const http_handler> m_pHandler;
+    };
+
+    void Accept()
+    {
+        m_acceptor.async_accept(
+            [this](std::error_code ec, asio::ip::tcp::socket socket)
+            {
+                if (ec)
+                {
+                    // The acceptor is closed by Stop.
+                    if (ec == asio::error::operation_aborted || !m_acceptor.is_open())
+                        return;
+
+                    MY_LOG(error, "[http_listener] Accept HAS FAILED: {}", ec.message());
+                    // Out of descriptors or memory: the next accept would fail right away, give the sessions
+                    // some time to end first.
+                    if (IsResourceError(ec))
+                    {
+                        m_retryTimer.expires_after(c_retryDelay);
+                        m_retryTimer.async_wait(
+                            [this](std::error_code ec)
+                            {
+                                if (!ec)
+                                    Accept();
+                            });
+                        return;
+                    }
+                    Accept();
+                    return;
+                }
+
+                std::make_shared<session>(std::move(socket), m_pHandler)->ReadRequest();
+                Accept();
+            });
+    }
+
+    static bool IsResourceError(std::error_code ec)
+    {
+        return ec == std::errc::too_many_files_open || ec == std::errc::too_many_files_open_in_system ||
+               ec == std::errc::no_buffer_space || ec == std::errc::not_enough_memory;
+    }
+
+    static constexpr std::chrono::milliseconds c_retryDelay{100};
+
+    asio::ip::tcp::acceptor m_acceptor;
+    asio::steady_timer m_retryTimer;
+    std::shared_ptr<const http_handler> m_pHandler;
+};
+
+} // namespace net
@@ -0,0 +1,1098 @@
+#pragma once
+#include "net_memory.h"
+#include <algorithm>
+#include <asio.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <my_cpp_utils/logger.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+
+// Async HTTP/1.1 client for the internal services the game server calls (see http_client).
+// Connections to a host are kept alive and shared by the requests, idempotent requests are pipelined on them,
+// and responses are parsed as the bytes arrive, with Content-Length, chunked or read-until-close bodies.
+
+struct http_request
+{
+    std::string method = "GET";
+    std::string host;
+    uint16_t nPort = 80;
+    // Path and query, e.g. "/users?id=10".
+    std::string target = "/";
+    // Host and Content-Length are added by the client.
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    // Safe to send again after the connection broke, and to pipeline behind other requests.
+    bool IsIdempotent() const
+    {
+        return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+    }
+};
+
+struct http_client_response
+{
+    int nStatus = 0;
+    // Names in lower case, in the order received.
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    // Value of the first header with the name (lower case), nullptr if there is none.
+    const std::string* Header(std::string_view name) const
+    {
+        for (const auto& [key, value] : headers)
+        {
+            if (key == name)
+                return &value;
+        }
+        return nullptr;
+    }
+};
+
+// Called on the strand of the client. ec is set if no complete response was received: asio::error::timed_out,
+// asio::error::operation_aborted after Close, std::errc::bad_message, std::errc::message_size or a socket error.
+using http_callback = std::function<void(std::error_code ec, http_client_response response)>;
+
+struct http_client_options
+{
+    // Connections kept per host:port.
+    size_t nMaxConnectionsPerHost = 4;
+    // Requests written to a connection before the responses to the previous ones arrive. 1 - no pipelining.
+    size_t nMaxPipelineDepth = 8;
+    std::chrono::milliseconds connectTimeout{2000};
+    // From Request to the complete response, retries included.
+    std::chrono::milliseconds requestTimeout{5000};
+    // An unused connection is closed after that. Keep it below the keep-alive timeout of the services.
+    std::chrono::milliseconds idleTimeout{30000};
+    // Larger responses fail with std::errc::message_size.
+    size_t nMaxHeaderSize = 64 * 1024;
+    size_t nMaxBodySize = 16 * 1024 * 1024;
+    // Receive buffers, held only by the connections waiting for a response. Created if not set.
+    std::shared_ptr<buffer_pool> pReadBuffers;
+};
+
+// Incremental HTTP/1.1 response parser. Takes the bytes in whatever pieces they arrive and copies what belongs to
+// the response out of them, so the receive buffer can be reused right away.
+class http_response_parser
+{
+public:
+    enum class result
+    {
+        need_more,
+        done,
+        error
+    };
+
+    http_response_parser(size_t nMaxHeaderSize, size_t nMaxBodySize)
+      : m_nMaxHeaderSize(nMaxHeaderSize), m_nMaxBodySize(nMaxBodySize)
+    {}
+
+    // Start the next response. body is a recycled string, only its capacity is used.
+    void Reset(bool bHeadRequest, std::string body = {})
+    {
+        m_response = {};
+        m_response.body = std::move(body);
+        m_response.body.clear();
+        m_line.clear();
+        m_state = state::status_line;
+        m_nHeaderSize = 0;
+        m_nRemaining = 0;
+        m_bHeadRequest = bHeadRequest;
+        m_bKeepAlive = true;
+        m_bStarted = false;
+        m_error = {};
+    }
+
+    // Parse the next bytes. Stops as soon as the response is complete: the bytes after nConsumed belong to the
+    // next response.
+    result Parse(const char* pData, size_t nSize, size_t& nConsumed)
+    {
+        nConsumed = 0;
+        m_bStarted = m_bStarted || nSize > 0;
+        while (m_state != state::done)
+        {
+            if (m_state == state::failed)
+                return result::error;
+
+            if (m_state == state::body || m_state == state::chunk_data || m_state == state::until_close)
+            {
+                size_t nAvailable = nSize - nConsumed;
+                if (nAvailable == 0)
+                    return result::need_more;
+
+                size_t nTake = m_state == state::until_close ? nAvailable : std::min(nAvailable, m_nRemaining);
+                if (m_response.body.size() + nTake > m_nMaxBodySize)
+                    return Fail(std::errc::message_size);
+
+                m_response.body.append(pData + nConsumed, nTake);
+                nConsumed += nTake;
+                if (m_state != state::until_close)
+                {
+                    m_nRemaining -= nTake;
+                    if (m_nRemaining == 0)
+                        m_state = m_state == state::body ? state::done : state::chunk_end;
+                }
+                continue;
+            }
+
+            // Everything else is line based.
+            std::string_view line;
+            if (!NextLine(pData, nSize, nConsumed, line))
+                return m_state == state::failed ? result::error : result::need_more;
+            HandleLine(line);
+            m_line.clear();
+        }
+        return result::done;
+    }
+
+    // The connection was closed by the server. Completes a body that is read until close.
+    bool Finish()
+    {
+        if (m_state != state::until_close)
+            return false;
+        m_state = state::done;
+        return true;
+    }
+
+    // Some bytes of the response arrived already.
+    bool Started() const { return m_bStarted; }
+    // The server keeps the connection after this response.
+    bool KeepAlive() const { return m_bKeepAlive; }
+    std::error_code Error() const { return m_error; }
+    http_client_response TakeResponse() { return std::move(m_response); }
+private:
+    enum class state
+    {
+        status_line,
+        header,
+        body,
+        chunk_size,
+        chunk_data,
+        chunk_end,
+        trailer,
+        until_close,
+        done,
+        failed
+    };
+
+    result Fail(std::errc error)
+    {
+        m_state = state::failed;
+        m_error = std::make_error_code(error);
+        return result::error;
+    }
+
+    // A line without its CRLF. Pieces of a line split between reads wait in m_line.
+    bool NextLine(const char* pData, size_t nSize, size_t& nConsumed, std::string_view& line)
+    {
+        const char* pBegin = pData + nConsumed;
+        const char* pEnd = static_cast<const char*>(std::memchr(pBegin, '\n', nSize - nConsumed));
+        size_t nLength = pEnd ? static_cast<size_t>(pEnd - pBegin) : nSize - nConsumed;
+
+        if (m_line.size() + nLength > m_nMaxHeaderSize)
+        {
+            Fail(std::errc::message_size);
+            return false;
+        }
+
+        if (!pEnd)
+        {
+            m_line.append(pBegin, nLength);
+            nConsumed = nSize;
+            return false;
+        }
+
+        nConsumed += nLength + 1;
+        if (m_line.empty())
+        {
+            line = std::string_view(pBegin, nLength);
+        }
+        else
+        {
+            m_line.append(pBegin, nLength);
+            line = m_line;
+        }
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        return true;
+    }
+
+    void HandleLine(std::string_view line)
+    {
+        if (m_state == state::status_line || m_state == state::header || m_state == state::trailer)
+        {
+            m_nHeaderSize += line.size() + 2;
+            if (m_nHeaderSize > m_nMaxHeaderSize)
+            {
+                Fail(std::errc::message_size);
+                return;
+            }
+        }
+
+        switch (m_state)
+        {
+        case state::status_line:
+            // HTTP/1.x SP 3DIGIT SP reason. Empty lines before it are tolerated.
+            if (line.empty())
+                return;
+            if (line.size() < 12 || line.substr(0, 7) != "HTTP/1." || line[8] != ' ' ||
+                !ParseNumber(line.substr(9, 3), 10, m_response.nStatus))
+            {
+                Fail(std::errc::bad_message);
+                return;
+            }
+            // HTTP/1.0 closes the connection unless it says otherwise.
+            m_bKeepAlive = line[7] != '0';
+            m_state = state::header;
+            return;
+        case state::header:
+        {
+            if (line.empty())
+            {
+                EndOfHeaders();
+                return;
+            }
+            size_t nColon = line.find(':');
+            if (nColon == std::string_view::npos || nColon == 0)
+            {
+                Fail(std::errc::bad_message);
+                return;
+            }
+            m_response.headers.emplace_back(Lower(line.substr(0, nColon)), std::string(Trim(line.substr(nColon + 1))));
+            return;
+        }
+        case state::chunk_size:
+        {
+            // Chunk extensions after ';' are ignored.
+            std::string_view size = Trim(line.substr(0, line.find(';')));
+            size_t nChunkSize = 0;
+            if (size.empty() || !ParseNumber(size, 16, nChunkSize))
+            {
+                Fail(std::errc::bad_message);
+                return;
+            }
+            m_nRemaining = nChunkSize;
+            m_state = nChunkSize == 0 ? state::trailer : state::chunk_data;
+            return;
+        }
+        case state::chunk_end:
+            if (!line.empty())
+            {
+                Fail(std::errc::bad_message);
+                return;
+            }
+            m_state = state::chunk_size;
+            return;
+        case state::trailer:
+            // Trailer fields are dropped.
+            if (line.empty())
+                m_state = state::done;
+            return;
+        default:
+            return;
+        }
+    }
+
+    void EndOfHeaders()
+    {
+        int nStatus = m_response.nStatus;
+        if (nStatus >= 100 && nStatus < 200 && nStatus != 101)
+        {
+            // Interim response (100 Continue), the real one follows.
+            m_response.headers.clear();
+            m_state = state::status_line;
+            return;
+        }
+
+        if (const auto* pConnection = m_response.Header("connection"))
+        {
+            std::string connection = Lower(*pConnection);
+            if (connection.find("close") != std::string::npos)
+                m_bKeepAlive = false;
+            else if (connection.find("keep-alive") != std::string::npos)
+                m_bKeepAlive = true;
+        }
+
+        if (m_bHeadRequest || nStatus == 101 || nStatus == 204 || nStatus == 304)
+        {
+            m_state = state::done;
+            return;
+        }
+
+        const auto* pTransferEncoding = m_response.Header("transfer-encoding");
+        if (pTransferEncoding && Lower(*pTransferEncoding).find("chunked") != std::string::npos)
+        {
+            m_state = state::chunk_size;
+            return;
+        }
+
+        if (const auto* pContentLength = m_response.Header("content-length"))
+        {
+            size_t nLength = 0;
+            if (!ParseNumber(*pContentLength, 10, nLength))
+            {
+                Fail(std::errc::bad_message);
+                return;
+            }
+            if (nLength > m_nMaxBodySize)
+            {
+                Fail(std::errc::message_size);
+                return;
+            }
+            m_response.body.reserve(nLength);
+            m_nRemaining = nLength;
+            m_state = nLength == 0 ? state::done : state::body;
+            return;
+        }
+
+        // Neither length nor chunks: the body ends with the connection.
+        m_bKeepAlive = false;
+        m_state = state::until_close;
+    }
+
+    template <typename Number>
+    static bool ParseNumber(std::string_view text, int nBase, Number& value)
+    {
+        auto [pEnd, ec] = std::from_chars(text.data(), text.data() + text.size(), value, nBase);
+        return ec == std::errc{} && pEnd == text.data() + text.size();
+    }
+
+    static std::string_view Trim(std::string_view text)
+    {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+            text.remove_prefix(1);
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+            text.remove_suffix(1);
+        return text;
+    }
+
+    static std::string Lower(std::string_view text)
+    {
+        std::string lower(text);
+        for (auto& c : lower)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return lower;
+    }
+
+    const size_t m_nMaxHeaderSize;
+    const size_t m_nMaxBodySize;
+
+    http_client_response m_response;
+    std::string m_line;
+    state m_state = state::status_line;
+    size_t m_nHeaderSize = 0;
+    // Bytes left of the body or of the current chunk.
+    size_t m_nRemaining = 0;
+    bool m_bHeadRequest = false;
+    bool m_bKeepAlive = true;
+    bool m_bStarted = false;
+    std::error_code m_error;
+};
+
+// State of an http_client, shared with the close posted by http_client::Close.
+class http_client_core : public std::enable_shared_from_this<http_client_core>
+{
+public:
+    http_client_core(asio::io_context& context, http_client_options options)
+      : m_context(context), m_strand(asio::make_strand(context)), m_options(std::move(options))
+    {
+        m_options.nMaxConnectionsPerHost = std::max<size_t>(m_options.nMaxConnectionsPerHost, 1);
+        m_options.nMaxPipelineDepth = std::max<size_t>(m_options.nMaxPipelineDepth, 1);
+        if (!m_options.pReadBuffers)
+            m_options.pReadBuffers = std::make_shared<buffer_pool>();
+    }
+
+    http_client_core(const http_client_core&) = delete;
+    http_client_core& operator=(const http_client_core&) = delete;
+
+    void Request(http_request request, http_callback callback)
+    {
+        auto deadline = std::chrono::steady_clock::now() + m_options.requestTimeout;
+        pending item{std::move(request), std::move(callback), deadline};
+        asio::post(
+            m_strand,
+            [this, item = std::move(item)]() mutable
+            {
+                if (m_bClosed)
+                {
+                    item.callback(asio::error_code(asio::error::operation_aborted), {});
+                    return;
+                }
+
+                auto& pHost = m_mapHosts[item.request.host + ":" + std::to_string(item.request.nPort)];
+                if (!pHost)
+                    pHost = std::make_shared<host_pool>(*this);
+                pHost->deqQueued.push_back(std::move(item));
+                Dispatch(*pHost);
+            });
+    }
+
+    // Give the body storage of a handled response back, so the next responses do not allocate it again.
+    void Recycle(http_client_response&& response)
+    {
+        if (response.body.capacity() == 0 || response.body.capacity() > c_nMaxRecycledBody)
+            return;
+
+        std::scoped_lock lock(m_muxBodies);
+        if (m_vecFreeBodies.size() < c_nMaxRecycledBodies)
+            m_vecFreeBodies.push_back(std::move(response.body));
+    }
+
+    // See http_client::Close. The posted close owns the core, so the strand handlers queued before it still
+    // find it alive, and the ones after it find host_pool::pClient reset.
+    void Close()
+    {
+        if (m_strand.running_in_this_thread() || m_context.stopped())
+        {
+            CloseNow();
+            return;
+        }
+
+        asio::post(m_strand, [self = this->shared_from_this()]() { self->CloseNow(); });
+    }
+private:
+    struct pending
+    {
+        http_request request;
+        http_callback callback;
+        std::chrono::steady_clock::time_point deadline;
+        // Times it was written to a connection.
+        int nAttempts = 0;
+    };
+
+    class session;
+
+    // Connections and waiting requests of one host:port.
+    struct host_pool : std::enable_shared_from_this<host_pool>
+    {
+        explicit host_pool(http_client_core& client) : pClient(&client), queueTimer(client.m_strand) {}
+
+        // nullptr after the client is closed. Handlers still in the context check it before anything else.
+        http_client_core* pClient;
+        std::deque<pending> deqQueued;
+        std::vector<std::shared_ptr<session>> vecSessions;
+        asio::steady_timer queueTimer;
+    };
+
+    // One keep-alive connection. Waits for the socket to become readable instead of keeping a read pending, so
+    // the receive buffer is taken from the pool only while responses are expected.
+    class session : public std::enable_shared_from_this<session>
+    {
+    public:
+        session(host_pool& host, const http_client_options& options)
+          : m_pHost(host.weak_from_this()), m_socket(host.pClient->m_strand), m_resolver(host.pClient->m_strand),
+            m_timer(host.pClient->m_strand), m_parser(options.nMaxHeaderSize, options.nMaxBodySize)
+        {}
+
+        bool IsConnecting() const { return m_state == state::connecting; }
+        bool IsIdle() const { return m_state == state::ready && m_deqInFlight.empty(); }
+        size_t InFlight() const { return m_deqInFlight.size(); }
+
+        // Pipelining is for idempotent requests only: a broken connection must not leave a request half done.
+        bool CanPipeline(const pending& item, size_t nMaxDepth) const
+        {
+            if (m_state != state::ready || m_deqInFlight.size() >= nMaxDepth || !item.request.IsIdempotent())
+                return false;
+            return std::all_of(
+                m_deqInFlight.begin(), m_deqInFlight.end(),
+                [](const pending& inFlight) { return inFlight.request.IsIdempotent(); });
+        }
+
+        void Connect(const http_request& request, std::chrono::milliseconds timeout)
+        {
+            m_state = state::connecting;
+            ArmTimer(std::chrono::steady_clock::now() + timeout);
+            m_resolver.async_resolve(
+                request.host, std::to_string(request.nPort),
+                [self = this->shared_from_this()](std::error_code ec, asio::ip::tcp::resolver::results_type results)
+                {
+                    if (!self->Host())
+                        return;
+                    if (ec)
+                    {
+                        self->Fail(ec);
+                        return;
+                    }
+
+                    asio::async_connect(
+                        self->m_socket, results,
+                        [self](std::error_code ec, const asio::ip::tcp::endpoint&)
+                        {
+                            auto pHost = self->Host();
+                            if (!pHost)
+                                return;
+                            if (ec)
+                            {
+                                self->Fail(ec);
+                                return;
+                            }
+
+                            asio::error_code ecOption;
+                            self->m_socket.set_option(asio::ip::tcp::no_delay(true), ecOption);
+                            self->m_socket.non_blocking(true, ecOption);
+                            self->m_state = state::ready;
+                            self->GoIdle(*pHost->pClient);
+                            pHost->pClient->Dispatch(*pHost);
+                        });
+                });
+        }
+
+        void Send(pending item)
+        {
+            auto* pClient = Host()->pClient;
+            ++item.nAttempts;
+            Serialize(item.request, m_pendingWrite);
+            m_deqInFlight.push_back(std::move(item));
+
+            if (m_deqInFlight.size() == 1)
+            {
+                StartResponse(*pClient);
+                ArmTimer(m_deqInFlight.front().deadline);
+            }
+            if (!m_bWriting)
+                Write();
+        }
+
+        // Close without failing anything, for the client's Close and the idle timeout.
+        void Shutdown()
+        {
+            m_state = state::closed;
+            asio::error_code ec;
+            m_resolver.cancel();
+            m_timer.cancel();
+            m_socket.close(ec);
+        }
+
+        // The requests still waiting for a response, taken out when the client is closed.
+        std::deque<pending> TakeInFlight() { return std::move(m_deqInFlight); }
+    private:
+        enum class state
+        {
+            connecting,
+            ready,
+            closed
+        };
+
+        // The pool while the connection and the client are open, nullptr otherwise.
+        std::shared_ptr<host_pool> Host()
+        {
+            auto pHost = m_pHost.lock();
+            if (!pHost || !pHost->pClient || m_state == state::closed)
+                return nullptr;
+            return pHost;
+        }
+
+        static void Serialize(const http_request& request, std::string& out)
+        {
+            out += request.method;
+            out += ' ';
+            out += request.target;
+            out += " HTTP/1.1\r\nHost: ";
+            out += request.host;
+            if (request.nPort != 80)
+            {
+                out += ':';
+                out += std::to_string(request.nPort);
+            }
+            out += "\r\n";
+            for (const auto& [name, value] : request.headers)
+            {
+                out += name;
+                out += ": ";
+                out += value;
+                out += "\r\n";
+            }
+            if (!request.body.empty() || request.method == "POST" || request.method == "PUT")
+            {
+                out += "Content-Length: ";
+                out += std::to_string(request.body.size());
+                out += "\r\n";
+            }
+            out += "\r\n";
+            out += request.body;
+        }
+
+        // Requests queued while a write is in progress go out together with the next one.
+        void Write()
+        {
+            m_bWriting = true;
+            m_writing.clear();
+            std::swap(m_writing, m_pendingWrite);
+            asio::async_write(
+                m_socket, asio::buffer(m_writing),
+                [self = this->shared_from_this()](std::error_code ec, std::size_t)
+                {
+                    if (!self->Host())
+                        return;
+                    if (ec)
+                    {
+                        self->Fail(ec);
+                        return;
+                    }
+                    if (self->m_pendingWrite.empty())
+                        self->m_bWriting = false;
+                    else
+                        self->Write();
+                });
+        }
+
+        void WaitReadable()
+        {
+            if (m_bWaiting)
+                return;
+
+            m_bWaiting = true;
+            m_socket.async_wait(
+                asio::ip::tcp::socket::wait_read,
+                [self = this->shared_from_this()](std::error_code ec)
+                {
+                    self->m_bWaiting = false;
+                    auto pHost = self->Host();
+                    if (!pHost)
+                        return;
+                    if (ec)
+                    {
+                        self->Fail(ec);
+                        return;
+                    }
+                    self->ReadAvailable(*pHost);
+                });
+        }
+
+        void ReadAvailable(host_pool& host)
+        {
+            auto& client = *host.pClient;
+            if (m_deqInFlight.empty())
+            {
+                // The server closed the idle connection, or sent what nobody asked for.
+                CloseIdle(host);
+                return;
+            }
+
+            if (m_buffer.empty())
+                m_buffer = client.m_options.pReadBuffers->Acquire();
+
+            for (;;)
+            {
+                asio::error_code ec;
+                size_t nRead = m_socket.read_some(asio::buffer(m_buffer), ec);
+                if (ec == asio::error::would_block)
+                    break;
+                if (ec == asio::error::eof)
+                {
+                    OnEof();
+                    return;
+                }
+                if (ec)
+                {
+                    Fail(ec);
+                    return;
+                }
+                if (!Consume(reinterpret_cast<const char*>(m_buffer.data()), nRead) || !Host())
+                    return;
+                if (nRead < m_buffer.size())
+                    break;
+            }
+
+            if (m_deqInFlight.empty())
+                GoIdle(client);
+            WaitReadable();
+        }
+
+        // Feed the parser, complete the responses. False if the connection is closed now.
+        bool Consume(const char* pData, size_t nSize)
+        {
+            size_t nOffset = 0;
+            while (nOffset < nSize)
+            {
+                if (m_deqInFlight.empty())
+                {
+                    Fail(std::make_error_code(std::errc::bad_message));
+                    return false;
+                }
+
+                size_t nConsumed = 0;
+                auto result = m_parser.Parse(pData + nOffset, nSize - nOffset, nConsumed);
+                nOffset += nConsumed;
+                if (result == http_response_parser::result::need_more)
+                    return true;
+                if (result == http_response_parser::result::error)
+                {
+                    Fail(m_parser.Error());
+                    return false;
+                }
+                if (!CompleteFront())
+                    return false;
+            }
+            return true;
+        }
+
+        bool CompleteFront()
+        {
+            auto pHost = Host();
+            auto& client = *pHost->pClient;
+            bool bKeepAlive = m_parser.KeepAlive();
+            pending item = std::move(m_deqInFlight.front());
+            m_deqInFlight.pop_front();
+            auto response = m_parser.TakeResponse();
+
+            if (!m_deqInFlight.empty())
+            {
+                StartResponse(client);
+                ArmTimer(m_deqInFlight.front().deadline);
+            }
+
+            item.callback({}, std::move(response));
+
+            // The callback may have closed the client.
+            if (!Host())
+                return false;
+            if (!bKeepAlive)
+            {
+                // The server does not read the requests written after that response, so they are sent again
+                // without counting it as an attempt.
+                for (auto& next : m_deqInFlight)
+                    --next.nAttempts;
+                Fail(asio::error_code(asio::error::eof));
+                return false;
+            }
+            client.Dispatch(*pHost);
+            return Host() != nullptr;
+        }
+
+        void StartResponse(http_client_core& client)
+        {
+            m_parser.Reset(m_deqInFlight.front().request.method == "HEAD", client.TakeBody());
+            WaitReadable();
+        }
+
+        void OnEof()
+        {
+            if (m_parser.Finish() && !CompleteFront())
+                return;
+            if (Host())
+                Fail(asio::error_code(asio::error::eof));
+        }
+
+        void GoIdle(http_client_core& client)
+        {
+            if (!m_buffer.empty())
+                client.m_options.pReadBuffers->Release(std::move(m_buffer));
+            m_buffer = {};
+            ArmTimer(std::chrono::steady_clock::now() + client.m_options.idleTimeout);
+            WaitReadable();
+        }
+
+        void ArmTimer(std::chrono::steady_clock::time_point deadline)
+        {
+            m_timer.expires_at(deadline);
+            m_timer.async_wait(
+                [self = this->shared_from_this()](std::error_code ec)
+                {
+                    // A newer deadline was set while this one was firing.
+                    if (ec || !self->Host() || self->m_timer.expiry() > std::chrono::steady_clock::now())
+                        return;
+
+                    if (self->m_state == state::connecting)
+                        self->Fail(asio::error_code(asio::error::timed_out));
+                    else if (!self->m_deqInFlight.empty())
+                        self->Fail(asio::error_code(asio::error::timed_out));
+                    else
+                        self->CloseIdle(*self->Host());
+                });
+        }
+
+        // Close an idle connection.
+        void CloseIdle(host_pool& host)
+        {
+            auto self = this->shared_from_this();
+            auto& client = *host.pClient;
+            Shutdown();
+            ReleaseBuffer(client);
+            client.OnSessionClosed(host, *this, {}, false);
+        }
+
+        // Close the connection because of ec. Requests that can be sent again go back to the pool, the rest fail.
+        void Fail(std::error_code ec)
+        {
+            auto self = this->shared_from_this();
+            auto pHost = Host();
+            auto& client = *pHost->pClient;
+            bool bConnecting = m_state == state::connecting;
+            Shutdown();
+            ReleaseBuffer(client);
+
+            auto now = std::chrono::steady_clock::now();
+            std::deque<pending> deqRetry;
+            std::vector<pending> vecFailed;
+            for (size_t i = 0; i < m_deqInFlight.size(); ++i)
+            {
+                auto& item = m_deqInFlight[i];
+                // Bytes of the front response arrived, or it is the one that timed out: it stays failed.
+                bool bAnswered = i == 0 && (m_parser.Started() || ec == asio::error::timed_out);
+                if (!bAnswered && item.request.IsIdempotent() && item.nAttempts < c_nMaxAttempts && item.deadline > now)
+                    deqRetry.push_back(std::move(item));
+                else
+                    vecFailed.push_back(std::move(item));
+            }
+            m_deqInFlight.clear();
+
+            if (bConnecting)
+                MY_LOG(warn, "[http_client] Connect HAS FAILED: {}", ec.message());
+            auto vecQueuedFailed = client.OnSessionClosed(*pHost, *this, std::move(deqRetry), bConnecting);
+            for (auto& item : vecFailed)
+                item.callback(ec, {});
+            for (auto& item : vecQueuedFailed)
+                item.callback(ec, {});
+        }
+
+        void ReleaseBuffer(http_client_core& client)
+        {
+            if (!m_buffer.empty())
+                client.m_options.pReadBuffers->Release(std::move(m_buffer));
+            m_buffer = {};
+        }
+
+        std::weak_ptr<host_pool> m_pHost;
+        asio::ip::tcp::socket m_socket;
+        asio::ip::tcp::resolver m_resolver;
+        // Connect timeout, deadline of the oldest request in flight, or idle timeout.
+        asio::steady_timer m_timer;
+        state m_state = state::connecting;
+
+        std::deque<pending> m_deqInFlight;
+        std::string m_pendingWrite;
+        std::string m_writing;
+        bool m_bWriting = false;
+        bool m_bWaiting = false;
+
+        std::vector<uint8_t> m_buffer;
+        http_response_parser m_parser;
+    };
+
+    void Dispatch(host_pool& host)
+    {
+        while (!host.deqQueued.empty())
+        {
+            auto& next = host.deqQueued.front();
+            session* pTarget = nullptr;
+            size_t nConnecting = 0;
+            for (auto& pSession : host.vecSessions)
+            {
+                if (pSession->IsConnecting())
+                    ++nConnecting;
+                else if (!pTarget && pSession->IsIdle())
+                    pTarget = pSession.get();
+            }
+
+            if (!pTarget && host.vecSessions.size() < m_options.nMaxConnectionsPerHost &&
+                nConnecting < host.deqQueued.size())
+            {
+                auto pSession = std::make_shared<session>(host, m_options);
+                host.vecSessions.push_back(pSession);
+                pSession->Connect(next.request, m_options.connectTimeout);
+                continue;
+            }
+
+            // Pipeline only when all connections are up, a connection coming up serves the request sooner.
+            if (!pTarget && nConnecting == 0)
+            {
+                for (auto& pSession : host.vecSessions)
+                {
+                    if (pSession->CanPipeline(next, m_options.nMaxPipelineDepth) &&
+                        (!pTarget || pSession->InFlight() < pTarget->InFlight()))
+                        pTarget = pSession.get();
+                }
+            }
+
+            if (!pTarget)
+                break;
+
+            pending item = std::move(next);
+            host.deqQueued.pop_front();
+            pTarget->Send(std::move(item));
+        }
+
+        ArmQueueTimer(host);
+    }
+
+    // Fail the requests that waited in the queue past their deadline.
+    void ArmQueueTimer(host_pool& host)
+    {
+        if (host.deqQueued.empty())
+        {
+            host.queueTimer.expires_at(std::chrono::steady_clock::time_point::max());
+            return;
+        }
+
+        auto deadline = std::min_element(
+                            host.deqQueued.begin(), host.deqQueued.end(),
+                            [](const pending& a, const pending& b) { return a.deadline < b.deadline; })
+                            ->deadline;
+        if (host.queueTimer.expiry() == deadline)
+            return;
+
+        host.queueTimer.expires_at(deadline);
+        host.queueTimer.async_wait(
+            [pHost = host.shared_from_this()](std::error_code ec)
+            {
+                if (ec || !pHost->pClient)
+                    return;
+
+                auto now = std::chrono::steady_clock::now();
+                std::vector<pending> vecExpired;
+                for (auto it = pHost->deqQueued.begin(); it != pHost->deqQueued.end();)
+                {
+                    if (it->deadline <= now)
+                    {
+                        vecExpired.push_back(std::move(*it));
+                        it = pHost->deqQueued.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+                for (auto& item : vecExpired)
+                    item.callback(asio::error_code(asio::error::timed_out), {});
+                if (pHost->pClient)
+                    pHost->pClient->ArmQueueTimer(*pHost);
+            });
+    }
+
+    // Returns the queued requests to fail: if the connection never came up and the host has no other one, as a new
+    // connection would most likely fail the same way.
+    std::vector<pending> OnSessionClosed(
+        host_pool& host, session& closed, std::deque<pending> deqRetry, bool bConnectFailed)
+    {
+        std::erase_if(host.vecSessions, [&closed](const auto& pSession) { return pSession.get() == &closed; });
+
+        // Retries keep their order and go before everything queued later.
+        for (auto it = deqRetry.rbegin(); it != deqRetry.rend(); ++it)
+            host.deqQueued.push_front(std::move(*it));
+
+        std::vector<pending> vecFailed;
+        if (bConnectFailed && host.vecSessions.empty())
+        {
+            for (auto& item : host.deqQueued)
+                vecFailed.push_back(std::move(item));
+            host.deqQueued.clear();
+        }
+        ArmQueueTimer(host);
+
+        asio::post(
+            m_strand,
+            [pHost = host.shared_from_this()]()
+            {
+                if (pHost->pClient)
+                    pHost->pClient->Dispatch(*pHost);
+            });
+        return vecFailed;
+    }
+
+    std::string TakeBody()
+    {
+        std::scoped_lock lock(m_muxBodies);
+        if (m_vecFreeBodies.empty())
+            return {};
+        auto body = std::move(m_vecFreeBodies.back());
+        m_vecFreeBodies.pop_back();
+        return body;
+    }
+
+    void CloseNow()
+    {
+        if (m_bClosed)
+            return;
+        m_bClosed = true;
+
+        std::vector<pending> vecAborted;
+        for (auto& [key, pHost] : m_mapHosts)
+        {
+            pHost->pClient = nullptr;
+            pHost->queueTimer.cancel();
+            for (auto& pSession : pHost->vecSessions)
+            {
+                pSession->Shutdown();
+                for (auto& item : pSession->TakeInFlight())
+                    vecAborted.push_back(std::move(item));
+            }
+            for (auto& item : pHost->deqQueued)
+                vecAborted.push_back(std::move(item));
+            pHost->vecSessions.clear();
+            pHost->deqQueued.clear();
+        }
+        m_mapHosts.clear();
+
+        for (auto& item : vecAborted)
+            item.callback(asio::error_code(asio::error::operation_aborted), {});
+    }
+
+    static constexpr int c_nMaxAttempts = 2;
+    static constexpr size_t c_nMaxRecycledBodies = 64;
+    static constexpr size_t c_nMaxRecycledBody = 1024 * 1024;
+
+    asio::io_context& m_context;
+    asio::strand<asio::io_context::executor_type> m_strand;
+    http_client_options m_options;
+    // Touched on the strand only.
+    std::unordered_map<std::string, std::shared_ptr<host_pool>> m_mapHosts;
+    bool m_bClosed = false;
+
+    std::mutex m_muxBodies;
+    std::vector<std::string> m_vecFreeBodies;
+};
+
+// Pool of keep-alive connections per host:port. Request can be called from any thread; connections, parsing and
+// the callbacks run on a strand of the given context, so the context may be run by several threads.
+//
+// A request goes to an idle connection first, then to a new one while the host has fewer than
+// nMaxConnectionsPerHost, then is pipelined behind the least loaded connection if it is idempotent and no
+// connection is still coming up. Idempotent requests whose connection broke before any byte of their response
+// arrived are sent once more.
+class http_client
+{
+public:
+    explicit http_client(asio::io_context& context, http_client_options options = {})
+      : m_pCore(std::make_shared<http_client_core>(context, std::move(options)))
+    {}
+
+    http_client(const http_client&) = delete;
+    http_client& operator=(const http_client&) = delete;
+
+    ~http_client() { Close(); }
+
+    void Request(http_request request, http_callback callback)
+    {
+        m_pCore->Request(std::move(request), std::move(callback));
+    }
+
+    // Give the body storage of a handled response back, so the next responses do not allocate it again.
+    void Recycle(http_client_response&& response) { m_pCore->Recycle(std::move(response)); }
+
+    // Close all connections. Requests in flight or queued fail with asio::error::operation_aborted, new ones too.
+    // Never blocks: from outside the strand of a running context the close is posted to it, and the callbacks of
+    // the aborted requests run there after Close has returned. The client may be destroyed right away.
+    void Close() { m_pCore->Close(); }
+private:
+    std::shared_ptr<http_client_core> m_pCore;
+};
+
+} // namespace net
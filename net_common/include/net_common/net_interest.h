@@ -0,0 +1,256 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+namespace net
+{
+
+// Interest management for game state broadcasts.
+// The server keeps entity positions in a uniform grid and every client (viewer) gets a relevance set:
+// the entities within its view radius. Only those entities are worth sending to the client.
+//
+// Typical tick of a game server (see server_interface::Tick):
+// 1. Move entities in interest.Entities() as the simulation changes them.
+// 2. interest.Update().
+// 3. For each client: send "spawn" for Relevance(id)->entered, "despawn" for ->left
+//    and state updates for ->visible.
+
+// Entity id chosen by the application (e.g. game object id).
+using entity_id = uint32_t;
+
+// Uniform grid of 2D points. Entities are stored as structure of arrays, so a query reads
+// only the coordinates it needs. A cell holds indices into these arrays.
+class interest_grid
+{
+public:
+    explicit interest_grid(float cellSize = 32.0f) : m_fCellSize(cellSize), m_fInvCellSize(1.0f / cellSize) {}
+
+    // Add the entity or move it if it already exists.
+    void Insert(entity_id id, float x, float y)
+    {
+        if (m_mapSlots.contains(id))
+        {
+            Move(id, x, y);
+            return;
+        }
+
+        auto nSlot = static_cast<uint32_t>(m_vecIds.size());
+        uint64_t nCell = CellKey(x, y);
+        m_vecIds.push_back(id);
+        m_vecX.push_back(x);
+        m_vecY.push_back(y);
+        m_vecCells.push_back(nCell);
+        m_mapSlots[id] = nSlot;
+        m_mapCells[nCell].push_back(nSlot);
+    }
+
+    // Incremental update: the cell lists are only touched when the entity crosses a cell border.
+    void Move(entity_id id, float x, float y)
+    {
+        auto it = m_mapSlots.find(id);
+        if (it == m_mapSlots.end())
+            return;
+
+        uint32_t nSlot = it->second;
+        m_vecX[nSlot] = x;
+        m_vecY[nSlot] = y;
+
+        uint64_t nCell = CellKey(x, y);
+        if (nCell != m_vecCells[nSlot])
+        {
+            ReplaceInCell(m_vecCells[nSlot], nSlot, c_nNoSlot);
+            m_mapCells[nCell].push_back(nSlot);
+            m_vecCells[nSlot] = nCell;
+        }
+    }
+
+    void Remove(entity_id id)
+    {
+        auto it = m_mapSlots.find(id);
+        if (it == m_mapSlots.end())
+            return;
+
+        uint32_t nSlot = it->second;
+        m_mapSlots.erase(it);
+        ReplaceInCell(m_vecCells[nSlot], nSlot, c_nNoSlot);
+
+        // Keep the arrays dense: the last entity takes the free slot.
+        auto nLast = static_cast<uint32_t>(m_vecIds.size() - 1);
+        if (nSlot != nLast)
+        {
+            m_vecIds[nSlot] = m_vecIds[nLast];
+            m_vecX[nSlot] = m_vecX[nLast];
+            m_vecY[nSlot] = m_vecY[nLast];
+            m_vecCells[nSlot] = m_vecCells[nLast];
+            m_mapSlots[m_vecIds[nSlot]] = nSlot;
+            ReplaceInCell(m_vecCells[nSlot], nLast, nSlot);
+        }
+
+        m_vecIds.pop_back();
+        m_vecX.pop_back();
+        m_vecY.pop_back();
+        m_vecCells.pop_back();
+    }
+
+    bool Contains(entity_id id) const { return m_mapSlots.contains(id); }
+    size_t Size() const { return m_vecIds.size(); }
+    float CellSize() const { return m_fCellSize; }
+
+    // Call fn(entity_id) for every entity within radius of (x, y).
+    template <typename Fn>
+    void QueryRadius(float x, float y, float radius, Fn&& fn) const
+    {
+        int32_t nMinX = CellCoord(x - radius);
+        int32_t nMaxX = CellCoord(x + radius);
+        int32_t nMinY = CellCoord(y - radius);
+        int32_t nMaxY = CellCoord(y + radius);
+        float fRadius2 = radius * radius;
+
+        for (int32_t cy = nMinY; cy <= nMaxY; ++cy)
+        {
+            for (int32_t cx = nMinX; cx <= nMaxX; ++cx)
+            {
+                auto it = m_mapCells.find(CellKey(cx, cy));
+                if (it == m_mapCells.end())
+                    continue;
+
+                for (uint32_t nSlot : it->second)
+                {
+                    float dx = m_vecX[nSlot] - x;
+                    float dy = m_vecY[nSlot] - y;
+                    if (dx * dx + dy * dy <= fRadius2)
+                        fn(m_vecIds[nSlot]);
+                }
+            }
+        }
+    }
+private:
+    // Marker for ReplaceInCell: remove the slot instead of replacing it.
+    static constexpr uint32_t c_nNoSlot = UINT32_MAX;
+
+    int32_t CellCoord(float v) const { return static_cast<int32_t>(std::floor(v * m_fInvCellSize)); }
+
+    static uint64_t CellKey(int32_t cx, int32_t cy)
+    {
+        return (uint64_t(uint32_t(cx)) << 32) | uint64_t(uint32_t(cy));
+    }
+
+    uint64_t CellKey(float x, float y) const { return CellKey(CellCoord(x), CellCoord(y)); }
+
+    // Replace nOldSlot in the cell list with nNewSlot, or remove it if nNewSlot is c_nNoSlot.
+    void ReplaceInCell(uint64_t nCell, uint32_t nOldSlot, uint32_t nNewSlot)
+    {
+        auto it = m_mapCells.find(nCell);
+        if (it == m_mapCells.end())
+            return;
+
+        auto& vecSlots = it->second;
+        auto itSlot = std::find(vecSlots.begin(), vecSlots.end(), nOldSlot);
+        if (itSlot == vecSlots.end())
+            return;
+
+        if (nNewSlot != c_nNoSlot)
+        {
+            *itSlot = nNewSlot;
+            return;
+        }
+
+        *itSlot = vecSlots.back();
+        vecSlots.pop_back();
+        if (vecSlots.empty())
+            m_mapCells.erase(it);
+    }
+private:
+    float m_fCellSize;
+    float m_fInvCellSize;
+
+    // Entities, structure of arrays. Index in these arrays is the "slot".
+    std::vector<entity_id> m_vecIds;
+    std::vector<float> m_vecX;
+    std::vector<float> m_vecY;
+    std::vector<uint64_t> m_vecCells;
+
+    std::unordered_map<entity_id, uint32_t> m_mapSlots;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_mapCells;
+};
+
+// Relevance set of one viewer. All vectors are sorted by entity id.
+struct relevance_set
+{
+    // Entities currently in the view radius.
+    std::vector<entity_id> visible;
+    // Changes since the previous interest_manager::Update.
+    std::vector<entity_id> entered;
+    std::vector<entity_id> left;
+};
+
+// Entities in a grid plus per-client viewers. Clients are identified by connection ID.
+// Not thread safe: use it from the thread calling server_interface::Update/Tick.
+class interest_manager
+{
+public:
+    explicit interest_manager(float cellSize = 32.0f) : m_grid(cellSize) {}
+
+    interest_grid& Entities() { return m_grid; }
+    const interest_grid& Entities() const { return m_grid; }
+
+    // Add the viewer or change its position and radius.
+    void SetViewer(uint32_t clientID, float x, float y, float radius)
+    {
+        auto& v = m_mapViewers[clientID];
+        v.x = x;
+        v.y = y;
+        v.radius = radius;
+    }
+
+    void RemoveViewer(uint32_t clientID) { m_mapViewers.erase(clientID); }
+
+    // Recompute relevance sets of all viewers. Call once per tick, after the entities have been moved.
+    void Update()
+    {
+        for (auto& [clientID, v] : m_mapViewers)
+        {
+            m_vecScratch.clear();
+            m_grid.QueryRadius(v.x, v.y, v.radius, [this](entity_id id) { m_vecScratch.push_back(id); });
+            std::sort(m_vecScratch.begin(), m_vecScratch.end());
+
+            auto& rel = v.relevance;
+            rel.entered.clear();
+            rel.left.clear();
+            std::set_difference(
+                m_vecScratch.begin(), m_vecScratch.end(), rel.visible.begin(), rel.visible.end(),
+                std::back_inserter(rel.entered));
+            std::set_difference(
+                rel.visible.begin(), rel.visible.end(), m_vecScratch.begin(), m_vecScratch.end(),
+                std::back_inserter(rel.left));
+
+            // The old set becomes the scratch buffer of the next viewer, so no allocation in steady state.
+            rel.visible.swap(m_vecScratch);
+        }
+    }
+
+    // Relevance set computed by the last Update, nullptr for an unknown client.
+    const relevance_set* Relevance(uint32_t clientID) const
+    {
+        auto it = m_mapViewers.find(clientID);
+        return it == m_mapViewers.end() ? nullptr : &it->second.relevance;
+    }
+private:
+    struct viewer
+    {
+        float x = 0.0f;
+        float y = 0.0f;
+        float radius = 0.0f;
+        relevance_set relevance;
+    };
+
+    interest_grid m_grid;
+    std::unordered_map<uint32_t, viewer> m_mapViewers;
+    std::vector<entity_id> m_vecScratch;
+};
+
+} // namespace net
@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <my_cpp_utils/logger.h>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace net
+{
+
+// Opt-in low latency mode. Trades CPU for tail latency:
+// the I/O thread never sleeps in the kernel, it spins on io_context::poll,
+// and Update(-1, true) spins on the incoming queue instead of waiting on the condition variable.
+struct latency_options
+{
+    bool enabled = false;
+    // Core for the asio I/O thread. -1 means "do not pin".
+    int ioCore = -1;
+    // Core for the thread calling Update. -1 means "do not pin".
+    int updateCore = -1;
+    // Consumer backoff while the queue is empty: spin, then yield, then sleep up to maxSleep.
+    size_t nSpins = 10000;
+    size_t nYields = 100;
+    std::chrono::microseconds maxSleep{50};
+};
+
+// Pin the calling thread to one CPU core. Returns false if it is not supported or failed.
+inline bool pin_current_thread(int core)
+{
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
+    {
+        MY_LOG(error, "[pin_current_thread] Cannot pin thread to core {}", core);
+        return false;
+    }
+    return true;
+#else
+    MY_LOG(warn, "[pin_current_thread] Thread pinning is not supported on this platform");
+    return false;
+#endif
+}
+
+// Tell the CPU we are in a spin loop (saves power, frees resources for the sibling hyper-thread).
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Bounded backoff: spin first, then yield, then sleep with a growing but capped interval.
+class spin_backoff
+{
+public:
+    explicit spin_backoff(const latency_options& options) : m_options(options) {}
+
+    void Pause()
+    {
+        if (m_nIteration < m_options.nSpins)
+        {
+            cpu_relax();
+        }
+        else if (m_nIteration < m_options.nSpins + m_options.nYields)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(m_sleep);
+            m_sleep = std::min(m_sleep * 2, m_options.maxSleep);
+        }
+        m_nIteration++;
+    }
+
+    void Reset()
+    {
+        m_nIteration = 0;
+        m_sleep = std::chrono::microseconds(1);
+    }
+private:
+    const latency_options& m_options;
+    size_t m_nIteration = 0;
+    std::chrono::microseconds m_sleep{1};
+};
+
+// Body of an asio I/O thread. In latency mode the thread is pinned and spins on poll,
+// so a completion is handled without a wakeup. Returns when the context is stopped.
+inline void run_io_context(asio::io_context& context, const latency_options& options)
+{
+    if (!options.enabled)
+    {
+        context.run();
+        return;
+    }
+
+    if (options.ioCore >= 0)
+        pin_current_thread(options.ioCore);
+
+    // poll returns immediately when there is nothing to do, so keep the context "busy" until it is stopped.
+    auto workGuard = asio::make_work_guard(context);
+    while (!context.stopped())
+        context.poll();
+}
+
+} // namespace net
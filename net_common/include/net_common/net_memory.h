@@ -0,0 +1,195 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+
+// Byte counter with a limit, shared by all connections of a server (see server_interface::SetMemoryLimit).
+// Connections charge it for their receive buffers, incoming messages not handled yet and outgoing queues.
+// Thread safe: charged from the asio thread and from the threads calling Send, released from Update.
+class memory_budget
+{
+public:
+    explicit memory_budget(size_t nLimit = SIZE_MAX) : m_nLimit(nLimit) {}
+
+    // Charge nBytes if they fit into the limit.
+    bool TryCharge(size_t nBytes)
+    {
+        size_t nUsed = m_nUsed.load(std::memory_order_relaxed);
+        do
+        {
+            if (nBytes > m_nLimit || nUsed > m_nLimit - nBytes)
+                return false;
+        } while (!m_nUsed.compare_exchange_weak(nUsed, nUsed + nBytes, std::memory_order_relaxed));
+        return true;
+    }
+
+    // Charge memory that is already allocated, whatever the limit is.
+    void Charge(size_t nBytes) { m_nUsed.fetch_add(nBytes, std::memory_order_relaxed); }
+
+    void Release(size_t nBytes)
+    {
+        m_nUsed.fetch_sub(nBytes);
+        if (m_nWaiters.load() > 0)
+            WakeWaiters();
+    }
+
+    // Call wake once, from the next Release, e.g. to resume a read paused by a failed TryCharge. wake runs under
+    // a lock: it must be short and must not touch the budget. A key has one waiter at most.
+    // Check HasRoom after the call, the room may have been released just before it.
+    void AddWaiter(const void* pKey, std::function<void()> wake)
+    {
+        std::scoped_lock lock(m_muxWaiters);
+        for (auto& [pWaiterKey, waiterWake] : m_vecWaiters)
+        {
+            if (pWaiterKey == pKey)
+            {
+                waiterWake = std::move(wake);
+                return;
+            }
+        }
+        m_vecWaiters.emplace_back(pKey, std::move(wake));
+        m_nWaiters.store(m_vecWaiters.size());
+    }
+
+    // After it returns, the wake of the key is not running and will not run.
+    void RemoveWaiter(const void* pKey)
+    {
+        std::scoped_lock lock(m_muxWaiters);
+        std::erase_if(m_vecWaiters, [pKey](const auto& waiter) { return waiter.first == pKey; });
+        m_nWaiters.store(m_vecWaiters.size());
+    }
+
+    bool HasRoom(size_t nBytes) const
+    {
+        size_t nUsed = m_nUsed.load();
+        return nBytes <= m_nLimit && nUsed <= m_nLimit - nBytes;
+    }
+
+    size_t Used() const { return m_nUsed.load(std::memory_order_relaxed); }
+    size_t Limit() const { return m_nLimit; }
+private:
+    void WakeWaiters()
+    {
+        std::scoped_lock lock(m_muxWaiters);
+        for (auto& [pKey, wake] : m_vecWaiters)
+            wake();
+        m_vecWaiters.clear();
+        m_nWaiters.store(0);
+    }
+
+    const size_t m_nLimit;
+    std::atomic<size_t> m_nUsed = 0;
+    // Waiters for room. The count lets Release skip the lock while nobody waits.
+    std::atomic<size_t> m_nWaiters = 0;
+    std::mutex m_muxWaiters;
+    std::vector<std::pair<const void*, std::function<void()>>> m_vecWaiters;
+};
+
+// Free list of equally sized buffers, shared by connections (see connection_options::idleBufferPool).
+// An idle connection gives its receive buffer back, so 100k mostly idle connections need only as many buffers
+// as there are connections receiving at the same moment. Thread safe.
+class buffer_pool
+{
+public:
+    explicit buffer_pool(size_t nBufferSize = 16 * 1024, size_t nMaxFree = 1024)
+      : m_nBufferSize(nBufferSize), m_nMaxFree(nMaxFree)
+    {}
+
+    std::vector<uint8_t> Acquire()
+    {
+        {
+            std::scoped_lock lock(m_mux);
+            if (!m_vecFree.empty())
+            {
+                auto buffer = std::move(m_vecFree.back());
+                m_vecFree.pop_back();
+                return buffer;
+            }
+        }
+        return std::vector<uint8_t>(m_nBufferSize);
+    }
+
+    // Buffers over nMaxFree are freed, so a burst does not pin its memory forever.
+    void Release(std::vector<uint8_t> buffer)
+    {
+        if (buffer.size() != m_nBufferSize)
+            return;
+
+        std::scoped_lock lock(m_mux);
+        if (m_vecFree.size() < m_nMaxFree)
+            m_vecFree.push_back(std::move(buffer));
+    }
+
+    size_t BufferSize() const { return m_nBufferSize; }
+
+    size_t FreeCount()
+    {
+        std::scoped_lock lock(m_mux);
+        return m_vecFree.size();
+    }
+private:
+    const size_t m_nBufferSize;
+    const size_t m_nMaxFree;
+    std::mutex m_mux;
+    std::vector<std::vector<uint8_t>> m_vecFree;
+};
+
+// FIFO on a vector. Takes no memory at all while empty (std::deque allocates a block even then) and one
+// contiguous block while in use. Not thread safe: made for the per connection queues of the asio thread.
+template <typename T>
+class compact_queue
+{
+public:
+    bool empty() const { return m_nHead == m_vecItems.size(); }
+    size_t size() const { return m_vecItems.size() - m_nHead; }
+    size_t capacity() const { return m_vecItems.capacity(); }
+
+    T& front() { return m_vecItems[m_nHead]; }
+
+    void push_back(T item) { m_vecItems.push_back(std::move(item)); }
+
+    void pop_front()
+    {
+        // Destroy the item now, not when the slot is reused.
+        m_vecItems[m_nHead++] = T{};
+
+        if (m_nHead == m_vecItems.size())
+        {
+            m_vecItems.clear();
+            m_nHead = 0;
+        }
+        else if (m_nHead >= c_nMinCompact && m_nHead > m_vecItems.size() / 2)
+        {
+            // The queue never drained: drop the consumed slots, so it does not grow forever.
+            m_vecItems.erase(m_vecItems.begin(), m_vecItems.begin() + static_cast<std::ptrdiff_t>(m_nHead));
+            m_nHead = 0;
+        }
+    }
+
+    auto begin() { return m_vecItems.begin() + static_cast<std::ptrdiff_t>(m_nHead); }
+    auto end() { return m_vecItems.end(); }
+
+    // Free the storage of an empty queue.
+    void Trim()
+    {
+        if (empty())
+        {
+            std::vector<T>().swap(m_vecItems);
+            m_nHead = 0;
+        }
+    }
+private:
+    static constexpr size_t c_nMinCompact = 32;
+
+    std::vector<T> m_vecItems;
+    size_t m_nHead = 0;
+};
+
+} // namespace net
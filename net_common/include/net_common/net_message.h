@@ -1,19 +1,65 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 namespace net
 {
 
+// Transport level flags of a frame. User messages have no flags.
+namespace frame_flags
+{
+// Body is a sequence of [message_header][body] frames, sent by server_interface in tick mode.
+constexpr uint32_t batch = 1 << 0;
+// Body is delta encoded against the previous body of the same message type (see net_delta.h).
+constexpr uint32_t delta = 1 << 1;
+// Body is sent in full and becomes the baseline for the next delta of this message type.
+constexpr uint32_t delta_baseline = 1 << 2;
+// Body is [uint32 original size][LZ4 style block] (see net_compress.h).
+constexpr uint32_t compressed = 1 << 3;
+// Frame is followed by a CRC32C of its header and body (see connection_options::checksum).
+constexpr uint32_t checksum = 1 << 4;
+// Body is a control_frame of the connection itself. It never reaches the user.
+constexpr uint32_t control = 1 << 5;
+// Body is followed by the int64 steady clock time the frame was written at (see connection_options::timestamps).
+// The timestamp goes before the checksum trailer and is covered by it.
+constexpr uint32_t timestamp = 1 << 6;
+// Body is a federation frame of a link between two servers (see net_federation.h). Kept on the received message,
+// server_interface::Update hands it to the federation instead of OnMessage.
+constexpr uint32_t federation = 1 << 7;
+} // namespace frame_flags
+
+// Body of a frame_flags::control frame.
+struct control_frame
+{
+    enum kind : uint32_t
+    {
+        // Clock sync heartbeat (see clock_sync): the client sends t0, the server answers with t0, t1 and t2.
+        clock_request = 1,
+        clock_response = 2,
+    };
+
+    uint32_t type = 0;
+    // clock_request: the sender's estimate of the receiver's clock is in offset and roundTrip.
+    uint32_t bHasEstimate = 0;
+    int64_t t0 = 0;
+    int64_t t1 = 0;
+    int64_t t2 = 0;
+    int64_t offset = 0;
+    int64_t roundTrip = 0;
+};
+
 // Message header is sent at the start of all messages.
 // It contains the id of the message and the size of the message.
-// Size of this struct is constant (8 bytes).
+// Size of this struct is constant (16 bytes for 32-bit ids, flags use what was padding before).
 template <typename T>
 struct message_header
 {
     T id{};
-    uint64_t size = 0; // size_t is not used because it is platform dependent.
+    uint32_t flags = 0; // See frame_flags.
+    uint64_t size = 0;  // size_t is not used because it is platform dependent.
 };
 
 template <typename T>
@@ -87,6 +133,11 @@ struct message
     }
 };
 
+// Immutable message shared by many outgoing queues. A broadcast is encoded once and every
+// recipient's queue holds a reference to the same frame.
+template <typename T>
+using shared_message = std::shared_ptr<const message<T>>;
+
 // Forward declare the connection.
 template <typename T>
 class connection;
@@ -96,6 +147,8 @@ struct owned_message
 {
     std::shared_ptr<connection<T>> remote = nullptr; // Server needs to identify which client sent the message.
     message<T> msg;
+    // Local steady clock time the frame was received at, in ns. 0 unless connection timing is enabled.
+    int64_t nReceivedNs = 0;
 
     // Overload the << operator for std::cout compatibility.
     friend std::ostream& operator<<(std::ostream& os, const owned_message<T>& msg)
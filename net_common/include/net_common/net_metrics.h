@@ -0,0 +1,230 @@
+#pragma once
+#include "net_connection.h"
+#include "net_timing.h"
+#include <cstdint>
+#include <fmt/format.h>
+#include <iterator>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+namespace net
+{
+
+// Server wide counters of the metrics endpoint. Touched from the asio thread only, as the endpoint itself.
+struct server_counters
+{
+    uint64_t nAccepted = 0;
+    // Refused by the address filter (blacklist, accept rate), the memory cap or OnClientConnect.
+    uint64_t nRefusedAddress = 0;
+    uint64_t nRefusedMemory = 0;
+    uint64_t nDenied = 0;
+};
+
+// Values of the server itself, collected on the asio thread for one scrape.
+struct server_metrics
+{
+    const server_counters* pCounters = nullptr;
+    size_t nIncomingQueue = 0;
+    // Accepted transports still in their handshake (TLS), not connections yet.
+    size_t nPendingHandshakes = 0;
+    size_t nMemoryUsed = 0;
+    size_t nMemoryLimit = 0;
+    const latency_histogram* pUpdateDelay = nullptr;
+};
+
+// Prometheus text exposition format, version 0.0.4.
+class prometheus_writer
+{
+public:
+    // "# HELP" and "# TYPE" lines. Every metric name must be declared once, before its samples.
+    void Declare(const char* name, const char* type, const char* help)
+    {
+        fmt::format_to(Out(), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+    }
+
+    // labels is "" or the inside of the braces, e.g. id="10000".
+    template <typename Value>
+    void Sample(const char* name, const std::string& labels, Value value)
+    {
+        if (labels.empty())
+            fmt::format_to(Out(), "{} {}\n", name, value);
+        else
+            fmt::format_to(Out(), "{}{{{}}} {}\n", name, labels, value);
+    }
+
+    // A latency histogram as a summary in seconds: p50, p90, p99, p99.9, sum and count.
+    void Summary(const char* name, const std::string& labels, const latency_histogram& histogram)
+    {
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        for (double q : {0.5, 0.9, 0.99, 0.999})
+        {
+            fmt::format_to(
+                Out(), "{}{{{}quantile=\"{}\"}} {}\n", name, prefix, q, double(histogram.PercentileNs(q)) / 1e9);
+        }
+        Sample(fmt::format("{}_sum", name).c_str(), labels, double(histogram.SumNs()) / 1e9);
+        Sample(fmt::format("{}_count", name).c_str(), labels, histogram.Count());
+    }
+
+    std::string& Text() { return m_text; }
+private:
+    std::back_insert_iterator<std::string> Out() { return std::back_inserter(m_text); }
+
+    std::string m_text;
+};
+
+// Label value with the characters Prometheus requires to be escaped.
+inline std::string PrometheusLabel(const std::string& value)
+{
+    std::string escaped;
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            escaped.push_back('\\');
+        if (c == '\n')
+        {
+            escaped += "\\n";
+            continue;
+        }
+        escaped.push_back(c);
+    }
+    return escaped;
+}
+
+// Server and per connection metrics in the Prometheus text format. Call it on the asio thread.
+template <typename T>
+std::string PrometheusMetrics(
+    const server_metrics& server, const std::vector<std::shared_ptr<connection<T>>>& connections)
+{
+    prometheus_writer out;
+    const auto& counters = *server.pCounters;
+
+    out.Declare("net_server_connections", "gauge", "Open connections.");
+    out.Sample("net_server_connections", "", connections.size());
+    out.Declare("net_server_accepted_total", "counter", "Accepted connections.");
+    out.Sample("net_server_accepted_total", "", counters.nAccepted);
+    out.Declare("net_server_refused_total", "counter", "Refused connections by reason.");
+    out.Sample("net_server_refused_total", "reason=\"address\"", counters.nRefusedAddress);
+    out.Sample("net_server_refused_total", "reason=\"memory\"", counters.nRefusedMemory);
+    out.Sample("net_server_refused_total", "reason=\"denied\"", counters.nDenied);
+    out.Declare("net_server_pending_handshakes", "gauge", "Accepted sockets still in their handshake.");
+    out.Sample("net_server_pending_handshakes", "", server.nPendingHandshakes);
+    out.Declare("net_server_incoming_queue_messages", "gauge", "Messages waiting for Update.");
+    out.Sample("net_server_incoming_queue_messages", "", server.nIncomingQueue);
+    out.Declare("net_server_memory_used_bytes", "gauge", "Bytes charged to the server wide memory cap.");
+    out.Sample("net_server_memory_used_bytes", "", server.nMemoryUsed);
+    out.Declare("net_server_memory_limit_bytes", "gauge", "Server wide memory cap, 0 - no cap.");
+    out.Sample("net_server_memory_limit_bytes", "", server.nMemoryLimit);
+    out.Declare("net_server_update_delay_seconds", "summary", "Receive to OnMessage delay.");
+    out.Summary("net_server_update_delay_seconds", "", *server.pUpdateDelay);
+
+    // One metric family at a time, as the format requires all samples of a name to be together.
+    std::vector<std::string> vecLabels;
+    vecLabels.reserve(connections.size());
+    for (const auto& pConnection : connections)
+    {
+        vecLabels.push_back(
+            fmt::format("id=\"{}\",remote=\"{}\"", pConnection->GetID(), PrometheusLabel(pConnection->RemoteName())));
+    }
+
+    auto family = [&](const char* name, const char* type, const char* help, auto value)
+    {
+        out.Declare(name, type, help);
+        for (size_t i = 0; i < connections.size(); ++i)
+            out.Sample(name, vecLabels[i], value(*connections[i]));
+    };
+    using counter = const std::atomic<uint64_t> connection_counters::*;
+    auto counterFamily = [&](const char* name, const char* help, counter field)
+    {
+        family(name, "counter", help, [field](const connection<T>& c) { return (c.Counters().*field).load(); });
+    };
+
+    counterFamily("net_connection_received_bytes_total", "Bytes read.", &connection_counters::nBytesIn);
+    counterFamily("net_connection_sent_bytes_total", "Bytes written.", &connection_counters::nBytesOut);
+    counterFamily("net_connection_received_frames_total", "Frames read.", &connection_counters::nFramesIn);
+    counterFamily("net_connection_sent_frames_total", "Frames written.", &connection_counters::nFramesOut);
+    counterFamily(
+        "net_connection_received_messages_total", "Messages put into the incoming queue.",
+        &connection_counters::nMessagesIn);
+    counterFamily(
+        "net_connection_dropped_messages_total", "Messages dropped by the rate limits.",
+        &connection_counters::nMessagesDropped);
+    counterFamily(
+        "net_connection_not_sent_messages_total", "Messages not sent as the server memory limit was reached.",
+        &connection_counters::nMessagesNotSent);
+    family(
+        "net_connection_outgoing_queue_frames", "gauge", "Frames waiting to be written.",
+        [](const connection<T>& c) { return c.OutgoingQueueSize(); });
+    family(
+        "net_connection_incoming_bytes", "gauge", "Bytes being received or waiting for Update.",
+        [](const connection<T>& c) { return c.IncomingBytes(); });
+    family(
+        "net_connection_outgoing_bytes", "gauge", "Bytes waiting to be written.",
+        [](const connection<T>& c) { return c.OutgoingBytes(); });
+
+    // Latency of the connections with timing enabled (connection_options::timestamps).
+    auto summaryFamily = [&](const char* name, const char* help, latency_histogram connection_timing::*field)
+    {
+        out.Declare(name, "summary", help);
+        for (size_t i = 0; i < connections.size(); ++i)
+        {
+            if (const auto* pTiming = connections[i]->Timing())
+                out.Summary(name, vecLabels[i], pTiming->*field);
+        }
+    };
+    summaryFamily("net_connection_one_way_in_seconds", "Remote write to local read.", &connection_timing::oneWayIn);
+    summaryFamily("net_connection_queue_out_seconds", "Wait in the outgoing queue.", &connection_timing::queueOut);
+
+    return std::move(out.Text());
+}
+
+// Connection list as JSON, for humans and scripts. Call it on the asio thread.
+template <typename T>
+std::string JsonConnections(const std::vector<std::shared_ptr<connection<T>>>& connections)
+{
+    auto histogram = [](const latency_histogram& h)
+    {
+        return nlohmann::json{
+            {"count", h.Count()},
+            {"mean_ns", h.MeanNs()},
+            {"p50_ns", h.PercentileNs(0.5)},
+            {"p99_ns", h.PercentileNs(0.99)},
+            {"max_ns", h.PercentileNs(1.0)}};
+    };
+
+    auto list = nlohmann::json::array();
+    for (const auto& pConnection : connections)
+    {
+        const auto& counters = pConnection->Counters();
+        nlohmann::json item{
+            {"id", pConnection->GetID()},
+            {"remote", pConnection->RemoteName()},
+            {"connected", pConnection->IsConnected()},
+            {"bytes_in", counters.nBytesIn.load()},
+            {"bytes_out", counters.nBytesOut.load()},
+            {"frames_in", counters.nFramesIn.load()},
+            {"frames_out", counters.nFramesOut.load()},
+            {"messages_in", counters.nMessagesIn.load()},
+            {"messages_dropped", counters.nMessagesDropped.load()},
+            {"messages_not_sent", counters.nMessagesNotSent.load()},
+            {"outgoing_queue", pConnection->OutgoingQueueSize()},
+            {"incoming_bytes", pConnection->IncomingBytes()},
+            {"outgoing_bytes", pConnection->OutgoingBytes()},
+            {"memory_bytes", pConnection->MemoryFootprint()}};
+
+        if (const auto* pTiming = pConnection->Timing())
+        {
+            item["timing"] = {
+                {"clock_offset_ns", pTiming->clock.OffsetNs()},
+                {"clock_valid", pTiming->clock.IsValid()},
+                {"one_way_in", histogram(pTiming->oneWayIn)},
+                {"queue_out", histogram(pTiming->queueOut)},
+                {"round_trip", histogram(pTiming->roundTrip)}};
+        }
+        list.push_back(std::move(item));
+    }
+    return list.dump(2);
+}
+
+} // namespace net
@@ -0,0 +1,170 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+namespace net
+{
+
+// Rate of a token bucket: tokens per second and the bucket size (how many may be taken at once).
+// rate 0 means unlimited.
+struct rate_limit
+{
+    double rate = 0.0;
+    double burst = 1.0;
+};
+
+// Classic token bucket. Tokens are refilled lazily from the elapsed time, so an idle bucket costs nothing.
+// Not thread safe.
+class token_bucket
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    token_bucket() = default;
+    token_bucket(rate_limit limit, clock::time_point now) : m_limit(limit), m_fTokens(limit.burst), m_last(now) {}
+
+    bool TryTake(clock::time_point now, double fCost = 1.0)
+    {
+        if (m_limit.rate <= 0.0)
+            return true;
+
+        Refill(now);
+        if (m_fTokens < fCost)
+            return false;
+
+        m_fTokens -= fCost;
+        return true;
+    }
+
+    // A full bucket behaves as a new one, so it may be forgotten.
+    bool IsFull(clock::time_point now)
+    {
+        Refill(now);
+        return m_fTokens >= m_limit.burst;
+    }
+private:
+    void Refill(clock::time_point now)
+    {
+        double fElapsed = std::chrono::duration<double>(now - m_last).count();
+        m_last = now;
+        m_fTokens = std::min(m_limit.burst, m_fTokens + fElapsed * m_limit.rate);
+    }
+
+    rate_limit m_limit;
+    double m_fTokens = 0.0;
+    clock::time_point m_last;
+};
+
+// Server side limits per remote address (see server_interface::SetAcceptLimits).
+struct accept_limit_options
+{
+    // New connections per second from one address. Unlimited by default.
+    rate_limit acceptRate;
+    // Failed handshakes from one address within failureWindow that blacklist it. 0 - never blacklist.
+    size_t nMaxHandshakeFailures = 3;
+    std::chrono::seconds failureWindow{60};
+    // How long a blacklisted address is refused.
+    std::chrono::seconds blacklistTime{300};
+};
+
+// Accept rate limits and the blacklist, keyed by remote address (transport::RemoteAddress).
+// Not thread safe: the server uses it from the asio thread only.
+class address_filter
+{
+public:
+    using clock = token_bucket::clock;
+
+    void SetOptions(const accept_limit_options& options) { m_options = options; }
+
+    // false - refuse the new connection: the address is blacklisted or connects too often.
+    bool Accept(const std::string& address, clock::time_point now)
+    {
+        Purge(now);
+
+        auto [it, bInserted] = m_mapEntries.try_emplace(address);
+        auto& entry = it->second;
+        if (bInserted)
+            entry.bucket = token_bucket(m_options.acceptRate, now);
+
+        if (now < entry.blockedUntil)
+            return false;
+
+        return entry.bucket.TryTake(now);
+    }
+
+    // Count a failed handshake. Returns true if the address has been blacklisted by this failure.
+    bool ReportFailure(const std::string& address, clock::time_point now)
+    {
+        if (m_options.nMaxHandshakeFailures == 0)
+            return false;
+
+        auto [it, bInserted] = m_mapEntries.try_emplace(address);
+        auto& entry = it->second;
+        if (bInserted)
+            entry.bucket = token_bucket(m_options.acceptRate, now);
+
+        // Failures older than the window are forgotten.
+        if (entry.nFailures == 0 || now - entry.firstFailure > m_options.failureWindow)
+        {
+            entry.firstFailure = now;
+            entry.nFailures = 0;
+        }
+
+        if (++entry.nFailures < m_options.nMaxHandshakeFailures)
+            return false;
+
+        entry.nFailures = 0;
+        entry.blockedUntil = now + m_options.blacklistTime;
+        return true;
+    }
+
+    void Block(const std::string& address, clock::time_point now, clock::duration duration)
+    {
+        auto [it, bInserted] = m_mapEntries.try_emplace(address);
+        if (bInserted)
+            it->second.bucket = token_bucket(m_options.acceptRate, now);
+        it->second.blockedUntil = now + duration;
+    }
+
+    bool IsBlocked(const std::string& address, clock::time_point now) const
+    {
+        auto it = m_mapEntries.find(address);
+        return it != m_mapEntries.end() && now < it->second.blockedUntil;
+    }
+private:
+    struct entry
+    {
+        token_bucket bucket;
+        size_t nFailures = 0;
+        clock::time_point firstFailure;
+        clock::time_point blockedUntil;
+    };
+
+    // Forget addresses that have nothing to remember, so the map does not keep every address ever seen.
+    // Runs once per failure window, so its cost is spread over many accepts.
+    void Purge(clock::time_point now)
+    {
+        if (now - m_lastPurge < m_options.failureWindow)
+            return;
+        m_lastPurge = now;
+
+        for (auto it = m_mapEntries.begin(); it != m_mapEntries.end();)
+        {
+            auto& e = it->second;
+            bool bFailuresExpired = e.nFailures == 0 || now - e.firstFailure > m_options.failureWindow;
+            if (now >= e.blockedUntil && bFailuresExpired && e.bucket.IsFull(now))
+                it = m_mapEntries.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    accept_limit_options m_options;
+    std::unordered_map<std::string, entry> m_mapEntries;
+    clock::time_point m_lastPurge;
+};
+
+} // namespace net
@@ -1,19 +1,74 @@
 #pragma once
+#include "net_capture.h"
 #include "net_connection.h"
+#include "net_federation.h"
+#include "net_hot_restart.h"
+#include "net_http.h"
+#include "net_latency.h"
+#include "net_memory.h"
 #include "net_message.h"
+#include "net_metrics.h"
+#include "net_rate_limit.h"
+#include "net_transport.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <exception>
 #include <fmt/chrono.h>
+#include <memory>
 #include <my_cpp_utils/logger.h>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(NET_HAS_TLS)
+#include "net_tls.h"
+#endif
 
 namespace net
 {
+// Topic (room) of the publish-subscribe routing. Ids are chosen by the application.
+using topic_id = uint32_t;
+
+// Fixed rate tick mode (see server_interface::EnableTickMode).
+struct tick_options
+{
+    // Ticks per second. Must be positive.
+    double tickRate = 30.0;
+    // Incoming messages handled per tick. The rest waits for the next tick.
+    size_t nMaxIncomingPerTick = -1;
+    // Outgoing messages and bytes per client per tick. The rest waits for the next tick.
+    // At least one message is always sent, so a large message can't stall the client.
+    size_t nMaxMessagesPerClient = -1;
+    size_t nMaxBytesPerClient = 64 * 1024;
+};
+
 template <typename T>
 class server_interface
 {
 public:
-    server_interface(uint16_t port) : m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
-    {}
+    // takeOverPath - hot restart: take the listening socket over from the server process serving this path
+    // (see EnableHotRestart) instead of binding the port. The port is bound when no process answers there.
+    server_interface(uint16_t port, const std::string& takeOverPath = {}) : m_asioAcceptor(m_asioContext)
+    {
+#if defined(NET_HAS_HOT_RESTART)
+        if (!takeOverPath.empty() && TakeOverListener(takeOverPath))
+            return;
+#endif
+        // Same as the acceptor constructor taking the endpoint.
+        asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+        m_asioAcceptor.open(endpoint.protocol());
+        m_asioAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        m_asioAcceptor.bind(endpoint);
+        m_asioAcceptor.listen();
+    }
     virtual ~server_interface() { Stop(); }
 
     bool Start()
@@ -24,8 +79,12 @@ public:
             // We should start waiting for a connection first.
             // Then we should start the thread context.
             // In other cases, the thread context may stop because there is no work to do.
-            WaitForClientConnection();
-            m_threadContext = std::thread([this]() { m_asioContext.run(); });
+            WaitForClientConnection(m_asioAcceptor);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+            if (m_localAcceptor)
+                WaitForClientConnection(*m_localAcceptor);
+#endif
+            m_threadContext = std::thread([this]() { run_io_context(m_asioContext, m_latency); });
         }
         catch (std::exception& e)
         {
@@ -46,50 +105,586 @@ public:
         if (m_threadContext.joinable())
             m_threadContext.join();
 
+        // The context is stopped, so the handshakes in progress never finish: give their sockets back now.
+        for (const auto& pPending : m_setHandshakes)
+        {
+            pPending->pTransport->Close();
+            if (m_memoryBudget)
+                m_memoryBudget->Release(pPending->nCharge);
+        }
+        m_setHandshakes.clear();
+
+        // Pending operations of in-process transports hold their connection and point to this context, which
+        // may be destroyed before the client side: close them while the context is still alive.
+        for (const auto& client : m_deqConnections)
+        {
+            if (client)
+                client->CloseNow();
+        }
+
+        // Nothing is sent or received anymore, so the capture is complete.
+        StopCapture();
+
+        if (m_pMetrics)
+            m_pMetrics->Stop();
+
         // Inform someone, anybody, if they care...
         MY_LOG(info, "[server_interface] Stopped!");
     }
+
+    // Enable the busy polling low latency mode (see latency_options). Must be called before Start.
+    void SetLatencyMode(const latency_options& options) { m_latency = options; }
+
+    // Settings for every connection accepted after this call (see connection_options).
+    void SetConnectionOptions(const connection_options<T>& options)
+    {
+        m_connectionOptions = options;
+        if (m_memoryBudget)
+            m_connectionOptions.sharedBudget = m_memoryBudget;
+        if (m_pCapture)
+            m_connectionOptions.capture = m_pCapture;
+    }
+
+    // Server wide memory cap: receive buffers, unhandled incoming messages and outgoing queues of all connections.
+    // Over the cap reads are paused and new connections are refused. Per connection budgets are set with
+    // SetConnectionOptions. Must be called before Start.
+    void SetMemoryLimit(size_t nBytes)
+    {
+        m_memoryBudget = std::make_shared<memory_budget>(nBytes);
+        m_connectionOptions.sharedBudget = m_memoryBudget;
+    }
+
+    // Bytes charged to the server wide budget. 0 if there is no limit.
+    size_t MemoryUsed() const { return m_memoryBudget ? m_memoryBudget->Used() : 0; }
+
+    // Traffic capture for load testing: every message sent or received, connects and disconnects are appended to
+    // the file with their time and client ID (see net_capture.h). net_replay plays the file back against a server.
+    // The file is written by a background thread. Must be called before Start.
+    bool StartCapture(const std::string& path)
+    {
+        auto pCapture = std::make_shared<capture_writer>();
+        if (!pCapture->Open(path, sizeof(message_header<T>)))
+        {
+            MY_LOG(error, "[server_interface] StartCapture HAS FAILED: can't open {}", path);
+            return false;
+        }
+
+        m_pCapture = pCapture;
+        m_connectionOptions.capture = pCapture;
+        MY_LOG(info, "[server_interface] Capturing traffic to {}", path);
+        return true;
+    }
+
+    // Write out the rest of the capture and close the file. May be called at any time.
+    void StopCapture()
+    {
+        if (!m_pCapture || !m_pCapture->Close())
+            return;
+
+        MY_LOG(
+            info, "[server_interface] Capture stopped: {} records, {} dropped", m_pCapture->RecordCount(),
+            m_pCapture->DroppedCount());
+    }
+
+    // Time messages wait in the incoming queue before Update handles them. Only messages of connections with
+    // timing enabled (connection_options::timestamps or clockSyncInterval) are counted.
+    const latency_histogram& UpdateDelay() const { return m_updateDelay; }
+
+    // HTTP endpoint for scrapers, served by the asio thread (see net_http.h). Must be called before Start.
+    //   /metrics     - server and per connection counters, queue depths and latencies in the Prometheus format.
+    //   /connections - the connection list as JSON.
+    // Everything it reads is either owned by the asio thread or atomic, so the message path takes no lock for it.
+    // The pages list the remote addresses and there is no authentication: see http_listener about the address.
+    bool StartMetrics(uint16_t port, const std::string& address = "127.0.0.1")
+    {
+        try
+        {
+            m_pMetrics = std::make_unique<http_listener>(
+                m_asioContext, port, [this](const std::string& path) { return HandleMetricsRequest(path); },
+                address);
+            m_pMetrics->Start();
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "[server_interface] StartMetrics HAS FAILED: {}", e.what());
+            m_pMetrics.reset();
+            return false;
+        }
+
+        MY_LOG(info, "[server_interface] Metrics endpoint on {}:{}", address, port);
+        return true;
+    }
+
+    // Link this server with other server processes (see net_federation.h): MessageAllClients and Publish reach
+    // their clients too, and theirs reach ours. Must be called before Start.
+    bool StartFederation(const federation_options& options)
+    {
+        if (options.nServerId == 0)
+        {
+            MY_LOG(error, "[server_interface] StartFederation HAS FAILED: server id 0 is reserved");
+            return false;
+        }
+        if (options.secret.empty())
+        {
+            MY_LOG(error, "[server_interface] StartFederation HAS FAILED: the secret is empty");
+            return false;
+        }
+
+        try
+        {
+            m_pFederation = std::make_unique<federation<T>>(m_asioContext, m_qMessagesIn, options);
+            m_pFederation->Start();
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "[server_interface] StartFederation HAS FAILED: {}", e.what());
+            m_pFederation.reset();
+            return false;
+        }
+
+        MY_LOG(
+            info, "[server_interface] Federation: server {}, port {}:{}, {} peers", options.nServerId,
+            options.listenAddress, options.nListenPort, options.peers.size());
+        return true;
+    }
+
+    // nullptr unless StartFederation has succeeded.
+    federation<T>* Federation() { return m_pFederation.get(); }
+
+    // Per address limits of new connections and the handshake failure blacklist. Must be called before Start.
+    // Only network clients have an address: local socket and in-process clients are not limited.
+    // Message floods of validated clients are limited per connection (connection_options::messageRateLimits).
+    void SetAcceptLimits(const accept_limit_options& options) { m_addressFilter.SetOptions(options); }
+
+    // Refuse new connections from the address for the given time. Thread safe.
+    void BlacklistAddress(const std::string& address, std::chrono::seconds duration)
+    {
+        asio::post(
+            m_asioContext,
+            [this, address, duration]()
+            {
+                MY_LOG(warn, "[server_interface] Address {} is blacklisted for {}", address, duration);
+                m_addressFilter.Block(address, address_filter::clock::now(), duration);
+            });
+    }
+
+    // Called by a connection whose client has failed the handshake (asio thread).
+    void ReportHandshakeFailure(const std::string& address)
+    {
+        if (address.empty())
+            return;
+        if (m_addressFilter.ReportFailure(address, address_filter::clock::now()))
+            MY_LOG(warn, "[server_interface] Address {} is blacklisted: too many failed handshakes", address);
+    }
+
+    // Enable the fixed rate tick mode. Must be called before Start. Then call Tick in a loop instead of Update.
+    // Messages sent to a client during a tick are not written immediately, they are packed into one
+    // aggregate frame at the end of the tick. So N chatty clients cost one write per client per tick,
+    // not one write per message.
+    void EnableTickMode(const tick_options& options)
+    {
+        m_tick = options;
+        if (!(m_tick.tickRate > 0.0) || !std::isfinite(m_tick.tickRate))
+        {
+            MY_LOG(
+                error, "[server_interface] EnableTickMode: tick rate {} is not positive, {} is used",
+                options.tickRate, tick_options().tickRate);
+            m_tick.tickRate = tick_options().tickRate;
+        }
+        m_bTickMode = true;
+    }
+
+    // One tick of the tick mode: handle incoming messages, flush one frame to every client
+    // and sleep until the next tick starts.
+    void Tick()
+    {
+        Update(m_tick.nMaxIncomingPerTick, false);
+        OnTick();
+
+        for (auto& client : m_deqConnections)
+        {
+            if (client && client->IsConnected())
+                client->FlushBatch();
+        }
+
+        // A late tick does not try to catch up, the schedule just starts over from now.
+        auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / m_tick.tickRate));
+        m_nextTick = std::max(m_nextTick + period, std::chrono::steady_clock::now());
+        std::this_thread::sleep_until(m_nextTick);
+    }
+
+#if defined(NET_HAS_TLS)
+    // Accept TLS instead of plain TCP on the port of the server (see net_tls.h). Must be called before Start.
+    // Local sockets and in-process connections stay plain, they never leave the host.
+    void SetTls(std::shared_ptr<tls_context> pTls) { m_pTls = std::move(pTls); }
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    // Also accept clients on a local (Unix domain) socket. Must be called before Start.
+    // Same host clients skip the loopback TCP stack this way.
+    bool ListenLocal(const std::string& path)
+    {
+        try
+        {
+            // A socket file left by a previous run would make bind fail.
+            RemoveStaleSocketFile(path);
+            m_localAcceptor.emplace(m_asioContext, asio::local::stream_protocol::endpoint(path));
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "[server_interface] ListenLocal exception: {}", e.what());
+            return false;
+        }
+
+        MY_LOG(info, "[server_interface] Listening on local socket {}", path);
+        return true;
+    }
+#endif
+
+#if defined(NET_HAS_HOT_RESTART)
+    // Hand the listening socket over to the next server process that asks for it on options.path
+    // (see net_hot_restart.h). Must be called before Start. Then loop until HotRestartDone and exit.
+    bool EnableHotRestart(const hot_restart_options& options)
+    {
+        try
+        {
+            // After a takeover the old process does not accept on the path any more, its socket file goes.
+            RemoveStaleSocketFile(options.path);
+            m_handoffAcceptor.emplace(m_asioContext, asio::local::stream_protocol::endpoint(options.path));
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "[server_interface] EnableHotRestart HAS FAILED: {}", e.what());
+            return false;
+        }
+
+        m_hotRestart = options;
+        WaitForHandoff();
+        MY_LOG(info, "[server_interface] Hot restart handoff on {}", options.path);
+        return true;
+    }
+
+    // Old process of a hot restart. Call it from the Update thread, with Tick or Update without waiting, as
+    // nothing wakes up a waiting Update. True once the listener is handed over and every client is gone, or
+    // drainTimeout has passed and the remaining clients have been flushed and disconnected (or flushTimeout has
+    // passed too). The process may exit then.
+    bool HotRestartDone()
+    {
+        if (!m_bHandedOver)
+            return false;
+
+        auto now = std::chrono::steady_clock::now();
+        if (m_drainDeadline == std::chrono::steady_clock::time_point{})
+            m_drainDeadline = now + m_hotRestart.drainTimeout;
+
+        bool bClientsLeft = std::any_of(
+            m_deqConnections.begin(), m_deqConnections.end(),
+            [](const auto& client) { return client && client->IsConnected(); });
+        if (!bClientsLeft)
+            return true;
+        if (now < m_drainDeadline)
+            return false;
+
+        if (!m_bDrainFlushing)
+        {
+            MY_LOG(info, "[server_interface] Drain timeout, disconnecting the remaining clients");
+            m_bDrainFlushing = true;
+            for (auto& client : m_deqConnections)
+            {
+                if (client && client->IsConnected())
+                    client->DisconnectWhenFlushed();
+            }
+        }
+        return now >= m_drainDeadline + m_hotRestart.flushTimeout;
+    }
+#endif
+
+    // Create an in-process connection to this server. The returned end of the pipe belongs to the caller
+    // and completes its operations on clientContext. Used by client_interface::ConnectInProcess.
+    std::unique_ptr<transport> ConnectInProcess(asio::io_context& clientContext)
+    {
+        auto [serverEnd, clientEnd] = make_memory_pipe(m_asioContext, clientContext);
+
+        // Connections are only touched from the asio thread, so hand the server end over to it.
+        asio::post(
+            m_asioContext,
+            [this, serverEnd = std::move(serverEnd)]() mutable { AcceptTransport(std::move(serverEnd)); });
+
+        return std::move(clientEnd);
+    }
 private:
     // ASYNC - Instruct ASIO to wait for connection.
-    void WaitForClientConnection()
+    template <typename Acceptor>
+    void WaitForClientConnection(Acceptor& acceptor)
     {
-        m_asioAcceptor.async_accept(
-            [this](std::error_code ec, asio::ip::tcp::socket socket)
+        using protocol_type = typename Acceptor::protocol_type;
+
+        acceptor.async_accept(
+            [this, &acceptor](std::error_code ec, typename protocol_type::socket socket)
             {
                 if (!ec)
                 {
-                    MY_LOG(
-                        info, "[server_interface] New Connection: {}", socket.remote_endpoint().address().to_string());
-
-                    // Create a new connection to handle this client and start waiting for more connections.
-                    // Server and client behave are different. That's why we need to specify the owner as server.
-                    // Use one queue for all connections(clients).
-                    std::shared_ptr<connection<T>> newconn = std::make_shared<connection<T>>(
-                        connection<T>::owner::server, m_asioContext, std::move(socket), m_qMessagesIn);
-
-                    if (OnClientConnect(newconn))
+#if defined(NET_HAS_TLS)
+                    if constexpr (std::is_same_v<protocol_type, asio::ip::tcp>)
                     {
-                        // Connection allowed, so add to container of new connections.
-                        m_deqConnections.push_back(std::move(newconn));
-                        m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
-
-                        MY_LOG(
-                            info, "[server_interface] Connection Approved. ID: {}", m_deqConnections.back()->GetID());
-                    }
-                    else
-                    {
-                        MY_LOG(info, "[server_interface] Connection Denied");
+                        if (m_pTls)
+                        {
+                            AcceptTransport(std::make_unique<tls_transport>(m_pTls, std::move(socket)), true);
+                            WaitForClientConnection(acceptor);
+                            return;
+                        }
                     }
+#endif
+                    AcceptTransport(std::make_unique<socket_transport<protocol_type>>(std::move(socket)));
                 }
                 else
                 {
+                    // Closed by the hot restart handoff.
+                    if (!acceptor.is_open())
+                        return;
                     MY_LOG(error, "[server_interface] New Connection Error: {}", ec.message());
                 }
 
                 // Prime the asio context with more work - again simply wait for another connection...
-                WaitForClientConnection();
+                WaitForClientConnection(acceptor);
             });
     }
+
+#if defined(NET_HAS_HOT_RESTART)
+    // New process of a hot restart: receive the listening socket of the old one. Blocking, called by the
+    // constructor.
+    bool TakeOverListener(const std::string& path)
+    {
+        int nDescriptor = -1;
+        try
+        {
+            asio::local::stream_protocol::socket handoff(m_asioContext);
+            handoff.connect(asio::local::stream_protocol::endpoint(path));
+
+            nDescriptor = ReceiveDescriptor(handoff.native_handle(), c_handoffTimeout);
+            if (nDescriptor < 0)
+            {
+                MY_LOG(error, "[server_interface] TakeOverListener HAS FAILED: {}", std::strerror(errno));
+                return false;
+            }
+            if (!IsListeningTcpSocket(nDescriptor))
+            {
+                MY_LOG(
+                    error, "[server_interface] TakeOverListener HAS FAILED: not a listening TCP socket: {}",
+                    std::strerror(errno));
+                ::close(nDescriptor);
+                return false;
+            }
+
+            sockaddr_storage address{};
+            socklen_t nLength = sizeof(address);
+            getsockname(nDescriptor, reinterpret_cast<sockaddr*>(&address), &nLength);
+            m_asioAcceptor.assign(
+                address.ss_family == AF_INET6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4(), nDescriptor);
+
+            // The old process closes its handoff acceptor before this connection. Wait for that, so that
+            // EnableHotRestart finds nobody accepting on the path and may bind it again.
+            char cData;
+            ssize_t nReceived;
+            do
+                nReceived = ::recv(handoff.native_handle(), &cData, 1, 0);
+            while (nReceived < 0 && errno == EINTR);
+        }
+        catch (std::exception& e)
+        {
+            // The acceptor does not own the descriptor unless assign succeeded, and it is the last step.
+            if (nDescriptor >= 0)
+            {
+                ::close(nDescriptor);
+                MY_LOG(error, "[server_interface] TakeOverListener HAS FAILED: {}", e.what());
+                return false;
+            }
+            // Nobody to take over from, e.g. the first start.
+            MY_LOG(info, "[server_interface] No listener to take over at {}: {}", path, e.what());
+            return false;
+        }
+
+        MY_LOG(info, "[server_interface] Took the listener over from {}", path);
+        return true;
+    }
+
+    // Old process of a hot restart: wait for the new one and give it the listening socket.
+    void WaitForHandoff()
+    {
+        m_handoffAcceptor->async_accept(
+            [this](std::error_code ec, asio::local::stream_protocol::socket handoff)
+            {
+                if (ec)
+                {
+                    if (ec != asio::error::operation_aborted)
+                        MY_LOG(error, "[server_interface] WaitForHandoff HAS FAILED: {}", ec.message());
+                    return;
+                }
+
+                if (!SendDescriptor(handoff.native_handle(), m_asioAcceptor.native_handle()))
+                {
+                    MY_LOG(error, "[server_interface] SendDescriptor HAS FAILED: {}", std::strerror(errno));
+                    WaitForHandoff();
+                    return;
+                }
+
+                // The new process accepts from now on. Its copy of the socket keeps the accept queue open,
+                // so clients connecting right now are not refused.
+                asio::error_code ignored;
+                m_asioAcceptor.close(ignored);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+                if (m_localAcceptor)
+                    m_localAcceptor->close(ignored);
+#endif
+                m_handoffAcceptor->close(ignored);
+                m_bHandedOver = true;
+
+                MY_LOG(
+                    info, "[server_interface] Listener handed over, draining for {} ms",
+                    m_hotRestart.drainTimeout.count());
+            });
+    }
+#endif
+
+    // Common part of accepting a client, whatever transport it came from.
+    // bHandshake - the transport is usable after AsyncConnect only (see tls_transport).
+    void AcceptTransport(std::unique_ptr<transport> pTransport, bool bHandshake = false)
+    {
+        MY_LOG(info, "[server_interface] New Connection: {}", pTransport->RemoteName());
+
+        // Blacklisted addresses and addresses that connect too often are dropped before anything is allocated.
+        // Transports without an address (see transport::RemoteAddress) are not filtered.
+        const std::string address = pTransport->RemoteAddress();
+        if (!address.empty() && !m_addressFilter.Accept(address, address_filter::clock::now()))
+        {
+            MY_LOG(
+                warn, "[server_interface] Connection Refused: {} is blacklisted or rate limited",
+                pTransport->RemoteName());
+            m_counters.nRefusedAddress++;
+            pTransport->Close();
+            return;
+        }
+
+        // Admission control: a new connection would take memory the server does not have. A handshake holds
+        // its memory before there is a connection, so it is charged until it ends.
+        size_t nCost = connection<T>::FixedMemoryCost(m_connectionOptions) + (bHandshake ? c_nHandshakeStateSize : 0);
+        if (m_memoryBudget && !(bHandshake ? m_memoryBudget->TryCharge(nCost) : m_memoryBudget->HasRoom(nCost)))
+        {
+            MY_LOG(
+                warn, "[server_interface] Connection Refused: memory limit {} bytes is reached",
+                m_memoryBudget->Limit());
+            m_counters.nRefusedMemory++;
+            pTransport->Close();
+            return;
+        }
+
+        // The checks above go first, so a refused client costs no handshake.
+        if (bHandshake)
+        {
+            auto pPending = std::make_shared<pending_handshake>(
+                std::move(pTransport), asio::steady_timer(m_asioContext, c_handshakeTimeout), nCost);
+            pPending->remoteName = pPending->pTransport->RemoteName();
+            m_setHandshakes.insert(pPending);
+
+            // A client that connects and says nothing would hold the socket and the TLS state forever.
+            pPending->deadline.async_wait(
+                [pPending](std::error_code ec)
+                {
+                    if (ec || !pPending->pTransport)
+                        return;
+                    pPending->bTimedOut = true;
+                    pPending->pTransport->Close();
+                });
+
+            pPending->pTransport->AsyncConnect(
+                [this, pPending](std::error_code ec)
+                {
+                    pPending->deadline.cancel();
+                    // Not in the set: Stop has closed it already.
+                    if (!m_setHandshakes.erase(pPending))
+                        return;
+                    if (m_memoryBudget)
+                        m_memoryBudget->Release(pPending->nCharge);
+
+                    if (ec)
+                    {
+                        MY_LOG(
+                            warn, "[server_interface] Handshake with {} HAS FAILED: {}", pPending->remoteName,
+                            pPending->bTimedOut ? std::string("timed out") : ec.message());
+                        pPending->pTransport->Close();
+                        return;
+                    }
+                    AdmitTransport(std::move(pPending->pTransport));
+                });
+            return;
+        }
+
+        AdmitTransport(std::move(pTransport));
+    }
+
+    // Create the connection of an accepted transport that passed the checks.
+    void AdmitTransport(std::unique_ptr<transport> pTransport)
+    {
+        // Create a new connection to handle this client and start waiting for more connections.
+        // Server and client behave are different. That's why we need to specify the owner as server.
+        // Use one queue for all connections(clients).
+        std::shared_ptr<connection<T>> newconn = std::make_shared<connection<T>>(
+            connection<T>::owner::server, m_asioContext, std::move(pTransport), m_qMessagesIn, m_connectionOptions);
+
+        if (m_bTickMode)
+            newconn->EnableBatching(m_tick.nMaxMessagesPerClient, m_tick.nMaxBytesPerClient);
+
+        if (OnClientConnect(newconn))
+        {
+            // Connection allowed, so add to container of new connections.
+            m_deqConnections.push_back(std::move(newconn));
+            m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
+
+            MY_LOG(info, "[server_interface] Connection Approved. ID: {}", m_deqConnections.back()->GetID());
+            m_counters.nAccepted++;
+            if (m_pMetrics)
+                m_vecMonitored.push_back(m_deqConnections.back());
+        }
+        else
+        {
+            MY_LOG(info, "[server_interface] Connection Denied");
+            m_counters.nDenied++;
+        }
+    }
+
+    // Runs on the asio thread. m_deqConnections belongs to the Update thread, so the endpoint keeps its own
+    // weak list of the connections and forgets the closed ones here.
+    http_response HandleMetricsRequest(const std::string& path)
+    {
+        std::vector<std::shared_ptr<connection<T>>> vecConnections;
+        std::erase_if(
+            m_vecMonitored,
+            [&vecConnections](const std::weak_ptr<connection<T>>& weak)
+            {
+                auto pConnection = weak.lock();
+                if (!pConnection || !pConnection->IsConnected())
+                    return true;
+                vecConnections.push_back(std::move(pConnection));
+                return false;
+            });
+
+        if (path == "/metrics")
+        {
+            server_metrics metrics;
+            metrics.pCounters = &m_counters;
+            metrics.nIncomingQueue = m_qMessagesIn.approx_count();
+            metrics.nPendingHandshakes = m_setHandshakes.size();
+            metrics.nMemoryUsed = MemoryUsed();
+            metrics.nMemoryLimit = m_memoryBudget ? m_memoryBudget->Limit() : 0;
+            metrics.pUpdateDelay = &m_updateDelay;
+            return {200, "text/plain; version=0.0.4; charset=utf-8", PrometheusMetrics<T>(metrics, vecConnections)};
+        }
+        if (path == "/connections")
+            return {200, "application/json", JsonConnections<T>(vecConnections)};
+
+        return {404, "text/plain; charset=utf-8", "Not found. Try /metrics or /connections\n"};
+    }
 public:
     // Send a message to a specific client.
     void MessageClient(std::shared_ptr<connection<T>> client, const message<T>& msg)
@@ -101,26 +696,27 @@ public:
         else
         {
             // If we couldn't communicate with the client then we may as well remove the client - it's dead.
-            OnClientDisconnect(client);
-            client.reset();
-
-            // Then remove the dead client connection from the container.
-            // In case of huge number of clients, we should use a more efficient data structure.
-            m_deqConnections.erase(
-                std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+            RemoveClient(client);
         }
     }
 
-    // Send a message to all clients.
+    // Send a message to all clients, those of the federated servers included.
     void MessageAllClients(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
     {
         MY_LOG(
             info, "[server_interface::MessageAllClients] Sending message: ID {}, Size {}", msg.header.id,
             msg.header.size);
 
-        // Optimization: This flag helps us to remove dead connections once we finish sending messages.
-        bool bInvalidClientExists = false;
-
+        MessageLocalClients(std::make_shared<const message<T>>(msg), pIgnoreClient);
+        if (m_pFederation)
+            m_pFederation->Forward(federation_item::broadcast, 0, msg);
+    }
+private:
+    // Send a message to the clients of this process. The message is shared by all their queues.
+    void MessageLocalClients(shared_message<T> pMsg, const std::shared_ptr<connection<T>>& pIgnoreClient)
+    {
+        // Dead clients are removed after the loop, as the removal changes the container.
+        std::vector<std::shared_ptr<connection<T>>> vecDeadClients;
         for (auto& client : m_deqConnections)
         {
             // Check if the client is still connected.
@@ -128,33 +724,174 @@ public:
             {
                 // If the client is not the one we are ignoring, send the message.
                 if (client != pIgnoreClient)
-                    client->Send(msg);
+                    client->Send(pMsg);
             }
             else
             {
                 // If we couldn't communicate with the client then we may as well remove the client - it's dead.
-                OnClientDisconnect(client);
-                client.reset();
-                bInvalidClientExists = true;
+                vecDeadClients.push_back(client);
             }
         }
 
-        // Remove the dead client connections from the container. We should use a more efficient data structure anyway.
-        if (bInvalidClientExists)
+        if (!vecDeadClients.empty())
         {
-            m_deqConnections.erase(
-                std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+            for (auto& client : vecDeadClients)
+                RemoveClient(client);
             MY_LOG(info, "[server_interface] Cleaned up dead connections");
         }
     }
+public:
+
+    // Topics (rooms). Subscribe, Unsubscribe and Publish must be called from the thread calling Update,
+    // as the other methods that touch the connections.
+
+    // Add the client to the topic. Subscribing twice is a no-op.
+    void Subscribe(std::shared_ptr<connection<T>> client, topic_id topic)
+    {
+        auto& vecTopics = m_mapClientTopics[client->GetID()];
+        if (std::find(vecTopics.begin(), vecTopics.end(), topic) != vecTopics.end())
+            return;
+
+        vecTopics.push_back(topic);
+        m_mapTopicMembers[topic].push_back(std::move(client));
+    }
 
+    // Remove the client from the topic.
+    void Unsubscribe(std::shared_ptr<connection<T>> client, topic_id topic)
+    {
+        auto itClient = m_mapClientTopics.find(client->GetID());
+        if (itClient == m_mapClientTopics.end())
+            return;
+
+        auto& vecTopics = itClient->second;
+        auto itTopic = std::find(vecTopics.begin(), vecTopics.end(), topic);
+        if (itTopic == vecTopics.end())
+            return;
+
+        // Order does not matter, so remove by swapping with the last element.
+        *itTopic = vecTopics.back();
+        vecTopics.pop_back();
+        if (vecTopics.empty())
+            m_mapClientTopics.erase(itClient);
+
+        RemoveTopicMember(topic, client);
+    }
+
+    // Remove the client from all its topics. Called automatically for dead clients.
+    void UnsubscribeAll(std::shared_ptr<connection<T>> client)
+    {
+        auto itClient = m_mapClientTopics.find(client->GetID());
+        if (itClient == m_mapClientTopics.end())
+            return;
+
+        for (topic_id topic : itClient->second)
+            RemoveTopicMember(topic, client);
+
+        m_mapClientTopics.erase(itClient);
+    }
+
+    // Send a message to the members of the topic only, those on the federated servers included.
+    // The message is encoded once, every member's queue shares the same frame.
+    void Publish(topic_id topic, const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+    {
+        // The topic may have members on the other servers only.
+        if (m_pFederation)
+            m_pFederation->Forward(federation_item::publish, topic, msg);
+
+        auto itTopic = m_mapTopicMembers.find(topic);
+        if (itTopic == m_mapTopicMembers.end())
+            return;
+
+        MY_LOG(
+            debug, "[server_interface::Publish] Topic {}, Members {}, ID {}, Size {}", topic, itTopic->second.size(),
+            msg.header.id, msg.header.size);
+
+        PublishLocal(topic, std::make_shared<const message<T>>(msg), pIgnoreClient);
+    }
+
+    // Number of clients subscribed to the topic.
+    size_t TopicSize(topic_id topic) const
+    {
+        auto itTopic = m_mapTopicMembers.find(topic);
+        return itTopic == m_mapTopicMembers.end() ? 0 : itTopic->second.size();
+    }
+private:
+    // Send a message to the members of the topic in this process.
+    void PublishLocal(topic_id topic, shared_message<T> pMsg, const std::shared_ptr<connection<T>>& pIgnoreClient)
+    {
+        auto itTopic = m_mapTopicMembers.find(topic);
+        if (itTopic == m_mapTopicMembers.end())
+            return;
+
+        // Dead members are removed after the loop, as the removal changes the member list.
+        std::vector<std::shared_ptr<connection<T>>> vecDeadClients;
+        for (auto& client : itTopic->second)
+        {
+            if (client->IsConnected())
+            {
+                if (client != pIgnoreClient)
+                    client->Send(pMsg);
+            }
+            else
+            {
+                vecDeadClients.push_back(client);
+            }
+        }
+
+        for (auto& client : vecDeadClients)
+            RemoveClient(client);
+    }
+
+    // A message forwarded by a federated server goes to the local clients only, the federation relays it.
+    void DeliverFederated(uint16_t type, uint32_t topic, const message<T>& msg)
+    {
+        auto pMsg = std::make_shared<const message<T>>(msg);
+        if (type == federation_item::broadcast)
+            MessageLocalClients(std::move(pMsg), nullptr);
+        else if (type == federation_item::publish)
+            PublishLocal(topic, std::move(pMsg), nullptr);
+    }
+    // Forget the dead client: notify the user, drop its topics and the connection.
+    void RemoveClient(std::shared_ptr<connection<T>> client)
+    {
+        OnClientDisconnect(client);
+        if (client)
+        {
+            UnsubscribeAll(client);
+            if (m_pCapture)
+                m_pCapture->Write(capture_event::disconnect, client->GetID());
+        }
+
+        // In case of huge number of clients, we should use a more efficient data structure.
+        m_deqConnections.erase(
+            std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+    }
+
+    void RemoveTopicMember(topic_id topic, const std::shared_ptr<connection<T>>& client)
+    {
+        auto itTopic = m_mapTopicMembers.find(topic);
+        if (itTopic == m_mapTopicMembers.end())
+            return;
+
+        auto& vecMembers = itTopic->second;
+        auto itMember = std::find(vecMembers.begin(), vecMembers.end(), client);
+        if (itMember != vecMembers.end())
+        {
+            *itMember = std::move(vecMembers.back());
+            vecMembers.pop_back();
+        }
+
+        if (vecMembers.empty())
+            m_mapTopicMembers.erase(itTopic);
+    }
+public:
     // It is allowed to user decide when is the most appropriate time to actually handle incoming messages.
     // nMaxMessages = -1 means "process all messages". This flag is used to restrict the number of messages to process
     // to prevent the server from being overwhelmed.
     void Update(size_t nMaxMessages = -1, bool bWait = false)
     {
         if (bWait)
-            m_qMessagesIn.wait();
+            WaitForMessages();
 
         size_t nMessageCount = 0;
         while (nMessageCount < nMaxMessages && !m_qMessagesIn.empty())
@@ -162,12 +899,50 @@ public:
             // Grab the front message.
             auto msg = m_qMessagesIn.pop_front();
 
-            // Handle the message.
-            OnMessage(msg.remote, msg.msg);
+            // OnMessage may change the message, so its charge is taken before.
+            size_t nCost = connection<T>::MessageCost(msg.msg);
+
+            if (msg.nReceivedNs != 0)
+                m_updateDelay.Record(SteadyNowNs() - msg.nReceivedNs);
+
+            // Handle the message. Frames of the federation links never reach the user.
+            if (msg.remote && msg.remote->IsServerLink())
+            {
+                if (m_pFederation)
+                {
+                    m_pFederation->Receive(
+                        msg.remote, msg.msg, [this](uint16_t type, uint32_t topic, const message<T>& forwarded)
+                        { DeliverFederated(type, topic, forwarded); });
+                }
+            }
+            else
+            {
+                OnMessage(msg.remote, msg.msg);
+            }
+
+            // Give its memory back to the connection, paused reads may go on.
+            if (msg.remote)
+                msg.remote->ReleaseIncoming(nCost);
 
             nMessageCount++;
         }
     }
+private:
+    void WaitForMessages()
+    {
+        if (!m_latency.enabled)
+        {
+            m_qMessagesIn.wait();
+            return;
+        }
+
+        // The consumer thread is pinned on the first call, as it is not known before.
+        if (m_latency.updateCore >= 0 && !m_bUpdateThreadPinned)
+            m_bUpdateThreadPinned = pin_current_thread(m_latency.updateCore);
+
+        spin_backoff backoff(m_latency);
+        m_qMessagesIn.wait_spin([&backoff]() { backoff.Pause(); });
+    }
 protected:
     // Called when a client connects, you can veto the connection by returning false.
     // Other words this function is a filter of clients (connections) by IP address, etc.
@@ -182,23 +957,96 @@ protected:
 
     // Called when a message arrives.
     virtual void OnMessage(std::shared_ptr<connection<T>> client, message<T>& msg) {}
+
+    // Called by Tick after the incoming messages, before the batches are flushed. Messages sent here go out
+    // in the frame of this tick, e.g. the state each client sees (see interest_manager).
+    virtual void OnTick() {}
 public:
     // This is called when a client is validated. This means that the client has been authenticated.
     // Despite the OnClientConnect function, this function is called after the client has been validated.
     virtual void OnClientValidated(std::shared_ptr<connection<T>> client) {}
 protected:
+    // Order of declaration is important - it is also the order of initialization.
+    // Connections (and messages which point to them) hold sockets, so they must be destroyed before the context.
+    asio::io_context m_asioContext;
+    std::thread m_threadContext;
+
+    // Sockets hides into the asio details. We will only have a listener socket.
+    asio::ip::tcp::acceptor m_asioAcceptor;
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    // Optional listener for same host clients.
+    std::optional<asio::local::stream_protocol::acceptor> m_localAcceptor;
+#endif
+#if defined(NET_HAS_TLS)
+    // TLS on the TCP port, see SetTls.
+    std::shared_ptr<tls_context> m_pTls;
+#endif
+
+    // An accepted transport in its handshake (see AcceptTransport). Not a connection yet.
+    struct pending_handshake
+    {
+        std::unique_ptr<transport> pTransport;
+        asio::steady_timer deadline;
+        // Charged to the memory budget until the handshake ends.
+        size_t nCharge = 0;
+        std::string remoteName;
+        bool bTimedOut = false;
+    };
+    static constexpr std::chrono::seconds c_handshakeTimeout{10};
+    // OpenSSL state of a connection in its handshake, roughly: the SSL object and its record buffers.
+    static constexpr size_t c_nHandshakeStateSize = 48 * 1024;
+    // Handshakes in progress. Touched from the asio thread only, and by Stop once the context is stopped.
+    std::unordered_set<std::shared_ptr<pending_handshake>> m_setHandshakes;
+
     // Thread safe queue for incoming message packets.
     thread_safe_queue<owned_message<T>> m_qMessagesIn;
 
     // Container of active validated connections.
     std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
 
-    // Order of declaration is important - it is also the order of initialization.
-    asio::io_context m_asioContext;
-    std::thread m_threadContext;
+    // Publish-subscribe routing: members of each topic and topics of each client (by client ID).
+    // Member lists are plain vectors, so Publish walks contiguous memory.
+    std::unordered_map<topic_id, std::vector<std::shared_ptr<connection<T>>>> m_mapTopicMembers;
+    std::unordered_map<uint32_t, std::vector<topic_id>> m_mapClientTopics;
 
-    // Sockets hides into the asio details. We will only have a listener socket.
-    asio::ip::tcp::acceptor m_asioAcceptor;
+    // Low latency mode settings.
+    latency_options m_latency;
+    bool m_bUpdateThreadPinned = false;
+
+    // Settings of new connections.
+    connection_options<T> m_connectionOptions;
+    // Server wide memory cap (see SetMemoryLimit). Shared with connections, so it outlives them.
+    std::shared_ptr<memory_budget> m_memoryBudget;
+    // Accept limits and blacklist per remote address. Touched from the asio thread only.
+    address_filter m_addressFilter;
+    // Traffic capture (see StartCapture). Shared with connections.
+    std::shared_ptr<capture_writer> m_pCapture;
+    // Receive to OnMessage delay (see UpdateDelay).
+    latency_histogram m_updateDelay;
+
+    // Metrics endpoint (see StartMetrics) and what it reports. Touched from the asio thread only.
+    std::unique_ptr<http_listener> m_pMetrics;
+    std::vector<std::weak_ptr<connection<T>>> m_vecMonitored;
+    server_counters m_counters;
+
+    // Links to the other servers (see StartFederation). Holds connections, so it goes after the context.
+    std::unique_ptr<federation<T>> m_pFederation;
+
+#if defined(NET_HAS_HOT_RESTART)
+    // Hot restart (see EnableHotRestart). The handoff runs on the asio thread, HotRestartDone on the Update
+    // thread, m_bHandedOver is what they share.
+    static constexpr std::chrono::seconds c_handoffTimeout{5};
+    hot_restart_options m_hotRestart;
+    std::optional<asio::local::stream_protocol::acceptor> m_handoffAcceptor;
+    std::atomic<bool> m_bHandedOver = false;
+    std::chrono::steady_clock::time_point m_drainDeadline;
+    bool m_bDrainFlushing = false;
+#endif
+
+    // Tick mode settings.
+    tick_options m_tick;
+    bool m_bTickMode = false;
+    std::chrono::steady_clock::time_point m_nextTick;
 
     // Clients will be identified in the system via an ID.
     // This number will be send to clients. This is more secure than sending the IP address.
@@ -0,0 +1,466 @@
+#pragma once
+#include "net_connection.h"
+#include "net_latency.h"
+#include "net_message.h"
+#include "net_thread_safe_queue.h"
+#include "net_transport.h"
+#include <algorithm>
+#include <asio.hpp>
+#include <asio/ip/tcp.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <my_cpp_utils/logger.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace net
+{
+
+// Client side sharding: keys are spread over several servers by a consistent hash ring, without a proxy in
+// between. Every server owns many points (virtual nodes) of a 64-bit ring, a key belongs to the server of the
+// first point at or after its hash. Adding or removing a server moves only the keys of its own points, about
+// 1/N of them, and every client with the same server names routes a key the same way.
+
+// Finalizer of splitmix64. Spreads keys that differ in a few bits over the whole ring.
+inline uint64_t ShardMix(uint64_t nValue)
+{
+    nValue ^= nValue >> 30;
+    nValue *= 0xbf58476d1ce4e5b9ull;
+    nValue ^= nValue >> 27;
+    nValue *= 0x94d049bb133111ebull;
+    nValue ^= nValue >> 31;
+    return nValue;
+}
+
+// Position of a key on the ring. Stable across processes and platforms, unlike std::hash.
+inline uint64_t ShardHash(uint64_t nKey) { return ShardMix(nKey); }
+
+// FNV-1a, mixed.
+inline uint64_t ShardHash(std::string_view key)
+{
+    uint64_t nHash = 0xcbf29ce484222325ull;
+    for (char c : key)
+    {
+        nHash ^= static_cast<uint8_t>(c);
+        nHash *= 0x100000001b3ull;
+    }
+    return ShardMix(nHash);
+}
+
+// Consistent hash ring of node ids. Not thread safe.
+class hash_ring
+{
+public:
+    static constexpr uint32_t c_nNoNode = uint32_t(-1);
+
+    explicit hash_ring(size_t nVirtualNodes = 160) : m_nVirtualNodes(std::max<size_t>(nVirtualNodes, 1)) {}
+
+    // The points of a node depend on its name only, so use the same names on every client.
+    void Add(std::string_view name, uint32_t nNode)
+    {
+        std::string point(name);
+        point.push_back('#');
+        const size_t nPrefix = point.size();
+        for (size_t i = 0; i < m_nVirtualNodes; ++i)
+        {
+            point.resize(nPrefix);
+            point += std::to_string(i);
+            m_vecPoints.push_back({ShardHash(point), nNode});
+        }
+        std::sort(m_vecPoints.begin(), m_vecPoints.end());
+    }
+
+    void Remove(uint32_t nNode)
+    {
+        std::erase_if(m_vecPoints, [nNode](const point& p) { return p.nNode == nNode; });
+    }
+
+    // Node owning the key hash, c_nNoNode if the ring is empty.
+    uint32_t Find(uint64_t nKeyHash) const
+    {
+        return Find(nKeyHash, [](uint32_t) { return true; });
+    }
+
+    // First node from the owner of the key hash on, clockwise, that accept(node) takes. c_nNoNode if none.
+    template <typename Accept>
+    uint32_t Find(uint64_t nKeyHash, Accept&& accept) const
+    {
+        if (m_vecPoints.empty())
+            return c_nNoNode;
+
+        auto it = std::lower_bound(m_vecPoints.begin(), m_vecPoints.end(), point{nKeyHash, 0});
+        size_t nStart = it == m_vecPoints.end() ? 0 : size_t(it - m_vecPoints.begin());
+        uint32_t nRejected = c_nNoNode;
+        for (size_t i = 0; i < m_vecPoints.size(); ++i)
+        {
+            uint32_t nNode = m_vecPoints[(nStart + i) % m_vecPoints.size()].nNode;
+            // Points of one node are scattered, so only the last rejected one is remembered.
+            if (nNode == nRejected)
+                continue;
+            if (accept(nNode))
+                return nNode;
+            nRejected = nNode;
+        }
+        return c_nNoNode;
+    }
+
+    bool IsEmpty() const { return m_vecPoints.empty(); }
+private:
+    struct point
+    {
+        uint64_t nHash;
+        uint32_t nNode;
+
+        auto operator<=>(const point&) const = default;
+    };
+
+    size_t m_nVirtualNodes;
+    // Sorted by hash.
+    std::vector<point> m_vecPoints;
+};
+
+struct shard_options
+{
+    // Points per server. More points - more even spread, a bigger ring to search.
+    size_t nVirtualNodes = 160;
+    // When the owner of a key is not connected, send to the next connected server of the ring instead of
+    // dropping the message. Off by default, as the other server does not have the state of the key.
+    bool failover = false;
+    // A server that is not connected is dialed again after reconnectInterval. The delay doubles with every
+    // failed dial up to maxReconnectInterval and starts over once the server is connected. 0 - never redial.
+    std::chrono::milliseconds reconnectInterval{1000};
+    std::chrono::milliseconds maxReconnectInterval{30000};
+};
+
+// Client connected to a set of servers at once (see hash_ring above). Send(key, msg) goes to the server owning
+// the key, the messages of all servers arrive in one incoming queue, tagged with their connection.
+// All methods may be called from any thread.
+template <typename T>
+class sharded_client
+{
+public:
+    // Makes the transport of a dial. The transport must use Context().
+    using transport_factory = std::function<std::unique_ptr<transport>()>;
+
+    explicit sharded_client(shard_options options = {})
+      : m_options(options), m_workGuard(asio::make_work_guard(m_context)), m_checkTimer(m_context),
+        m_ring(options.nVirtualNodes)
+    {}
+
+    virtual ~sharded_client() { Close(); }
+
+    // Add a server under a name, which places it on the ring. The name must be unique and the same on every
+    // client, e.g. "host:port". Returns false if the name is taken or the connection could not be created.
+    // The host is resolved once, redials use the same addresses.
+    bool AddServer(const std::string& name, const std::string& host, const uint16_t port)
+    {
+        try
+        {
+            asio::ip::tcp::resolver resolver(m_context);
+            auto results = resolver.resolve(host, std::to_string(port));
+            std::vector<asio::ip::tcp::endpoint> endpoints(results.begin(), results.end());
+
+            return AddServer(
+                name,
+                transport_factory(
+                    [this, endpoints = std::move(endpoints)]()
+                    { return std::make_unique<tcp_transport>(asio::ip::tcp::socket(m_context), endpoints); }));
+        }
+        catch (std::exception& e)
+        {
+            MY_LOG(error, "[sharded_client] AddServer HAS FAILED: {}", e.what());
+            return false;
+        }
+    }
+
+    // Add a server whose transports are made by makeTransport, once now and once for every redial.
+    bool AddServer(const std::string& name, transport_factory makeTransport)
+    {
+        auto pTransport = makeTransport();
+        return AddShard(name, std::move(pTransport), std::move(makeTransport));
+    }
+
+    // Add a server reached by an already created transport. The transport must use Context(). A transport is
+    // dialed once: this server is not redialed, use the transport_factory overload for that.
+    bool AddServer(const std::string& name, std::unique_ptr<transport> pTransport)
+    {
+        return AddShard(name, std::move(pTransport), nullptr);
+    }
+
+    // Disconnect a server and take it off the ring. Its keys move to the servers next to its points.
+    bool RemoveServer(const std::string& name)
+    {
+        std::shared_ptr<connection<T>> pConnection;
+        {
+            std::scoped_lock lock(m_muxShards);
+            auto itNode = m_mapNodes.find(name);
+            if (itNode == m_mapNodes.end())
+                return false;
+
+            m_ring.Remove(itNode->second);
+            pConnection = std::move(m_mapShards[itNode->second].pConnection);
+            m_mapShards.erase(itNode->second);
+            m_mapNodes.erase(itNode);
+        }
+        pConnection->Disconnect();
+        return true;
+    }
+
+    // Dial a server that is not connected right away, without waiting for its redial. Returns false if there is
+    // no such server, it is connected, or it was added with a transport and cannot be dialed again.
+    bool Reconnect(const std::string& name)
+    {
+        std::scoped_lock lock(m_muxShards);
+        auto itNode = m_mapNodes.find(name);
+        if (itNode == m_mapNodes.end())
+            return false;
+
+        shard& s = m_mapShards.at(itNode->second);
+        if (s.pConnection->IsConnected() || !s.makeTransport)
+            return false;
+        s.backoff = m_options.reconnectInterval;
+        Dial(s);
+        return true;
+    }
+
+    // Send a message to the server owning the key. Returns false if it was dropped: no server, or the owner
+    // is not connected and there is no failover.
+    bool Send(uint64_t nKey, const message<T>& msg) { return SendHashed(ShardHash(nKey), msg); }
+    bool Send(std::string_view key, const message<T>& msg) { return SendHashed(ShardHash(key), msg); }
+
+    // Send a message to every connected server.
+    void SendAll(const message<T>& msg)
+    {
+        auto pMsg = std::make_shared<const message<T>>(msg);
+        std::scoped_lock lock(m_muxShards);
+        for (auto& [nNode, s] : m_mapShards)
+        {
+            if (s.pConnection->IsConnected())
+                s.pConnection->Send(pMsg);
+        }
+    }
+
+    // Name of the server owning the key, empty if there is none.
+    std::string ServerOf(std::string_view key) const
+    {
+        std::scoped_lock lock(m_muxShards);
+        uint32_t nNode = m_ring.Find(ShardHash(key));
+        return nNode == hash_ring::c_nNoNode ? std::string() : m_mapShards.at(nNode).name;
+    }
+
+    // Name of the server of a received message (owned_message::remote).
+    std::string ServerName(const connection<T>* pConnection) const
+    {
+        std::scoped_lock lock(m_muxShards);
+        for (const auto& [nNode, s] : m_mapShards)
+        {
+            if (s.pConnection.get() == pConnection)
+                return s.name;
+        }
+        return {};
+    }
+
+    // Connected servers out of all added ones.
+    std::pair<size_t, size_t> ConnectedCount() const
+    {
+        std::scoped_lock lock(m_muxShards);
+        size_t nConnected = std::count_if(
+            m_mapShards.begin(), m_mapShards.end(),
+            [](const auto& item) { return item.second.pConnection->IsConnected(); });
+        return {nConnected, m_mapShards.size()};
+    }
+
+    // Disconnect from all servers and stop the context thread. The client cannot be used afterwards.
+    void Close()
+    {
+        {
+            std::scoped_lock lock(m_muxShards);
+            m_bClosed = true;
+            for (auto& [nNode, s] : m_mapShards)
+                s.pConnection->Disconnect();
+        }
+
+        m_workGuard.reset();
+        m_context.stop();
+        if (m_thrContext.joinable())
+            m_thrContext.join();
+
+        // The context is stopped, so no handler can touch the connections anymore.
+        std::scoped_lock lock(m_muxShards);
+        m_mapShards.clear();
+        m_mapNodes.clear();
+        m_ring = hash_ring(m_options.nVirtualNodes);
+    }
+
+    // Must be called before the first AddServer (see client_interface).
+    void SetLatencyMode(const latency_options& options) { m_latency = options; }
+    // Settings of the connections added after the call.
+    void SetConnectionOptions(const connection_options<T>& options) { m_connectionOptions = options; }
+
+    // Messages of all servers. owned_message::remote is the connection they came from.
+    thread_safe_queue<owned_message<T>>& Incoming() { return m_qMessagesIn; }
+
+    // Pass up to nMaxMessages incoming messages to OnMessage. Use either it or Incoming, not both.
+    size_t Update(size_t nMaxMessages = -1)
+    {
+        size_t nHandled = 0;
+        while (nHandled < nMaxMessages && !m_qMessagesIn.empty())
+        {
+            auto msg = m_qMessagesIn.pop_front();
+            OnMessage(msg.remote, msg.msg);
+            nHandled++;
+        }
+        return nHandled;
+    }
+
+    asio::io_context& Context() { return m_context; }
+protected:
+    // Called by Update for every message, with the connection of the server that sent it.
+    virtual void OnMessage(std::shared_ptr<connection<T>> server, message<T>& msg) {}
+private:
+    struct shard
+    {
+        std::string name;
+        std::shared_ptr<connection<T>> pConnection;
+        // Empty if the server cannot be redialed.
+        transport_factory makeTransport;
+        // Delay of the next redial, and the time it is due.
+        std::chrono::milliseconds backoff{0};
+        std::chrono::steady_clock::time_point nextDial;
+    };
+
+    bool AddShard(const std::string& name, std::unique_ptr<transport> pTransport, transport_factory makeTransport)
+    {
+        std::scoped_lock lock(m_muxShards);
+        if (m_mapNodes.contains(name))
+        {
+            MY_LOG(error, "[sharded_client] AddServer HAS FAILED: {} is added already", name);
+            return false;
+        }
+
+        shard s{name, nullptr, std::move(makeTransport)};
+        s.backoff = m_options.reconnectInterval;
+        Dial(s, std::move(pTransport));
+
+        uint32_t nNode = m_nNextNode++;
+        m_mapShards.emplace(nNode, std::move(s));
+        m_mapNodes.emplace(name, nNode);
+        m_ring.Add(name, nNode);
+
+        // The context thread starts with the first server, so SetLatencyMode still applies.
+        if (!m_thrContext.joinable())
+        {
+            if (m_options.reconnectInterval.count() > 0)
+                ScheduleCheck();
+            m_thrContext = std::thread([this]() { run_io_context(m_context, m_latency); });
+        }
+        return true;
+    }
+
+    // Replace the connection of a server by a new one and dial it. m_muxShards is locked.
+    void Dial(shard& s, std::unique_ptr<transport> pTransport = nullptr)
+    {
+        if (!pTransport)
+            pTransport = s.makeTransport();
+
+        connection_options<T> options = m_connectionOptions;
+        options.tagIncoming = true;
+        s.pConnection = std::make_shared<connection<T>>(
+            connection<T>::owner::client, m_context, std::move(pTransport), m_qMessagesIn, std::move(options));
+        s.pConnection->ConnectToServer();
+        s.nextDial = std::chrono::steady_clock::now() + s.backoff;
+    }
+
+    // Redial the servers that are not connected and are due.
+    void CheckShards()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::scoped_lock lock(m_muxShards);
+        if (m_bClosed)
+            return;
+        for (auto& [nNode, s] : m_mapShards)
+        {
+            if (s.pConnection->IsConnected())
+            {
+                s.backoff = m_options.reconnectInterval;
+                continue;
+            }
+            if (!s.makeTransport || now < s.nextDial)
+                continue;
+
+            s.backoff = std::min(s.backoff * 2, std::max(m_options.maxReconnectInterval, m_options.reconnectInterval));
+            MY_LOG(warn, "[sharded_client] Server {} is not connected, dialing it again", s.name);
+            try
+            {
+                Dial(s);
+            }
+            catch (std::exception& e)
+            {
+                s.nextDial = now + s.backoff;
+                MY_LOG(error, "[sharded_client] Dial of {} HAS FAILED: {}", s.name, e.what());
+            }
+        }
+        ScheduleCheck();
+    }
+
+    void ScheduleCheck()
+    {
+        m_checkTimer.expires_after(m_options.reconnectInterval);
+        m_checkTimer.async_wait(
+            [this](std::error_code ec)
+            {
+                if (!ec)
+                    CheckShards();
+            });
+    }
+
+    bool SendHashed(uint64_t nKeyHash, const message<T>& msg)
+    {
+        std::shared_ptr<connection<T>> pConnection;
+        {
+            std::scoped_lock lock(m_muxShards);
+            uint32_t nNode = m_ring.Find(
+                nKeyHash,
+                [this](uint32_t nCandidate)
+                { return !m_options.failover || m_mapShards.at(nCandidate).pConnection->IsConnected(); });
+            if (nNode == hash_ring::c_nNoNode)
+                return false;
+            pConnection = m_mapShards.at(nNode).pConnection;
+        }
+
+        if (!pConnection->IsConnected())
+            return false;
+        pConnection->Send(msg);
+        return true;
+    }
+
+    shard_options m_options;
+    // Declared before the context, as the connections reference it until the context is gone.
+    thread_safe_queue<owned_message<T>> m_qMessagesIn;
+    asio::io_context m_context;
+    // Keeps the context running while there is no server.
+    asio::executor_work_guard<asio::io_context::executor_type> m_workGuard;
+    std::thread m_thrContext;
+    // Asio thread: period of CheckShards.
+    asio::steady_timer m_checkTimer;
+    latency_options m_latency;
+    connection_options<T> m_connectionOptions;
+
+    // Guards the ring and the shard maps, not the connections themselves.
+    mutable std::mutex m_muxShards;
+    hash_ring m_ring;
+    // Name to node id, and node id to its server.
+    std::map<std::string, uint32_t, std::less<>> m_mapNodes;
+    std::map<uint32_t, shard> m_mapShards;
+    uint32_t m_nNextNode = 0;
+    // Close was called, no more redials.
+    bool m_bClosed = false;
+};
+
+} // namespace net
@@ -0,0 +1,450 @@
+#pragma once
+#include "net_message.h"
+#include "net_thread_safe_queue.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <my_cpp_utils/logger.h>
+#include <span>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace net
+{
+
+#if defined(__linux__)
+
+namespace detail
+{
+// Process shared futex (no FUTEX_PRIVATE_FLAG), the word lives in a file mapped by two processes.
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::milliseconds timeout)
+{
+    timespec ts{};
+    ts.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+    ts.tv_nsec = static_cast<long>((timeout.count() % 1000) * 1000000);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>& word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+} // namespace detail
+
+// Control block of one ring direction. It lives inside the mapped file, so only lock free atomics are allowed.
+// Producer and consumer fields are on different cache lines to avoid false sharing.
+struct shm_ring_control
+{
+    // Total bytes published by the producer. Written by the producer only.
+    alignas(64) std::atomic<uint64_t> head;
+    // Total bytes released by the consumer. Written by the consumer only.
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set by the consumer before it sleeps on readerWakeups. The producer only makes a syscall if it is set.
+    alignas(64) std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint32_t> readerWakeups;
+    // Same for a producer waiting for free space.
+    alignas(64) std::atomic<uint32_t> writerWaiting;
+    std::atomic<uint32_t> writerWakeups;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory ring requires lock free atomics");
+
+// Single producer, single consumer byte ring over shared memory.
+// Each record is [uint32 size][uint32 kind][payload], padded to 8 bytes. A record never wraps:
+// if it does not fit before the end of the buffer, a padding record fills the rest and it starts from zero.
+class shm_ring
+{
+public:
+    shm_ring() = default;
+    shm_ring(shm_ring_control* control, uint8_t* data, uint64_t capacity)
+      : m_control(control), m_data(data), m_capacity(capacity)
+    {}
+
+    // Largest payload that can be written.
+    uint64_t MaxPayload() const { return m_capacity / 2 - sizeof(record_header); }
+
+    // Producer side. Payload is written in two parts (header and body) to avoid an intermediate buffer.
+    // Returns false if there is not enough free space right now.
+    bool TryWrite(const void* pPart1, size_t nPart1, const void* pPart2, size_t nPart2)
+    {
+        uint64_t payload = nPart1 + nPart2;
+        uint64_t need = Align(sizeof(record_header) + payload);
+        uint64_t head = m_control->head.load(std::memory_order_relaxed);
+        uint64_t tail = m_control->tail.load(std::memory_order_acquire);
+        uint64_t free = m_capacity - (head - tail);
+        uint64_t offset = head % m_capacity;
+        uint64_t contiguous = m_capacity - offset;
+
+        if (contiguous < need)
+        {
+            if (free < contiguous + need)
+            {
+                m_nBlockedTail = tail;
+                return false;
+            }
+
+            // Not enough room before the end of the buffer. Skip to the beginning.
+            record_header padding{static_cast<uint32_t>(contiguous), record_kind::padding};
+            std::memcpy(m_data + offset, &padding, sizeof(padding));
+            head += contiguous;
+            offset = 0;
+        }
+        else if (free < need)
+        {
+            m_nBlockedTail = tail;
+            return false;
+        }
+
+        record_header record{static_cast<uint32_t>(payload), record_kind::frame};
+        std::memcpy(m_data + offset, &record, sizeof(record));
+        std::memcpy(m_data + offset + sizeof(record), pPart1, nPart1);
+        if (nPart2 > 0)
+            std::memcpy(m_data + offset + sizeof(record) + nPart1, pPart2, nPart2);
+
+        // Publish. seq_cst pairs with the consumer setting readerWaiting before it checks head for the last time.
+        m_control->head.store(head + need, std::memory_order_seq_cst);
+        if (m_control->readerWaiting.load(std::memory_order_seq_cst) && m_control->readerWaiting.exchange(0))
+        {
+            m_control->readerWakeups.fetch_add(1);
+            detail::futex_wake(m_control->readerWakeups);
+        }
+        return true;
+    }
+
+    // Consumer side. Calls handler(const uint8_t* payload, size_t size) with a pointer into the shared memory.
+    // The memory is released after the handler returns, so the handler must not keep the pointer.
+    // Returns false if the ring is empty.
+    template <typename Handler>
+    bool TryRead(Handler&& handler)
+    {
+        uint64_t tail = m_control->tail.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            uint64_t head = m_control->head.load(std::memory_order_acquire);
+            if (tail == head)
+                return false;
+
+            uint64_t offset = tail % m_capacity;
+            record_header record;
+            std::memcpy(&record, m_data + offset, sizeof(record));
+
+            if (record.kind == record_kind::padding)
+            {
+                tail += record.size;
+                m_control->tail.store(tail, std::memory_order_release);
+                continue;
+            }
+
+            handler(static_cast<const uint8_t*>(m_data + offset + sizeof(record)), static_cast<size_t>(record.size));
+
+            m_control->tail.store(tail + Align(sizeof(record) + record.size), std::memory_order_seq_cst);
+            if (m_control->writerWaiting.load(std::memory_order_seq_cst) && m_control->writerWaiting.exchange(0))
+            {
+                m_control->writerWakeups.fetch_add(1);
+                detail::futex_wake(m_control->writerWakeups);
+            }
+            return true;
+        }
+    }
+
+    bool Empty() const
+    {
+        return m_control->head.load(std::memory_order_acquire) == m_control->tail.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side. Spin for a while, then sleep on the futex until the producer publishes something.
+    void WaitReadable(size_t nSpins, std::chrono::milliseconds timeout)
+    {
+        for (size_t i = 0; i < nSpins; ++i)
+        {
+            if (!Empty())
+                return;
+        }
+
+        uint32_t wakeups = m_control->readerWakeups.load();
+        m_control->readerWaiting.store(1, std::memory_order_seq_cst);
+        if (Empty())
+            detail::futex_wait(m_control->readerWakeups, wakeups, timeout);
+        m_control->readerWaiting.store(0, std::memory_order_relaxed);
+    }
+
+    // Producer side. After a failed TryWrite, sleep until the consumer releases some space (or timeout).
+    void WaitWritable(std::chrono::milliseconds timeout)
+    {
+        uint32_t wakeups = m_control->writerWakeups.load();
+        m_control->writerWaiting.store(1, std::memory_order_seq_cst);
+        if (m_control->tail.load(std::memory_order_seq_cst) == m_nBlockedTail)
+            detail::futex_wait(m_control->writerWakeups, wakeups, timeout);
+        m_control->writerWaiting.store(0, std::memory_order_relaxed);
+    }
+
+    static uint64_t Align(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+private:
+    enum record_kind : uint32_t
+    {
+        frame = 0,
+        padding = 1,
+    };
+
+    struct record_header
+    {
+        uint32_t size;
+        uint32_t kind;
+    };
+
+    shm_ring_control* m_control = nullptr;
+    uint8_t* m_data = nullptr;
+    uint64_t m_capacity = 0;
+    // Consumer position seen by the last failed TryWrite. Producer side only.
+    uint64_t m_nBlockedTail = 0;
+};
+
+// Two processes on the same host exchanging message<T> frames through a memory mapped file.
+// The file holds two rings, one per direction. The API follows client_interface: Send, Incoming, IsConnected.
+// For the lowest latency use Poll instead of Incoming: it hands out the body straight from the shared memory.
+// Each ring has one producer and one consumer per process: Send may be called from any thread, the calls are
+// serialized by a mutex. Poll and Wait must be called from one thread.
+template <typename T>
+class shm_channel
+{
+public:
+    shm_channel() = default;
+    shm_channel(const shm_channel&) = delete;
+    virtual ~shm_channel() { Disconnect(); }
+
+    // Create the shared file (e.g. "/dev/shm/feed") with two rings of nCapacity bytes each.
+    // bStartReceiver = false means the user calls Poll and Incoming() is not fed.
+    bool Create(const std::string& path, uint64_t nCapacity = 4 * 1024 * 1024, bool bStartReceiver = true)
+    {
+        nCapacity = shm_ring::Align(nCapacity);
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+        {
+            MY_LOG(error, "[shm_channel] Cannot create {}: {}", path, std::strerror(errno));
+            return false;
+        }
+
+        size_t nFileSize = sizeof(file_header) + 2 * nCapacity;
+        if (::ftruncate(fd, static_cast<off_t>(nFileSize)) != 0 || !Map(fd, nFileSize))
+        {
+            MY_LOG(error, "[shm_channel] Cannot map {}: {}", path, std::strerror(errno));
+            ::close(fd);
+            return false;
+        }
+
+        // The file is zero filled by ftruncate, so the atomics start at zero.
+        m_pFile->capacity = nCapacity;
+        m_pFile->magic.store(c_nMagic, std::memory_order_release);
+
+        m_bCreator = true;
+        m_path = path;
+        SetupRings();
+        if (bStartReceiver)
+            StartReceiver();
+
+        MY_LOG(info, "[shm_channel] Created {}, ring capacity {}", path, nCapacity);
+        return true;
+    }
+
+    // Attach to a file created by the other process.
+    bool Open(const std::string& path, bool bStartReceiver = true)
+    {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0)
+        {
+            MY_LOG(error, "[shm_channel] Cannot open {}: {}", path, std::strerror(errno));
+            return false;
+        }
+
+        off_t nFileSize = ::lseek(fd, 0, SEEK_END);
+        if (nFileSize < static_cast<off_t>(sizeof(file_header)) || !Map(fd, static_cast<size_t>(nFileSize)))
+        {
+            MY_LOG(error, "[shm_channel] Cannot map {}", path);
+            ::close(fd);
+            return false;
+        }
+
+        if (m_pFile->magic.load(std::memory_order_acquire) != c_nMagic ||
+            sizeof(file_header) + 2 * m_pFile->capacity != static_cast<uint64_t>(nFileSize))
+        {
+            MY_LOG(error, "[shm_channel] {} is not a shared channel file", path);
+            Unmap();
+            return false;
+        }
+
+        m_bCreator = false;
+        m_path = path;
+        SetupRings();
+        if (bStartReceiver)
+            StartReceiver();
+
+        MY_LOG(info, "[shm_channel] Opened {}", path);
+        return true;
+    }
+
+    void Disconnect()
+    {
+        if (!m_pFile)
+            return;
+
+        m_pFile->closed.store(1);
+        m_bStop = true;
+        if (m_threadReceiver.joinable())
+            m_threadReceiver.join();
+
+        Unmap();
+
+        // The creator owns the file.
+        if (m_bCreator)
+            ::unlink(m_path.c_str());
+    }
+
+    bool IsConnected() const { return m_pFile && !m_pFile->closed.load(std::memory_order_relaxed); }
+
+    // Write the frame into the ring. Spins, then sleeps, while the ring is full. Thread safe.
+    bool Send(const message<T>& msg)
+    {
+        if (!IsConnected())
+            return false;
+
+        if (sizeof(message_header<T>) + msg.body.size() > m_out.MaxPayload())
+        {
+            MY_LOG(error, "[shm_channel] Message too big for the ring: {}", msg.body.size());
+            return false;
+        }
+
+        // The ring has a single producer, so concurrent senders take turns.
+        std::scoped_lock lock(m_muxSend);
+        while (!m_out.TryWrite(&msg.header, sizeof(message_header<T>), msg.body.data(), msg.body.size()))
+        {
+            if (!IsConnected())
+                return false;
+            m_out.WaitWritable(c_waitTimeout);
+        }
+        return true;
+    }
+
+    // Zero copy receive. Calls handler(const message_header<T>&, std::span<const uint8_t> body) for each frame,
+    // the body points into the shared memory and is valid only during the call.
+    // Use only when the channel was created/opened with bStartReceiver = false.
+    template <typename Handler>
+    size_t Poll(Handler&& handler, size_t nMaxFrames = -1)
+    {
+        auto onPayload = [&handler](const uint8_t* pPayload, size_t nSize)
+        {
+            message_header<T> header;
+            std::memcpy(&header, pPayload, sizeof(header));
+            handler(header, std::span<const uint8_t>(pPayload + sizeof(header), nSize - sizeof(header)));
+        };
+
+        size_t nFrames = 0;
+        while (nFrames < nMaxFrames && m_in.TryRead(onPayload))
+            nFrames++;
+        return nFrames;
+    }
+
+    // Wait until Poll has something to return. Spins first, sleeps on the futex after that.
+    void Wait(size_t nSpins = 10000) { m_in.WaitReadable(nSpins, c_waitTimeout); }
+
+    // Retrieve queue of messages from the other side (filled by the receiver thread).
+    thread_safe_queue<owned_message<T>>& Incoming() { return m_qMessagesIn; }
+private:
+    struct file_header
+    {
+        std::atomic<uint64_t> magic;
+        uint64_t capacity;
+        std::atomic<uint32_t> closed;
+        alignas(64) shm_ring_control rings[2];
+    };
+
+    bool Map(int fd, size_t nSize)
+    {
+        void* p = ::mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        m_pFile = static_cast<file_header*>(p);
+        m_nMappedSize = nSize;
+        return true;
+    }
+
+    void Unmap()
+    {
+        ::munmap(m_pFile, m_nMappedSize);
+        m_pFile = nullptr;
+        m_nMappedSize = 0;
+    }
+
+    void SetupRings()
+    {
+        uint8_t* pData = reinterpret_cast<uint8_t*>(m_pFile) + sizeof(file_header);
+        uint64_t nCapacity = m_pFile->capacity;
+
+        // Ring 0 goes from the creator to the opener, ring 1 goes back.
+        shm_ring ring0(&m_pFile->rings[0], pData, nCapacity);
+        shm_ring ring1(&m_pFile->rings[1], pData + nCapacity, nCapacity);
+        m_out = m_bCreator ? ring0 : ring1;
+        m_in = m_bCreator ? ring1 : ring0;
+    }
+
+    void StartReceiver()
+    {
+        m_bStop = false;
+        m_threadReceiver = std::thread(
+            [this]()
+            {
+                while (!m_bStop)
+                {
+                    bool bRead = m_in.TryRead(
+                        [this](const uint8_t* pPayload, size_t nSize)
+                        {
+                            owned_message<T> msg;
+                            std::memcpy(&msg.msg.header, pPayload, sizeof(message_header<T>));
+                            msg.msg.body.assign(pPayload + sizeof(message_header<T>), pPayload + nSize);
+                            m_qMessagesIn.push_back(msg);
+                        });
+
+                    if (!bRead)
+                        m_in.WaitReadable(10000, c_waitTimeout);
+                }
+            });
+    }
+private:
+    static constexpr uint64_t c_nMagic = 0x314D48535F54454E; // "NET_SHM1"
+    // Sleeps are bounded, so a closed peer or Disconnect is noticed even without a wakeup.
+    static constexpr std::chrono::milliseconds c_waitTimeout{50};
+
+    file_header* m_pFile = nullptr;
+    size_t m_nMappedSize = 0;
+    bool m_bCreator = false;
+    std::string m_path;
+
+    shm_ring m_out;
+    shm_ring m_in;
+    // Serializes the writers of m_out.
+    std::mutex m_muxSend;
+
+    std::atomic<bool> m_bStop = false;
+    std::thread m_threadReceiver;
+
+    // This is thread safe queue of incoming messages from the other side.
+    thread_safe_queue<owned_message<T>> m_qMessagesIn;
+};
+
+#endif // __linux__
+
+} // namespace net
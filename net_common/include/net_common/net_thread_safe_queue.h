@@ -1,4 +1,7 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <mutex>
 
@@ -26,22 +29,35 @@ public:
 
     void push_back(const T& item)
     {
-        std::scoped_lock lock(muxQueue);
-        deqQueue.emplace_back(std::move(item));
+        {
+            std::scoped_lock lock(muxQueue);
+            deqQueue.emplace_back(std::move(item));
+            nItems.store(deqQueue.size(), std::memory_order_relaxed);
+        }
 
-        // Notify any threads waiting on data.
-        std::scoped_lock lockBlocking(muxBlocking);
-        cvBlocking.notify_one();
+        NotifyWaiters();
+    }
+
+    void push_back(T&& item)
+    {
+        {
+            std::scoped_lock lock(muxQueue);
+            deqQueue.emplace_back(std::move(item));
+            nItems.store(deqQueue.size(), std::memory_order_relaxed);
+        }
+
+        NotifyWaiters();
     }
 
     void push_front(const T& item)
     {
-        std::scoped_lock lock(muxQueue);
-        deqQueue.emplace_front(std::move(item));
+        {
+            std::scoped_lock lock(muxQueue);
+            deqQueue.emplace_front(std::move(item));
+            nItems.store(deqQueue.size(), std::memory_order_relaxed);
+        }
 
-        // Notify any threads waiting on data.
-        std::scoped_lock lockBlocking(muxBlocking);
-        cvBlocking.notify_one();
+        NotifyWaiters();
     }
 
     bool empty()
@@ -56,10 +72,14 @@ public:
         return deqQueue.size();
     }
 
+    // Size without the lock, for monitoring. May be a moment behind the producers.
+    size_t approx_count() const { return nItems.load(std::memory_order_relaxed); }
+
     void clear()
     {
         std::scoped_lock lock(muxQueue);
         deqQueue.clear();
+        nItems.store(0, std::memory_order_relaxed);
     }
 
     T pop_front()
@@ -67,25 +87,61 @@ public:
         std::scoped_lock lock(muxQueue);
         auto t = std::move(deqQueue.front());
         deqQueue.pop_front();
+        nItems.store(deqQueue.size(), std::memory_order_relaxed);
         return t;
     }
 
+    // Move up to nMaxItems items from the front to the back of out under one lock. Returns how many were moved.
+    template <typename Container>
+    size_t pop_front_n(Container& out, size_t nMaxItems)
+    {
+        std::scoped_lock lock(muxQueue);
+        size_t nItemsMoved = std::min(nMaxItems, deqQueue.size());
+        for (size_t i = 0; i < nItemsMoved; ++i)
+        {
+            out.push_back(std::move(deqQueue.front()));
+            deqQueue.pop_front();
+        }
+        nItems.store(deqQueue.size(), std::memory_order_relaxed);
+        return nItemsMoved;
+    }
+
     T pop_back()
     {
         std::scoped_lock lock(muxQueue);
         auto t = std::move(deqQueue.back());
         deqQueue.pop_back();
+        nItems.store(deqQueue.size(), std::memory_order_relaxed);
         return t;
     }
 
-    // Wait until the queue is not empty, then pop the front item.
+    // Wait until the queue is not empty.
     void wait()
     {
+        std::unique_lock<std::mutex> lock(muxBlocking);
+        nWaiters.fetch_add(1);
         while (empty())
-        {
-            std::unique_lock<std::mutex> lock(muxBlocking);
             cvBlocking.wait(lock);
-        }
+        nWaiters.fetch_sub(1);
+    }
+
+    // Wait until the queue is not empty without the condition variable. Calls pause() on every empty check.
+    // Checks are lock free, so a spinning consumer does not slow down the producers.
+    template <typename Pause>
+    void wait_spin(Pause&& pause)
+    {
+        while (nItems.load(std::memory_order_acquire) == 0)
+            pause();
+    }
+private:
+    // Wake up threads blocked in wait(). Nobody waits in the common case, so skip the lock then.
+    void NotifyWaiters()
+    {
+        if (nWaiters.load() == 0)
+            return;
+
+        std::scoped_lock lockBlocking(muxBlocking);
+        cvBlocking.notify_one();
     }
 protected:
     // Mutex to protect the double-ended queue.
@@ -96,5 +152,9 @@ protected:
     std::condition_variable cvBlocking;
     // Mutex to protect the condition variable.
     std::mutex muxBlocking;
+    // Number of threads blocked in wait().
+    std::atomic<int> nWaiters = 0;
+    // Copy of deqQueue.size() which can be read without the lock.
+    std::atomic<size_t> nItems = 0;
 };
 } // namespace net
\ No newline at end of file
@@ -0,0 +1,168 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace net
+{
+
+// Nanoseconds of the steady clock. Timestamps on the wire use it, as it never jumps.
+// Steady clocks of two hosts have unrelated epochs, so a remote timestamp only means something after
+// the clock offset is known (see clock_sync).
+inline int64_t SteadyNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Log-linear latency histogram: 8 buckets per power of two, so a percentile is within 12.5% of the real value.
+// Record is lock free and may race with readers on other threads.
+class latency_histogram
+{
+public:
+    void Record(int64_t nValueNs)
+    {
+        uint64_t nValue = nValueNs > 0 ? uint64_t(nValueNs) : 0;
+        m_buckets[BucketIndex(nValue)].fetch_add(1, std::memory_order_relaxed);
+        m_nCount.fetch_add(1, std::memory_order_relaxed);
+        m_nSum.fetch_add(nValue, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const { return m_nCount.load(std::memory_order_relaxed); }
+    uint64_t SumNs() const { return m_nSum.load(std::memory_order_relaxed); }
+
+    int64_t MeanNs() const
+    {
+        uint64_t nCount = Count();
+        return nCount ? int64_t(m_nSum.load(std::memory_order_relaxed) / nCount) : 0;
+    }
+
+    // Lower bound of the bucket that holds the p-th fraction of the values (p in [0, 1]).
+    int64_t PercentileNs(double p) const
+    {
+        uint64_t nCount = Count();
+        if (nCount == 0)
+            return 0;
+
+        auto nRank = static_cast<uint64_t>(p * double(nCount - 1)) + 1;
+        uint64_t nSeen = 0;
+        for (size_t i = 0; i < c_nBuckets; ++i)
+        {
+            nSeen += m_buckets[i].load(std::memory_order_relaxed);
+            if (nSeen >= nRank)
+                return int64_t(BucketLowerBound(i));
+        }
+        return int64_t(BucketLowerBound(c_nBuckets - 1));
+    }
+private:
+    static constexpr size_t c_nSubBits = 3;
+    static constexpr size_t c_nSubBuckets = size_t(1) << c_nSubBits;
+    // Values up to 2^42 ns (more than an hour) have their own buckets, larger ones share the last one.
+    static constexpr size_t c_nMaxExponent = 42;
+    static constexpr size_t c_nBuckets = (c_nMaxExponent - c_nSubBits + 2) * c_nSubBuckets;
+
+    static size_t BucketIndex(uint64_t nValue)
+    {
+        if (nValue < c_nSubBuckets)
+            return size_t(nValue);
+
+        auto nExponent = static_cast<size_t>(std::bit_width(nValue) - 1);
+        if (nExponent > c_nMaxExponent)
+            return c_nBuckets - 1;
+
+        size_t nSub = size_t(nValue >> (nExponent - c_nSubBits)) & (c_nSubBuckets - 1);
+        return (nExponent - c_nSubBits + 1) * c_nSubBuckets + nSub;
+    }
+
+    static uint64_t BucketLowerBound(size_t nIndex)
+    {
+        if (nIndex < c_nSubBuckets)
+            return nIndex;
+
+        size_t nExponent = nIndex / c_nSubBuckets + c_nSubBits - 1;
+        size_t nSub = nIndex % c_nSubBuckets;
+        return uint64_t(c_nSubBuckets + nSub) << (nExponent - c_nSubBits);
+    }
+
+    std::array<std::atomic<uint64_t>, c_nBuckets> m_buckets{};
+    std::atomic<uint64_t> m_nCount = 0;
+    std::atomic<uint64_t> m_nSum = 0;
+};
+
+// NTP style estimate of the remote clock. For one round trip:
+//   t0 - local send, t1 - remote receive, t2 - remote send, t3 - local receive
+//   offset = ((t1 - t0) + (t2 - t3)) / 2   (remote clock - local clock)
+//   delay  = (t3 - t0) - (t2 - t1)         (network round trip without the remote processing)
+// The offset is exact when both directions take the same time. Queueing makes samples asymmetric, so the
+// sample with the smallest delay out of the last few is trusted, as NTP does.
+// Written by the asio thread, readable from any thread.
+class clock_sync
+{
+public:
+    void AddSample(int64_t t0, int64_t t1, int64_t t2, int64_t t3)
+    {
+        int64_t nDelay = (t3 - t0) - (t2 - t1);
+        if (nDelay < 0)
+            return;
+
+        m_samples[m_nNext++ % c_nSamples] = {((t1 - t0) + (t2 - t3)) / 2, nDelay};
+
+        sample best{0, std::numeric_limits<int64_t>::max()};
+        for (const auto& s : m_samples)
+        {
+            if (s.nDelay >= 0 && s.nDelay < best.nDelay)
+                best = s;
+        }
+
+        m_nOffsetNs.store(best.nOffset, std::memory_order_relaxed);
+        m_nRoundTripNs.store(best.nDelay, std::memory_order_relaxed);
+        m_bValid.store(true, std::memory_order_release);
+    }
+
+    // The remote side has estimated the offset of our clock: ours is the same with the opposite sign.
+    void SetFromRemote(int64_t nRemoteOffsetNs, int64_t nRoundTripNs)
+    {
+        m_nOffsetNs.store(-nRemoteOffsetNs, std::memory_order_relaxed);
+        m_nRoundTripNs.store(nRoundTripNs, std::memory_order_relaxed);
+        m_bValid.store(true, std::memory_order_release);
+    }
+
+    bool IsValid() const { return m_bValid.load(std::memory_order_acquire); }
+    int64_t OffsetNs() const { return m_nOffsetNs.load(std::memory_order_relaxed); }
+    int64_t RoundTripNs() const { return m_nRoundTripNs.load(std::memory_order_relaxed); }
+
+    // Remote steady clock time converted to the local steady clock.
+    int64_t ToLocalNs(int64_t nRemoteNs) const { return nRemoteNs - OffsetNs(); }
+private:
+    static constexpr size_t c_nSamples = 8;
+
+    struct sample
+    {
+        int64_t nOffset = 0;
+        int64_t nDelay = -1; // -1 - empty slot.
+    };
+
+    std::array<sample, c_nSamples> m_samples{};
+    size_t m_nNext = 0;
+    std::atomic<int64_t> m_nOffsetNs = 0;
+    std::atomic<int64_t> m_nRoundTripNs = 0;
+    std::atomic<bool> m_bValid = false;
+};
+
+// Timing of one connection (see connection_options::timestamps and clockSyncInterval).
+struct connection_timing
+{
+    clock_sync clock;
+    // Remote send (frame timestamp, offset corrected) to local receive: network and kernel buffers.
+    latency_histogram oneWayIn;
+    // Time an outgoing frame waited in the connection queue for the transport.
+    latency_histogram queueOut;
+    // Round trips of the clock sync heartbeat.
+    latency_histogram roundTrip;
+};
+
+} // namespace net
@@ -0,0 +1,568 @@
+#pragma once
+#include "net_transport.h"
+#include <asio.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/ssl.hpp>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <my_cpp_utils/logger.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <span>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace net
+{
+
+// TLS over TCP. Compiled only with NET_USE_TLS, as it needs OpenSSL.
+//
+// The SSL context is an asio::ssl::context, but the transport does not use asio::ssl::stream: the stream
+// encrypts into a memory BIO and writes the result itself, which rules kernel TLS out. Here OpenSSL works on
+// the socket directly, non-blocking, and asio only waits for the socket to become readable or writable.
+// When the kernel takes over the record encryption (kTLS), writes go to the socket as they are.
+
+struct tls_options
+{
+    // Server: certificate chain and private key. PEM text, or the file when the text is empty.
+    std::string certificatePem;
+    std::string certificateFile;
+    std::string privateKeyPem;
+    std::string privateKeyFile;
+
+    // Client: CA certificates the server certificate must chain to. PEM text, or the file when the text is
+    // empty, or the system ones when both are empty.
+    std::string caPem;
+    std::string caFile;
+    // Client: verify the server certificate and its host name. Turn it off for tests only.
+    bool verifyPeer = true;
+
+    // Server: issue session tickets. Client: keep the tickets and resume with them, which skips the certificate
+    // exchange and the key agreement of a full handshake.
+    bool sessionTickets = true;
+
+    // Kernel TLS (Linux, OpenSSL 3 built with kTLS, "tls" kernel module). Used when the cipher allows it,
+    // see tls_transport::IsKtlsSend.
+    bool ktls = false;
+};
+
+// Self signed certificate and its key, PEM. For tests and benchmarks.
+struct tls_identity
+{
+    std::string certificatePem;
+    std::string privateKeyPem;
+};
+
+inline tls_identity MakeSelfSignedIdentity(const std::string& commonName)
+{
+    tls_identity identity;
+
+    EVP_PKEY* pKey = EVP_EC_gen("P-256");
+    X509* pCert = X509_new();
+    if (!pKey || !pCert)
+    {
+        EVP_PKEY_free(pKey);
+        X509_free(pCert);
+        throw std::bad_alloc();
+    }
+
+    ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(pCert), 365L * 24 * 3600);
+    X509_set_pubkey(pCert, pKey);
+    X509_NAME* pName = X509_get_subject_name(pCert);
+    X509_NAME_add_entry_by_txt(
+        pName, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>(commonName.c_str()), -1, -1, 0);
+    X509_set_issuer_name(pCert, pName);
+    X509_sign(pCert, pKey, EVP_sha256());
+
+    auto toString = [](BIO* pBio)
+    {
+        char* pData = nullptr;
+        long nLength = BIO_get_mem_data(pBio, &pData);
+        std::string text(pData, static_cast<size_t>(nLength));
+        BIO_free(pBio);
+        return text;
+    };
+    BIO* pCertBio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(pCertBio, pCert);
+    identity.certificatePem = toString(pCertBio);
+    BIO* pKeyBio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PrivateKey(pKeyBio, pKey, nullptr, nullptr, 0, nullptr, nullptr);
+    identity.privateKeyPem = toString(pKeyBio);
+
+    X509_free(pCert);
+    EVP_PKEY_free(pKey);
+    return identity;
+}
+
+// SSL context shared by the connections of a server or of a client. Throws asio::system_error if a certificate
+// or a key can't be loaded. Client contexts also keep the last session of every server, for resumption.
+class tls_context
+{
+public:
+    enum class role
+    {
+        server,
+        client
+    };
+
+    tls_context(role r, const tls_options& options)
+      : m_role(r), m_options(options),
+        m_context(r == role::server ? asio::ssl::context::tls_server : asio::ssl::context::tls_client)
+    {
+        SSL_CTX* pContext = m_context.native_handle();
+        SSL_CTX_set_min_proto_version(pContext, TLS1_2_VERSION);
+        // Writes of the connection are retried with the same buffer, but without the modes OpenSSL insists on
+        // the same address, and it writes the whole buffer before it returns.
+        SSL_CTX_set_mode(pContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+        // A peer closing without close_notify is an ordinary end of stream, as for a plain socket.
+        SSL_CTX_set_options(pContext, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+        if (options.ktls)
+        {
+#if defined(SSL_OP_ENABLE_KTLS)
+            SSL_CTX_set_options(pContext, SSL_OP_ENABLE_KTLS);
+#else
+            MY_LOG(warn, "[tls_context] kTLS is not supported by this OpenSSL build");
+#endif
+        }
+
+        if (r == role::server)
+        {
+            if (!options.certificatePem.empty())
+                m_context.use_certificate_chain(asio::buffer(options.certificatePem));
+            else
+                m_context.use_certificate_chain_file(options.certificateFile);
+            if (!options.privateKeyPem.empty())
+                m_context.use_private_key(asio::buffer(options.privateKeyPem), asio::ssl::context::pem);
+            else
+                m_context.use_private_key_file(options.privateKeyFile, asio::ssl::context::pem);
+
+            static const unsigned char c_sessionContext[] = "net_common";
+            SSL_CTX_set_session_id_context(pContext, c_sessionContext, sizeof(c_sessionContext) - 1);
+            if (!options.sessionTickets)
+            {
+                SSL_CTX_set_options(pContext, SSL_OP_NO_TICKET);
+                SSL_CTX_set_num_tickets(pContext, 0);
+            }
+        }
+        else
+        {
+            if (options.verifyPeer)
+            {
+                m_context.set_verify_mode(asio::ssl::verify_peer);
+                if (!options.caPem.empty())
+                    m_context.add_certificate_authority(asio::buffer(options.caPem));
+                else if (!options.caFile.empty())
+                    m_context.load_verify_file(options.caFile);
+                else
+                    m_context.set_default_verify_paths();
+            }
+            else
+            {
+                m_context.set_verify_mode(asio::ssl::verify_none);
+            }
+
+            if (options.sessionTickets)
+            {
+                // OpenSSL hands every new session to OnNewSession, its own cache is not used.
+                SSL_CTX_set_session_cache_mode(pContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+                SSL_CTX_set_ex_data(pContext, ContextIndex(), this);
+                SSL_CTX_sess_set_new_cb(pContext, &tls_context::OnNewSession);
+            }
+        }
+    }
+
+    tls_context(const tls_context&) = delete;
+    tls_context& operator=(const tls_context&) = delete;
+
+    ~tls_context()
+    {
+        for (auto& [key, pSession] : m_mapSessions)
+            SSL_SESSION_free(pSession);
+    }
+
+    role Role() const { return m_role; }
+    const tls_options& Options() const { return m_options; }
+    asio::ssl::context& Native() { return m_context; }
+
+    // Client: make the connection resume the last session with the server, if there is one.
+    void ResumeSession(SSL* pSsl, const std::string& key)
+    {
+        std::scoped_lock lock(m_muxSessions);
+        auto it = m_mapSessions.find(key);
+        if (it != m_mapSessions.end())
+            SSL_set_session(pSsl, it->second);
+    }
+
+    // Index of the session key of an SSL object (see tls_transport).
+    static int SessionKeyIndex()
+    {
+        static const int nIndex = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return nIndex;
+    }
+private:
+    static int ContextIndex()
+    {
+        static const int nIndex = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return nIndex;
+    }
+
+    // Returns 1 to keep the reference to the session.
+    static int OnNewSession(SSL* pSsl, SSL_SESSION* pSession)
+    {
+        auto* pSelf = static_cast<tls_context*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(pSsl), ContextIndex()));
+        auto* pKey = static_cast<const std::string*>(SSL_get_ex_data(pSsl, SessionKeyIndex()));
+        if (!pSelf || !pKey || !SSL_SESSION_is_resumable(pSession))
+            return 0;
+
+        std::scoped_lock lock(pSelf->m_muxSessions);
+        SSL_SESSION*& pStored = pSelf->m_mapSessions[*pKey];
+        if (pStored)
+            SSL_SESSION_free(pStored);
+        pStored = pSession;
+        return 1;
+    }
+
+    role m_role;
+    tls_options m_options;
+    asio::ssl::context m_context;
+    // Server "host:port" to its last session. Connections of several threads may share the context.
+    std::mutex m_muxSessions;
+    std::unordered_map<std::string, SSL_SESSION*> m_mapSessions;
+};
+
+// Transport over TLS. AsyncConnect does the handshake on both sides: server side transports are created by
+// server_interface from the accepted socket and are not usable before it completes.
+// Like the other transports it expects one read and one write at a time, from one thread.
+class tls_transport : public transport
+{
+public:
+    using endpoint_type = asio::ip::tcp::endpoint;
+
+    // Server side: socket returned by the acceptor.
+    tls_transport(std::shared_ptr<tls_context> pContext, asio::ip::tcp::socket socket)
+      : m_pContext(std::move(pContext)), m_socket(std::move(socket))
+    {
+        CreateSsl();
+        AttachSocket();
+        SSL_set_accept_state(m_pSsl);
+    }
+
+    // Client side: AsyncConnect tries the endpoints one by one, then does the handshake. serverName is checked
+    // against the server certificate and, with the port, names the session to resume.
+    tls_transport(
+        std::shared_ptr<tls_context> pContext, asio::ip::tcp::socket socket, std::vector<endpoint_type> endpoints,
+        std::string serverName)
+      : m_pContext(std::move(pContext)), m_socket(std::move(socket)), m_endpoints(std::move(endpoints)),
+        m_serverName(std::move(serverName))
+    {
+        CreateSsl();
+        SSL_set_connect_state(m_pSsl);
+    }
+
+    ~tls_transport() override { SSL_free(m_pSsl); }
+
+    void AsyncRead(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        Read(buffer, 0, false, std::move(handler), false);
+    }
+
+    void AsyncReadSome(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        Read(buffer, 0, true, std::move(handler), false);
+    }
+
+    void AsyncWaitReadable(io_handler handler) override
+    {
+        // Decrypted bytes may wait inside OpenSSL, the socket would not tell about them.
+        if (SSL_has_pending(m_pSsl))
+        {
+            asio::post(m_socket.get_executor(), [handler = std::move(handler)]() { handler({}, 0); });
+            return;
+        }
+        m_socket.async_wait(
+            asio::ip::tcp::socket::wait_read, [handler = std::move(handler)](std::error_code ec) { handler(ec, 0); });
+    }
+
+    void AsyncWrite(asio::const_buffer buffer, io_handler handler) override
+    {
+        AsyncWrite(std::span<const asio::const_buffer>(&buffer, 1), std::move(handler));
+    }
+
+    void AsyncWrite(std::span<const asio::const_buffer> buffers, io_handler handler) override
+    {
+        // The kernel makes the records, so the socket takes plain text, in one syscall.
+        if (m_bKtlsSend)
+        {
+            asio::async_write(m_socket, buffers, std::move(handler));
+            return;
+        }
+
+        if (buffers.size() == 1)
+        {
+            Write(buffers[0], 0, std::move(handler), false);
+            return;
+        }
+
+        // One record for the header and the body instead of one each.
+        m_vecWriteBuffer.clear();
+        for (const auto& buffer : buffers)
+        {
+            auto bytes = static_cast<const uint8_t*>(buffer.data());
+            m_vecWriteBuffer.insert(m_vecWriteBuffer.end(), bytes, bytes + buffer.size());
+        }
+        Write(asio::buffer(m_vecWriteBuffer), 0, std::move(handler), false);
+    }
+
+#if defined(NET_HAS_FILE_SEND)
+    void AsyncSendFile(int nFile, uint64_t nOffset, size_t nLength, io_handler handler) override
+    {
+        // The kernel encrypts what sendfile hands it. Without kTLS the file has to go through SSL_write.
+        if (m_bKtlsSend)
+            detail::SendFileToSocket(m_socket, nFile, nOffset, nLength, 0, std::move(handler), false);
+        else
+            transport::AsyncSendFile(nFile, nOffset, nLength, std::move(handler));
+    }
+#endif
+
+    void AsyncConnect(connect_handler handler) override
+    {
+        if (m_endpoints.empty())
+        {
+            Handshake(std::move(handler));
+            return;
+        }
+
+        asio::async_connect(
+            m_socket, m_endpoints,
+            [this, handler = std::move(handler)](std::error_code ec, const endpoint_type& endpoint) mutable
+            {
+                if (ec)
+                {
+                    handler(ec);
+                    return;
+                }
+
+                AttachSocket();
+                m_sessionKey = m_serverName + ":" + std::to_string(endpoint.port());
+                SSL_set_ex_data(m_pSsl, tls_context::SessionKeyIndex(), &m_sessionKey);
+                SSL_set_tlsext_host_name(m_pSsl, m_serverName.c_str());
+                if (m_pContext->Options().verifyPeer)
+                    SSL_set1_host(m_pSsl, m_serverName.c_str());
+                if (m_pContext->Options().sessionTickets)
+                    m_pContext->ResumeSession(m_pSsl, m_sessionKey);
+
+                Handshake(std::move(handler));
+            });
+    }
+
+    void Close() override
+    {
+        if (!m_socket.is_open())
+            return;
+
+        // close_notify, if the socket takes it right away. Nothing waits for the answer.
+        if (m_bHandshakeDone)
+        {
+            ERR_clear_error();
+            SSL_shutdown(m_pSsl);
+        }
+        asio::error_code ec;
+        m_socket.close(ec);
+    }
+
+    bool IsOpen() const override { return m_socket.is_open(); }
+
+    std::string RemoteName() const override
+    {
+        asio::error_code ec;
+        auto endpoint = m_socket.remote_endpoint(ec);
+        if (ec)
+            return "<not connected>";
+        return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    }
+
+    std::string RemoteAddress() const override
+    {
+        asio::error_code ec;
+        // Empty as for socket_transport: a socket that is already gone must not share a key with the others.
+        auto endpoint = m_socket.remote_endpoint(ec);
+        return ec ? std::string() : endpoint.address().to_string();
+    }
+
+    // After the handshake: the session was resumed, not negotiated from scratch.
+    bool IsResumed() const { return m_bHandshakeDone && SSL_session_reused(m_pSsl) == 1; }
+
+    // After the handshake: the kernel encrypts the writes / decrypts the reads.
+    bool IsKtlsSend() const { return m_bKtlsSend; }
+    bool IsKtlsReceive() const { return m_bKtlsReceive; }
+
+    asio::ip::tcp::socket& Socket() { return m_socket; }
+    SSL* NativeHandle() { return m_pSsl; }
+private:
+    void CreateSsl()
+    {
+        m_pSsl = SSL_new(m_pContext->Native().native_handle());
+        if (!m_pSsl)
+            throw std::bad_alloc();
+    }
+
+    void AttachSocket()
+    {
+        // Messages are small and written as header + body (see socket_transport).
+        asio::error_code ec;
+        m_socket.set_option(asio::ip::tcp::no_delay(true), ec);
+        // OpenSSL reads and writes the socket itself and must never block the asio thread.
+        m_socket.native_non_blocking(true, ec);
+        SSL_set_fd(m_pSsl, static_cast<int>(m_socket.native_handle()));
+    }
+
+    void Handshake(connect_handler handler)
+    {
+        ERR_clear_error();
+        int nResult = SSL_do_handshake(m_pSsl);
+        if (nResult == 1)
+        {
+            m_bHandshakeDone = true;
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+            m_bKtlsSend = BIO_get_ktls_send(SSL_get_wbio(m_pSsl)) != 0;
+            m_bKtlsReceive = BIO_get_ktls_recv(SSL_get_rbio(m_pSsl)) != 0;
+#endif
+            MY_LOG(
+                debug, "[tls_transport] Handshake with {} done: {}, {}, resumed {}, kTLS send {} receive {}",
+                RemoteName(), SSL_get_version(m_pSsl), SSL_get_cipher_name(m_pSsl), IsResumed(), m_bKtlsSend,
+                m_bKtlsReceive);
+            asio::post(m_socket.get_executor(), [handler = std::move(handler)]() { handler({}); });
+            return;
+        }
+
+        WaitAndRetry(
+            nResult, [this, handler = std::move(handler)](std::error_code ec) mutable
+            {
+                if (ec)
+                    handler(ec);
+                else
+                    Handshake(std::move(handler));
+            });
+    }
+
+    // bSome - complete with whatever is read, otherwise fill the buffer. bFromHandler - running as a completion
+    // handler already, so the handler may be called right away.
+    void Read(asio::mutable_buffer buffer, size_t nDone, bool bSome, io_handler handler, bool bFromHandler)
+    {
+        while (nDone < buffer.size())
+        {
+            size_t nRead = 0;
+            ERR_clear_error();
+            int nResult =
+                SSL_read_ex(m_pSsl, static_cast<uint8_t*>(buffer.data()) + nDone, buffer.size() - nDone, &nRead);
+            if (nResult != 1)
+            {
+                WaitAndRetry(
+                    nResult, [this, buffer, nDone, bSome, handler = std::move(handler)](std::error_code ec) mutable
+                    {
+                        if (ec)
+                            handler(ec, nDone);
+                        else
+                            Read(buffer, nDone, bSome, std::move(handler), true);
+                    });
+                return;
+            }
+
+            nDone += nRead;
+            if (bSome)
+                break;
+        }
+        Complete(std::move(handler), nDone, bFromHandler);
+    }
+
+    void Write(asio::const_buffer buffer, size_t nDone, io_handler handler, bool bFromHandler)
+    {
+        while (nDone < buffer.size())
+        {
+            size_t nWritten = 0;
+            ERR_clear_error();
+            int nResult = SSL_write_ex(
+                m_pSsl, static_cast<const uint8_t*>(buffer.data()) + nDone, buffer.size() - nDone, &nWritten);
+            if (nResult != 1)
+            {
+                WaitAndRetry(
+                    nResult, [this, buffer, nDone, handler = std::move(handler)](std::error_code ec) mutable
+                    {
+                        if (ec)
+                            handler(ec, nDone);
+                        else
+                            Write(buffer, nDone, std::move(handler), true);
+                    });
+                return;
+            }
+            nDone += nWritten;
+        }
+        Complete(std::move(handler), nDone, bFromHandler);
+    }
+
+    void Complete(io_handler handler, size_t nLength, bool bFromHandler)
+    {
+        if (bFromHandler)
+            handler({}, nLength);
+        else
+            asio::post(m_socket.get_executor(), [handler = std::move(handler), nLength]() { handler({}, nLength); });
+    }
+
+    // Wait for the socket state OpenSSL asked for, then call next({}). Failures go to next(error).
+    template <typename Next>
+    void WaitAndRetry(int nResult, Next next)
+    {
+        int nError = SSL_get_error(m_pSsl, nResult);
+        if (nError == SSL_ERROR_WANT_READ || nError == SSL_ERROR_WANT_WRITE)
+        {
+            m_socket.async_wait(
+                nError == SSL_ERROR_WANT_READ ? asio::ip::tcp::socket::wait_read : asio::ip::tcp::socket::wait_write,
+                std::move(next));
+            return;
+        }
+
+        asio::post(
+            m_socket.get_executor(), [next = std::move(next), ec = MakeError(nError)]() mutable { next(ec); });
+    }
+
+    static std::error_code MakeError(int nError)
+    {
+        if (nError == SSL_ERROR_ZERO_RETURN)
+            return asio::error_code(asio::error::eof);
+
+        unsigned long nSslError = ERR_get_error();
+        ERR_clear_error();
+        if (nSslError != 0)
+            return std::error_code(static_cast<int>(nSslError), asio::error::get_ssl_category());
+        if (nError == SSL_ERROR_SYSCALL && errno != 0)
+            return std::error_code(errno, std::system_category());
+        return asio::error_code(asio::error::eof);
+    }
+
+    std::shared_ptr<tls_context> m_pContext;
+    asio::ip::tcp::socket m_socket;
+    SSL* m_pSsl = nullptr;
+    std::vector<endpoint_type> m_endpoints;
+    std::string m_serverName;
+    // Key of the session cache, referenced by the SSL object.
+    std::string m_sessionKey;
+    // Several buffers written at once are joined here.
+    std::vector<uint8_t> m_vecWriteBuffer;
+    bool m_bHandshakeDone = false;
+    bool m_bKtlsSend = false;
+    bool m_bKtlsReceive = false;
+};
+
+} // namespace net
@@ -0,0 +1,427 @@
+#pragma once
+#include "net_timing.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fmt/format.h>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Transport tracing: binary events of the connection hot paths (see NET_TRACE).
+//
+// NET_TRACE_LEVEL is set by the NET_TRACE_LEVEL CMake option. Events below it are compiled out completely.
+// Enabled events cost one relaxed load while no trace_sink is running. While it runs, an event is a few
+// integers pushed into a lock free ring of the calling thread. No formatting, allocation or lock happens
+// on the network thread: a background thread of the sink drains the rings and formats the text.
+
+#ifndef NET_TRACE_LEVEL
+#define NET_TRACE_LEVEL 1
+#endif
+
+namespace net
+{
+
+// Same order as the spdlog levels.
+namespace trace_level
+{
+constexpr int trace = 0;
+constexpr int debug = 1;
+constexpr int info = 2;
+constexpr int warn = 3;
+constexpr int error = 4;
+constexpr int off = 6;
+} // namespace trace_level
+
+enum class trace_event : uint16_t
+{
+    connect_start,
+    connect_done,
+    disconnect,
+    send,
+    queue_outgoing,
+    encode_delta,
+    compress,
+    write_batch,
+    read_header_done,
+    pause_read,
+    read_some_start,
+    read_some_done,
+    wait_readable,
+    read_body_start,
+    read_body_done,
+    write_header_start,
+    write_header_done,
+    write_body_start,
+    write_body_done,
+    received,
+    rate_limit_drop,
+    clock_sync,
+    control_unknown,
+    write_validation_start,
+    write_validation_done,
+    read_validation_start,
+    read_validation_done,
+};
+
+// Text of an event. Every "{}" is replaced by the next argument.
+inline const char* TraceFormat(trace_event event)
+{
+    switch (event)
+    {
+    case trace_event::connect_start:
+        return "ConnectToServer STARTS";
+    case trace_event::connect_done:
+        return "ConnectToServer HAS COMPLETED";
+    case trace_event::disconnect:
+        return "Disconnect STARTS";
+    case trace_event::send:
+        return "Send STARTS: ID {}, BodySize {}";
+    case trace_event::queue_outgoing:
+        return "Send: ID {}, BodySize {}, QueueSize {}";
+    case trace_event::encode_delta:
+        return "EncodeDelta: ID {}, BodySize {}, Encoded {}";
+    case trace_event::compress:
+        return "CompressMessage: ID {}, BodySize {}, Compressed {}";
+    case trace_event::write_batch:
+        return "WriteBatch: Messages {}, Bytes {}, Left {}";
+    case trace_event::read_header_done:
+        return "ReadHeader HAS COMPLETED: ID {}, BodySize {}";
+    case trace_event::pause_read:
+        return "PauseRead: incoming memory budget is exceeded ({} bytes)";
+    case trace_event::read_some_start:
+        return "ReadSome STARTS: Buffered {}";
+    case trace_event::read_some_done:
+        return "ReadSome HAS COMPLETED: AsioLenth {}";
+    case trace_event::wait_readable:
+        return "WaitReadable STARTS";
+    case trace_event::read_body_start:
+        return "ReadBody STARTS: BodySize {}, AlreadyRead {}";
+    case trace_event::read_body_done:
+        return "ReadBody HAS COMPLETED: Size {}, AsioLenth {}";
+    case trace_event::write_header_start:
+        return "WriteHeader STARTS: ID {}, BodySize {}";
+    case trace_event::write_header_done:
+        return "WriteHeader HAS COMPLETED: ID {}, BodySize {}, AsioLenth {}";
+    case trace_event::write_body_start:
+        return "WriteBody STARTS: ID {}, BodySize {}";
+    case trace_event::write_body_done:
+        return "WriteBody HAS COMPLETED: ID {}, BodySize {}, AsioLenth {}";
+    case trace_event::received:
+        return "Received message: ID {}, BodySize {}";
+    case trace_event::rate_limit_drop:
+        return "Message DROPPED: rate limit of ID {} is exceeded";
+    case trace_event::clock_sync:
+        return "Clock sync: offset {} ns, round trip {} ns";
+    case trace_event::control_unknown:
+        return "HandleControl: unknown type {}";
+    case trace_event::write_validation_start:
+        return "WriteValidation STARTS: HandshakeOut {}";
+    case trace_event::write_validation_done:
+        return "WriteValidation HAS COMPLETED: HandshakeOut {}, AsioLenth {}";
+    case trace_event::read_validation_start:
+        return "ReadValidation STARTS";
+    case trace_event::read_validation_done:
+        return "ReadValidation HAS COMPLETED: HandshakeIn {}, AsioLenth {}";
+    }
+    return "Unknown event";
+}
+
+// One event as it lies in a ring. 48 bytes.
+struct trace_record
+{
+    int64_t nTimeNs = 0;
+    uint32_t nConnectionID = 0;
+    trace_event event{};
+    uint8_t nLevel = 0;
+    uint8_t nArgs = 0;
+    std::array<int64_t, 4> args{};
+};
+
+// Single producer (the owning thread), single consumer (the sink thread) ring of trace records.
+// A full ring drops new records and counts them, the producer never waits.
+class trace_ring
+{
+public:
+    static constexpr size_t c_nCapacity = 4096; // Power of two.
+
+    void Push(const trace_record& record)
+    {
+        size_t nHead = m_nHead.load(std::memory_order_relaxed);
+        if (nHead - m_nTail.load(std::memory_order_acquire) == c_nCapacity)
+        {
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_records[nHead & (c_nCapacity - 1)] = record;
+        m_nHead.store(nHead + 1, std::memory_order_release);
+    }
+
+    template <typename Handler>
+    size_t Drain(Handler&& handler)
+    {
+        size_t nTail = m_nTail.load(std::memory_order_relaxed);
+        size_t nHead = m_nHead.load(std::memory_order_acquire);
+        for (size_t i = nTail; i != nHead; ++i)
+            handler(m_records[i & (c_nCapacity - 1)]);
+        m_nTail.store(nHead, std::memory_order_release);
+        return nHead - nTail;
+    }
+
+    uint64_t TakeDropped() { return m_nDropped.exchange(0, std::memory_order_relaxed); }
+
+    // Set when the owning thread has exited. The sink forgets the ring once it is drained.
+    std::atomic<bool> bOrphaned = false;
+private:
+    // Producer and consumer indices on separate cache lines, so they do not bounce between cores.
+    alignas(64) std::atomic<size_t> m_nHead = 0;
+    alignas(64) std::atomic<size_t> m_nTail = 0;
+    std::atomic<uint64_t> m_nDropped = 0;
+    std::array<trace_record, c_nCapacity> m_records;
+};
+
+// Process wide consumer of the trace rings. Formats the records into a text file from a background thread.
+// Use TraceSink() to get it.
+class trace_sink
+{
+public:
+    ~trace_sink() { Stop(); }
+
+    // Start writing the events to a file. Events traced before Start are not recorded.
+    bool Start(const std::string& path, std::chrono::milliseconds flushInterval = std::chrono::milliseconds(10))
+    {
+        Stop();
+
+        m_pFile = std::fopen(path.c_str(), "w");
+        if (!m_pFile)
+            return false;
+
+        // Events pushed after the previous Stop belong to no trace.
+        {
+            std::scoped_lock lock(m_muxRings);
+            for (auto& pRing : m_vecRings)
+                pRing->Drain([](const trace_record&) {});
+        }
+
+        m_nStartNs = SteadyNowNs();
+        m_flushInterval = flushInterval;
+        {
+            std::scoped_lock lock(m_muxThread);
+            m_bStopping = false;
+        }
+        m_thread = std::thread([this]() { WriterLoop(); });
+        m_bRunning.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Format what is left in the rings and close the file.
+    void Stop()
+    {
+        if (!m_bRunning.exchange(false))
+            return;
+
+        {
+            std::scoped_lock lock(m_muxThread);
+            m_bStopping = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+
+        std::fclose(m_pFile);
+        m_pFile = nullptr;
+    }
+
+    bool IsRunning() const { return m_bRunning.load(std::memory_order_relaxed); }
+
+    // Ring of the calling thread. Created and registered on the first event of the thread.
+    trace_ring& ThreadRing()
+    {
+        // Marks the ring orphaned when the thread exits. The sink still holds it until it is drained.
+        struct ring_holder
+        {
+            std::shared_ptr<trace_ring> pRing;
+            ~ring_holder()
+            {
+                if (pRing)
+                    pRing->bOrphaned = true;
+            }
+        };
+        thread_local ring_holder holder;
+
+        if (!holder.pRing)
+        {
+            holder.pRing = std::make_shared<trace_ring>();
+            std::scoped_lock lock(m_muxRings);
+            m_vecRings.push_back(holder.pRing);
+        }
+        return *holder.pRing;
+    }
+
+    uint64_t RecordCount() const { return m_nRecords.load(std::memory_order_relaxed); }
+    uint64_t DroppedCount() const { return m_nDropped.load(std::memory_order_relaxed); }
+private:
+    void WriterLoop()
+    {
+        std::string text;
+        bool bStopping = false;
+        while (!bStopping)
+        {
+            {
+                std::unique_lock lock(m_muxThread);
+                m_cv.wait_for(lock, m_flushInterval, [this]() { return m_bStopping; });
+                bStopping = m_bStopping;
+            }
+
+            std::vector<std::shared_ptr<trace_ring>> vecRings;
+            {
+                std::scoped_lock lock(m_muxRings);
+                // Drained below for the last time, as their threads are gone.
+                std::erase_if(
+                    m_vecRings,
+                    [&vecRings](const auto& pRing)
+                    {
+                        if (!pRing->bOrphaned)
+                            return false;
+                        vecRings.push_back(pRing);
+                        return true;
+                    });
+                vecRings.insert(vecRings.end(), m_vecRings.begin(), m_vecRings.end());
+            }
+
+            for (auto& pRing : vecRings)
+            {
+                size_t nRecords = pRing->Drain(
+                    [&](const trace_record& record)
+                    {
+                        AppendRecord(record, text);
+                        if (text.size() >= c_nWriteChunk)
+                            WriteText(text);
+                    });
+                m_nRecords.fetch_add(nRecords, std::memory_order_relaxed);
+
+                if (uint64_t nDropped = pRing->TakeDropped())
+                {
+                    m_nDropped.fetch_add(nDropped, std::memory_order_relaxed);
+                    fmt::format_to(
+                        std::back_inserter(text), "[trace] {} events dropped, the ring was full\n", nDropped);
+                }
+            }
+            WriteText(text);
+            std::fflush(m_pFile);
+        }
+    }
+
+    void WriteText(std::string& text)
+    {
+        std::fwrite(text.data(), 1, text.size(), m_pFile);
+        text.clear();
+    }
+
+    // "<us since Start> [level] [Connection id] <event text>". Records of different threads are not merged
+    // by time, sort by it if needed. Formatted by hand, as fmt parsing a runtime format string costs more
+    // than the event itself.
+    void AppendRecord(const trace_record& record, std::string& text)
+    {
+        static constexpr const char* c_levels[] = {"trace", "debug", "info", "warn", "error", "critical", "off"};
+
+        auto appendInt = [&text](int64_t nValue)
+        {
+            fmt::format_int digits(nValue);
+            text.append(digits.data(), digits.size());
+        };
+
+        appendInt((record.nTimeNs - m_nStartNs) / 1000);
+        text += "us [";
+        text += c_levels[std::min<size_t>(record.nLevel, std::size(c_levels) - 1)];
+        text += "] [Connection ";
+        appendInt(record.nConnectionID);
+        text += "] ";
+
+        size_t nArg = 0;
+        for (const char* p = TraceFormat(record.event); *p; ++p)
+        {
+            if (p[0] == '{' && p[1] == '}' && nArg < record.nArgs)
+            {
+                appendInt(record.args[nArg++]);
+                ++p;
+            }
+            else
+                text.push_back(*p);
+        }
+        text.push_back('\n');
+    }
+
+    static constexpr size_t c_nWriteChunk = 64 * 1024;
+
+    std::atomic<bool> m_bRunning = false;
+    std::FILE* m_pFile = nullptr;
+    int64_t m_nStartNs = 0;
+    std::chrono::milliseconds m_flushInterval{10};
+
+    std::mutex m_muxThread;
+    std::condition_variable m_cv;
+    bool m_bStopping = false;
+    std::thread m_thread;
+
+    std::mutex m_muxRings;
+    std::vector<std::shared_ptr<trace_ring>> m_vecRings;
+
+    std::atomic<uint64_t> m_nRecords = 0;
+    std::atomic<uint64_t> m_nDropped = 0;
+};
+
+inline trace_sink& TraceSink()
+{
+    static trace_sink sink;
+    return sink;
+}
+
+// Trace arguments are stored as int64: integers, bools and enums (e.g. message ids).
+template <typename Arg>
+constexpr int64_t ToTraceArg(Arg value)
+{
+    if constexpr (std::is_enum_v<Arg>)
+        return static_cast<int64_t>(static_cast<std::underlying_type_t<Arg>>(value));
+    else
+        return static_cast<int64_t>(value);
+}
+
+template <typename... Args>
+inline void Trace(int nLevel, trace_event event, uint32_t nConnectionID, Args... args)
+{
+    static_assert(sizeof...(Args) <= std::tuple_size_v<decltype(trace_record::args)>, "Too many trace arguments");
+
+    auto& sink = TraceSink();
+    if (!sink.IsRunning())
+        return;
+
+    trace_record record;
+    record.nTimeNs = SteadyNowNs();
+    record.nConnectionID = nConnectionID;
+    record.event = event;
+    record.nLevel = static_cast<uint8_t>(nLevel);
+    record.nArgs = static_cast<uint8_t>(sizeof...(Args));
+    size_t i = 0;
+    ((record.args[i++] = ToTraceArg(args)), ...);
+    sink.ThreadRing().Push(record);
+}
+
+} // namespace net
+
+// NET_TRACE(debug, read_header_done, m_nID, id, size): level and event are names from trace_level and
+// trace_event. Up to four integer arguments. Below NET_TRACE_LEVEL the arguments are not even evaluated.
+#define NET_TRACE(level, event, connectionID, ...)                                                                     \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if constexpr (net::trace_level::level >= NET_TRACE_LEVEL)                                                      \
+            net::Trace(net::trace_level::level, net::trace_event::event, connectionID __VA_OPT__(, ) __VA_ARGS__);     \
+    } while (0)
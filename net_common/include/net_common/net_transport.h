@@ -0,0 +1,501 @@
+#pragma once
+#include "net_file.h"
+#include <algorithm>
+#include <asio.hpp>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+#include <asio/local/stream_protocol.hpp>
+#endif
+
+#if defined(NET_HAS_FILE_SEND)
+#include <sys/sendfile.h>
+#endif
+
+namespace net
+{
+
+// Completion handlers used by all transports. Same signatures as the asio read/write/connect handlers.
+using io_handler = std::function<void(std::error_code, std::size_t)>;
+using connect_handler = std::function<void(std::error_code)>;
+
+// Transport is the byte stream under a connection.
+// The connection only needs "read exactly N bytes", "write exactly N bytes" and "close",
+// so the framing and the handshake are the same for every transport.
+class transport
+{
+public:
+    virtual ~transport() = default;
+
+    // ASYNC - Read exactly buffer.size() bytes.
+    virtual void AsyncRead(asio::mutable_buffer buffer, io_handler handler) = 0;
+
+    // ASYNC - Read at least one byte, at most buffer.size() bytes.
+    virtual void AsyncReadSome(asio::mutable_buffer buffer, io_handler handler) = 0;
+
+    // ASYNC - Complete when there is something to read (or the stream is closed), without reading it.
+    // Lets an idle connection wait without holding a receive buffer. The length is always 0.
+    virtual void AsyncWaitReadable(io_handler handler) = 0;
+
+    // ASYNC - Write exactly buffer.size() bytes.
+    virtual void AsyncWrite(asio::const_buffer buffer, io_handler handler) = 0;
+
+    // ASYNC - Write all the buffers in order, as one operation (one syscall for sockets).
+    // The span must stay valid until the handler is called.
+    virtual void AsyncWrite(std::span<const asio::const_buffer> buffers, io_handler handler) = 0;
+
+    // ASYNC - Establish the stream. Transports created by an acceptor are already connected
+    // and complete this immediately.
+    virtual void AsyncConnect(connect_handler handler) = 0;
+
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+
+    // Human readable name of the remote side. Used for logging only.
+    virtual std::string RemoteName() const = 0;
+
+    // Remote host without the port: the key of per host limits and of the blacklist. Empty if the transport has
+    // no network address (local socket, in-process pipe): all its clients would share one key, so the server
+    // does not apply the per address limits to them.
+    virtual std::string RemoteAddress() const { return {}; }
+
+#if defined(NET_HAS_FILE_SEND)
+    // ASYNC - Write nLength bytes of the file from nOffset. The file must stay open until the handler is called.
+    // This default reads the file in chunks and writes them. Socket transports override it with sendfile, where
+    // the kernel copies the file from the page cache and nothing passes through user space.
+    virtual void AsyncSendFile(int nFile, uint64_t nOffset, size_t nLength, io_handler handler)
+    {
+        auto pBuffer = std::make_shared<std::vector<uint8_t>>(std::min(nLength, c_nFileChunkSize));
+        SendFileChunks(nFile, nOffset, nLength, 0, std::move(pBuffer), std::move(handler));
+    }
+private:
+    static constexpr size_t c_nFileChunkSize = 64 * 1024;
+
+    void SendFileChunks(int nFile, uint64_t nOffset, size_t nLength, size_t nDone,
+                        std::shared_ptr<std::vector<uint8_t>> pBuffer, io_handler handler)
+    {
+        ssize_t nRead = 0;
+        if (nDone < nLength)
+        {
+            do
+                nRead = ::pread(nFile, pBuffer->data(), std::min(nLength - nDone, pBuffer->size()),
+                                static_cast<off_t>(nOffset + nDone));
+            while (nRead < 0 && errno == EINTR);
+        }
+
+        if (nRead <= 0)
+        {
+            // Done, or the file could not be read. An empty write completes it, so the handler is never called
+            // from inside AsyncSendFile.
+            std::error_code ec;
+            if (nRead < 0)
+                ec = std::error_code(errno, std::system_category());
+            else if (nDone < nLength)
+                ec = asio::error_code(asio::error::eof);
+            AsyncWrite(
+                asio::const_buffer(), [handler = std::move(handler), ec, nDone](std::error_code, std::size_t)
+                { handler(ec, nDone); });
+            return;
+        }
+
+        AsyncWrite(
+            asio::buffer(pBuffer->data(), static_cast<size_t>(nRead)),
+            [this, nFile, nOffset, nLength, nDone, pBuffer, handler = std::move(handler)](
+                std::error_code ec, std::size_t nWritten) mutable
+            {
+                if (ec)
+                    handler(ec, nDone + nWritten);
+                else
+                    SendFileChunks(nFile, nOffset, nLength, nDone + nWritten, std::move(pBuffer), std::move(handler));
+            });
+    }
+#endif
+};
+
+#if defined(NET_HAS_FILE_SEND)
+namespace detail
+{
+// sendfile of a file range to a stream socket, waiting whenever the socket is full.
+// bFromHandler - running as a completion handler already, so the handler may be called right away.
+template <typename Socket>
+void SendFileToSocket(Socket& socket, int nFile, uint64_t nOffset, size_t nLength, size_t nDone, io_handler handler,
+                      bool bFromHandler)
+{
+    // sendfile must not block the asio thread. asio keeps working with a non-blocking descriptor.
+    asio::error_code ecSocket;
+    socket.native_non_blocking(true, ecSocket);
+    std::error_code ec = ecSocket;
+    while (!ec && nDone < nLength)
+    {
+        off_t nPosition = static_cast<off_t>(nOffset + nDone);
+        ssize_t nSent = ::sendfile(socket.native_handle(), nFile, &nPosition, nLength - nDone);
+        if (nSent > 0)
+            nDone += static_cast<size_t>(nSent);
+        else if (nSent < 0 && errno == EAGAIN)
+        {
+            socket.async_wait(
+                Socket::wait_write,
+                [&socket, nFile, nOffset, nLength, nDone, handler = std::move(handler)](std::error_code ec) mutable
+                {
+                    if (ec)
+                        handler(ec, nDone);
+                    else
+                        SendFileToSocket(socket, nFile, nOffset, nLength, nDone, std::move(handler), true);
+                });
+            return;
+        }
+        else if (nSent == 0)
+            ec = asio::error_code(asio::error::eof); // The file is shorter than nOffset + nLength.
+        else if (errno != EINTR)
+            ec = std::error_code(errno, std::system_category());
+    }
+
+    if (bFromHandler)
+        handler(ec, nDone);
+    else
+        asio::post(socket.get_executor(), [handler = std::move(handler), ec, nDone]() { handler(ec, nDone); });
+}
+} // namespace detail
+#endif
+
+// Transport over any asio stream socket: TCP or local (Unix domain) sockets.
+template <typename Protocol>
+class socket_transport : public transport
+{
+public:
+    using socket_type = typename Protocol::socket;
+    using endpoint_type = typename Protocol::endpoint;
+
+    // Server side: socket returned by the acceptor, already connected.
+    explicit socket_transport(socket_type socket) : m_socket(std::move(socket)) { SetSocketOptions(); }
+
+    // Client side: AsyncConnect will try the endpoints one by one.
+    socket_transport(socket_type socket, std::vector<endpoint_type> endpoints)
+      : m_socket(std::move(socket)), m_endpoints(std::move(endpoints))
+    {}
+
+    void AsyncRead(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        asio::async_read(m_socket, buffer, std::move(handler));
+    }
+
+    void AsyncReadSome(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        m_socket.async_read_some(buffer, std::move(handler));
+    }
+
+    void AsyncWaitReadable(io_handler handler) override
+    {
+        m_socket.async_wait(
+            socket_type::wait_read, [handler = std::move(handler)](std::error_code ec) { handler(ec, 0); });
+    }
+
+    void AsyncWrite(asio::const_buffer buffer, io_handler handler) override
+    {
+        asio::async_write(m_socket, buffer, std::move(handler));
+    }
+
+    void AsyncWrite(std::span<const asio::const_buffer> buffers, io_handler handler) override
+    {
+        asio::async_write(m_socket, buffers, std::move(handler));
+    }
+
+    void AsyncConnect(connect_handler handler) override
+    {
+        if (m_endpoints.empty())
+        {
+            asio::post(m_socket.get_executor(), [handler = std::move(handler)]() { handler({}); });
+            return;
+        }
+
+        asio::async_connect(
+            m_socket, m_endpoints,
+            [this, handler = std::move(handler)](std::error_code ec, const endpoint_type&)
+            {
+                if (!ec)
+                    SetSocketOptions();
+                handler(ec);
+            });
+    }
+
+    void Close() override
+    {
+        asio::error_code ec;
+        m_socket.close(ec);
+    }
+
+    bool IsOpen() const override { return m_socket.is_open(); }
+
+    std::string RemoteName() const override
+    {
+        asio::error_code ec;
+        auto endpoint = m_socket.remote_endpoint(ec);
+        if (ec)
+            return "<not connected>";
+
+        if constexpr (std::is_same_v<Protocol, asio::ip::tcp>)
+            return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+        else
+            return endpoint.path();
+    }
+
+    std::string RemoteAddress() const override
+    {
+        if constexpr (std::is_same_v<Protocol, asio::ip::tcp>)
+        {
+            asio::error_code ec;
+            // No address, no shared key: a socket that is already gone is not filtered.
+            auto endpoint = m_socket.remote_endpoint(ec);
+            return ec ? std::string() : endpoint.address().to_string();
+        }
+        else
+        {
+            // Every client of a Unix socket has the same (usually empty) path. Access is up to its file mode.
+            return {};
+        }
+    }
+
+#if defined(NET_HAS_FILE_SEND)
+    void AsyncSendFile(int nFile, uint64_t nOffset, size_t nLength, io_handler handler) override
+    {
+        detail::SendFileToSocket(m_socket, nFile, nOffset, nLength, 0, std::move(handler), false);
+    }
+#endif
+
+    // Direct access for socket specific tuning (options, native handle, etc.).
+    socket_type& Socket() { return m_socket; }
+private:
+    void SetSocketOptions()
+    {
+        // Messages are small and written as header + body. Without this option Nagle's algorithm holds the body
+        // until the header is acknowledged, and the delayed ACK turns it into tens of milliseconds of latency.
+        if constexpr (std::is_same_v<Protocol, asio::ip::tcp>)
+        {
+            asio::error_code ec;
+            m_socket.set_option(asio::ip::tcp::no_delay(true), ec);
+        }
+    }
+
+    socket_type m_socket;
+    std::vector<endpoint_type> m_endpoints;
+};
+
+using tcp_transport = socket_transport<asio::ip::tcp>;
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+using local_transport = socket_transport<asio::local::stream_protocol>;
+
+// Make way for binding a Unix socket on path: remove the socket file a previous run left behind, the one
+// nobody accepts on any more. Anything else stays and bind fails on it: a file that is not a socket, or the
+// socket of a running process.
+inline void RemoveStaleSocketFile(const std::string& path)
+{
+    std::error_code ec;
+    if (!std::filesystem::is_socket(std::filesystem::symlink_status(path, ec)))
+        return;
+
+    asio::io_context context;
+    asio::local::stream_protocol::socket probe(context);
+    asio::error_code connectError;
+    probe.connect(asio::local::stream_protocol::endpoint(path), connectError);
+    if (connectError == asio::error::connection_refused)
+        std::filesystem::remove(path, ec);
+}
+#endif
+
+// One direction of an in-process pipe. The writer appends bytes, the reader takes them.
+// Only one read may be pending at a time, as with async_read on a socket.
+struct memory_pipe_channel
+{
+    std::mutex mux;
+    // Written bytes. Unread bytes start at readPos.
+    std::vector<uint8_t> data;
+    size_t readPos = 0;
+    bool closed = false;
+    // Pending read of the reader side.
+    asio::mutable_buffer pendingBuffer;
+    // false - the read needs the whole buffer, true - any number of bytes will do
+    // (an empty buffer then waits for data without taking it).
+    bool pendingSome = false;
+    io_handler pendingHandler;
+    asio::io_context* pendingContext = nullptr;
+    // A pending read is outstanding work, as it is for a socket. Keeps io_context::run from returning.
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> pendingWork;
+
+    // Must be called with mux locked. Completes the pending read if it can be completed.
+    void TryCompleteRead()
+    {
+        if (!pendingHandler)
+            return;
+
+        size_t available = data.size() - readPos;
+        if (pendingSome ? available > 0 : available >= pendingBuffer.size())
+        {
+            size_t length = std::min(available, pendingBuffer.size());
+            std::memcpy(pendingBuffer.data(), data.data() + readPos, length);
+            readPos += length;
+
+            // Compact the buffer from time to time, so it does not grow forever.
+            if (readPos == data.size())
+            {
+                data.clear();
+                readPos = 0;
+            }
+            else if (readPos > data.size() / 2)
+            {
+                data.erase(data.begin(), data.begin() + static_cast<std::ptrdiff_t>(readPos));
+                readPos = 0;
+            }
+
+            asio::post(*pendingContext, [handler = std::move(pendingHandler), length]() { handler({}, length); });
+        }
+        else if (closed)
+        {
+            asio::post(
+                *pendingContext,
+                [handler = std::move(pendingHandler)]() { handler(asio::error_code(asio::error::eof), 0); });
+        }
+        else
+        {
+            return;
+        }
+
+        pendingHandler = nullptr;
+        pendingContext = nullptr;
+        pendingWork.reset();
+    }
+
+    void Close()
+    {
+        std::scoped_lock lock(mux);
+        closed = true;
+        TryCompleteRead();
+    }
+};
+
+// In-process transport. No kernel, no sockets: bytes are copied between two memory_pipe_channels
+// and completions are posted to the io_context of each side. Useful for tests, benchmarks and
+// services that live in the same process as the server.
+class memory_pipe_transport : public transport
+{
+public:
+    memory_pipe_transport(
+        asio::io_context& context, std::shared_ptr<memory_pipe_channel> in, std::shared_ptr<memory_pipe_channel> out,
+        std::string name)
+      : m_context(context), m_in(std::move(in)), m_out(std::move(out)), m_name(std::move(name))
+    {}
+
+    ~memory_pipe_transport() override { Close(); }
+
+    void AsyncRead(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        StartRead(buffer, false, std::move(handler));
+    }
+
+    void AsyncReadSome(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        StartRead(buffer, true, std::move(handler));
+    }
+
+    void AsyncWaitReadable(io_handler handler) override { StartRead(asio::mutable_buffer(), true, std::move(handler)); }
+
+    void AsyncWrite(asio::const_buffer buffer, io_handler handler) override
+    {
+        AsyncWrite(std::span<const asio::const_buffer>(&buffer, 1), std::move(handler));
+    }
+
+    void AsyncWrite(std::span<const asio::const_buffer> buffers, io_handler handler) override
+    {
+        size_t length = 0;
+        {
+            std::scoped_lock lock(m_out->mux);
+            if (m_out->closed)
+            {
+                asio::post(
+                    m_context,
+                    [handler = std::move(handler)]() { handler(asio::error_code(asio::error::broken_pipe), 0); });
+                return;
+            }
+
+            for (const auto& buffer : buffers)
+            {
+                auto bytes = static_cast<const uint8_t*>(buffer.data());
+                m_out->data.insert(m_out->data.end(), bytes, bytes + buffer.size());
+                length += buffer.size();
+            }
+            m_out->TryCompleteRead();
+        }
+
+        asio::post(m_context, [handler = std::move(handler), length]() { handler({}, length); });
+    }
+
+    void AsyncConnect(connect_handler handler) override
+    {
+        asio::post(m_context, [handler = std::move(handler)]() { handler({}); });
+    }
+
+    void Close() override
+    {
+        if (!m_bOpen.exchange(false))
+            return;
+
+        // The own pending read is dropped rather than completed: its handler holds the connection and its
+        // context may be stopped already. It is destroyed outside the lock, as it may own this transport.
+        io_handler dropped;
+        {
+            std::scoped_lock lock(m_in->mux);
+            m_in->closed = true;
+            dropped = std::move(m_in->pendingHandler);
+            m_in->pendingHandler = nullptr;
+            m_in->pendingContext = nullptr;
+            m_in->pendingWork.reset();
+        }
+        m_out->Close();
+    }
+
+    bool IsOpen() const override { return m_bOpen; }
+
+    std::string RemoteName() const override { return m_name; }
+private:
+    void StartRead(asio::mutable_buffer buffer, bool bSome, io_handler handler)
+    {
+        std::scoped_lock lock(m_in->mux);
+        m_in->pendingBuffer = buffer;
+        m_in->pendingSome = bSome;
+        m_in->pendingHandler = std::move(handler);
+        m_in->pendingContext = &m_context;
+        m_in->pendingWork.emplace(m_context.get_executor());
+        m_in->TryCompleteRead();
+    }
+private:
+    asio::io_context& m_context;
+    std::shared_ptr<memory_pipe_channel> m_in;
+    std::shared_ptr<memory_pipe_channel> m_out;
+    std::string m_name;
+    std::atomic<bool> m_bOpen = true;
+};
+
+// Create two connected ends of an in-process pipe. Each end completes its operations on its own io_context.
+inline std::pair<std::unique_ptr<transport>, std::unique_ptr<transport>> make_memory_pipe(
+    asio::io_context& contextA, asio::io_context& contextB)
+{
+    auto aToB = std::make_shared<memory_pipe_channel>();
+    auto bToA = std::make_shared<memory_pipe_channel>();
+    return {
+        std::make_unique<memory_pipe_transport>(contextA, bToA, aToB, "in-process"),
+        std::make_unique<memory_pipe_transport>(contextB, aToB, bToA, "in-process")};
+}
+
+} // namespace net
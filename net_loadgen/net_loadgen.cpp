@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fmt/format.h>
+#include <fstream>
+#include <memory>
+#include <my_cpp_utils/logger.h>
+#include <net_common/net_connection.h>
+#include <net_common/net_memory.h>
+#include <net_common/net_server.h>
+#include <net_common/net_timing.h>
+#include <net_common/net_transport.h>
+#include <random>
+#include <simple_common/custom_msg_type.h>
+#include <simple_common/settings.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Headless load generator for simple_server.
+// Thousands of logical clients share a small pool of I/O threads (one io_context per thread), so 10k clients
+// cost a few threads, not 10k. A client_interface would start a thread per client.
+// Clients follow scripted scenarios: ping at a rate, MessageAll at a rate, a linear ramp-up and churn
+// (clients replaced by new ones). Every scenario ends with a report of its latency and error counts.
+//
+//   net_loadgen --clients 1000 --ramp-up 10 --duration 30 --ping-rate 2
+//   net_loadgen --scenarios scenarios.txt
+//
+// Scenario file: "[name]" starts a scenario, then "key = value" lines with the option names without "--".
+// Scenarios run one after another, each starts from zero clients.
+
+using loadgen_connection = net::connection<CustomMsgTypes>;
+
+struct scenario
+{
+    std::string name = "default";
+    size_t clients = 100;
+    // Seconds to reach "clients", linearly. Part of the duration.
+    double rampUp = 0.0;
+    double duration = 10.0;
+    // Messages per client per second.
+    double pingRate = 1.0;
+    double messageAllRate = 0.0;
+    // Share of the clients replaced by new connections per second (0.1 - 10% per second).
+    double churn = 0.0;
+    // Extra ping body bytes.
+    size_t payload = 0;
+};
+
+struct loadgen_options
+{
+    std::string host = "127.0.0.1";
+    uint16_t port = settings::defaultPort;
+    // Unix domain socket path of the server. Used instead of host:port if set.
+    std::string local;
+    // I/O threads, each with its own io_context.
+    size_t threads = 2;
+    // A client that is not connected after this many seconds is counted as a failed connect.
+    double connectTimeout = 5.0;
+    std::vector<scenario> scenarios;
+};
+
+// Counters of one scenario. Updated by the scheduler and the receiver threads.
+struct scenario_stats
+{
+    std::atomic<uint64_t> nConnects = 0;
+    std::atomic<uint64_t> nAccepted = 0;
+    std::atomic<uint64_t> nDenied = 0;
+    std::atomic<uint64_t> nConnectFailures = 0;
+    std::atomic<uint64_t> nDropped = 0;
+    std::atomic<uint64_t> nChurned = 0;
+    std::atomic<uint64_t> nPingsSent = 0;
+    std::atomic<uint64_t> nPingsReceived = 0;
+    std::atomic<uint64_t> nMessageAllSent = 0;
+    std::atomic<uint64_t> nBroadcastsReceived = 0;
+    net::latency_histogram pingLatency;
+};
+
+// One io_context per thread. Handlers of a connection never run on two threads at once,
+// which the connection class relies on.
+class io_pool
+{
+public:
+    explicit io_pool(size_t nThreads)
+    {
+        for (size_t i = 0; i < std::max<size_t>(1, nThreads); ++i)
+        {
+            m_vecContexts.push_back(std::make_unique<asio::io_context>());
+            m_vecGuards.push_back(asio::make_work_guard(*m_vecContexts.back()));
+        }
+        for (auto& pContext : m_vecContexts)
+            m_vecThreads.emplace_back([&context = *pContext]() { context.run(); });
+    }
+
+    ~io_pool() { Stop(); }
+
+    // Round robin.
+    asio::io_context& Next() { return *m_vecContexts[m_nNext++ % m_vecContexts.size()]; }
+
+    void Stop()
+    {
+        for (auto& pContext : m_vecContexts)
+            pContext->stop();
+        for (auto& thread : m_vecThreads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+private:
+    std::vector<std::unique_ptr<asio::io_context>> m_vecContexts;
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_vecGuards;
+    std::vector<std::thread> m_vecThreads;
+    size_t m_nNext = 0;
+};
+
+struct logical_client
+{
+    std::unique_ptr<loadgen_connection> pConnection;
+    std::chrono::steady_clock::time_point created;
+    bool bSeenConnected = false;
+    // Sends owed by the rates, fractions carry over to the next tick.
+    double fPingCredit = 0.0;
+    double fMessageAllCredit = 0.0;
+};
+
+bool SetScenarioOption(scenario& s, const std::string& key, const std::string& value)
+{
+    if (key == "clients")
+        s.clients = std::stoul(value);
+    else if (key == "ramp-up")
+        s.rampUp = std::stod(value);
+    else if (key == "duration")
+        s.duration = std::stod(value);
+    else if (key == "ping-rate")
+        s.pingRate = std::stod(value);
+    else if (key == "message-all-rate")
+        s.messageAllRate = std::stod(value);
+    else if (key == "churn")
+        s.churn = std::stod(value);
+    else if (key == "payload")
+        s.payload = std::stoul(value);
+    else
+        return false;
+    return true;
+}
+
+std::string Trim(const std::string& text)
+{
+    size_t nBegin = text.find_first_not_of(" \t\r");
+    if (nBegin == std::string::npos)
+        return {};
+    size_t nEnd = text.find_last_not_of(" \t\r");
+    return text.substr(nBegin, nEnd - nBegin + 1);
+}
+
+bool LoadScenarios(const std::string& path, std::vector<scenario>& scenarios)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        MY_LOG(error, "[net_loadgen] Can't open scenario file {}", path);
+        return false;
+    }
+
+    std::string line;
+    size_t nLine = 0;
+    while (std::getline(file, line))
+    {
+        nLine++;
+        line = Trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+
+        if (line.front() == '[' && line.back() == ']')
+        {
+            scenarios.emplace_back();
+            scenarios.back().name = Trim(line.substr(1, line.size() - 2));
+            continue;
+        }
+
+        size_t nEqual = line.find('=');
+        if (scenarios.empty() || nEqual == std::string::npos ||
+            !SetScenarioOption(scenarios.back(), Trim(line.substr(0, nEqual)), Trim(line.substr(nEqual + 1))))
+        {
+            MY_LOG(error, "[net_loadgen] {}:{}: can't parse \"{}\"", path, nLine, line);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ParseOptions(int argc, char** argv, loadgen_options& options)
+{
+    scenario inlineScenario;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--host")
+            options.host = value;
+        else if (key == "--port")
+            options.port = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--local")
+            options.local = value;
+        else if (key == "--threads")
+            options.threads = std::stoul(value);
+        else if (key == "--connect-timeout")
+            options.connectTimeout = std::stod(value);
+        else if (key == "--scenarios")
+        {
+            if (!LoadScenarios(value, options.scenarios))
+                return false;
+        }
+        else if (key.starts_with("--") && SetScenarioOption(inlineScenario, key.substr(2), value))
+            continue;
+        else
+            MY_LOG(warn, "[net_loadgen] Unknown option {}", key);
+    }
+
+    if (options.scenarios.empty())
+        options.scenarios.push_back(inlineScenario);
+    return true;
+}
+
+class load_generator
+{
+public:
+    explicit load_generator(const loadgen_options& options) : m_options(options)
+    {
+        if (m_options.local.empty())
+        {
+            asio::io_context context;
+            asio::ip::tcp::resolver resolver(context);
+            for (const auto& entry : resolver.resolve(m_options.host, std::to_string(m_options.port)))
+                m_vecEndpoints.push_back(entry.endpoint());
+        }
+
+        // Idle clients give their receive buffers back, so 10k mostly idle clients stay small.
+        m_connectionOptions.idleBufferPool = std::make_shared<net::buffer_pool>();
+    }
+
+    void Run(const scenario& s)
+    {
+        scenario_stats stats;
+        std::atomic<bool> bReceiving = true;
+        net::thread_safe_queue<net::owned_message<CustomMsgTypes>> qIn;
+        std::thread threadReceive([&]() { ReceiveLoop(qIn, stats, bReceiving); });
+
+        // Connections are destroyed after the pool has stopped, so no handler can touch them,
+        // but before the pool, as their sockets belong to its contexts.
+        io_pool pool(m_options.threads);
+        std::vector<logical_client> vecClients;
+        std::vector<std::unique_ptr<loadgen_connection>> vecRetired;
+        RunSchedule(s, pool, qIn, stats, vecClients, vecRetired);
+        pool.Stop();
+        vecClients.clear();
+        vecRetired.clear();
+
+        // Wake up the receiver, so it sees bReceiving == false.
+        bReceiving = false;
+        qIn.push_back({});
+        threadReceive.join();
+
+        Report(s, stats);
+    }
+private:
+    void RunSchedule(
+        const scenario& s, io_pool& pool, net::thread_safe_queue<net::owned_message<CustomMsgTypes>>& qIn,
+        scenario_stats& stats, std::vector<logical_client>& vecClients,
+        std::vector<std::unique_ptr<loadgen_connection>>& vecRetired)
+    {
+        using clock = std::chrono::steady_clock;
+        constexpr auto c_tick = std::chrono::milliseconds(10);
+        const auto connectTimeout =
+            std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(m_options.connectTimeout));
+
+        std::uniform_real_distribution<double> phase(0.0, 1.0);
+        auto addClient = [&]()
+        {
+            // The connection runs on the context of its socket.
+            asio::io_context& context = pool.Next();
+            logical_client client;
+            client.pConnection = std::make_unique<loadgen_connection>(
+                loadgen_connection::owner::client, context, MakeTransport(context), qIn, m_connectionOptions);
+            client.pConnection->ConnectToServer();
+            client.created = clock::now();
+            // Random phases, so the clients do not send in lockstep.
+            client.fPingCredit = phase(m_random);
+            client.fMessageAllCredit = phase(m_random);
+            vecClients.push_back(std::move(client));
+            stats.nConnects++;
+        };
+        auto retireClient = [&](size_t nIndex)
+        {
+            vecClients[nIndex].pConnection->Disconnect();
+            vecRetired.push_back(std::move(vecClients[nIndex].pConnection));
+            vecClients[nIndex] = std::move(vecClients.back());
+            vecClients.pop_back();
+        };
+
+        const auto timeStart = clock::now();
+        auto timeLast = timeStart;
+        double fChurnCredit = 0.0;
+        while (true)
+        {
+            std::this_thread::sleep_until(timeLast + c_tick);
+            auto now = clock::now();
+            double dt = std::chrono::duration<double>(now - timeLast).count();
+            double elapsed = std::chrono::duration<double>(now - timeStart).count();
+            timeLast = now;
+            if (elapsed >= s.duration)
+                break;
+
+            // Ramp-up: the number of clients grows linearly to s.clients.
+            double fRamp = s.rampUp > 0.0 ? std::min(1.0, elapsed / s.rampUp) : 1.0;
+            auto nTarget = static_cast<size_t>(double(s.clients) * fRamp);
+            while (vecClients.size() < nTarget)
+                addClient();
+
+            // Churn: replace random clients by new connections.
+            fChurnCredit += s.churn * double(vecClients.size()) * dt;
+            for (; fChurnCredit >= 1.0 && !vecClients.empty(); fChurnCredit -= 1.0)
+            {
+                retireClient(std::uniform_int_distribution<size_t>(0, vecClients.size() - 1)(m_random));
+                addClient();
+                stats.nChurned++;
+            }
+
+            for (size_t i = 0; i < vecClients.size();)
+            {
+                auto& client = vecClients[i];
+                if (!client.pConnection->IsConnected())
+                {
+                    // Dead clients are replaced, so the load stays at the target.
+                    if (client.bSeenConnected)
+                        stats.nDropped++;
+                    else if (now - client.created < connectTimeout)
+                    {
+                        ++i;
+                        continue;
+                    }
+                    else
+                        stats.nConnectFailures++;
+
+                    retireClient(i);
+                    addClient();
+                    continue;
+                }
+                client.bSeenConnected = true;
+
+                client.fPingCredit += s.pingRate * dt;
+                for (; client.fPingCredit >= 1.0; client.fPingCredit -= 1.0)
+                    SendPing(*client.pConnection, s, stats);
+
+                client.fMessageAllCredit += s.messageAllRate * dt;
+                for (; client.fMessageAllCredit >= 1.0; client.fMessageAllCredit -= 1.0)
+                {
+                    net::message<CustomMsgTypes> msg;
+                    msg.header.id = CustomMsgTypes::MessageAll;
+                    client.pConnection->Send(msg);
+                    stats.nMessageAllSent++;
+                }
+                ++i;
+            }
+        }
+
+        for (auto& client : vecClients)
+            client.pConnection->Disconnect();
+    }
+
+    void SendPing(loadgen_connection& connection, const scenario& s, scenario_stats& stats)
+    {
+        net::message<CustomMsgTypes> msg;
+        msg.header.id = CustomMsgTypes::ServerPing;
+        msg.body.resize(s.payload);
+        msg.header.size = msg.body.size();
+        // The server echoes the ping, the send time comes back with it.
+        msg << net::SteadyNowNs();
+        connection.Send(msg);
+        stats.nPingsSent++;
+    }
+
+    static void ReceiveLoop(
+        net::thread_safe_queue<net::owned_message<CustomMsgTypes>>& qIn, scenario_stats& stats,
+        std::atomic<bool>& bReceiving)
+    {
+        while (bReceiving)
+        {
+            qIn.wait();
+            while (!qIn.empty())
+            {
+                auto msg = qIn.pop_front().msg;
+                // The wakeup message of Run, or an answer that came after the scenario.
+                if (!bReceiving)
+                    return;
+
+                switch (msg.header.id)
+                {
+                case CustomMsgTypes::ServerAccept:
+                    stats.nAccepted++;
+                    break;
+                case CustomMsgTypes::ServerDeny:
+                    stats.nDenied++;
+                    break;
+                case CustomMsgTypes::ServerPing:
+                    {
+                        if (msg.body.size() < sizeof(int64_t))
+                            break;
+                        int64_t nSentNs = 0;
+                        msg >> nSentNs;
+                        stats.pingLatency.Record(net::SteadyNowNs() - nSentNs);
+                        stats.nPingsReceived++;
+                        break;
+                    }
+                case CustomMsgTypes::ServerMessage:
+                    stats.nBroadcastsReceived++;
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+    }
+
+    std::unique_ptr<net::transport> MakeTransport(asio::io_context& context)
+    {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        if (!m_options.local.empty())
+        {
+            std::vector endpoints{asio::local::stream_protocol::endpoint(m_options.local)};
+            return std::make_unique<net::local_transport>(
+                asio::local::stream_protocol::socket(context), std::move(endpoints));
+        }
+#endif
+        return std::make_unique<net::tcp_transport>(asio::ip::tcp::socket(context), m_vecEndpoints);
+    }
+
+    static void Report(const scenario& s, const scenario_stats& stats)
+    {
+        auto us = [&](double p) { return double(stats.pingLatency.PercentileNs(p)) / 1000.0; };
+        uint64_t nPingsSent = stats.nPingsSent;
+        uint64_t nPingsLost = nPingsSent - std::min<uint64_t>(nPingsSent, stats.nPingsReceived);
+
+        fmt::print(
+            "[{}] clients={} ramp-up={}s duration={}s ping-rate={} message-all-rate={} churn={}\n", s.name, s.clients,
+            s.rampUp, s.duration, s.pingRate, s.messageAllRate, s.churn);
+        fmt::print(
+            "  connections: opened {} accepted {} denied {} connect failures {} dropped {} churned {}\n",
+            stats.nConnects.load(), stats.nAccepted.load(), stats.nDenied.load(), stats.nConnectFailures.load(),
+            stats.nDropped.load(), stats.nChurned.load());
+        fmt::print(
+            "  ping: sent {} received {} lost {} ({:.2f}/s)\n", nPingsSent, stats.nPingsReceived.load(), nPingsLost,
+            double(stats.nPingsReceived.load()) / s.duration);
+        fmt::print(
+            "  ping latency us: p50 {:.1f} p90 {:.1f} p99 {:.1f} p99.9 {:.1f} max {:.1f} mean {:.1f}\n", us(0.5),
+            us(0.9), us(0.99), us(0.999), us(1.0), double(stats.pingLatency.MeanNs()) / 1000.0);
+        fmt::print(
+            "  message all: sent {} broadcasts received {}\n", stats.nMessageAllSent.load(),
+            stats.nBroadcastsReceived.load());
+    }
+
+    const loadgen_options& m_options;
+    std::vector<asio::ip::tcp::endpoint> m_vecEndpoints;
+    net::connection_options<CustomMsgTypes> m_connectionOptions;
+    std::mt19937 m_random{std::random_device{}()};
+};
+
+int main(int argc, char** argv)
+{
+    utils::Logger::Init("logs/net_loadgen.log", spdlog::level::warn);
+
+    loadgen_options options;
+    if (!ParseOptions(argc, argv, options))
+        return -1;
+
+    load_generator generator(options);
+    for (const auto& s : options.scenarios)
+        generator.Run(s);
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <fmt/format.h>
+#include <my_cpp_utils/logger.h>
+#include <net_common/net_capture.h>
+#include <net_common/net_connection.h>
+#include <net_common/net_message.h>
+#include <net_common/net_server.h>
+#include <net_common/net_transport.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Replays a traffic capture (see server_interface::StartCapture) against a running server.
+// Every client connection of the capture becomes "clones" synthetic connections, and each of them sends
+// what the captured client sent, with the captured timing scaled by "speed" (0 - as fast as possible).
+//
+//   net_replay --capture traffic.netcap --port 60001 --speed 1 --clones 10
+//
+// Connections are opened before the replay clock starts, so the handshake is not a part of the replayed timing.
+// The messages of one connection are sent in the captured order; the order between connections follows the
+// capture as well, so two replays of the same file at max speed send the same sequence.
+
+// Message ids are replayed as they are, the tool does not need to know them.
+enum class ReplayMsgTypes : uint32_t
+{
+};
+
+using replay_connection = net::connection<ReplayMsgTypes>;
+
+struct replay_options
+{
+    std::string capture;
+    std::string host = "127.0.0.1";
+    uint16_t port = 60001;
+    // Unix domain socket path of the server. Used instead of host:port if set.
+    std::string local;
+    // 1 - captured timing, 2 - twice as fast, 0 - no pauses at all.
+    double speed = 1.0;
+    // Synthetic connections per captured connection.
+    size_t clones = 1;
+    // Time to wait for the connections to be accepted and for the last answers after the replay.
+    double warmup = 2.0;
+    double drain = 1.0;
+};
+
+// One step of the replay: a message to send, or a connection to close.
+struct replay_event
+{
+    int64_t nTimeNs = 0;
+    uint32_t nConnectionID = 0;
+    net::capture_event event = net::capture_event::inbound;
+    net::shared_message<ReplayMsgTypes> pMsg;
+};
+
+struct replay_capture
+{
+    std::vector<replay_event> vecEvents;
+    // Captured connection IDs in the order they appear.
+    std::vector<uint32_t> vecConnectionIDs;
+    size_t nInbound = 0;
+    size_t nOutbound = 0;
+};
+
+replay_options ParseOptions(int argc, char** argv)
+{
+    replay_options options;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--capture")
+            options.capture = value;
+        else if (key == "--host")
+            options.host = value;
+        else if (key == "--port")
+            options.port = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--local")
+            options.local = value;
+        else if (key == "--speed")
+            options.speed = std::stod(value);
+        else if (key == "--clones")
+            options.clones = std::max<size_t>(1, std::stoul(value));
+        else if (key == "--warmup")
+            options.warmup = std::stod(value);
+        else if (key == "--drain")
+            options.drain = std::stod(value);
+        else
+            MY_LOG(warn, "[net_replay] Unknown option {}", key);
+    }
+    return options;
+}
+
+bool LoadCapture(const std::string& path, replay_capture& capture)
+{
+    net::capture_reader reader;
+    if (!reader.Open(path))
+    {
+        MY_LOG(error, "[net_replay] Can't open capture {}", path);
+        return false;
+    }
+    if (reader.Header().nHeaderSize != sizeof(net::message_header<ReplayMsgTypes>))
+    {
+        MY_LOG(
+            error, "[net_replay] Capture has {} byte message headers, expected {}", reader.Header().nHeaderSize,
+            sizeof(net::message_header<ReplayMsgTypes>));
+        return false;
+    }
+
+    net::capture_record record;
+    std::vector<uint8_t> header;
+    std::vector<uint8_t> body;
+    std::unordered_map<uint32_t, bool> mapSeen;
+    while (reader.Next(record, header, body))
+    {
+        if (record.event == net::capture_event::outbound)
+        {
+            capture.nOutbound++;
+            continue;
+        }
+
+        // Clients connected before the capture started have no connect record.
+        if (!mapSeen[record.nConnectionID])
+        {
+            mapSeen[record.nConnectionID] = true;
+            capture.vecConnectionIDs.push_back(record.nConnectionID);
+        }
+
+        if (record.event == net::capture_event::connect)
+            continue;
+
+        replay_event event;
+        event.nTimeNs = record.nTimeNs;
+        event.nConnectionID = record.nConnectionID;
+        event.event = record.event;
+        if (record.event == net::capture_event::inbound)
+        {
+            auto pMsg = std::make_shared<net::message<ReplayMsgTypes>>();
+            std::memcpy(&pMsg->header, header.data(), header.size());
+            pMsg->body = std::move(body);
+            pMsg->header.size = pMsg->body.size();
+            event.pMsg = std::move(pMsg);
+            capture.nInbound++;
+        }
+        capture.vecEvents.push_back(std::move(event));
+    }
+    return true;
+}
+
+std::unique_ptr<net::transport> MakeTransport(
+    const replay_options& options, asio::io_context& context, const std::vector<asio::ip::tcp::endpoint>& endpoints)
+{
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    if (!options.local.empty())
+    {
+        std::vector endpoints{asio::local::stream_protocol::endpoint(options.local)};
+        return std::make_unique<net::local_transport>(
+            asio::local::stream_protocol::socket(context), std::move(endpoints));
+    }
+#endif
+
+    return std::make_unique<net::tcp_transport>(asio::ip::tcp::socket(context), endpoints);
+}
+
+int main(int argc, char** argv)
+{
+    utils::Logger::Init("logs/net_replay.log", spdlog::level::warn);
+
+    replay_options options = ParseOptions(argc, argv);
+    if (options.capture.empty())
+    {
+        fmt::print("usage: net_replay --capture <file> [--host 127.0.0.1] [--port 60001] [--local <path>]\n"
+                   "                  [--speed 1] [--clones 1] [--warmup 2] [--drain 1]\n");
+        return -1;
+    }
+
+    replay_capture capture;
+    if (!LoadCapture(options.capture, capture))
+        return -1;
+    if (capture.vecEvents.empty())
+    {
+        MY_LOG(error, "[net_replay] Capture {} has no client messages", options.capture);
+        return -1;
+    }
+
+    // All connections share one context and one thread, as net_benchmark clients do.
+    asio::io_context context;
+    std::vector<asio::ip::tcp::endpoint> endpoints;
+    if (options.local.empty())
+    {
+        asio::ip::tcp::resolver resolver(context);
+        for (const auto& entry : resolver.resolve(options.host, std::to_string(options.port)))
+            endpoints.push_back(entry.endpoint());
+    }
+
+    net::thread_safe_queue<net::owned_message<ReplayMsgTypes>> qIn;
+    std::vector<std::unique_ptr<replay_connection>> connections;
+    std::unordered_map<uint32_t, std::vector<replay_connection*>> mapClones;
+    for (uint32_t nCapturedID : capture.vecConnectionIDs)
+    {
+        for (size_t i = 0; i < options.clones; ++i)
+        {
+            connections.push_back(std::make_unique<replay_connection>(
+                replay_connection::owner::client, context, MakeTransport(options, context, endpoints), qIn,
+                net::connection_options<ReplayMsgTypes>{}));
+            connections.back()->ConnectToServer();
+            mapClones[nCapturedID].push_back(connections.back().get());
+        }
+    }
+    auto workGuard = asio::make_work_guard(context);
+    std::thread threadContext([&]() { context.run(); });
+
+    // Servers greet new clients after the handshake, so the greetings tell that the connections may send.
+    // A server that says nothing first gets the whole warmup time.
+    size_t nReceived = 0;
+    auto warmupEnd = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                            std::chrono::duration<double>(options.warmup));
+    while (nReceived < connections.size() && std::chrono::steady_clock::now() < warmupEnd)
+    {
+        while (!qIn.empty())
+        {
+            qIn.pop_front();
+            nReceived++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    size_t nGreetings = nReceived;
+
+    size_t nConnected = 0;
+    for (const auto& pConnection : connections)
+        nConnected += pConnection->IsConnected();
+
+    // Replay clock: captured time, relative to the first event, divided by the speed.
+    const int64_t nFirstNs = capture.vecEvents.front().nTimeNs;
+    const auto timeStart = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds maxLag{0};
+    size_t nSent = 0;
+    for (const auto& event : capture.vecEvents)
+    {
+        if (options.speed > 0.0)
+        {
+            auto due = timeStart + std::chrono::nanoseconds(
+                                       static_cast<int64_t>(double(event.nTimeNs - nFirstNs) / options.speed));
+            auto now = std::chrono::steady_clock::now();
+            if (now < due)
+                std::this_thread::sleep_until(due);
+            else
+                maxLag = std::max(maxLag, std::chrono::duration_cast<std::chrono::nanoseconds>(now - due));
+        }
+
+        for (replay_connection* pConnection : mapClones[event.nConnectionID])
+        {
+            if (event.event == net::capture_event::inbound)
+            {
+                pConnection->Send(event.pMsg);
+                nSent++;
+            }
+            else if (event.event == net::capture_event::disconnect)
+            {
+                pConnection->Disconnect();
+            }
+        }
+
+        while (!qIn.empty())
+        {
+            qIn.pop_front();
+            nReceived++;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+
+    // Answers to the last messages are still on their way.
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.drain));
+    while (!qIn.empty())
+    {
+        qIn.pop_front();
+        nReceived++;
+    }
+
+    fmt::print(
+        "capture={} captured connections={} client messages={} server messages={}\n", options.capture,
+        capture.vecConnectionIDs.size(), capture.nInbound, capture.nOutbound);
+    fmt::print(
+        "speed={} clones={} connections={} connected={}\n",
+        options.speed > 0.0 ? fmt::format("{}x", options.speed) : std::string("max"), options.clones,
+        connections.size(), nConnected);
+    fmt::print("sent: {} in {:.3f}s, {:.0f} messages/s\n", nSent, elapsed, elapsed > 0 ? double(nSent) / elapsed : 0.0);
+    fmt::print("max lag behind the captured timing: {:.3f}ms\n", double(maxLag.count()) / 1e6);
+    fmt::print(
+        "received: {} (expected about {} as in the capture)\n", nReceived - nGreetings,
+        capture.nOutbound * options.clones);
+
+    for (const auto& pConnection : connections)
+        pConnection->Disconnect();
+    workGuard.reset();
+    context.stop();
+    threadContext.join();
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "net_test.h"
+#include <cstdint>
+#include <net_common/net_compress.h>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+std::vector<uint8_t> RandomBytes(size_t nSize, uint32_t nSeed)
+{
+    std::mt19937 random(nSeed);
+    std::vector<uint8_t> bytes(nSize);
+    for (auto& byte : bytes)
+        byte = static_cast<uint8_t>(random());
+    return bytes;
+}
+
+// Text like data: repeated words, so there are matches at many offsets.
+std::vector<uint8_t> RepetitiveBytes(size_t nSize)
+{
+    const char* words[] = {"player ", "position ", "health ", "100 ", "250.5 ", "inventory "};
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; bytes.size() < nSize; ++i)
+    {
+        const char* word = words[(i * 7 + i / 3) % 6];
+        while (*word && bytes.size() < nSize)
+            bytes.push_back(static_cast<uint8_t>(*word++));
+    }
+    return bytes;
+}
+
+bool RoundTrip(net::lz::compressor& compressor, const std::vector<uint8_t>& input, size_t* pCompressedSize = nullptr)
+{
+    std::vector<uint8_t> compressed;
+    compressor.Compress(input.data(), input.size(), compressed);
+    if (compressed.size() > net::lz::MaxCompressedSize(input.size()))
+        return false;
+    if (pCompressedSize)
+        *pCompressedSize = compressed.size();
+
+    std::vector<uint8_t> output(input.size());
+    return net::lz::Decompress(compressed.data(), compressed.size(), output.data(), output.size()) && output == input;
+}
+
+} // namespace
+
+TEST(LzRoundTripsEverySize)
+{
+    net::lz::compressor compressor;
+    for (size_t nSize : {0, 1, 4, 5, 12, 13, 16, 100, 4096, 65536 + 17, 300000})
+    {
+        CHECK(RoundTrip(compressor, RandomBytes(nSize, uint32_t(nSize))));
+        CHECK(RoundTrip(compressor, RepetitiveBytes(nSize)));
+        CHECK(RoundTrip(compressor, std::vector<uint8_t>(nSize, 0)));
+    }
+}
+
+TEST(LzShrinksRepetitiveData)
+{
+    net::lz::compressor compressor;
+    size_t nCompressed = 0;
+    CHECK(RoundTrip(compressor, std::vector<uint8_t>(1 << 20, 7), &nCompressed));
+    CHECK(nCompressed < 8192);
+
+    CHECK(RoundTrip(compressor, RepetitiveBytes(100000), &nCompressed));
+    CHECK(nCompressed < 50000);
+}
+
+TEST(LzCompressorIsReusedAfterTrim)
+{
+    net::lz::compressor compressor;
+    CHECK(RoundTrip(compressor, RepetitiveBytes(10000)));
+    compressor.Trim();
+    CHECK(compressor.MemoryFootprint() == 0);
+    CHECK(RoundTrip(compressor, RepetitiveBytes(10000)));
+}
+
+TEST(LzRefusesMalformedInput)
+{
+    net::lz::compressor compressor;
+    auto input = RepetitiveBytes(5000);
+    std::vector<uint8_t> compressed;
+    compressor.Compress(input.data(), input.size(), compressed);
+
+    // The output size must match exactly, in both directions.
+    std::vector<uint8_t> output(input.size() + 1);
+    CHECK(!net::lz::Decompress(compressed.data(), compressed.size(), output.data(), input.size() - 1));
+    CHECK(!net::lz::Decompress(compressed.data(), compressed.size(), output.data(), input.size() + 1));
+
+    // Cut off input.
+    for (size_t nCut : {size_t(1), compressed.size() / 2, compressed.size() - 1})
+        CHECK(!net::lz::Decompress(compressed.data(), nCut, output.data(), input.size()));
+
+    // A match reaching before the start of the output.
+    const uint8_t badOffset[] = {0x14, 'a', 0x10, 0x00, 0x50, 'a', 'b', 'c', 'd', 'e'};
+    std::vector<uint8_t> small(64);
+    CHECK(!net::lz::Decompress(badOffset, sizeof(badOffset), small.data(), 1 + 8 + 5));
+
+    // Garbage must be refused or decoded within the bounds, never read or written past them.
+    for (uint32_t nSeed = 0; nSeed < 200; ++nSeed)
+    {
+        auto garbage = RandomBytes(64 + nSeed, nSeed);
+        net::lz::Decompress(garbage.data(), garbage.size(), small.data(), small.size());
+    }
+}
@@ -0,0 +1,109 @@
+#include "net_test.h"
+#include <cstdint>
+#include <net_common/net_delta.h>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+bool RoundTrip(const std::vector<uint8_t>& baseline, const std::vector<uint8_t>& body, size_t* pEncodedSize = nullptr)
+{
+    std::vector<uint8_t> encoded;
+    net::delta::Encode(baseline, body, encoded);
+    if (pEncodedSize)
+        *pEncodedSize = encoded.size();
+
+    std::vector<uint8_t> decoded;
+    return net::delta::Decode(baseline, encoded.data(), encoded.size(), body.size(), decoded) && decoded == body;
+}
+
+} // namespace
+
+TEST(DeltaVarintRoundTrips)
+{
+    for (uint64_t value : {uint64_t(0), uint64_t(1), uint64_t(127), uint64_t(128), uint64_t(300), ~uint64_t(0)})
+    {
+        std::vector<uint8_t> out;
+        net::delta::WriteVarint(out, value);
+        const uint8_t* data = out.data();
+        uint64_t read = 0;
+        CHECK(net::delta::ReadVarint(data, out.data() + out.size(), read));
+        CHECK(read == value);
+        CHECK(data == out.data() + out.size());
+    }
+
+    // Cut off in the middle of a number.
+    std::vector<uint8_t> out;
+    net::delta::WriteVarint(out, 1 << 20);
+    const uint8_t* data = out.data();
+    uint64_t read = 0;
+    CHECK(!net::delta::ReadVarint(data, out.data() + out.size() - 1, read));
+}
+
+TEST(DeltaRoundTripsAgainstAnyBaseline)
+{
+    std::mt19937 random(42);
+    std::vector<uint8_t> state(1000);
+    for (auto& byte : state)
+        byte = static_cast<uint8_t>(random());
+
+    CHECK(RoundTrip({}, state));
+    CHECK(RoundTrip(state, state));
+    CHECK(RoundTrip(state, {}));
+
+    // Grown and shrunk bodies: bytes past the baseline are sent as they are.
+    auto grown = state;
+    grown.resize(1500, 9);
+    CHECK(RoundTrip(state, grown));
+    CHECK(RoundTrip(grown, state));
+
+    // Scattered changes, zero runs of every length around c_nMinZeroRun.
+    for (size_t nStep : {1, 2, 3, 4, 7, 100})
+    {
+        auto changed = state;
+        for (size_t i = 0; i < changed.size(); i += nStep)
+            changed[i] ^= 0x5A;
+        CHECK(RoundTrip(state, changed));
+    }
+}
+
+TEST(DeltaOfSmallChangeIsSmall)
+{
+    std::vector<uint8_t> state(4096, 1);
+    auto changed = state;
+    changed[100] = 2;
+    changed[3000] = 3;
+
+    size_t nEncoded = 0;
+    CHECK(RoundTrip(state, changed, &nEncoded));
+    CHECK(nEncoded < 16);
+}
+
+TEST(DeltaRefusesMalformedInput)
+{
+    std::vector<uint8_t> baseline(100, 1);
+    std::vector<uint8_t> body(100, 2);
+    std::vector<uint8_t> encoded;
+    net::delta::Encode(baseline, body, encoded);
+
+    std::vector<uint8_t> decoded;
+    // Over the size limit.
+    CHECK(!net::delta::Decode(baseline, encoded.data(), encoded.size(), body.size() - 1, decoded));
+    // Cut off: the body is not complete.
+    CHECK(!net::delta::Decode(baseline, encoded.data(), encoded.size() - 1, body.size(), decoded));
+    // Runs past the end of the body.
+    std::vector<uint8_t> overrun;
+    net::delta::WriteVarint(overrun, 10);
+    net::delta::WriteVarint(overrun, 8);
+    net::delta::WriteVarint(overrun, 3);
+    overrun.insert(overrun.end(), {1, 2, 3});
+    CHECK(!net::delta::Decode(baseline, overrun.data(), overrun.size(), 1000, decoded));
+    // A literal longer than the data left.
+    std::vector<uint8_t> shortLiteral;
+    net::delta::WriteVarint(shortLiteral, 10);
+    net::delta::WriteVarint(shortLiteral, 0);
+    net::delta::WriteVarint(shortLiteral, 10);
+    shortLiteral.insert(shortLiteral.end(), {1, 2, 3});
+    CHECK(!net::delta::Decode(baseline, shortLiteral.data(), shortLiteral.size(), 1000, decoded));
+}
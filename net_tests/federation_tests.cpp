@@ -0,0 +1,54 @@
+#include "net_test.h"
+#include <cstdint>
+#include <net_common/net_federation.h>
+
+TEST(SeenWindowAcceptsEachSequenceOnce)
+{
+    net::seen_window window;
+    for (uint64_t nSeq = 1; nSeq <= 200; ++nSeq)
+    {
+        CHECK(window.Insert(1, nSeq));
+        CHECK(!window.Insert(1, nSeq));
+    }
+    CHECK(!window.Insert(1, 150));
+}
+
+TEST(SeenWindowAcceptsReorderedItems)
+{
+    net::seen_window window;
+    CHECK(window.Insert(1, 10));
+    CHECK(window.Insert(1, 5));
+    CHECK(window.Insert(1, 9));
+    CHECK(window.Insert(1, 12));
+    CHECK(window.Insert(1, 11));
+    CHECK(!window.Insert(1, 5));
+    CHECK(!window.Insert(1, 9));
+    CHECK(!window.Insert(1, 11));
+    CHECK(window.Insert(1, 6));
+}
+
+TEST(SeenWindowForgetsItemsOlderThan64)
+{
+    net::seen_window window;
+    CHECK(window.Insert(1, 100));
+    // 64 behind the highest one still fits the bitmap, 65 does not and is taken for a duplicate.
+    CHECK(window.Insert(1, 36));
+    CHECK(!window.Insert(1, 35));
+
+    // A jump of more than 64 clears the bitmap, a jump of exactly 64 keeps the old highest one.
+    CHECK(window.Insert(1, 164));
+    CHECK(!window.Insert(1, 100));
+    CHECK(window.Insert(1, 1000));
+    CHECK(!window.Insert(1, 164));
+    CHECK(window.Insert(1, 999));
+}
+
+TEST(SeenWindowStartsOverOnNewIncarnation)
+{
+    // A restarted origin counts from 1 again.
+    net::seen_window window;
+    CHECK(window.Insert(1, 500));
+    CHECK(window.Insert(2, 1));
+    CHECK(window.Insert(2, 2));
+    CHECK(!window.Insert(2, 1));
+}
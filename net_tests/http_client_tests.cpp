@@ -0,0 +1,164 @@
+#include "net_test.h"
+#include <net_common/net_http_client.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace
+{
+
+using parse_result = net::http_response_parser::result;
+
+// Feed the bytes in pieces of nPiece bytes. nConsumed - bytes taken in total when the response is done.
+parse_result ParseInPieces(net::http_response_parser& parser, std::string_view bytes, size_t nPiece, size_t& nConsumed)
+{
+    nConsumed = 0;
+    auto result = parse_result::need_more;
+    while (nConsumed < bytes.size() && result == parse_result::need_more)
+    {
+        size_t nSize = std::min(nPiece, bytes.size() - nConsumed);
+        size_t nTaken = 0;
+        result = parser.Parse(bytes.data() + nConsumed, nSize, nTaken);
+        nConsumed += nTaken;
+    }
+    return result;
+}
+
+} // namespace
+
+TEST(HttpParserReadsContentLengthInAnyPieces)
+{
+    const std::string_view response = "HTTP/1.1 200 OK\r\n"
+                                      "Content-Type: text/plain\r\n"
+                                      "Content-Length: 11\r\n"
+                                      "\r\n"
+                                      "hello world";
+    for (size_t nPiece : {size_t(1), size_t(2), size_t(7), response.size()})
+    {
+        net::http_response_parser parser(1024, 1024);
+        parser.Reset(false);
+        size_t nConsumed = 0;
+        CHECK(ParseInPieces(parser, response, nPiece, nConsumed) == parse_result::done);
+        CHECK(nConsumed == response.size());
+        CHECK(parser.KeepAlive());
+
+        auto result = parser.TakeResponse();
+        CHECK(result.nStatus == 200);
+        CHECK(result.body == "hello world");
+        CHECK(result.Header("content-type") && *result.Header("content-type") == "text/plain");
+    }
+}
+
+TEST(HttpParserReadsChunkedBody)
+{
+    const std::string_view response = "HTTP/1.1 200 OK\r\n"
+                                      "Transfer-Encoding: chunked\r\n"
+                                      "\r\n"
+                                      "5;ext=1\r\nhello\r\n"
+                                      "6\r\n world\r\n"
+                                      "0\r\n"
+                                      "Trailer: dropped\r\n"
+                                      "\r\n";
+    for (size_t nPiece : {size_t(1), size_t(3), response.size()})
+    {
+        net::http_response_parser parser(1024, 1024);
+        parser.Reset(false);
+        size_t nConsumed = 0;
+        CHECK(ParseInPieces(parser, response, nPiece, nConsumed) == parse_result::done);
+        auto result = parser.TakeResponse();
+        CHECK(result.body == "hello world");
+        CHECK(!result.Header("trailer"));
+    }
+}
+
+TEST(HttpParserStopsAtEndOfPipelinedResponse)
+{
+    const std::string_view first = "HTTP/1.1 204 No Content\r\n\r\n";
+    const std::string_view second = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    const std::string both = std::string(first) + std::string(second);
+
+    net::http_response_parser parser(1024, 1024);
+    parser.Reset(false);
+    size_t nConsumed = 0;
+    CHECK(parser.Parse(both.data(), both.size(), nConsumed) == parse_result::done);
+    CHECK(nConsumed == first.size());
+    CHECK(parser.TakeResponse().nStatus == 204);
+
+    parser.Reset(false);
+    size_t nSecond = 0;
+    CHECK(parser.Parse(both.data() + nConsumed, both.size() - nConsumed, nSecond) == parse_result::done);
+    CHECK(nSecond == second.size());
+    CHECK(parser.TakeResponse().body == "ok");
+}
+
+TEST(HttpParserHandlesBodylessResponses)
+{
+    // HEAD: the length belongs to the resource, no body follows.
+    net::http_response_parser parser(1024, 1024);
+    parser.Reset(true);
+    const std::string_view head = "HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n";
+    size_t nConsumed = 0;
+    CHECK(parser.Parse(head.data(), head.size(), nConsumed) == parse_result::done);
+    CHECK(parser.TakeResponse().body.empty());
+
+    // 100 Continue is skipped, the final response follows it.
+    parser.Reset(false);
+    const std::string_view interim = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+    CHECK(parser.Parse(interim.data(), interim.size(), nConsumed) == parse_result::done);
+    CHECK(nConsumed == interim.size());
+    CHECK(parser.TakeResponse().nStatus == 201);
+}
+
+TEST(HttpParserReadsBodyUntilClose)
+{
+    net::http_response_parser parser(1024, 1024);
+    parser.Reset(false);
+    CHECK(!parser.Started());
+    const std::string_view response = "HTTP/1.0 200 OK\r\n\r\nuntil the end";
+    size_t nConsumed = 0;
+    CHECK(parser.Parse(response.data(), response.size(), nConsumed) == parse_result::need_more);
+    CHECK(parser.Started());
+    CHECK(!parser.KeepAlive());
+    CHECK(parser.Finish());
+    CHECK(parser.TakeResponse().body == "until the end");
+}
+
+TEST(HttpParserConnectionHeaderOverridesVersion)
+{
+    net::http_response_parser parser(1024, 1024);
+    parser.Reset(false);
+    const std::string_view close = "HTTP/1.1 200 OK\r\nConnection: Close\r\nContent-Length: 0\r\n\r\n";
+    size_t nConsumed = 0;
+    CHECK(parser.Parse(close.data(), close.size(), nConsumed) == parse_result::done);
+    CHECK(!parser.KeepAlive());
+
+    parser.Reset(false);
+    const std::string_view keepAlive = "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 0\r\n\r\n";
+    CHECK(parser.Parse(keepAlive.data(), keepAlive.size(), nConsumed) == parse_result::done);
+    CHECK(parser.KeepAlive());
+}
+
+TEST(HttpParserRefusesMalformedAndOversizedResponses)
+{
+    auto parse = [](std::string_view response, size_t nMaxHeader, size_t nMaxBody)
+    {
+        net::http_response_parser parser(nMaxHeader, nMaxBody);
+        parser.Reset(false);
+        size_t nConsumed = 0;
+        auto result = parser.Parse(response.data(), response.size(), nConsumed);
+        return result == parse_result::error ? parser.Error() : std::error_code();
+    };
+    auto badMessage = std::make_error_code(std::errc::bad_message);
+    auto messageSize = std::make_error_code(std::errc::message_size);
+
+    CHECK(parse("HTTP/2 200 OK\r\n\r\n", 1024, 1024) == badMessage);
+    CHECK(parse("HTTP/1.1 2x0 OK\r\n\r\n", 1024, 1024) == badMessage);
+    CHECK(parse("HTTP/1.1 200 OK\r\nno colon\r\n\r\n", 1024, 1024) == badMessage);
+    CHECK(parse("HTTP/1.1 200 OK\r\nContent-Length: 12a\r\n\r\n", 1024, 1024) == badMessage);
+    CHECK(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 1024, 1024) == badMessage);
+    CHECK(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nabX\r\n", 1024, 1024) == badMessage);
+
+    CHECK(parse("HTTP/1.1 200 OK\r\nContent-Length: 2000\r\n\r\n", 1024, 1024) == messageSize);
+    CHECK(parse("HTTP/1.1 200 OK\r\nX-Long: " + std::string(2000, 'x') + "\r\n\r\n", 1024, 1024) == messageSize);
+    CHECK(parse("HTTP/1.0 200 OK\r\n\r\n" + std::string(2000, 'x'), 1024, 1024) == messageSize);
+}
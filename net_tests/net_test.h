@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdio>
+#include <vector>
+
+// Minimal test harness, so the tests need nothing beyond the dependencies of the library.
+// TEST(Name) registers a test, CHECK records a failure and lets the test go on.
+namespace net_test
+{
+
+struct test_case
+{
+    const char* name;
+    void (*function)();
+};
+
+inline std::vector<test_case>& Registry()
+{
+    static std::vector<test_case> tests;
+    return tests;
+}
+
+inline int& Failures()
+{
+    static int nFailures = 0;
+    return nFailures;
+}
+
+struct registrar
+{
+    registrar(const char* name, void (*function)()) { Registry().push_back({name, function}); }
+};
+
+} // namespace net_test
+
+#define TEST(name) \
+    static void name(); \
+    static net_test::registrar name##Registrar(#name, name); \
+    static void name()
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) HAS FAILED\n", __FILE__, __LINE__, #condition); \
+            ++net_test::Failures(); \
+        } \
+    } \
+    while (false)
@@ -0,0 +1,28 @@
+#include "net_test.h"
+#include <cstdio>
+#include <cstring>
+#include <my_cpp_utils/logger.h>
+
+// Unit and in-process round trip tests of net_common. Runs every test, or only those whose name contains
+// the first argument. Returns non zero if any check fails.
+int main(int argc, char** argv)
+{
+    utils::Logger::Init("logs/net_tests.log", spdlog::level::warn);
+
+    const char* filter = argc > 1 ? argv[1] : "";
+    int nFailedTests = 0;
+    for (const auto& test : net_test::Registry())
+    {
+        if (std::strstr(test.name, filter) == nullptr)
+            continue;
+
+        int nFailuresBefore = net_test::Failures();
+        test.function();
+        bool bPassed = net_test::Failures() == nFailuresBefore;
+        std::printf("[%s] %s\n", bPassed ? "  OK  " : "FAILED", test.name);
+        nFailedTests += bPassed ? 0 : 1;
+    }
+
+    std::printf("%d test(s) failed\n", nFailedTests);
+    return nFailedTests == 0 ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+#include "net_test.h"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <net_common/net_client.h>
+#include <net_common/net_server.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Round trips through a whole client and server over an in-process pipe (see make_memory_pipe): the framing,
+// the handshake and every send stage, each on its own and all of them at once.
+
+namespace
+{
+
+enum class TestMsgTypes : uint32_t
+{
+    Echo,
+    State,
+    Blob,
+};
+
+using test_message = net::message<TestMsgTypes>;
+
+// Sends every message back to its sender.
+class echo_server : public net::server_interface<TestMsgTypes>
+{
+public:
+    echo_server() : net::server_interface<TestMsgTypes>(0) {}
+
+    std::shared_ptr<net::connection<TestMsgTypes>> m_pLastClient;
+protected:
+    bool OnClientConnect(std::shared_ptr<net::connection<TestMsgTypes>> client) override { return true; }
+
+    void OnMessage(std::shared_ptr<net::connection<TestMsgTypes>> client, test_message& msg) override
+    {
+        m_pLastClient = client;
+        client->Send(msg);
+    }
+};
+
+test_message MakeMessage(TestMsgTypes id, std::vector<uint8_t> body)
+{
+    test_message msg;
+    msg.header.id = id;
+    msg.header.size = body.size();
+    msg.body = std::move(body);
+    return msg;
+}
+
+// Empty and tiny bodies, several frames per read, a body larger than the receive buffer, compressible and
+// random blobs, and a state that changes a little with every message.
+std::vector<test_message> MakeTraffic()
+{
+    std::vector<test_message> messages;
+    messages.push_back(MakeMessage(TestMsgTypes::Echo, {}));
+
+    test_message numbers;
+    numbers.header.id = TestMsgTypes::Echo;
+    numbers << uint32_t(7) << 2.5 << int64_t(-1);
+    messages.push_back(numbers);
+
+    for (uint8_t i = 0; i < 200; ++i)
+        messages.push_back(MakeMessage(TestMsgTypes::Echo, std::vector<uint8_t>(i % 17, i)));
+
+    std::vector<uint8_t> text;
+    while (text.size() < 300000)
+    {
+        for (char c : std::string_view("the quick brown fox jumps over the lazy dog "))
+            text.push_back(static_cast<uint8_t>(c));
+    }
+    messages.push_back(MakeMessage(TestMsgTypes::Blob, text));
+
+    std::mt19937 random(7);
+    std::vector<uint8_t> noise(5000);
+    for (auto& byte : noise)
+        byte = static_cast<uint8_t>(random());
+    messages.push_back(MakeMessage(TestMsgTypes::Blob, noise));
+
+    std::vector<uint8_t> state(2000);
+    for (size_t i = 0; i < state.size(); ++i)
+        state[i] = static_cast<uint8_t>(i * 31);
+    for (size_t i = 0; i < 50; ++i)
+    {
+        state[(i * 97) % state.size()] ^= 0xFF;
+        if (i % 10 == 9)
+            state.resize(state.size() + 3, uint8_t(i));
+        messages.push_back(MakeMessage(TestMsgTypes::State, state));
+    }
+    return messages;
+}
+
+// Send the messages and collect what comes back, until all of them are back or the time is over.
+std::vector<test_message> Exchange(
+    echo_server& server, net::client_interface<TestMsgTypes>& client, const std::vector<test_message>& messages,
+    bool bTick, std::chrono::milliseconds timeout = std::chrono::seconds(10))
+{
+    for (const auto& msg : messages)
+        client.Send(msg);
+
+    std::vector<test_message> received;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (received.size() < messages.size() && std::chrono::steady_clock::now() < deadline)
+    {
+        if (bTick)
+            server.Tick();
+        else
+            server.Update(-1, false);
+
+        while (!client.Incoming().empty())
+            received.push_back(client.Incoming().pop_front().msg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return received;
+}
+
+bool SameMessages(const std::vector<test_message>& sent, const std::vector<test_message>& received)
+{
+    if (sent.size() != received.size())
+        return false;
+    for (size_t i = 0; i < sent.size(); ++i)
+    {
+        if (received[i].header.id != sent[i].header.id || received[i].body != sent[i].body ||
+            received[i].header.size != received[i].body.size())
+            return false;
+    }
+    return true;
+}
+
+size_t TotalBodySize(const std::vector<test_message>& messages)
+{
+    size_t nTotal = 0;
+    for (const auto& msg : messages)
+        nTotal += msg.body.size();
+    return nTotal;
+}
+
+// Counters of the server side of the connection. Copied out, as the connection can't outlive the server.
+struct round_trip_counters
+{
+    uint64_t nBytesIn = 0;
+    uint64_t nFramesOut = 0;
+    uint64_t nMessagesIn = 0;
+};
+
+// Run the traffic through a server and a client with the same options.
+round_trip_counters RoundTrip(const net::connection_options<TestMsgTypes>& options, bool bTick = false)
+{
+    echo_server server;
+    server.SetConnectionOptions(options);
+    if (bTick)
+    {
+        net::tick_options tick;
+        tick.tickRate = 1000;
+        server.EnableTickMode(tick);
+    }
+    CHECK(server.Start());
+
+    net::client_interface<TestMsgTypes> client;
+    client.SetConnectionOptions(options);
+    CHECK(client.ConnectInProcess(server));
+
+    // Sent before the handshake is over, so they wait for it: the server handles nothing before validation.
+    auto messages = MakeTraffic();
+    CHECK(SameMessages(messages, Exchange(server, client, messages, bTick)));
+    CHECK(client.IsConnected());
+
+    round_trip_counters counters;
+    CHECK(server.m_pLastClient);
+    if (server.m_pLastClient)
+    {
+        counters.nBytesIn = server.m_pLastClient->Counters().nBytesIn;
+        counters.nFramesOut = server.m_pLastClient->Counters().nFramesOut;
+        counters.nMessagesIn = server.m_pLastClient->Counters().nMessagesIn;
+    }
+    return counters;
+}
+
+} // namespace
+
+TEST(PipeRoundTripPlain)
+{
+    CHECK(RoundTrip({}).nMessagesIn == MakeTraffic().size());
+}
+
+TEST(PipeRoundTripChecksum)
+{
+    net::connection_options<TestMsgTypes> options;
+    options.checksum = true;
+    RoundTrip(options);
+}
+
+TEST(PipeRoundTripTimestamps)
+{
+    net::connection_options<TestMsgTypes> options;
+    options.timestamps = true;
+    RoundTrip(options);
+}
+
+TEST(PipeRoundTripCompression)
+{
+    net::connection_options<TestMsgTypes> options;
+    options.compressTypes = {{TestMsgTypes::Blob, 64}};
+    // The text blob shrinks a lot, the noise is sent as it is.
+    CHECK(RoundTrip(options).nBytesIn < TotalBodySize(MakeTraffic()) / 2);
+}
+
+TEST(PipeRoundTripDelta)
+{
+    net::connection_options<TestMsgTypes> options;
+    options.deltaTypes = {TestMsgTypes::State};
+    // 50 states of about 2000 bytes, each a few bytes away from the one before.
+    CHECK(RoundTrip(options).nBytesIn < TotalBodySize(MakeTraffic()) - 50 * 1500);
+}
+
+TEST(PipeRoundTripBatching)
+{
+    // Echoes of the same tick go out in one aggregate frame.
+    CHECK(RoundTrip({}, true).nFramesOut < MakeTraffic().size() / 2);
+}
+
+TEST(PipeRoundTripAllStages)
+{
+    net::connection_options<TestMsgTypes> options;
+    options.checksum = true;
+    options.timestamps = true;
+    options.compressTypes = {{TestMsgTypes::Blob, 64}, {TestMsgTypes::State, 64}};
+    options.deltaTypes = {TestMsgTypes::State};
+    options.nMaxIncomingBytes = 256 * 1024;
+    RoundTrip(options, true);
+}
+
+TEST(PipeRefusesFramesWithoutRequiredChecksum)
+{
+    // One side sends frames without the trailer the other requires: the connection is closed, nothing is handled.
+    echo_server server;
+    net::connection_options<TestMsgTypes> options;
+    options.checksum = true;
+    server.SetConnectionOptions(options);
+    CHECK(server.Start());
+
+    net::client_interface<TestMsgTypes> client;
+    CHECK(client.ConnectInProcess(server));
+    auto received = Exchange(
+        server, client, {MakeMessage(TestMsgTypes::Echo, {1, 2, 3})}, false, std::chrono::milliseconds(300));
+    CHECK(received.empty());
+    CHECK(!server.m_pLastClient);
+}
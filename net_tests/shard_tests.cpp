@@ -0,0 +1,112 @@
+#include "net_test.h"
+#include <cstdint>
+#include <net_common/net_shard.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+std::vector<uint32_t> Owners(const net::hash_ring& ring, size_t nKeys)
+{
+    std::vector<uint32_t> owners;
+    for (uint64_t nKey = 0; nKey < nKeys; ++nKey)
+        owners.push_back(ring.Find(net::ShardHash(nKey)));
+    return owners;
+}
+
+} // namespace
+
+TEST(ShardHashIsStable)
+{
+    // Clients of other builds and platforms must route a key the same way.
+    CHECK(net::ShardHash(uint64_t(42)) == 0xa759ea27d4727622ull);
+    CHECK(net::ShardHash(std::string_view("player-1")) == 0xb59a7cc6ea8fa8c2ull);
+    CHECK(net::ShardHash(std::string_view("player-1")) != net::ShardHash(std::string_view("player-2")));
+}
+
+TEST(HashRingEmptyHasNoOwner)
+{
+    net::hash_ring ring;
+    CHECK(ring.IsEmpty());
+    CHECK(ring.Find(net::ShardHash(uint64_t(1))) == net::hash_ring::c_nNoNode);
+
+    ring.Add("a", 0);
+    ring.Remove(0);
+    CHECK(ring.IsEmpty());
+}
+
+TEST(HashRingSpreadsKeysEvenly)
+{
+    net::hash_ring ring;
+    ring.Add("server-a", 0);
+    ring.Add("server-b", 1);
+    ring.Add("server-c", 2);
+
+    size_t counts[3] = {};
+    for (uint32_t nOwner : Owners(ring, 30000))
+    {
+        CHECK(nOwner < 3);
+        if (nOwner < 3)
+            counts[nOwner]++;
+    }
+    for (size_t nCount : counts)
+        CHECK(nCount > 7000 && nCount < 13000);
+}
+
+TEST(HashRingRoutesByNameNotOrder)
+{
+    net::hash_ring first;
+    first.Add("server-a", 0);
+    first.Add("server-b", 1);
+
+    net::hash_ring second;
+    second.Add("server-b", 1);
+    second.Add("server-a", 0);
+
+    CHECK(Owners(first, 1000) == Owners(second, 1000));
+}
+
+TEST(HashRingMovesOnlyTheKeysOfChangedNode)
+{
+    net::hash_ring ring;
+    ring.Add("server-a", 0);
+    ring.Add("server-b", 1);
+    ring.Add("server-c", 2);
+    auto before = Owners(ring, 20000);
+
+    // A new node takes keys over from the others, nothing moves between the old ones.
+    ring.Add("server-d", 3);
+    auto grown = Owners(ring, 20000);
+    size_t nMoved = 0;
+    for (size_t i = 0; i < before.size(); ++i)
+    {
+        if (grown[i] != before[i])
+        {
+            CHECK(grown[i] == 3);
+            nMoved++;
+        }
+    }
+    CHECK(nMoved > 3000 && nMoved < 7000);
+
+    // Removing it gives back exactly what it took.
+    ring.Remove(3);
+    CHECK(Owners(ring, 20000) == before);
+}
+
+TEST(HashRingFindSkipsRejectedNodes)
+{
+    net::hash_ring ring;
+    ring.Add("server-a", 0);
+    ring.Add("server-b", 1);
+    ring.Add("server-c", 2);
+
+    for (uint64_t nKey = 0; nKey < 1000; ++nKey)
+    {
+        uint64_t nHash = net::ShardHash(nKey);
+        uint32_t nOwner = ring.Find(nHash);
+        uint32_t nNext = ring.Find(nHash, [nOwner](uint32_t nNode) { return nNode != nOwner; });
+        CHECK(nNext != nOwner && nNext < 3);
+        CHECK(ring.Find(nHash, [](uint32_t) { return false; }) == net::hash_ring::c_nNoNode);
+    }
+}
@@ -0,0 +1,60 @@
+#include "net_test.h"
+#include <cstdint>
+#include <net_common/net_timing.h>
+
+namespace
+{
+
+// A percentile is the lower bound of its bucket: within 12.5% below the real value.
+bool IsClose(int64_t nPercentile, int64_t nReal)
+{
+    return nPercentile <= nReal && nPercentile * 8 >= nReal * 7;
+}
+
+} // namespace
+
+TEST(LatencyHistogramEmptyIsZero)
+{
+    net::latency_histogram histogram;
+    CHECK(histogram.Count() == 0);
+    CHECK(histogram.MeanNs() == 0);
+    CHECK(histogram.PercentileNs(0.5) == 0);
+}
+
+TEST(LatencyHistogramSmallValuesAreExact)
+{
+    net::latency_histogram histogram;
+    for (int64_t nValue = 0; nValue < 8; ++nValue)
+        histogram.Record(nValue);
+
+    CHECK(histogram.Count() == 8);
+    CHECK(histogram.SumNs() == 28);
+    CHECK(histogram.PercentileNs(0.0) == 0);
+    CHECK(histogram.PercentileNs(1.0) == 7);
+}
+
+TEST(LatencyHistogramPercentilesAreWithinBucket)
+{
+    net::latency_histogram histogram;
+    for (int64_t nValue = 1; nValue <= 100000; ++nValue)
+        histogram.Record(nValue * 1000);
+
+    CHECK(histogram.Count() == 100000);
+    CHECK(histogram.MeanNs() == 50000500);
+    CHECK(IsClose(histogram.PercentileNs(0.5), 50000000));
+    CHECK(IsClose(histogram.PercentileNs(0.99), 99000000));
+    CHECK(IsClose(histogram.PercentileNs(1.0), 100000000));
+    CHECK(histogram.PercentileNs(0.5) <= histogram.PercentileNs(0.99));
+}
+
+TEST(LatencyHistogramClampsOutOfRangeValues)
+{
+    net::latency_histogram histogram;
+    // Negative values (clock skew) count as zero, huge ones share the last bucket.
+    histogram.Record(-5);
+    CHECK(histogram.PercentileNs(1.0) == 0);
+
+    histogram.Record(int64_t(1) << 60);
+    CHECK(histogram.Count() == 2);
+    CHECK(histogram.PercentileNs(1.0) > 0 && histogram.PercentileNs(1.0) < int64_t(1) << 43);
+}
@@ -3,6 +3,7 @@
 #include <my_cpp_utils/string_utils.h>
 #include <net_common/net_client.h>
 #include <net_common/net_message.h>
+#include <random>
 #include <simple_common/custom_msg_type.h>
 #include <simple_common/settings.h>
 
@@ -16,10 +17,8 @@ public:
         net::message<CustomMsgTypes> msg;
         msg.header.id = CustomMsgTypes::ServerPing;
 
-        // Measure round trip time.
-        // Caution with this ...
-        std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-        msg << timeNow;
+        // Measure round trip time. The time never leaves this process, so the steady clock is fine.
+        msg << net::SteadyNowNs();
 
         MY_LOG(
             debug, "[PingServer] Send message: ID {}, BodySizeInHeader {}, RealBodySize {}", msg.header.id,
@@ -39,6 +38,101 @@ public:
 
         Send(msg);
     }
+
+    void JoinRoom(uint32_t room)
+    {
+        net::message<CustomMsgTypes> msg;
+        msg.header.id = CustomMsgTypes::JoinRoom;
+        msg << room;
+        Send(msg);
+    }
+
+    void MessageRoom(uint32_t room)
+    {
+        net::message<CustomMsgTypes> msg;
+        msg.header.id = CustomMsgTypes::MessageRoom;
+        msg << room;
+        Send(msg);
+    }
+
+    // Move the player to a random point of the world. The server then sends the players around it.
+    void MoveRandomly()
+    {
+        std::uniform_real_distribution<float> coord(0.0f, settings::worldSize);
+        net::message<CustomMsgTypes> msg;
+        msg.header.id = CustomMsgTypes::MoveTo;
+        msg << coord(m_random) << coord(m_random);
+        Send(msg);
+    }
+protected:
+    void OnMessage(net::message<CustomMsgTypes>& msg) override
+    {
+        switch (msg.header.id)
+        {
+        case CustomMsgTypes::ServerAccept:
+            {
+                MY_LOG(info, "[OnMessage] Server accepted connection");
+                break;
+            }
+        case CustomMsgTypes::ServerDeny:
+            {
+                MY_LOG(info, "[OnMessage] Server denied connection");
+                break;
+            }
+        case CustomMsgTypes::ServerPing:
+            {
+                // Measure round trip time in seconds.
+                int64_t nThenNs = 0;
+                msg >> nThenNs;
+                auto durationSec = double(net::SteadyNowNs() - nThenNs) / 1e9;
+                MY_LOG(info, "[OnMessage] Recieved ping message. Round trip time: {}s", durationSec);
+
+                // Split of the delay: server to client (network), client queue and the clock offset.
+                if (const auto* pTiming = Timing(); pTiming && pTiming->clock.IsValid())
+                {
+                    MY_LOG(
+                        info, "[OnMessage] Clock offset {}us, one way in p50 {}us p99 {}us, queue out p50 {}us",
+                        pTiming->clock.OffsetNs() / 1000, pTiming->oneWayIn.PercentileNs(0.5) / 1000,
+                        pTiming->oneWayIn.PercentileNs(0.99) / 1000, pTiming->queueOut.PercentileNs(0.5) / 1000);
+                }
+                break;
+            }
+        case CustomMsgTypes::ServerMessage:
+            {
+                uint32_t clientID;
+                msg >> clientID;
+                MY_LOG(info, "[OnMessage] Recieved broadcast message from {}", clientID);
+                break;
+            }
+        case CustomMsgTypes::EntityEnter:
+        case CustomMsgTypes::EntityState:
+            {
+                uint32_t id;
+                float x, y;
+                msg >> y >> x >> id;
+                if (msg.header.id == CustomMsgTypes::EntityEnter)
+                    MY_LOG(info, "[OnMessage] Player {} is in sight at ({}, {})", id, x, y);
+                else
+                    MY_LOG(debug, "[OnMessage] Player {} moved to ({}, {})", id, x, y);
+                break;
+            }
+        case CustomMsgTypes::EntityLeave:
+            {
+                uint32_t id;
+                msg >> id;
+                MY_LOG(info, "[OnMessage] Player {} is out of sight", id);
+                break;
+            }
+        case CustomMsgTypes::MessageAll:
+        case CustomMsgTypes::JoinRoom:
+        case CustomMsgTypes::LeaveRoom:
+        case CustomMsgTypes::MessageRoom:
+        case CustomMsgTypes::MoveTo:
+            break;
+        }
+    }
+private:
+    std::mt19937 m_random{std::random_device{}()};
 };
 
 int SDL_main(int argv, char** args)
@@ -46,14 +140,18 @@ int SDL_main(int argv, char** args)
     utils::Logger::Init("logs/simple_client.log", spdlog::level::info);
 
     CustomClient c;
+    net::connection_options<CustomMsgTypes> options;
+    options.timestamps = true;
+    options.clockSyncInterval = std::chrono::milliseconds(settings::clockSyncIntervalMs);
+    c.SetConnectionOptions(options);
     c.Connect("127.0.0.1", settings::defaultPort);
 
     try
     {
         SDLApp app(SDL_INIT_VIDEO);
         SDLWindow window(
-            "Press 1 to ping server, 2 to message all, 3 to quit", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640,
-            480, SDL_WINDOW_SHOWN);
+            "Press 1 to ping server, 2 to message all, 3 to quit, 4 to join room, 5 to message room, 6 to move",
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_SHOWN);
 
         bool quit = false;
         while (!quit)
@@ -79,6 +177,15 @@ int SDL_main(int argv, char** args)
                     case SDLK_3:
                         quit = true;
                         break;
+                    case SDLK_4:
+                        c.JoinRoom(settings::defaultRoom);
+                        break;
+                    case SDLK_5:
+                        c.MessageRoom(settings::defaultRoom);
+                        break;
+                    case SDLK_6:
+                        c.MoveRandomly();
+                        break;
                     }
                 }
             }
@@ -86,43 +193,13 @@ int SDL_main(int argv, char** args)
             // If the client still connected.
             if (c.IsConnected())
             {
-                // If client has incoming messages.
-                if (!c.Incoming().empty())
+                // Handle everything that came since the last frame, but never spend more than the frame budget.
+                auto stats = c.Update(settings::clientMaxMessagesPerFrame, settings::clientFrameBudget);
+                if (stats.nBacklog > settings::clientMaxMessagesPerFrame)
                 {
-                    auto msg = c.Incoming().pop_front().msg;
-
-                    switch (msg.header.id)
-                    {
-                    case CustomMsgTypes::ServerAccept:
-                        {
-                            MY_LOG(info, "[SDL_main] Server accepted connection");
-                            break;
-                        }
-                    case CustomMsgTypes::ServerDeny:
-                        {
-                            MY_LOG(info, "[SDL_main] Server denied connection");
-                            break;
-                        }
-                    case CustomMsgTypes::ServerPing:
-                        {
-                            // Measure round trip time in seconds.
-                            std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-                            std::chrono::system_clock::time_point timeThen;
-                            msg >> timeThen;
-                            auto durationSec = std::chrono::duration<double>(timeNow - timeThen).count();
-                            MY_LOG(info, "[SDL_main] Recieved ping message. Round trip time: {}s", durationSec);
-                            break;
-                        }
-                    case CustomMsgTypes::ServerMessage:
-                        {
-                            uint32_t clientID;
-                            msg >> clientID;
-                            MY_LOG(info, "[SDL_main] Recieved broadcast message from {}", clientID);
-                            break;
-                        }
-                    case CustomMsgTypes::MessageAll:
-                        break;
-                    }
+                    MY_LOG(
+                        warn, "[SDL_main] Client falls behind: {} messages waiting, oldest for {}ms", stats.nBacklog,
+                        stats.nBehindNs / 1000000);
                 }
             }
             else
@@ -8,4 +8,14 @@ enum class CustomMsgTypes : uint32_t
     ServerPing,
     MessageAll,
     ServerMessage,
+    JoinRoom,
+    LeaveRoom,
+    MessageRoom,
+    // Client: float x, y - move the player of the client there. The first one puts it into the world.
+    MoveTo,
+    // Server, per tick, for the players within settings::viewRadius of the receiver (see net_interest.h).
+    // EntityEnter and EntityState: uint32_t id, float x, y. EntityLeave: uint32_t id.
+    EntityEnter,
+    EntityLeave,
+    EntityState,
 };
@@ -1,7 +1,32 @@
 #pragma once
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 
 namespace settings
 {
 const uint16_t defaultPort = 60001;
+// Same host clients may use the local socket instead of TCP loopback.
+const char* const defaultLocalPath = "simple_server.sock";
+// Server ticks per second. Messages to a client are sent as one frame per tick.
+const double serverTickRate = 30.0;
+// Room used by the simple client for the JoinRoom / MessageRoom demo.
+const uint32_t defaultRoom = 1;
+// Interest management demo: a client sees the players within this radius, the world is a square of worldSize.
+const float viewRadius = 100.0f;
+const float interestCellSize = 50.0f;
+const float worldSize = 400.0f;
+// Flood protection: broadcasts (MessageAll, MessageRoom) per client per second and the burst.
+// A client with this many dropped messages is disconnected.
+const double broadcastRate = 2.0;
+const double broadcastBurst = 5.0;
+const size_t maxDroppedMessages = 100;
+// New connections per second from one IP address and the burst.
+const double acceptRate = 1.0;
+const double acceptBurst = 5.0;
+// Clock sync heartbeat of the client, so frame timestamps give one way latency.
+const uint32_t clockSyncIntervalMs = 1000;
+// Incoming messages the client handles per frame and the time it may spend on them.
+const size_t clientMaxMessagesPerFrame = 1000;
+const std::chrono::microseconds clientFrameBudget{4000};
 }
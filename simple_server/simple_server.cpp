@@ -1,12 +1,19 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <my_cpp_utils/logger.h>
+#include <net_common/net_interest.h>
 #include <net_common/net_server.h>
 #include <simple_common/custom_msg_type.h>
 #include <simple_common/settings.h>
+#include <unordered_map>
 
 class CustomServer : public net::server_interface<CustomMsgTypes>
 {
 public:
-    CustomServer(uint16_t port) : net::server_interface<CustomMsgTypes>(port) {}
+    CustomServer(uint16_t port, const std::string& takeOverPath)
+      : net::server_interface<CustomMsgTypes>(port, takeOverPath), m_interest(settings::interestCellSize)
+    {}
 protected:
     virtual bool OnClientConnect(std::shared_ptr<net::connection<CustomMsgTypes>> client)
     {
@@ -19,6 +26,8 @@ protected:
     virtual void OnClientDisconnect(std::shared_ptr<net::connection<CustomMsgTypes>> client)
     {
         MY_LOG(info, "[CustomServer::OnClientDisconnect] Client {} disconnected", client->GetID());
+
+        RemovePlayer(client->GetID());
     }
 
     virtual void OnMessage(std::shared_ptr<net::connection<CustomMsgTypes>> client, net::message<CustomMsgTypes>& msg)
@@ -40,24 +49,248 @@ protected:
                 MessageAllClients(msg, client);
                 break;
             }
+        case CustomMsgTypes::JoinRoom:
+            {
+                uint32_t room;
+                msg >> room;
+                MY_LOG(info, "[CustomServer::OnMessage] Client {} joins room {}", client->GetID(), room);
+                Subscribe(client, room);
+                break;
+            }
+        case CustomMsgTypes::LeaveRoom:
+            {
+                uint32_t room;
+                msg >> room;
+                MY_LOG(info, "[CustomServer::OnMessage] Client {} leaves room {}", client->GetID(), room);
+                Unsubscribe(client, room);
+                break;
+            }
+        case CustomMsgTypes::MessageRoom:
+            {
+                uint32_t room;
+                msg >> room;
+                MY_LOG(info, "[CustomServer::OnMessage] MessageRoom {} received from client {}", room, client->GetID());
+                net::message<CustomMsgTypes> msg;
+                msg.header.id = CustomMsgTypes::ServerMessage;
+                msg << client->GetID();
+                Publish(room, msg, client);
+                break;
+            }
+        case CustomMsgTypes::MoveTo:
+            {
+                // The position comes from the client: check the size and keep it inside the world.
+                if (msg.body.size() != 2 * sizeof(float))
+                    break;
+                float x, y;
+                msg >> y >> x;
+                if (!std::isfinite(x) || !std::isfinite(y))
+                    break;
+                x = std::clamp(x, 0.0f, settings::worldSize);
+                y = std::clamp(y, 0.0f, settings::worldSize);
+
+                uint32_t id = client->GetID();
+                m_interest.Entities().Insert(id, x, y);
+                m_interest.SetViewer(id, x, y, settings::viewRadius);
+                m_mapPlayers[id] = {client, x, y, true};
+                break;
+            }
         default:
             MY_LOG(error, "Unrecognized message type");
             break;
         }
     }
+
+    // Every player gets only the players around it: enter and leave when they cross its view radius, the
+    // position of the visible ones that moved during the tick.
+    void OnTick() override
+    {
+        // OnClientDisconnect comes with the next broadcast only, so the closed connections are checked here.
+        std::vector<uint32_t> vecGone;
+        for (const auto& [id, player] : m_mapPlayers)
+        {
+            if (!player.pClient->IsConnected())
+                vecGone.push_back(id);
+        }
+        for (uint32_t id : vecGone)
+            RemovePlayer(id);
+
+        if (m_mapPlayers.empty())
+            return;
+
+        m_interest.Update();
+        for (auto& [id, player] : m_mapPlayers)
+        {
+            const net::relevance_set* pRelevance = m_interest.Relevance(id);
+            for (net::entity_id other : pRelevance->entered)
+                SendEntity(player, CustomMsgTypes::EntityEnter, other);
+            for (net::entity_id other : pRelevance->left)
+            {
+                net::message<CustomMsgTypes> msg;
+                msg.header.id = CustomMsgTypes::EntityLeave;
+                msg << other;
+                player.pClient->Send(msg);
+            }
+            for (net::entity_id other : pRelevance->visible)
+            {
+                if (m_mapPlayers.at(other).bMoved &&
+                    !std::binary_search(pRelevance->entered.begin(), pRelevance->entered.end(), other))
+                    SendEntity(player, CustomMsgTypes::EntityState, other);
+            }
+        }
+
+        for (auto& [id, player] : m_mapPlayers)
+            player.bMoved = false;
+    }
+private:
+    struct player
+    {
+        std::shared_ptr<net::connection<CustomMsgTypes>> pClient;
+        float x = 0.0f;
+        float y = 0.0f;
+        // Moved during this tick.
+        bool bMoved = false;
+    };
+
+    // The others see the player leave on the next tick.
+    void RemovePlayer(uint32_t id)
+    {
+        m_interest.Entities().Remove(id);
+        m_interest.RemoveViewer(id);
+        m_mapPlayers.erase(id);
+    }
+
+    void SendEntity(player& to, CustomMsgTypes type, net::entity_id id)
+    {
+        const player& entity = m_mapPlayers.at(id);
+        net::message<CustomMsgTypes> msg;
+        msg.header.id = type;
+        msg << id << entity.x << entity.y;
+        to.pClient->Send(msg);
+    }
+
+    // Players are the clients that have sent MoveTo, the entity id is the client id.
+    net::interest_manager m_interest;
+    std::unordered_map<uint32_t, player> m_mapPlayers;
 };
 
-int main()
+int main(int argc, char** argv)
 {
     utils::Logger::Init("logs/simple_server.log", spdlog::level::info);
 
-    CustomServer server(settings::defaultPort);
+    // "--port 60002" listens on another port, e.g. for a second server on the same host.
+    // "--capture traffic.netcap" records the traffic for net_replay.
+    // "--no-accept-limits 1" lets net_loadgen open thousands of connections from one address.
+    // "--trace logs/simple_server.trace" writes the transport events of the connections (see net_trace.h).
+    // "--metrics 9100" serves /metrics (Prometheus) and /connections (JSON) over HTTP, on the local host only
+    // unless "--metrics-address 0.0.0.0" (or another address) says otherwise.
+    // "--federation-id 1 --federation-port 61001 --federation-peer 127.0.0.1:61002" links this server with
+    // other simple_server processes, so broadcasts and rooms span all of them (see net_federation.h).
+    // --federation-peer may be repeated. The link secret comes from "--federation-secret", or from the
+    // NET_FEDERATION_SECRET environment variable, which unlike the command line is not visible to other users.
+    // There is no default. The port is bound to 127.0.0.1 unless "--federation-address" says otherwise.
+    // "--hot-restart simple_server.handoff" takes the port over from the simple_server running with the same
+    // option, which then finishes with its clients and exits. Only the client port is handed over: the metrics and
+    // federation ports and the capture file would be taken by both processes, so they cannot be combined with it.
+    uint16_t nPort = settings::defaultPort;
+    std::string capturePath;
+    std::string tracePath;
+    uint16_t nMetricsPort = 0;
+    std::string metricsAddress = "127.0.0.1";
+    bool bAcceptLimits = true;
+    std::string hotRestartPath;
+    net::federation_options federation;
+    if (const char* secret = std::getenv("NET_FEDERATION_SECRET"))
+        federation.secret = secret;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--port")
+            nPort = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--capture")
+            capturePath = value;
+        else if (key == "--no-accept-limits")
+            bAcceptLimits = value != "1";
+        else if (key == "--trace")
+            tracePath = value;
+        else if (key == "--hot-restart")
+            hotRestartPath = value;
+        else if (key == "--metrics")
+            nMetricsPort = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--metrics-address")
+            metricsAddress = value;
+        else if (key == "--federation-id")
+            federation.nServerId = static_cast<uint32_t>(std::stoul(value));
+        else if (key == "--federation-port")
+            federation.nListenPort = static_cast<uint16_t>(std::stoul(value));
+        else if (key == "--federation-address")
+            federation.listenAddress = value;
+        else if (key == "--federation-secret")
+            federation.secret = value;
+        else if (key == "--federation-peer")
+        {
+            size_t nColon = value.rfind(':');
+            auto nPeerPort = static_cast<uint16_t>(std::stoul(value.substr(nColon + 1)));
+            federation.peers.push_back({value.substr(0, nColon), nPeerPort});
+        }
+    }
+
+    if (!hotRestartPath.empty() && (nMetricsPort != 0 || federation.nListenPort != 0 || !capturePath.empty()))
+    {
+        MY_LOG(error, "--hot-restart cannot be combined with --metrics, --federation-port or --capture");
+        return 1;
+    }
+
+    CustomServer server(nPort, hotRestartPath);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    // Only the server on the default port takes the local socket.
+    if (nPort == settings::defaultPort)
+        server.ListenLocal(settings::defaultLocalPath);
+#endif
+
+    net::tick_options tick;
+    tick.tickRate = settings::serverTickRate;
+    server.EnableTickMode(tick);
+
+    // Each broadcast costs a send to every client, so a flooding client must not reach OnMessage.
+    net::connection_options<CustomMsgTypes> options;
+    options.messageRateLimits[CustomMsgTypes::MessageAll] = {settings::broadcastRate, settings::broadcastBurst};
+    options.messageRateLimits[CustomMsgTypes::MessageRoom] = {settings::broadcastRate, settings::broadcastBurst};
+    options.nMaxDroppedMessages = settings::maxDroppedMessages;
+    // Timestamp every frame, the clients measure one way latency with them.
+    options.timestamps = true;
+    server.SetConnectionOptions(options);
+
+    if (!capturePath.empty())
+        server.StartCapture(capturePath);
+    if (!tracePath.empty())
+        net::TraceSink().Start(tracePath);
+    if (nMetricsPort != 0)
+        server.StartMetrics(nMetricsPort, metricsAddress);
+    if (federation.nServerId != 0 && !server.StartFederation(federation))
+        return 1;
+
+    if (bAcceptLimits)
+    {
+        net::accept_limit_options acceptLimits;
+        acceptLimits.acceptRate = {settings::acceptRate, settings::acceptBurst};
+        server.SetAcceptLimits(acceptLimits);
+    }
+
+#if defined(NET_HAS_HOT_RESTART)
+    if (!hotRestartPath.empty())
+        server.EnableHotRestart({.path = hotRestartPath});
+#endif
 
     server.Start();
 
     while (true)
     {
-        server.Update(-1, true);
+        server.Tick();
+#if defined(NET_HAS_HOT_RESTART)
+        if (server.HotRestartDone())
+            break;
+#endif
     }
 
     return 0;